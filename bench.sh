@@ -0,0 +1,14 @@
+#!/bin/bash
+
+cd "$(dirname "$0")"
+
+# Бенчмарки имеют смысл только в Release сборке
+if [ ! -f build/pool_bench ]; then
+    ./build.sh
+fi
+
+# Запуск всех бенчмарков по очереди
+for bench in build/*_bench; do
+    echo "=== $(basename "$bench") ==="
+    "$bench" "$@"
+done
@@ -0,0 +1,43 @@
+#include "../src/avltree/avltree.hpp"
+#include "bench_common.hpp"
+
+/* find_batch against one find per key, for batch sizes from 1 to 1024
+ * on a tree larger than the last level cache.
+ *
+ * usage: batch_bench [keys]
+ */
+
+int main(int argc, char **argv) {
+  size_t count = arg_size(argc, argv, 4000000);
+  int max_value = static_cast<int>(count * 2);
+  AVLTree<int> tree;
+  for (int key : random_keys(count, max_value, 1)) {
+    tree.insert(key);
+  }
+  std::vector<int> probes = random_keys(1u << 22, max_value, 2);
+  std::vector<Node<int> *> found(probes.size());
+
+  Timer timer;
+  for (size_t i = 0; i < probes.size(); ++i) {
+    found[i] = tree.find(probes[i]);
+  }
+  print_row("find", probes.size(), timer.seconds());
+  do_not_optimize(found.back());
+
+  for (size_t batch : {1, 4, 16, 64, 256, 1024}) {
+    timer.reset();
+    for (size_t i = 0; i < probes.size(); i += batch) {
+      size_t end = std::min(i + batch, probes.size());
+      tree.find_batch(probes.begin() + i, probes.begin() + end,
+                      found.begin() + i);
+    }
+    print_row("find_batch batch=" + std::to_string(batch), probes.size(),
+              timer.seconds());
+    do_not_optimize(found.back());
+  }
+
+  timer.reset();
+  tree.lowerbound_batch(probes.begin(), probes.end(), found.begin());
+  print_row("lowerbound_batch batch=all", probes.size(), timer.seconds());
+  do_not_optimize(found.back());
+}
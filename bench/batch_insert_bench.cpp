@@ -0,0 +1,35 @@
+#include "../src/avltree/avltree.hpp"
+#include "bench_common.hpp"
+
+/* Adding an unsorted batch to a big tree: insert_batch against
+ * one insert per key, for growing batch sizes.
+ *
+ * usage: batch_insert_bench [tree keys]
+ */
+
+int main(int argc, char **argv) {
+  size_t count = arg_size(argc, argv, 1000000);
+  int max_value = static_cast<int>(count * 8);
+  std::vector<int> base = random_keys(count, max_value, 1);
+  std::sort(base.begin(), base.end());
+
+  for (size_t batch_size = 1000; batch_size <= count; batch_size *= 4) {
+    std::vector<int> batch = random_keys(batch_size, max_value, 2);
+
+    AVLTree<int> loop_tree(sorted_range, base.begin(), base.end());
+    Timer timer;
+    for (int key : batch) {
+      loop_tree.insert(key);
+    }
+    double loop_seconds = timer.seconds();
+
+    AVLTree<int> batch_tree(sorted_range, base.begin(), base.end());
+    timer.reset();
+    batch_tree.insert_batch(batch.begin(), batch.end());
+    double batch_seconds = timer.seconds();
+
+    std::string suffix = " batch=" + std::to_string(batch_size);
+    print_row("insert loop" + suffix, batch_size, loop_seconds);
+    print_row("insert_batch" + suffix, batch_size, batch_seconds);
+  }
+}
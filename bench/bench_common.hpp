@@ -0,0 +1,72 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+/* Small helpers shared by the benchmarks.
+ *
+ * Benchmarks are plain executables, build them in Release
+ * (./build.sh) and run with ./bench.sh or one by one from build/.
+ */
+
+class Timer {
+public:
+  Timer() : start_{std::chrono::steady_clock::now()} {}
+
+  void reset() { start_ = std::chrono::steady_clock::now(); }
+
+  double seconds() const {
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start_;
+    return elapsed.count();
+  }
+
+private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+// resident set size of the current process in KiB
+inline long current_rss_kb() {
+  long pages = 0;
+  long resident = 0;
+  FILE *statm = std::fopen("/proc/self/statm", "r");
+  if (statm == nullptr) {
+    return -1;
+  }
+  if (std::fscanf(statm, "%ld %ld", &pages, &resident) != 2) {
+    resident = 0;
+  }
+  std::fclose(statm);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+inline std::vector<int> random_keys(size_t count, int max_value,
+                                    unsigned seed = 42) {
+  std::mt19937 gen(seed);
+  std::uniform_int_distribution<int> distr(0, max_value);
+  std::vector<int> keys(count);
+  for (int &key : keys) {
+    key = distr(gen);
+  }
+  return keys;
+}
+
+// first command line argument as a size, for scaling runs up or down
+inline size_t arg_size(int argc, char **argv, size_t fallback) {
+  return (argc > 1) ? std::strtoull(argv[1], nullptr, 10) : fallback;
+}
+
+// keeps the optimizer from dropping a computed value
+template <typename T> inline void do_not_optimize(const T &value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+inline void print_row(const std::string &name, size_t ops, double seconds) {
+  std::printf("%-36s %12zu ops %10.3f ms %10.2f Mops/s\n", name.c_str(), ops,
+              seconds * 1e3, ops / seconds / 1e6);
+}
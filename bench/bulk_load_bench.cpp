@@ -0,0 +1,40 @@
+#include "../src/avltree/avltree.hpp"
+#include "bench_common.hpp"
+
+/* Loading sorted keys: build_from_sorted against one insert per key.
+ *
+ * usage: bulk_load_bench [keys]
+ */
+
+int main(int argc, char **argv) {
+  size_t count = arg_size(argc, argv, 10000000);
+  std::vector<int> keys(count);
+  for (size_t i = 0; i < count; ++i) {
+    keys[i] = static_cast<int>(i);
+  }
+
+  {
+    AVLTree<int> tree;
+    Timer timer;
+    for (int key : keys) {
+      tree.insert(key);
+    }
+    print_row("insert loop (sorted keys)", count, timer.seconds());
+  }
+
+  {
+    AVLTree<int> tree;
+    Timer timer;
+    tree.build_from_sorted(keys.begin(), keys.end());
+    print_row("build_from_sorted", count, timer.seconds());
+    do_not_optimize(tree.get_root());
+  }
+
+  {
+    AVLTree<int, NewDeleteAllocator> tree;
+    Timer timer;
+    tree.build_from_sorted(keys.begin(), keys.end());
+    print_row("build_from_sorted (new/delete)", count, timer.seconds());
+    do_not_optimize(tree.get_root());
+  }
+}
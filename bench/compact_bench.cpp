@@ -0,0 +1,60 @@
+#include "../src/avltree/avltree.hpp"
+#include "../src/avltree/compact_avltree.hpp"
+#include "bench_common.hpp"
+
+/* Memory and speed of CompactAVLTree against AVLTree for int keys.
+ *
+ * usage: compact_bench [keys]
+ */
+
+template <typename Tree> void fill(Tree &tree, const std::vector<int> &keys) {
+  for (int key : keys) {
+    tree.insert(key);
+  }
+}
+
+// node storage the tree holds on to
+size_t node_bytes(const AVLTree<int> &tree) {
+  return tree.get_allocator().reserved_bytes();
+}
+
+template <bool ParentLinks>
+size_t node_bytes(const CompactAVLTree<int, ParentLinks> &tree) {
+  return tree.memory_bytes();
+}
+
+template <typename Tree>
+void run(const char *name, const std::vector<int> &keys,
+         const std::vector<int> &probes) {
+  Tree tree;
+  Timer timer;
+  fill(tree, keys);
+  print_row(std::string(name) + " insert", keys.size(), timer.seconds());
+  double bytes_per_key = double(node_bytes(tree)) / tree.get_size();
+
+  timer.reset();
+  size_t found = 0;
+  for (int key : probes) {
+    found += (tree.find(key) != nullptr);
+  }
+  print_row(std::string(name) + " find", probes.size(), timer.seconds());
+  do_not_optimize(found);
+
+  timer.reset();
+  for (size_t i = 0; i < keys.size(); i += 2) {
+    tree.delete_key(keys[i]);
+  }
+  print_row(std::string(name) + " delete", keys.size() / 2, timer.seconds());
+
+  std::printf("%-36s %12.1f bytes/key\n\n", name, bytes_per_key);
+}
+
+int main(int argc, char **argv) {
+  size_t count = arg_size(argc, argv, 4000000);
+  std::vector<int> keys = random_keys(count, static_cast<int>(count * 4), 1);
+  std::vector<int> probes = random_keys(count, static_cast<int>(count * 4), 2);
+
+  run<AVLTree<int>>("AVLTree", keys, probes);
+  run<CompactAVLTree<int>>("CompactAVLTree", keys, probes);
+  run<CompactAVLTree<int, true>>("CompactAVLTree+parent", keys, probes);
+}
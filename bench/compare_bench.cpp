@@ -0,0 +1,67 @@
+#include "../src/avltree/avltree.hpp"
+#include "bench_common.hpp"
+#include <string>
+
+/* Key comparisons per operation for string keys, and the time they take.
+ *
+ * "operator<" counts every call of a plain less-than ordering, which the
+ * tree has to call twice where it needs a three-way answer. "compare"
+ * uses a comparator with a three-way compare member, one call per node.
+ *
+ * usage: compare_bench [keys]
+ */
+
+static size_t comparisons = 0;
+
+struct CountingLess {
+  bool operator()(const std::string &a, const std::string &b) const {
+    ++comparisons;
+    return a < b;
+  }
+};
+
+struct CountingThreeWay {
+  bool operator()(const std::string &a, const std::string &b) const {
+    ++comparisons;
+    return a < b;
+  }
+  int compare(const std::string &a, const std::string &b) const {
+    ++comparisons;
+    return a.compare(b);
+  }
+};
+
+template <typename Compare>
+void run(const char *name, const std::vector<std::string> &keys) {
+  AVLTree<std::string, NodePool, NoOrderStatistics, Compare> tree;
+  comparisons = 0;
+  Timer timer;
+  for (const std::string &key : keys) {
+    tree.insert(key);
+  }
+  double seconds = timer.seconds();
+  std::printf("%-20s insert %8.2f cmp/op %10.3f ms\n", name,
+              double(comparisons) / keys.size(), seconds * 1e3);
+
+  comparisons = 0;
+  timer.reset();
+  size_t found = 0;
+  for (const std::string &key : keys) {
+    found += (tree.find(key) != nullptr);
+  }
+  seconds = timer.seconds();
+  do_not_optimize(found);
+  std::printf("%-20s find   %8.2f cmp/op %10.3f ms\n", name,
+              double(comparisons) / keys.size(), seconds * 1e3);
+}
+
+int main(int argc, char **argv) {
+  size_t count = arg_size(argc, argv, 500000);
+  std::vector<std::string> keys;
+  for (int key : random_keys(count, static_cast<int>(count * 4))) {
+    keys.push_back("customer/" + std::to_string(key) + "/orders");
+  }
+
+  run<CountingLess>("operator<", keys);
+  run<CountingThreeWay>("compare", keys);
+}
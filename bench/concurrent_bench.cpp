@@ -0,0 +1,92 @@
+#include "../src/avltree/avltree.hpp"
+#include "../src/avltree/concurrent_avltree.hpp"
+#include "bench_common.hpp"
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+
+/* Threads that all read and write: ConcurrentAVLTree against an AVLTree
+ * behind a std::shared_mutex, for several shares of reads. Every thread
+ * runs for half a second on its own clock; the rows give the operations
+ * of all threads together in that time.
+ *
+ * usage: concurrent_bench [keys]
+ */
+
+class LockedTree {
+public:
+  void insert(int key) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    tree_.insert(key);
+  }
+  void delete_key(int key) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    tree_.delete_key(key);
+  }
+  bool contains(int key) {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return tree_.find(key) != nullptr;
+  }
+
+private:
+  AVLTree<int> tree_;
+  std::shared_mutex mutex_;
+};
+
+template <typename Tree>
+void run(const std::string &name, size_t count, size_t threads,
+         int read_percent) {
+  Tree tree;
+  int max_value = static_cast<int>(count * 2);
+  for (int key : random_keys(count, max_value, 1)) {
+    tree.insert(key);
+  }
+
+  std::atomic<size_t> total{0};
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t] {
+      std::vector<int> keys = random_keys(1 << 16, max_value, 10 + t);
+      size_t found = 0;
+      size_t ops = 0;
+      Timer timer;
+      while (timer.seconds() < 0.5) {
+        for (size_t i = 0; i < 64; ++i, ++ops) {
+          int key = keys[ops % keys.size()];
+          int kind = static_cast<int>(ops * 37 % 100);
+          if (kind < read_percent) {
+            found += tree.contains(key);
+          } else if (kind % 2 == 0) {
+            tree.insert(key);
+          } else {
+            tree.delete_key(key);
+          }
+        }
+      }
+      total += ops;
+      do_not_optimize(found);
+    });
+  }
+  Timer timer;
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+  double seconds = timer.seconds();
+
+  print_row(name + " reads=" + std::to_string(read_percent) +
+                "% threads=" + std::to_string(threads),
+            total, seconds);
+}
+
+int main(int argc, char **argv) {
+  size_t count = arg_size(argc, argv, 1000000);
+  for (int read_percent : {100, 90, 50, 10}) {
+    for (size_t threads : {1, 2, 4, 8, 16}) {
+      run<ConcurrentAVLTree<int>>("ConcurrentAVLTree", count, threads,
+                                  read_percent);
+      run<LockedTree>("AVLTree+shared_mutex", count, threads, read_percent);
+    }
+    std::printf("\n");
+  }
+}
@@ -0,0 +1,92 @@
+#include "../src/avltree/avltree.hpp"
+#include "../src/avltree/cow_avltree.hpp"
+#include "bench_common.hpp"
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+
+/* One writer and a growing number of readers: CowAVLTree against an
+ * AVLTree behind a std::shared_mutex. Every thread runs for half a
+ * second on its own clock, a writer starved by the lock included; the
+ * rows give reads and writes done in that time.
+ *
+ * usage: cow_bench [keys]
+ */
+
+class LockedTree {
+public:
+  void insert(int key) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    tree_.insert(key);
+  }
+  void delete_key(int key) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    tree_.delete_key(key);
+  }
+  bool contains(int key) {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return tree_.find(key) != nullptr;
+  }
+
+private:
+  AVLTree<int> tree_;
+  std::shared_mutex mutex_;
+};
+
+template <typename Tree>
+void run(const std::string &name, size_t count, size_t readers) {
+  Tree tree;
+  int max_value = static_cast<int>(count * 2);
+  for (int key : random_keys(count, max_value, 1)) {
+    tree.insert(key);
+  }
+
+  std::atomic<size_t> reads{0};
+  std::vector<std::thread> threads;
+  for (size_t r = 0; r < readers; ++r) {
+    threads.emplace_back([&, r] {
+      std::vector<int> probes = random_keys(1 << 16, max_value, 10 + r);
+      size_t found = 0;
+      size_t done_reads = 0;
+      Timer timer;
+      while (timer.seconds() < 0.5) {
+        for (size_t i = 0; i < 256; ++i, ++done_reads) {
+          found += tree.contains(probes[done_reads % probes.size()]);
+        }
+      }
+      reads += done_reads;
+      do_not_optimize(found);
+    });
+  }
+
+  std::vector<int> updates = random_keys(1 << 16, max_value, 3);
+  size_t writes = 0;
+  Timer timer;
+  while (timer.seconds() < 0.5) {
+    int key = updates[writes % updates.size()];
+    if (writes % 2 == 0) {
+      tree.insert(key);
+    } else {
+      tree.delete_key(key);
+    }
+    ++writes;
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  double seconds = timer.seconds();
+
+  std::string suffix = " readers=" + std::to_string(readers);
+  print_row(name + " reads" + suffix, reads, seconds);
+  print_row(name + " writes" + suffix, writes, seconds);
+}
+
+int main(int argc, char **argv) {
+  size_t count = arg_size(argc, argv, 1000000);
+  for (size_t readers : {1, 2, 4, 8, 16, 32}) {
+    run<CowAVLTree<int>>("CowAVLTree", count, readers);
+    run<LockedTree>("AVLTree+shared_mutex", count, readers);
+    std::printf("\n");
+  }
+}
@@ -0,0 +1,36 @@
+#include "../src/avltree/avltree.hpp"
+#include "bench_common.hpp"
+
+/* Dumping a tree to an array: in_order, which walks on one thread,
+ * against export_keys on a growing number of threads (caller included),
+ * in order and in pre-order.
+ *
+ * usage: export_bench [keys]
+ */
+
+int main(int argc, char **argv) {
+  size_t count = arg_size(argc, argv, 20000000);
+  AVLTree<int> tree;
+  tree.build_from_unsorted(random_keys(count, static_cast<int>(count)));
+  count = tree.get_size();
+
+  {
+    Timer timer;
+    std::vector<int> keys = tree.in_order();
+    print_row("in_order", count, timer.seconds());
+    do_not_optimize(keys.data());
+  }
+
+  for (size_t threads : {1, 2, 4, 8, 16, 32}) {
+    ThreadPool pool(threads - 1);
+    for (TraversalOrder order :
+         {TraversalOrder::in_order, TraversalOrder::pre_order}) {
+      Timer timer;
+      std::vector<int> keys = tree.export_keys(order, &pool);
+      print_row(std::string(order == TraversalOrder::in_order ? "in" : "pre") +
+                    "-order export threads=" + std::to_string(threads),
+                count, timer.seconds());
+      do_not_optimize(keys.data());
+    }
+  }
+}
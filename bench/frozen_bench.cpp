@@ -0,0 +1,59 @@
+#include "../src/avltree/avltree.hpp"
+#include "bench_common.hpp"
+
+/* Lookups in a live AVLTree against its frozen copies, for trees from
+ * cache-sized up to the given number of keys. The frozen layouts should
+ * pull ahead once the tree no longer fits in the caches. The blocked
+ * layout runs once per instruction set the CPU has.
+ *
+ * usage: frozen_bench [max keys]
+ */
+
+template <typename Tree>
+void time_finds(const std::string &name, Tree &tree,
+                const std::vector<int> &probes) {
+  Timer timer;
+  size_t found = 0;
+  for (int key : probes) {
+    found += (tree.find(key) != nullptr);
+  }
+  print_row(name, probes.size(), timer.seconds());
+  do_not_optimize(found);
+}
+
+int main(int argc, char **argv) {
+  size_t max_count = arg_size(argc, argv, size_t(1) << 24);
+  for (size_t count = 4096; count <= max_count; count *= 8) {
+    int max_value = static_cast<int>(std::min<size_t>(count * 2, 1u << 30));
+    std::vector<int> keys = random_keys(count, max_value, 1);
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    AVLTree<int> tree(sorted_range, keys.begin(), keys.end());
+    std::vector<int> probes = random_keys(1u << 22, max_value, 2);
+
+    std::string suffix = " n=" + std::to_string(tree.get_size());
+    Timer timer;
+    FrozenAVLTree<int> eytzinger = tree.freeze(FrozenLayout::eytzinger);
+    print_row("freeze eytzinger" + suffix, tree.get_size(), timer.seconds());
+    timer.reset();
+    FrozenAVLTree<int> veb = tree.freeze(FrozenLayout::van_emde_boas);
+    print_row("freeze van_emde_boas" + suffix, tree.get_size(),
+              timer.seconds());
+
+    time_finds("AVLTree find" + suffix, tree, probes);
+    time_finds("eytzinger find" + suffix, eytzinger, probes);
+    time_finds("van_emde_boas find" + suffix, veb, probes);
+
+    FrozenAVLTree<int> blocked = tree.freeze(FrozenLayout::blocked);
+    for (auto [level, name] : {std::pair(SimdLevel::scalar, "scalar"),
+                               std::pair(SimdLevel::sse42, "sse4.2"),
+                               std::pair(SimdLevel::avx2, "avx2")}) {
+      blocked.set_simd_level(level);
+      if (blocked.get_simd_level() == level) {
+        time_finds(std::string("blocked ") + name + " find" + suffix, blocked,
+                   probes);
+      }
+    }
+    std::printf("\n");
+  }
+}
@@ -0,0 +1,41 @@
+#include "../src/avltree/avltree.hpp"
+#include "bench_common.hpp"
+
+/* Loading unsorted keys: one insert per key against build_from_unsorted
+ * on a growing number of threads (caller included). The rows count the
+ * input keys, duplicates among them included.
+ *
+ * usage: parallel_build_bench [keys]
+ */
+
+int main(int argc, char **argv) {
+  size_t count = arg_size(argc, argv, 20000000);
+  std::vector<int> keys = random_keys(count, static_cast<int>(count));
+
+  {
+    AVLTree<int> tree;
+    Timer timer;
+    for (int key : keys) {
+      tree.insert(key);
+    }
+    print_row("insert loop", count, timer.seconds());
+  }
+
+  {
+    AVLTree<int> tree;
+    Timer timer;
+    tree.build_from_unsorted(keys);
+    print_row("build_from_unsorted no pool", count, timer.seconds());
+    do_not_optimize(tree.get_root());
+  }
+
+  for (size_t threads : {1, 2, 4, 8, 16, 32}) {
+    ThreadPool pool(threads - 1);
+    AVLTree<int> tree;
+    Timer timer;
+    tree.build_from_unsorted(keys, &pool);
+    print_row("build_from_unsorted threads=" + std::to_string(threads), count,
+              timer.seconds());
+    do_not_optimize(tree.get_root());
+  }
+}
@@ -0,0 +1,49 @@
+#include "../src/avltree/avltree.hpp"
+#include "bench_common.hpp"
+#include <cstdio>
+
+/* Insert/delete churn with the default NodePool against plain new/delete.
+ *
+ * usage: pool_bench [keys]
+ */
+
+template <template <typename> class Alloc>
+void run(const char *name, const std::vector<int> &keys) {
+  long rss_before = current_rss_kb();
+  AVLTree<int, Alloc> tree;
+
+  Timer timer;
+  for (int key : keys) {
+    tree.insert(key);
+  }
+  print_row(std::string(name) + " insert", keys.size(), timer.seconds());
+  long rss_after = current_rss_kb();
+
+  // churn: every round deletes half of the keys and inserts them back
+  timer.reset();
+  const int rounds = 4;
+  for (int round = 0; round < rounds; ++round) {
+    for (size_t i = round % 2; i < keys.size(); i += 2) {
+      tree.delete_key(keys[i]);
+    }
+    for (size_t i = round % 2; i < keys.size(); i += 2) {
+      tree.insert(keys[i]);
+    }
+  }
+  print_row(std::string(name) + " delete+insert churn", keys.size() * rounds,
+            timer.seconds());
+
+  timer.reset();
+  tree.clear_tree();
+  print_row(std::string(name) + " clear", keys.size(), timer.seconds());
+
+  std::printf("%-36s %12ld KiB rss growth\n\n", name, rss_after - rss_before);
+}
+
+int main(int argc, char **argv) {
+  size_t count = arg_size(argc, argv, 2000000);
+  std::vector<int> keys = random_keys(count, static_cast<int>(count * 4));
+
+  run<NodePool>("NodePool", keys);
+  run<NewDeleteAllocator>("new/delete", keys);
+}
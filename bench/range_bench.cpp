@@ -0,0 +1,54 @@
+#include "../src/avltree/avltree.hpp"
+#include "bench_common.hpp"
+
+/* Visiting every key in [lo, hi]: for_each_in_range against the old way,
+ * an in_order() copy filtered afterwards, for short and long ranges.
+ *
+ * usage: range_bench [keys]
+ */
+
+int main(int argc, char **argv) {
+  size_t count = arg_size(argc, argv, 1000000);
+  int max_value = static_cast<int>(count * 2);
+  std::vector<int> keys = random_keys(count, max_value, 1);
+  std::sort(keys.begin(), keys.end());
+  AVLTree<int> tree(sorted_range, keys.begin(), keys.end());
+
+  // range widths are given in keys, the tree holds about one per 2 values
+  for (size_t width : {16, 1024, 65536}) {
+    size_t queries = std::max<size_t>(4, (1u << 22) / width);
+    std::vector<int> starts = random_keys(queries, max_value, 2);
+
+    Timer timer;
+    long sum = 0;
+    size_t visited = 0;
+    for (int lo : starts) {
+      int hi = lo + static_cast<int>(width * 2);
+      tree.for_each_in_range(lo, hi, [&](int key) {
+        sum += key;
+        ++visited;
+      });
+    }
+    double visitor_seconds = timer.seconds();
+    do_not_optimize(sum);
+
+    // the copy is the same for every query, so time a few and scale up
+    size_t copy_queries = std::min<size_t>(queries, 8);
+    timer.reset();
+    for (size_t i = 0; i < copy_queries; ++i) {
+      int lo = starts[i];
+      int hi = lo + static_cast<int>(width * 2);
+      for (int key : tree.in_order()) {
+        if (key >= lo && key <= hi) {
+          sum += key;
+        }
+      }
+    }
+    double copy_seconds = timer.seconds() * queries / copy_queries;
+    do_not_optimize(sum);
+
+    std::string suffix = " width=" + std::to_string(width);
+    print_row("for_each_in_range" + suffix, visited, visitor_seconds);
+    print_row("in_order + filter" + suffix, visited, copy_seconds);
+  }
+}
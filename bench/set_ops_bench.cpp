@@ -0,0 +1,63 @@
+#include "../src/avltree/avltree.hpp"
+#include "bench_common.hpp"
+#include <algorithm>
+#include <thread>
+
+/* Join-based union / intersection / difference of two random trees,
+ * from one thread up to every core.
+ *
+ * usage: set_ops_bench [keys per tree]
+ */
+
+enum class Operation { Union, Intersection, Difference };
+
+double run(Operation operation, const std::vector<int> &a_keys,
+           const std::vector<int> &b_keys, ThreadPool *pool) {
+  AVLTree<int> a(sorted_range, a_keys.begin(), a_keys.end());
+  AVLTree<int> b(sorted_range, b_keys.begin(), b_keys.end());
+  Timer timer;
+  switch (operation) {
+  case Operation::Union:
+    a.union_with(std::move(b), pool);
+    break;
+  case Operation::Intersection:
+    a.intersect_with(std::move(b), pool);
+    break;
+  case Operation::Difference:
+    a.difference_with(std::move(b), pool);
+    break;
+  }
+  return timer.seconds();
+}
+
+int main(int argc, char **argv) {
+  size_t count = arg_size(argc, argv, 2000000);
+  std::vector<int> a_keys = random_keys(count, static_cast<int>(count * 2), 1);
+  std::vector<int> b_keys = random_keys(count, static_cast<int>(count * 2), 2);
+  std::sort(a_keys.begin(), a_keys.end());
+  std::sort(b_keys.begin(), b_keys.end());
+
+  size_t cores = std::max(1u, std::thread::hardware_concurrency());
+  for (size_t threads = 1; threads <= cores; threads *= 2) {
+    ThreadPool pool(threads - 1);
+    std::string suffix = " threads=" + std::to_string(threads);
+    print_row("union" + suffix, 2 * count,
+              run(Operation::Union, a_keys, b_keys, &pool));
+    print_row("intersection" + suffix, 2 * count,
+              run(Operation::Intersection, a_keys, b_keys, &pool));
+    print_row("difference" + suffix, 2 * count,
+              run(Operation::Difference, a_keys, b_keys, &pool));
+  }
+
+  // what the operations replace: merging two in_order() copies
+  AVLTree<int> a(sorted_range, a_keys.begin(), a_keys.end());
+  AVLTree<int> b(sorted_range, b_keys.begin(), b_keys.end());
+  Timer timer;
+  std::vector<int> a_sorted = a.in_order();
+  std::vector<int> b_sorted = b.in_order();
+  std::vector<int> merged;
+  std::set_union(a_sorted.begin(), a_sorted.end(), b_sorted.begin(),
+                 b_sorted.end(), std::back_inserter(merged));
+  AVLTree<int> rebuilt(sorted_range, merged.begin(), merged.end());
+  print_row("in_order + set_union + rebuild", 2 * count, timer.seconds());
+}
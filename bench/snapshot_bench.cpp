@@ -0,0 +1,67 @@
+#include "../src/avltree/avltree.hpp"
+#include "../src/avltree/mapped_avltree.hpp"
+#include "bench_common.hpp"
+#include <cstdio>
+
+/* Restart cost: rebuilding a tree from its raw keys against loading a
+ * saved image into a tree and mapping it as a MappedAVLTree. Every row
+ * counts the keys of the tree. The image goes to the directory given as
+ * second argument, the current one by default; the page cache is warm
+ * after the save, so the rows measure CPU and memory, not the disk.
+ *
+ * usage: snapshot_bench [keys] [dir]
+ */
+
+int main(int argc, char **argv) {
+  size_t count = arg_size(argc, argv, 20000000);
+  std::string path =
+      std::string(argc > 2 ? argv[2] : ".") + "/snapshot_bench.bin";
+  std::vector<int> keys = random_keys(count, static_cast<int>(count));
+  ThreadPool pool;
+
+  AVLTree<int> tree;
+  {
+    Timer timer;
+    tree.build_from_unsorted(keys, &pool);
+    print_row("rebuild from keys", tree.get_size(), timer.seconds());
+  }
+  count = tree.get_size();
+  {
+    Timer timer;
+    tree.save(path);
+    print_row("save", count, timer.seconds());
+  }
+  {
+    AVLTree<int> loaded;
+    Timer timer;
+    loaded.load(path);
+    print_row("load", count, timer.seconds());
+    do_not_optimize(loaded.get_root());
+  }
+  {
+    AVLTree<int> loaded;
+    Timer timer;
+    loaded.load(path, &pool);
+    print_row("load threads=" + std::to_string(pool.get_concurrency()), count,
+              timer.seconds());
+    do_not_optimize(loaded.get_root());
+  }
+  {
+    Timer timer;
+    MappedAVLTree<int> mapped(path);
+    print_row("map, verified", count, timer.seconds());
+    do_not_optimize(mapped.begin());
+  }
+  {
+    Timer timer;
+    MappedAVLTree<int> mapped(path, false);
+    double open_seconds = timer.seconds();
+    print_row("map, unverified", count, open_seconds);
+    timer.reset();
+    for (int key : keys) {
+      do_not_optimize(mapped.find(key));
+    }
+    print_row("mapped find", keys.size(), timer.seconds());
+  }
+  std::remove(path.c_str());
+}
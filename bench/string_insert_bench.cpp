@@ -0,0 +1,41 @@
+#include "../src/avltree/avltree.hpp"
+#include "bench_common.hpp"
+#include <string>
+
+/* Inserting std::string keys too long for the small string buffer,
+ * copied from a vector that is kept, and moved out of a throwaway one.
+ *
+ * usage: string_insert_bench [keys]
+ */
+
+std::vector<std::string> make_keys(size_t count) {
+  std::vector<std::string> keys;
+  keys.reserve(count);
+  for (int key : random_keys(count, static_cast<int>(count * 4))) {
+    keys.push_back("user:session:" + std::to_string(key) + ":payload");
+  }
+  return keys;
+}
+
+int main(int argc, char **argv) {
+  size_t count = arg_size(argc, argv, 1000000);
+  std::vector<std::string> keys = make_keys(count);
+
+  {
+    AVLTree<std::string> tree;
+    Timer timer;
+    for (const std::string &key : keys) {
+      tree.insert(key);
+    }
+    print_row("insert copy", count, timer.seconds());
+  }
+  {
+    std::vector<std::string> moved = keys;
+    AVLTree<std::string> tree;
+    Timer timer;
+    for (std::string &key : moved) {
+      tree.insert(std::move(key));
+    }
+    print_row("insert move", count, timer.seconds());
+  }
+}
@@ -0,0 +1,52 @@
+#include "../src/avltree/logged_avltree.hpp"
+#include "bench_common.hpp"
+#include <cstdio>
+#include <thread>
+
+/* Durable inserts per second into a LoggedAVLTree, for a growing number
+ * of threads and group commit windows. Every insert has returned only
+ * once its record was synced; the rows also give the average number of
+ * records per sync. The log goes to the directory given as second
+ * argument, the current one by default; point it at the disk to
+ * measure, not at a tmpfs.
+ *
+ * usage: wal_bench [inserts] [dir]
+ */
+
+int main(int argc, char **argv) {
+  size_t count = arg_size(argc, argv, 20000);
+  std::string dir = (argc > 2) ? argv[2] : ".";
+  std::string snapshot = dir + "/wal_bench.snapshot";
+  std::string log = dir + "/wal_bench.wal";
+  std::vector<int> keys = random_keys(count, 1 << 30);
+
+  for (size_t threads : {1, 4, 16, 64}) {
+    for (int window : {0, 50, 200, 1000}) {
+      std::remove(snapshot.c_str());
+      std::remove(log.c_str());
+      LoggedAVLTree<int> tree(snapshot, log,
+                              std::chrono::microseconds(window));
+      Timer timer;
+      std::vector<std::thread> workers;
+      for (size_t t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+          for (size_t i = t; i < count; i += threads) {
+            tree.insert(keys[i]);
+          }
+        });
+      }
+      for (std::thread &worker : workers) {
+        worker.join();
+      }
+      double seconds = timer.seconds();
+      // print_row's Mops/s would round to zero here
+      std::printf("threads=%-3zu window=%-5dus %6.1f/sync %10.3f ms %10.0f "
+                  "ops/s\n",
+                  threads, window,
+                  static_cast<double>(count) / tree.get_sync_count(),
+                  seconds * 1e3, count / seconds);
+    }
+  }
+  std::remove(snapshot.c_str());
+  std::remove(log.c_str());
+}
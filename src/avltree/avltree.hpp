@@ -1,199 +1,926 @@
 #pragma once
 
+#include "../utils/parallel_sort.hpp"
+#include "../utils/thread_pool.hpp"
+#include "compare.hpp"
+#include "frozen_avltree.hpp"
 #include "node.hpp"
+#include "node_pool.hpp"
+#include "snapshot.hpp"
+#include "tree_iterator.hpp"
+#include <algorithm>
 #include <cstdlib>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #define MAX_BALANCE_TRESHOLD 1
 #define MIN_BALANCE_TRESHOLD -1
 
+/* insert_batch rebuilds the whole tree once the batch holds at least
+ * 1/BATCH_REBUILD_RATIO as many keys as the tree
+ */
+#define BATCH_REBUILD_RATIO 8
+
+/* set operations hand subtrees at least this high over to the thread
+ * pool, smaller ones are not worth the scheduling
+ */
+#define PARALLEL_HEIGHT_CUTOFF 14
+
+/* find_batch and lowerbound_batch walk down this many lookups side by
+ * side; enough to keep the misses of a core in flight, see batch_bench
+ */
+#define FIND_BATCH_WIDTH 32
+
 template <typename T> class PstreeDisplay; // see pstree_fun.hpp
 
-template <typename T> class AVLTree {
+// tag for constructors that take an already sorted range
+struct sorted_range_t {
+  explicit sorted_range_t() = default;
+};
+inline constexpr sorted_range_t sorted_range{};
+
+// order in which export_keys writes the keys
+enum class TraversalOrder { in_order, pre_order, post_order };
+
+/* Alloc is the node allocator policy, see node_pool.hpp.
+ * By default every tree owns a NodePool.
+ *
+ * Stats is the node statistics policy, see node.hpp. With
+ * OrderStatistics every node knows the size of its subtree and the tree
+ * offers select, rank and count_range in O(log n).
+ *
+ * Compare orders the keys, see compare.hpp. Two keys are equal when
+ * neither is less than the other.
+ */
+template <typename T, template <typename> class Alloc = NodePool,
+          typename Stats = NoOrderStatistics, typename Compare = std::less<T>>
+class AVLTree {
   friend class PstreeDisplay<T>;
 
+  /* Lookups accept any key type K when Compare is transparent, T only
+   * otherwise. Each of them has a plain T overload as well, so that
+   * arguments convertible to T keep working with any Compare.
+   */
+  template <typename K>
+  using lookup_key_t =
+      std::enable_if_t<std::is_same_v<K, T> || is_transparent<Compare>::value>;
+
 public:
+  using value_type = T;
+  using size_type = size_t;
+  using key_compare = Compare;
+  using iterator = TreeIterator<T, Stats>;
+  using const_iterator = iterator; // keys are never mutable
+  using reverse_iterator = std::reverse_iterator<iterator>;
+  using const_reverse_iterator = reverse_iterator;
+
   AVLTree();
+  explicit AVLTree(const Compare &comp);
+  template <typename ForwardIt>
+  AVLTree(sorted_range_t, ForwardIt first, ForwardIt last);
+  AVLTree(const AVLTree &) = delete; // nodes are owned, no shallow copies
+  AVLTree &operator=(const AVLTree &) = delete;
+  AVLTree(AVLTree &&other) noexcept;
+  AVLTree &operator=(AVLTree &&other) noexcept;
   ~AVLTree();
   void insert(const T &key);
-  Node<T> *find(const T &key);
-  void delete_key(const T &key);
+  void insert(T &&key);
+  template <typename... Args> std::pair<iterator, bool> emplace(Args &&...args);
+  template <typename InputIt> void insert_batch(InputIt first, InputIt last);
+  template <typename ForwardIt>
+  void build_from_sorted(ForwardIt first, ForwardIt last);
+  void build_from_unsorted(std::vector<T> keys, ThreadPool *pool = nullptr);
+  Node<T, Stats> *find(const T &key) { return find<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  Node<T, Stats> *find(const K &key);
+  template <typename ForwardIt, typename OutputIt>
+  void find_batch(ForwardIt first, ForwardIt last, OutputIt out) {
+    search_batch_<false>(first, last, out);
+  }
+  template <typename ForwardIt, typename OutputIt>
+  void lowerbound_batch(ForwardIt first, ForwardIt last, OutputIt out) {
+    search_batch_<true>(first, last, out);
+  }
+  void delete_key(const T &key) { delete_key<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  void delete_key(const K &key);
   void clear_tree();
 
-  Node<T> *get_min() const;
-  Node<T> *get_max() const;
+  Node<T, Stats> *get_min() const;
+  Node<T, Stats> *get_max() const;
   size_t get_height() const;
   size_t get_size() const;
   void display() const;
   bool is_balanced() const;
   bool is_empty() const;
-  Node<T> *lowerbound(const T &key);
-  Node<T> *upperbound(const T &key);
+  Node<T, Stats> *lowerbound(const T &key) { return lowerbound<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  Node<T, Stats> *lowerbound(const K &key);
+  Node<T, Stats> *upperbound(const T &key) { return upperbound<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  Node<T, Stats> *upperbound(const K &key);
   std::vector<T> in_order() const;
   std::vector<T> pre_order() const;
   std::vector<T> post_order() const;
-  Node<T> *get_root() const;
+  void export_keys(T *out, TraversalOrder order = TraversalOrder::in_order,
+                   ThreadPool *pool = nullptr) const;
+  std::vector<T> export_keys(TraversalOrder order = TraversalOrder::in_order,
+                             ThreadPool *pool = nullptr) const;
+  Node<T, Stats> *get_root() const;
+
+  iterator begin() const;
+  iterator end() const;
+  reverse_iterator rbegin() const;
+  reverse_iterator rend() const;
+  iterator lower_bound(const T &key) const { return lower_bound<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  iterator lower_bound(const K &key) const;
+  iterator upper_bound(const T &key) const { return upper_bound<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  iterator upper_bound(const K &key) const;
+  template <typename F>
+  void for_each_in_range(const T &lo, const T &hi, F &&fn) const {
+    for_each_in_range<T, F>(lo, hi, std::forward<F>(fn));
+  }
+  template <typename K, typename F, typename = lookup_key_t<K>>
+  void for_each_in_range(const K &lo, const K &hi, F &&fn) const;
+  template <typename F>
+  void for_each_in_range_desc(const T &lo, const T &hi, F &&fn) const {
+    for_each_in_range_desc<T, F>(lo, hi, std::forward<F>(fn));
+  }
+  template <typename K, typename F, typename = lookup_key_t<K>>
+  void for_each_in_range_desc(const K &lo, const K &hi, F &&fn) const;
+
+  const Alloc<Node<T, Stats>> &get_allocator() const;
+  Compare key_comp() const;
+  FrozenAVLTree<T, Compare>
+  freeze(FrozenLayout layout = FrozenLayout::blocked) const;
+  void save(const std::string &path) const;
+  void load(const std::string &path, ThreadPool *pool = nullptr);
+
+  Node<T, Stats> *select(size_t k) const;
+  size_t rank(const T &key) const { return rank<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  size_t rank(const K &key) const;
+  size_t count_range(const T &lo, const T &hi) const {
+    return count_range<T>(lo, hi);
+  }
+  template <typename K, typename = lookup_key_t<K>>
+  size_t count_range(const K &lo, const K &hi) const;
+
+  // O(log n) with OrderStatistics only, see the definition
+  std::pair<AVLTree, AVLTree> split(const T &key);
+  static AVLTree join(AVLTree &&left, const T &pivot, AVLTree &&right);
+  static AVLTree join(AVLTree &&left, AVLTree &&right);
+  void union_with(AVLTree &&other, ThreadPool *pool = nullptr);
+  void intersect_with(AVLTree &&other, ThreadPool *pool = nullptr);
+  void difference_with(AVLTree &&other, ThreadPool *pool = nullptr);
 
 private:
-  Node<T> *insert_recursively(Node<T> *, const T &);
-  Node<T> *fix_balance(Node<T> *, const T &);
-  Node<T> *RR_rotate(Node<T> *);
-  Node<T> *RL_rotate(Node<T> *);
-  Node<T> *LL_rotate(Node<T> *);
-  Node<T> *LR_rotate(Node<T> *);
-  void traverse_inorder(Node<T> *node, void (*func)(const Node<T> *)) const;
-  bool is_balanced_(const Node<T> *node) const;
-  Node<T> *delete_node_(Node<T> *del_node);
-  void transplant_(Node<T> *u, Node<T> *v);
-  void isolate_node_(Node<T> *node);
-  Node<T> *rebalance_up_(Node<T> *unbalanced_node);
-  Node<T> *process_delete_rotation_(Node<T> *node, int balance);
-  void in_order_(Node<T> *node, std::vector<T> &vec) const;
-  void pre_order_(Node<T> *node, std::vector<T> &vec) const;
-  void post_order_(Node<T> *node, std::vector<T> &vec) const;
-
-  Node<T> *root_;
+  // nodes thrown away by set operations, chained through left_
+  struct DroppedNodes {
+    Node<T, Stats> *head = nullptr;
+    Node<T, Stats> *tail = nullptr;
+    size_t count = 0;
+
+    void push(Node<T, Stats> *node);
+    void push_subtree(Node<T, Stats> *node);
+    void splice(DroppedNodes &other);
+  };
+
+  // one node, or its whole subtree when whole is set, see export_keys
+  struct ExportItem {
+    const Node<T, Stats> *node;
+    bool whole;
+  };
+
+  template <typename K>
+  Node<T, Stats> *insert_from_(Node<T, Stats> *start, K &&key);
+  template <bool Lower, typename ForwardIt, typename OutputIt>
+  void search_batch_(ForwardIt first, ForwardIt last, OutputIt out);
+  Node<T, Stats> *find_slot_(Node<T, Stats> *start, const T &key,
+                             Node<T, Stats> *&parent, bool &left_child);
+  void attach_(Node<T, Stats> *node, Node<T, Stats> *parent, bool left_child);
+  Node<T, Stats> *finger_start_(Node<T, Stats> *finger, const T &key);
+  Node<T, Stats> *fix_balance(Node<T, Stats> *);
+  void retrace_(Node<T, Stats> *node);
+  Node<T, Stats> *RR_rotate(Node<T, Stats> *);
+  Node<T, Stats> *RL_rotate(Node<T, Stats> *);
+  Node<T, Stats> *LL_rotate(Node<T, Stats> *);
+  Node<T, Stats> *LR_rotate(Node<T, Stats> *);
+  void traverse_inorder(Node<T, Stats> *node,
+                        void (*func)(const Node<T, Stats> *)) const;
+  bool is_balanced_(const Node<T, Stats> *node) const;
+  Node<T, Stats> *delete_node_(Node<T, Stats> *del_node);
+  void transplant_(Node<T, Stats> *u, Node<T, Stats> *v);
+  void isolate_node_(Node<T, Stats> *node);
+  static T *export_subtree_(const Node<T, Stats> *node, TraversalOrder order,
+                            T *out);
+  void collect_export_items_(const Node<T, Stats> *node, TraversalOrder order,
+                             std::vector<ExportItem> &items) const;
+  template <typename F>
+  static void for_each_index_(size_t begin, size_t end, F &fn,
+                              ThreadPool *pool);
+  template <typename F>
+  static void for_each_key_(const Node<T, Stats> *node, F &fn);
+  template <typename... Args> Node<T, Stats> *create_node_(Args &&...args);
+  void destroy_node_(Node<T, Stats> *node);
+  void destroy_subtree_(Node<T, Stats> *node);
+  template <typename ForwardIt>
+  Node<T, Stats> *build_sorted_(ForwardIt &it, ForwardIt last, size_t count,
+                                Node<T, Stats> *&block);
+  static Node<T, Stats> *build_parallel_(T *keys, size_t count,
+                                         Node<T, Stats> *block,
+                                         ThreadPool *pool);
+  template <typename ForwardIt>
+  ForwardIt next_key_(ForwardIt it, ForwardIt last) const;
+  Node<T, Stats> *link_(Node<T, Stats> *left, Node<T, Stats> *node,
+                        Node<T, Stats> *right);
+  Node<T, Stats> *join_(Node<T, Stats> *left, Node<T, Stats> *pivot,
+                        Node<T, Stats> *right);
+  Node<T, Stats> *join_right_(Node<T, Stats> *left, Node<T, Stats> *pivot,
+                              Node<T, Stats> *right);
+  Node<T, Stats> *join_left_(Node<T, Stats> *left, Node<T, Stats> *pivot,
+                             Node<T, Stats> *right);
+  Node<T, Stats> *split_(Node<T, Stats> *node, const T &key,
+                         Node<T, Stats> *&less, Node<T, Stats> *&greater);
+  Node<T, Stats> *split_last_(Node<T, Stats> *node, Node<T, Stats> *&rest);
+  Node<T, Stats> *join2_(Node<T, Stats> *left, Node<T, Stats> *right);
+  static void detach_children_(Node<T, Stats> *node, Node<T, Stats> *&left,
+                               Node<T, Stats> *&right);
+  template <typename F, typename G>
+  static void fork_(ThreadPool *pool, const Node<T, Stats> *node, F &&left,
+                    G &&right);
+  Node<T, Stats> *union_(Node<T, Stats> *a, Node<T, Stats> *b,
+                         DroppedNodes &dropped, ThreadPool *pool);
+  Node<T, Stats> *intersect_(Node<T, Stats> *a, Node<T, Stats> *b,
+                             DroppedNodes &dropped, ThreadPool *pool);
+  Node<T, Stats> *difference_(Node<T, Stats> *a, Node<T, Stats> *b,
+                              DroppedNodes &dropped, ThreadPool *pool);
+  void finish_set_operation_(Node<T, Stats> *root, AVLTree &other,
+                             DroppedNodes &dropped);
+  template <typename K> size_t count_not_greater_(const K &key) const;
+  static void update_node_(Node<T, Stats> *node);
+  static void update_sizes_up_(Node<T, Stats> *node);
+  static int height_(const Node<T, Stats> *node);
+  static size_t count_nodes_(const Node<T, Stats> *node);
+  template <typename F>
+  static bool walk_(const Node<T, Stats> *root, TraversalOrder order,
+                    F &&visit);
+  template <typename F>
+  static bool walk_in_order_(const Node<T, Stats> *root, F &visit);
+  template <typename F>
+  static bool walk_pre_order_(const Node<T, Stats> *root, F &visit);
+  template <typename F>
+  static bool walk_post_order_(const Node<T, Stats> *root, F &visit);
+
+  Node<T, Stats> *root_;
   size_t size_;
+  Alloc<Node<T, Stats>> node_alloc_;
+  KeyCompare<T, Compare> key_comp_;
 };
 
-template <typename T> AVLTree<T>::AVLTree() : root_{nullptr}, size_{0} {}
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+AVLTree<T, Alloc, Stats, Compare>::AVLTree() : root_{nullptr}, size_{0} {}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+AVLTree<T, Alloc, Stats, Compare>::AVLTree(const Compare &comp)
+    : root_{nullptr}, size_{0}, key_comp_{comp} {}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename ForwardIt>
+AVLTree<T, Alloc, Stats, Compare>::AVLTree(sorted_range_t, ForwardIt first,
+                                           ForwardIt last)
+    : AVLTree() {
+  build_from_sorted(first, last);
+}
 
-template <typename T> AVLTree<T>::~AVLTree() { delete root_; }
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+AVLTree<T, Alloc, Stats, Compare>::AVLTree(AVLTree &&other) noexcept
+    : root_{other.root_}, size_{other.size_},
+      node_alloc_{std::move(other.node_alloc_)}, key_comp_{other.key_comp_} {
+  other.root_ = nullptr;
+  other.size_ = 0;
+}
 
-template <typename T> void AVLTree<T>::clear_tree() {
-  delete root_;
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+AVLTree<T, Alloc, Stats, Compare> &
+AVLTree<T, Alloc, Stats, Compare>::operator=(AVLTree &&other) noexcept {
+  if (this != &other) {
+    clear_tree();
+    root_ = other.root_;
+    size_ = other.size_;
+    node_alloc_ = std::move(other.node_alloc_);
+    key_comp_ = other.key_comp_;
+    other.root_ = nullptr;
+    other.size_ = 0;
+  }
+  return *this;
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+AVLTree<T, Alloc, Stats, Compare>::~AVLTree() { clear_tree(); }
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::clear_tree() {
+  destroy_subtree_(root_);
+  node_alloc_.release();
   root_ = nullptr;
   size_ = 0;
 }
 
-template <typename T> size_t AVLTree<T>::get_size() const { return size_; }
+// constructs a node whose key is built from args
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename... Args>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::create_node_(
+    Args &&...args) {
+  Node<T, Stats> *node = node_alloc_.allocate();
+  try {
+    return new (node)
+        Node<T, Stats>(std::in_place, std::forward<Args>(args)...);
+  } catch (...) {
+    node_alloc_.deallocate(node);
+    throw;
+  }
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::destroy_node_(Node<T, Stats> *node) {
+  node->~Node();
+  node_alloc_.deallocate(node);
+}
+
+/* Frees every node of the subtree.
+ *
+ * With a bulk-releasing allocator the memory itself is returned
+ * by node_alloc_.release(), so for trivially destructible keys
+ * there is nothing to do per node and the walk is skipped.
+ *
+ * The walk needs no stack: a node with a left child is rotated right,
+ * which leaves the tree a chain of right children that is freed from
+ * the top down.
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::destroy_subtree_(Node<T, Stats> *node) {
+  constexpr bool bulk = Alloc<Node<T, Stats>>::releases_in_bulk;
+  if (bulk && std::is_trivially_destructible<T>::value) {
+    return;
+  }
+  while (node != nullptr) {
+    Node<T, Stats> *left = node->left_;
+    if (left != nullptr) {
+      node->left_ = left->right_;
+      left->right_ = node;
+      node = left;
+      continue;
+    }
+    Node<T, Stats> *right = node->right_;
+    if (bulk) {
+      node->~Node();
+    } else {
+      destroy_node_(node);
+    }
+    node = right;
+  }
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+size_t AVLTree<T, Alloc, Stats, Compare>::get_size() const { return size_; }
 
-template <typename T> size_t AVLTree<T>::get_height() const {
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+size_t AVLTree<T, Alloc, Stats, Compare>::get_height() const {
   return root_->get_height();
 }
 
-template <typename T> void AVLTree<T>::insert(const T &key) {
-  Node<T> *node = insert_recursively(root_, key);
-  if (node != nullptr) {
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::insert(const T &key) {
+  insert_from_(root_, key);
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::insert(T &&key) {
+  insert_from_(root_, std::move(key));
+}
+
+/* Inserts a key constructed from args, unless an equal key is present.
+ *
+ * Returns the node with that key and whether it was inserted. When args
+ * is a single T the tree is searched first, so nothing is constructed
+ * (and the argument is not moved from) for a duplicate. Otherwise the
+ * key has to be built before it can be compared, and the node is
+ * destroyed again if the key turns out to be present.
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename... Args>
+std::pair<typename AVLTree<T, Alloc, Stats, Compare>::iterator, bool>
+AVLTree<T, Alloc, Stats, Compare>::emplace(Args &&...args) {
+  size_t old_size = size_;
+  Node<T, Stats> *node = nullptr;
+  if constexpr (sizeof...(Args) == 1 &&
+                (std::is_same_v<std::decay_t<Args>, T> && ...)) {
+    node = insert_from_(root_, std::forward<Args>(args)...);
+  } else {
+    Node<T, Stats> *created = create_node_(std::forward<Args>(args)...);
+    Node<T, Stats> *parent = nullptr;
+    bool left_child = false;
+    node = find_slot_(root_, created->key_, parent, left_child);
+    if (node != nullptr) {
+      destroy_node_(created);
+    } else {
+      node = created;
+      attach_(node, parent, left_child);
+    }
+  }
+  return {iterator(node, &root_), size_ != old_size};
+}
+
+/* Inserts key into the subtree of start, which must be the subtree where
+ * key belongs (the root always is). Returns the node holding key.
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename K>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::insert_from_(
+    Node<T, Stats> *start, K &&key) {
+  Node<T, Stats> *parent = nullptr;
+  bool left_child = false;
+  Node<T, Stats> *found = find_slot_(start, key, parent, left_child);
+  if (found != nullptr) {
+    return found;
+  }
+  Node<T, Stats> *node = create_node_(std::forward<K>(key));
+  attach_(node, parent, left_child);
+  return node;
+}
+
+/* 1. Going down.
+ *
+ * Walk down the subtree of start until we find a free place for key,
+ * remembering the last visited node - it becomes the parent. Returns
+ * the node that already holds key, if any.
+ *
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::find_slot_(
+    Node<T, Stats> *start, const T &key, Node<T, Stats> *&parent,
+    bool &left_child) {
+  parent = (start != nullptr) ? start->parent_ : nullptr;
+  Node<T, Stats> *walk_node = start;
+  while (walk_node != nullptr) {
+    /* if the same key was found in an existing node,
+     * then the tree structure should remain the same
+     */
+    int order = key_comp_.compare(key, walk_node->key_);
+    if (order == 0) {
+      return walk_node;
+    }
+    parent = walk_node;
+    left_child = (order < 0);
+    walk_node = left_child ? walk_node->left_ : walk_node->right_;
+  }
+  return nullptr;
+}
+
+/* 2. Going up.
+ *
+ * Hang the new node under parent, then fix heights and balance from
+ * there, retrace_ stops as soon as a subtree keeps its old height.
+ *
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::attach_(Node<T, Stats> *node,
+                                                Node<T, Stats> *parent,
+                                                bool left_child) {
+  ++size_;
+  node->parent_ = parent;
+  if (parent == nullptr) {
     root_ = node;
+    return;
   }
+  if (left_child) {
+    parent->left_ = node;
+  } else {
+    parent->right_ = node;
+  }
+  retrace_(parent);
 }
 
-template <typename T>
-Node<T> *AVLTree<T>::insert_recursively(Node<T> *node, const T &key) {
-  /* 1. Going down.
-   *
-   * We will recursively go down the tree,
-   * until we find a correct place for a new node.
-   *
-   */
+/* Inserts a batch of keys in any order.
+ *
+ * The batch is sorted and deduplicated first, then merged in one of two
+ * ways depending on its size relative to the tree:
+ *
+ *  - big batch: the tree and the batch are merged as two sorted
+ *    sequences and the tree is rebuilt with build_from_sorted, O(n + m);
+ *  - small batch: keys are inserted in ascending order, each descent
+ *    starting from the previously inserted node instead of the root
+ *    (finger search), so neighbouring keys share most of the path.
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename InputIt>
+void AVLTree<T, Alloc, Stats, Compare>::insert_batch(InputIt first,
+                                                     InputIt last) {
+  std::vector<T> batch(first, last);
+  auto less = [this](const T &a, const T &b) { return key_comp_.less(a, b); };
+  std::sort(batch.begin(), batch.end(), less);
+  batch.erase(std::unique(batch.begin(), batch.end(),
+                          [&less](const T &a, const T &b) {
+                            return !less(a, b) && !less(b, a);
+                          }),
+              batch.end());
+  if (batch.empty()) {
+    return;
+  }
 
-  /* found place for new node */
-  if (node == nullptr) {
-    ++size_;
-    return new Node<T>(key);
+  if (batch.size() * BATCH_REBUILD_RATIO >= size_) {
+    std::vector<T> keys = in_order();
+    std::vector<T> merged;
+    merged.reserve(keys.size() + batch.size());
+    std::set_union(std::make_move_iterator(keys.begin()),
+                   std::make_move_iterator(keys.end()),
+                   std::make_move_iterator(batch.begin()),
+                   std::make_move_iterator(batch.end()),
+                   std::back_inserter(merged), less);
+    build_from_sorted(merged.begin(), merged.end());
+    return;
   }
 
-  /* if the same key was found in an existing node,
-   * then the tree structure should remain the same
-   */
-  if (key == node->key_) {
-    return node;
+  Node<T, Stats> *finger = nullptr;
+  for (const T &key : batch) {
+    finger = insert_from_(finger_start_(finger, key), key);
+  }
+}
+
+/* Lowest ancestor of finger whose subtree is where key belongs,
+ * given that key is greater than the key of finger.
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::finger_start_(
+    Node<T, Stats> *finger, const T &key) {
+  if (finger == nullptr) {
+    return root_;
+  }
+  Node<T, Stats> *node = finger;
+  while (node->parent_ != nullptr) {
+    Node<T, Stats> *parent = node->parent_;
+    // left subtree of parent holds keys up to parent->key_ only
+    if (parent->left_ == node && key_comp_.less(key, parent->key_)) {
+      break;
+    }
+    node = parent;
   }
+  return node;
+}
 
-  if (key < node->key_) {
-    /* Let's try to find a place for a new node in the left subtree */
-    node->left_ = insert_recursively(node->left_, key);
+/* Replaces the content of the tree with the keys of a sorted range.
+ *
+ * The range must be sorted in ascending order, duplicates are dropped.
+ * The tree is built perfectly balanced in O(n) without a single
+ * rotation: one pass counts the distinct keys, the second one builds
+ * the tree in order. When the allocator can hand out a contiguous block,
+ * nodes end up in memory in key order.
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename ForwardIt>
+void AVLTree<T, Alloc, Stats, Compare>::build_from_sorted(ForwardIt first,
+                                                          ForwardIt last) {
+  clear_tree();
+
+  size_t count = 0;
+  for (ForwardIt it = first; it != last; it = next_key_(it, last)) {
+    ++count;
+  }
 
-    /* Fix parent of returned node */
-    node->left_->parent_ = node;
-  } else if (key > node->key_) {
-    /* Let's try to find a place for a new node in the right subtree */
-    node->right_ = insert_recursively(node->right_, key);
+  Node<T, Stats> *block = nullptr;
+  if constexpr (has_block_allocation<Alloc<Node<T, Stats>>>::value) {
+    block = node_alloc_.allocate_block(count);
+  }
+  root_ = build_sorted_(first, last, count, block);
+  size_ = count;
+}
 
-    /* Fix parent of returned node, perfectly works with balance */
-    node->right_->parent_ = node;
+// builds a subtree of count distinct keys starting at it, advances it
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename ForwardIt>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::build_sorted_(
+    ForwardIt &it, ForwardIt last, size_t count, Node<T, Stats> *&block) {
+  if (count == 0) {
+    return nullptr;
   }
+  size_t left_count = count / 2;
+  Node<T, Stats> *left = build_sorted_(it, last, left_count, block);
 
-  /* 2. Going up.
-   *
-   * From this moment we have found a place for the new node,
-   * and now we begin to climb up the recursion and gradually
-   * correct the balance in the nodes until we reach the root.
-   *
-   */
+  Node<T, Stats> *slot = (block != nullptr) ? block++ : node_alloc_.allocate();
+  Node<T, Stats> *node = new (slot) Node<T, Stats>(*it);
+  it = next_key_(it, last);
 
-  /* Recalculate new height of given node */
-  node->recalc_height();
+  Node<T, Stats> *right = build_sorted_(it, last, count - left_count - 1,
+                                        block);
 
-  return fix_balance(node, key);
+  node->left_ = left;
+  node->right_ = right;
+  if (left != nullptr) {
+    left->parent_ = node;
+  }
+  if (right != nullptr) {
+    right->parent_ = node;
+  }
+  update_node_(node);
+  return node;
+}
+
+/* Replaces the content of the tree with keys in any order.
+ *
+ * With a pool the keys are sorted and deduplicated in parallel, see
+ * parallel_sort.hpp, and the two subtrees of every node above
+ * PARALLEL_HEIGHT_CUTOFF are built side by side. All nodes come from
+ * one block allocated up front, node i of the key order in slot i, so
+ * the builders never touch the allocator and the layout is the one of
+ * build_from_sorted. Allocators without blocks, or keys whose move may
+ * throw, take the sequential path after the sort.
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::build_from_unsorted(std::vector<T> keys,
+                                                            ThreadPool *pool) {
+  auto less = [this](const T &a, const T &b) { return key_comp_.less(a, b); };
+  parallel_sort(keys, less, pool);
+  parallel_unique(keys, less, pool);
+
+  if constexpr (has_block_allocation<Alloc<Node<T, Stats>>>::value &&
+                std::is_nothrow_move_constructible<T>::value) {
+    clear_tree();
+    Node<T, Stats> *block = node_alloc_.allocate_block(keys.size());
+    root_ = build_parallel_(keys.data(), keys.size(), block, pool);
+    size_ = keys.size();
+  } else {
+    build_from_sorted(std::make_move_iterator(keys.begin()),
+                      std::make_move_iterator(keys.end()));
+  }
+}
+
+// builds the subtree of count distinct sorted keys into block[0, count)
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::build_parallel_(
+    T *keys, size_t count, Node<T, Stats> *block, ThreadPool *pool) {
+  if (count == 0) {
+    return nullptr;
+  }
+  size_t left_count = count / 2;
+  Node<T, Stats> *node = new (block + left_count)
+      Node<T, Stats>(std::in_place, std::move(keys[left_count]));
+
+  Node<T, Stats> *left = nullptr;
+  Node<T, Stats> *right = nullptr;
+  auto build_left = [&] {
+    left = build_parallel_(keys, left_count, block, pool);
+  };
+  auto build_right = [&] {
+    right = build_parallel_(keys + left_count + 1, count - left_count - 1,
+                            block + left_count + 1, pool);
+  };
+  if (pool != nullptr && count >> PARALLEL_HEIGHT_CUTOFF != 0) {
+    pool->parallel_invoke(build_left, build_right);
+  } else {
+    build_left();
+    build_right();
+  }
+
+  node->left_ = left;
+  node->right_ = right;
+  if (left != nullptr) {
+    left->parent_ = node;
+  }
+  if (right != nullptr) {
+    right->parent_ = node;
+  }
+  update_node_(node);
+  return node;
+}
+
+// first position after it holding a key different from *it
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename ForwardIt>
+ForwardIt AVLTree<T, Alloc, Stats, Compare>::next_key_(ForwardIt it,
+                                                       ForwardIt last) const {
+  ForwardIt next = it;
+  while (++next != last && !key_comp_.less(*it, *next)) {
+  }
+  return next;
 }
 
-template <typename T> Node<T> *AVLTree<T>::find(const T &key) {
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename K, typename>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::find(const K &key) {
   if (root_ == nullptr)
     return nullptr;
-  Node<T> *walk_node = root_;
-  while (walk_node != nullptr && key != walk_node->key_) {
-    walk_node = (key < walk_node->key_) ? walk_node->left_ : walk_node->right_;
+  Node<T, Stats> *walk_node = root_;
+  while (walk_node != nullptr) {
+    int order = key_comp_.compare(key, walk_node->key_);
+    if (order == 0) {
+      break;
+    }
+    walk_node = (order < 0) ? walk_node->left_ : walk_node->right_;
   }
   return walk_node;
 }
 
-template <typename T>
-Node<T> *AVLTree<T>::fix_balance(Node<T> *node, const T &key) {
+/* find (Lower: lowerbound) for every key in [first, last), writing the
+ * nodes found to out in the same order.
+ *
+ * A single lookup in a large tree waits for a cache miss at every level.
+ * Here FIND_BATCH_WIDTH lookups take turns: each one steps down a level
+ * and prefetches its next node, so by the time it comes round again the
+ * node is usually in cache and the misses of all of them overlap.
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <bool Lower, typename ForwardIt, typename OutputIt>
+void AVLTree<T, Alloc, Stats, Compare>::search_batch_(ForwardIt first,
+                                                      ForwardIt last,
+                                                      OutputIt out) {
+  using K = typename std::iterator_traits<ForwardIt>::value_type;
+  static_assert(std::is_same_v<K, T> || is_transparent<Compare>::value,
+                "batch lookups need T keys or a transparent Compare");
+  const K *keys[FIND_BATCH_WIDTH];
+  Node<T, Stats> *walk[FIND_BATCH_WIDTH];
+  Node<T, Stats> *found[FIND_BATCH_WIDTH];
+  size_t lanes[FIND_BATCH_WIDTH]; // lookups still walking come first
+
+  while (first != last) {
+    size_t count = 0;
+    for (; count < FIND_BATCH_WIDTH && first != last; ++count, ++first) {
+      keys[count] = std::addressof(*first);
+      walk[count] = root_;
+      found[count] = nullptr;
+      lanes[count] = count;
+    }
+    size_t active = (root_ != nullptr) ? count : 0;
+    while (active > 0) {
+      for (size_t i = 0; i < active;) {
+        size_t lane = lanes[i];
+        Node<T, Stats> *node = walk[lane];
+        if constexpr (Lower) {
+          bool left = !key_comp_.less(node->key_, *keys[lane]);
+          if (left) {
+            found[lane] = node;
+          }
+          node = left ? node->left_ : node->right_;
+        } else {
+          int order = key_comp_.compare(*keys[lane], node->key_);
+          if (order == 0) {
+            found[lane] = node;
+          }
+          node = (order == 0) ? nullptr
+                              : ((order < 0) ? node->left_ : node->right_);
+        }
+        walk[lane] = node;
+        if (node != nullptr) {
+          __builtin_prefetch(node);
+          ++i;
+        } else {
+          lanes[i] = lanes[--active];
+        }
+      }
+    }
+    out = std::copy(found, found + count, out);
+  }
+}
+
+/* Restores the AVL property in a node whose children are balanced
+ * but may differ in height by two. Heights of the children must be up
+ * to date. Returns the new root of the subtree, its parent should be
+ * fixed in caller.
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::fix_balance(
+    Node<T, Stats> *node) {
+  int node_balance = node->get_balance();
+
   /* LL-case:
    *
-   * Disbalance occured in the current node,
-   * after inserting new node into the left subtree
-   * of the left child of our node.
+   * Left subtree is too high and is not heavier on its right side,
+   * a single clockwise turn is enough.
    *
    */
-  if (node->get_balance() > MAX_BALANCE_TRESHOLD && node->left_ &&
-      key < node->left_->key_) {
-    return LL_rotate(node); /* parent should be fixed in caller */
+  if (node_balance > MAX_BALANCE_TRESHOLD && node->left_->get_balance() >= 0) {
+    return LL_rotate(node);
   }
 
-  /* RR-case:
-   *
-   * Disbalance occured in the current node,
-   * after inserting new node into the right subtree
-   * of the right child of our node.
-   *
-   */
-  if (node->get_balance() < MIN_BALANCE_TRESHOLD && node->right_ &&
-      key > node->right_->key_) {
-    return RR_rotate(node); /* parent should be fixed in caller */
+  /* RR-case: mirror of LL */
+  if (node_balance < MIN_BALANCE_TRESHOLD && node->right_->get_balance() <= 0) {
+    return RR_rotate(node);
   }
 
   /* LR-case:
    *
-   * Disbalance occured in the current node,
-   * after inserting new node into the right subtree
-   * of the left child of our node.
+   * Left subtree is too high because of the right subtree
+   * of the left child, a double rotate is needed.
    *
    */
-  if (node->get_balance() > MAX_BALANCE_TRESHOLD && node->left_ &&
-      key > node->left_->key_) {
-    return LR_rotate(node); /* parent should be fixed in caller */
+  if (node_balance > MAX_BALANCE_TRESHOLD) {
+    return LR_rotate(node);
   }
 
-  /* RL-case:
-   *
-   * Disbalance occured in the current node,
-   * after inserting new node into the left subtree
-   * of the right child of our node.
-   *
-   */
-  if (node->get_balance() < MIN_BALANCE_TRESHOLD && node->right_ &&
-      key < node->right_->key_) {
-    return RL_rotate(node); /* parent should be fixed in caller */
+  /* RL-case: mirror of LR */
+  if (node_balance < MIN_BALANCE_TRESHOLD) {
+    return RL_rotate(node);
   }
 
   return node; /* if no rotates are needed */
 }
 
+/* Walks from node to the root fixing heights and rotating where needed.
+ *
+ * The stored height of every node on the way is still the height it had
+ * before the modification below it. Once a (possibly rotated) subtree
+ * ends up with that same height, nothing above it can change and the
+ * walk stops - after an insertion that happens right after the first
+ * rotation at the latest.
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::retrace_(Node<T, Stats> *node) {
+  while (node != nullptr) {
+    Node<T, Stats> *parent = node->parent_;
+    int old_height = node->get_height();
+
+    update_node_(node);
+    Node<T, Stats> *subtree = fix_balance(node);
+    if (subtree != node) {
+      subtree->parent_ = parent;
+      if (parent == nullptr) {
+        root_ = subtree;
+      } else if (parent->left_ == node) {
+        parent->left_ = subtree;
+      } else {
+        parent->right_ = subtree;
+      }
+    }
+
+    if (subtree->get_height() == old_height) {
+      // heights above are fine, subtree sizes still change up to the root
+      update_sizes_up_(parent);
+      return;
+    }
+    node = parent;
+  }
+}
+
+// recalculates height and, with order statistics, subtree size
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::update_node_(Node<T, Stats> *node) {
+  node->recalc_height();
+  node->recalc_size();
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::update_sizes_up_(Node<T, Stats> *node) {
+  if constexpr (Stats::enabled) {
+    for (; node != nullptr; node = node->parent_) {
+      node->recalc_size();
+    }
+  }
+}
+
 // single rotate - turn x counter clockwise
-template <typename T> Node<T> *AVLTree<T>::RR_rotate(Node<T> *x) {
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::RR_rotate(
+    Node<T, Stats> *x) {
   if (x->right_ == nullptr)
     return x;
 
@@ -205,8 +932,8 @@ template <typename T> Node<T> *AVLTree<T>::RR_rotate(Node<T> *x) {
   //  z   ?      z
   // clang-format on
 
-  Node<T> *y = x->right_; // save subtree
-  Node<T> *z = y->left_;  // save subtree
+  Node<T, Stats> *y = x->right_; // save subtree
+  Node<T, Stats> *z = y->left_;  // save subtree
 
   y->left_ = x;
   x->right_ = z;
@@ -218,14 +945,17 @@ template <typename T> Node<T> *AVLTree<T>::RR_rotate(Node<T> *x) {
   }
 
   // recalc height : x - first, y - second
-  x->recalc_height();
-  y->recalc_height();
+  update_node_(x);
+  update_node_(y);
 
   return y;
 }
 
 // single rotate - turn x clockwise
-template <typename T> Node<T> *AVLTree<T>::LL_rotate(Node<T> *x) {
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::LL_rotate(
+    Node<T, Stats> *x) {
   if (x->left_ == nullptr) {
     return x;
   }
@@ -238,8 +968,8 @@ template <typename T> Node<T> *AVLTree<T>::LL_rotate(Node<T> *x) {
   // ?   z       z
   // clang-format on
 
-  Node<T> *y = x->left_;  // save subtree
-  Node<T> *z = y->right_; // save subtree
+  Node<T, Stats> *y = x->left_;  // save subtree
+  Node<T, Stats> *z = y->right_; // save subtree
 
   y->right_ = x;
   x->left_ = z;
@@ -251,27 +981,35 @@ template <typename T> Node<T> *AVLTree<T>::LL_rotate(Node<T> *x) {
   }
 
   // recalc height : x - first, y - second
-  x->recalc_height();
-  y->recalc_height();
+  update_node_(x);
+  update_node_(y);
 
   return y;
 }
 
 // double rotate
-template <typename T> Node<T> *AVLTree<T>::RL_rotate(Node<T> *node) {
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::RL_rotate(
+    Node<T, Stats> *node) {
   node->right_ = LL_rotate(node->right_); // turn right child clockwise
   node->right_->parent_ = node;           // fix parent
   return RR_rotate(node);                 // parent should be fixed in caller
 }
 
 // double rotate
-template <typename T> Node<T> *AVLTree<T>::LR_rotate(Node<T> *node) {
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::LR_rotate(
+    Node<T, Stats> *node) {
   node->left_ = RR_rotate(node->left_); // turn left child counter clockwise
   node->left_->parent_ = node;          // fix parent
   return LL_rotate(node);               // parent should be fixed in caller
 }
 
-template <typename T> void AVLTree<T>::display() const {
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::display() const {
   if (root_ == nullptr) {
     return;
   }
@@ -279,53 +1017,84 @@ template <typename T> void AVLTree<T>::display() const {
   std::cout << std::endl;
 }
 
-template <typename T>
-void AVLTree<T>::traverse_inorder(Node<T> *node,
-                                  void (*func)(const Node<T> *)) const {
-  if (node == nullptr) {
-    return;
-  }
-  traverse_inorder(node->left_, func);
-  func(node);
-  traverse_inorder(node->right_, func);
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::traverse_inorder(
+    Node<T, Stats> *node, void (*func)(const Node<T, Stats> *)) const {
+  walk_(node, TraversalOrder::in_order, [func](const Node<T, Stats> *node) {
+    func(node);
+    return true;
+  });
 }
 
-template <typename T> bool AVLTree<T>::is_balanced() const {
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+bool AVLTree<T, Alloc, Stats, Compare>::is_balanced() const {
   return is_balanced_(root_);
 }
 
-template <typename T> bool AVLTree<T>::is_balanced_(const Node<T> *node) const {
-  if (node == nullptr)
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+bool AVLTree<T, Alloc, Stats, Compare>::is_balanced_(
+    const Node<T, Stats> *root) const {
+  auto check = [](const Node<T, Stats> *node) {
+    int balance = node->get_balance();
+    if (balance < MIN_BALANCE_TRESHOLD || balance > MAX_BALANCE_TRESHOLD) {
+      return false;
+    }
+
+    /* stored heights and parent links must be consistent as well,
+     * otherwise the balance computed above means nothing
+     */
+    int left_height = (node->left_) ? node->left_->get_height() : 0;
+    int right_height = (node->right_) ? node->right_->get_height() : 0;
+    if (node->get_height() != 1 + std::max(left_height, right_height)) {
+      return false;
+    }
+    if ((node->left_ && node->left_->parent_ != node) ||
+        (node->right_ && node->right_->parent_ != node)) {
+      return false;
+    }
+    if constexpr (Stats::enabled) {
+      size_t left_size = (node->left_) ? node->left_->get_subtree_size() : 0;
+      size_t right_size = (node->right_) ? node->right_->get_subtree_size() : 0;
+      if (node->get_subtree_size() != 1 + left_size + right_size) {
+        return false;
+      }
+    }
     return true;
-  int balance = node->get_balance();
-  if (balance < MIN_BALANCE_TRESHOLD || balance > MAX_BALANCE_TRESHOLD) {
-    return false;
-  }
-  return is_balanced_(node->left_) && is_balanced_(node->right_);
+  };
+  // pre-order: the links to the children are checked before the walk
+  // goes down them and climbs back up their parent_
+  return walk_(root, TraversalOrder::pre_order, check);
 }
 
-template <typename T> bool AVLTree<T>::is_empty() const { return size_ == 0; }
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+bool AVLTree<T, Alloc, Stats, Compare>::is_empty() const { return size_ == 0; }
 
-template <typename T> void AVLTree<T>::delete_key(const T &key) {
-  Node<T> *found_node = find(key);
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename K, typename>
+void AVLTree<T, Alloc, Stats, Compare>::delete_key(const K &key) {
+  Node<T, Stats> *found_node = find(key);
   if (found_node == nullptr) {
     return;
   }
-  Node<T> *unbalanced_node = delete_node_(found_node);
-  if (unbalanced_node == nullptr) {
-    return;
-  }
-  root_ = rebalance_up_(unbalanced_node);
+  retrace_(delete_node_(found_node));
 }
 
-template <typename T> Node<T> *AVLTree<T>::delete_node_(Node<T> *del_node) {
-  Node<T> *unbalanced_node = nullptr;
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *
+AVLTree<T, Alloc, Stats, Compare>::delete_node_(Node<T, Stats> *del_node) {
+  Node<T, Stats> *unbalanced_node = nullptr;
   --size_;
   if (del_node->left_ == nullptr) {
     unbalanced_node = del_node->parent_;
     transplant_(del_node, del_node->right_);
     isolate_node_(del_node);
-    delete del_node;
+    destroy_node_(del_node);
     return unbalanced_node;
   }
 
@@ -333,13 +1102,18 @@ template <typename T> Node<T> *AVLTree<T>::delete_node_(Node<T> *del_node) {
     unbalanced_node = del_node->parent_;
     transplant_(del_node, del_node->left_);
     isolate_node_(del_node);
-    delete del_node;
+    destroy_node_(del_node);
     return unbalanced_node;
   }
 
-  Node<T> *rotate_node = del_node->right_->get_min();
+  Node<T, Stats> *rotate_node = del_node->right_->get_min();
   unbalanced_node = rotate_node;
 
+  /* rotate_node takes the place of del_node, so it inherits its old
+   * height - retrace_ compares against it to know when to stop
+   */
+  rotate_node->set_height(del_node->get_height());
+
   if (rotate_node->parent_ != del_node) {
     unbalanced_node = rotate_node->parent_;
     transplant_(rotate_node, rotate_node->right_);
@@ -351,13 +1125,16 @@ template <typename T> Node<T> *AVLTree<T>::delete_node_(Node<T> *del_node) {
   rotate_node->left_ = del_node->left_;
   rotate_node->left_->parent_ = rotate_node;
   isolate_node_(del_node);
-  delete del_node;
+  destroy_node_(del_node);
 
   return unbalanced_node;
 }
 
 // isolate node for deletion
-template <typename T> void AVLTree<T>::transplant_(Node<T> *u, Node<T> *v) {
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::transplant_(Node<T, Stats> *u,
+                                                    Node<T, Stats> *v) {
   if (u->parent_ == nullptr) {
     root_ = v;
   } else if (u == u->parent_->left_) {
@@ -369,145 +1146,1136 @@ template <typename T> void AVLTree<T>::transplant_(Node<T> *u, Node<T> *v) {
     v->parent_ = u->parent_;
   }
 }
-template <typename T> void AVLTree<T>::isolate_node_(Node<T> *node) {
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::isolate_node_(Node<T, Stats> *node) {
   node->left_ = nullptr;
   node->right_ = nullptr;
 }
 
-template <typename T>
-Node<T> *AVLTree<T>::process_delete_rotation_(Node<T> *node, int node_balance) {
-  // fix parent after return
-  if (node_balance > MAX_BALANCE_TRESHOLD && node->left_ &&
-      node->left_->get_balance() >= 0) {
-    return LL_rotate(node);
-  }
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::get_min() const {
+  return (root_) ? root_->get_min() : nullptr;
+}
 
-  if (node_balance < MIN_BALANCE_TRESHOLD && node->right_ &&
-      node->right_->get_balance() <= 0) {
-    return RR_rotate(node);
-  }
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::get_max() const {
+  return (root_) ? root_->get_max() : nullptr;
+}
 
-  if (node_balance > MAX_BALANCE_TRESHOLD && node->left_ &&
-      node->left_->get_balance() < 0) {
-    return LR_rotate(node);
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename K, typename>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::lowerbound(const K &key) {
+  Node<T, Stats> *current = root_;
+  Node<T, Stats> *result = nullptr;
+  while (current != nullptr) {
+    if (!key_comp_.less(current->key_, key)) {
+      result = current;
+      current = current->left_;
+    } else {
+      current = current->right_;
+    }
   }
+  return result;
+}
 
-  if (node_balance < MIN_BALANCE_TRESHOLD && node->right_ &&
-      node->right_->get_balance() > 0) {
-    return RL_rotate(node);
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename K, typename>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::upperbound(const K &key) {
+  Node<T, Stats> *current = root_;
+  Node<T, Stats> *result = nullptr;
+  while (current) {
+    if (!key_comp_.less(key, current->key_)) {
+      result = current;
+      current = current->right_;
+    } else {
+      current = current->left_;
+    }
   }
+  return result;
+}
 
-  return node;
+/* STL-style iteration, see tree_iterator.hpp.
+ *
+ * Unlike lowerbound/upperbound above, lower_bound(key) is the first key
+ * >= key and upper_bound(key) the first key > key, as in std::set.
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+typename AVLTree<T, Alloc, Stats, Compare>::iterator
+AVLTree<T, Alloc, Stats, Compare>::begin() const {
+  return iterator(get_min(), &root_);
 }
 
-template <typename T>
-Node<T> *AVLTree<T>::rebalance_up_(Node<T> *unbalanced_node) {
-  Node<T> *prev_node = unbalanced_node;
-  bool left_child = false;
-  int node_balance = 0;
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+typename AVLTree<T, Alloc, Stats, Compare>::iterator
+AVLTree<T, Alloc, Stats, Compare>::end() const {
+  return iterator(nullptr, &root_);
+}
 
-  for (;;) {
-    prev_node = unbalanced_node->parent_;
-    if (prev_node) {
-      left_child = (prev_node->left_ == unbalanced_node);
-    }
-    unbalanced_node->recalc_height();
-    node_balance = unbalanced_node->get_balance();
-    unbalanced_node = process_delete_rotation_(unbalanced_node, node_balance);
-    unbalanced_node->parent_ = prev_node;
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+typename AVLTree<T, Alloc, Stats, Compare>::reverse_iterator
+AVLTree<T, Alloc, Stats, Compare>::rbegin() const {
+  return reverse_iterator(end());
+}
 
-    if (!prev_node) {
-      return unbalanced_node;
-    }
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+typename AVLTree<T, Alloc, Stats, Compare>::reverse_iterator
+AVLTree<T, Alloc, Stats, Compare>::rend() const {
+  return reverse_iterator(begin());
+}
 
-    if (left_child) {
-      prev_node->left_ = unbalanced_node;
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename K, typename>
+typename AVLTree<T, Alloc, Stats, Compare>::iterator
+AVLTree<T, Alloc, Stats, Compare>::lower_bound(const K &key) const {
+  Node<T, Stats> *current = root_;
+  Node<T, Stats> *result = nullptr;
+  while (current != nullptr) {
+    if (key_comp_.less(current->key_, key)) {
+      current = current->right_;
     } else {
-      prev_node->right_ = unbalanced_node;
+      result = current;
+      current = current->left_;
     }
-    unbalanced_node = prev_node;
   }
+  return iterator(result, &root_);
 }
 
-template <typename T> Node<T> *AVLTree<T>::get_min() const {
-  return (root_) ? root_->get_min() : nullptr;
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename K, typename>
+typename AVLTree<T, Alloc, Stats, Compare>::iterator
+AVLTree<T, Alloc, Stats, Compare>::upper_bound(const K &key) const {
+  Node<T, Stats> *current = root_;
+  Node<T, Stats> *result = nullptr;
+  while (current != nullptr) {
+    if (key_comp_.less(key, current->key_)) {
+      result = current;
+      current = current->left_;
+    } else {
+      current = current->right_;
+    }
+  }
+  return iterator(result, &root_);
 }
 
-template <typename T> Node<T> *AVLTree<T>::get_max() const {
-  return (root_) ? root_->get_max() : nullptr;
+/* Calls fn(key) for every key in [lo, hi], in ascending order.
+ *
+ * One descent finds the first key, then the walk goes from successor to
+ * successor, so a range of k keys costs O(log n + k) and nothing is
+ * copied. fn must not modify the tree.
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename K, typename F, typename>
+void AVLTree<T, Alloc, Stats, Compare>::for_each_in_range(const K &lo,
+                                                          const K &hi,
+                                                          F &&fn) const {
+  Node<T, Stats> *node = lower_bound(lo).get_node();
+  while (node != nullptr && !key_comp_.less(hi, node->key_)) {
+    fn(static_cast<const T &>(node->key_));
+    node = node->get_next();
+  }
 }
 
-template <typename T> Node<T> *AVLTree<T>::lowerbound(const T &key) {
-  Node<T> *current = root_;
-  Node<T> *result = nullptr;
-  while (current != nullptr) {
-    if (current->key_ >= key) {
-      result = current;
+// same as for_each_in_range, from hi down to lo
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename K, typename F, typename>
+void AVLTree<T, Alloc, Stats, Compare>::for_each_in_range_desc(const K &lo,
+                                                               const K &hi,
+                                                               F &&fn) const {
+  Node<T, Stats> *current = root_;
+  Node<T, Stats> *node = nullptr;
+  while (current != nullptr) { // last key <= hi
+    if (key_comp_.less(hi, current->key_)) {
       current = current->left_;
     } else {
+      node = current;
       current = current->right_;
     }
   }
-  return result;
+  while (node != nullptr && !key_comp_.less(node->key_, lo)) {
+    fn(static_cast<const T &>(node->key_));
+    node = node->get_prev();
+  }
 }
 
-template <typename T> Node<T> *AVLTree<T>::upperbound(const T &key) {
-  Node<T> *current = root_;
-  Node<T> *result = nullptr;
-  while (current) {
-    if (current->key_ <= key) {
-      result = current;
-      current = current->right_;
-    } else {
-      current = current->left_;
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+std::vector<T> AVLTree<T, Alloc, Stats, Compare>::in_order() const {
+  return export_keys(TraversalOrder::in_order);
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+std::vector<T> AVLTree<T, Alloc, Stats, Compare>::pre_order() const {
+  return export_keys(TraversalOrder::pre_order);
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+std::vector<T> AVLTree<T, Alloc, Stats, Compare>::post_order() const {
+  return export_keys(TraversalOrder::post_order);
+}
+
+/* Writes the get_size() keys to out, which must have room for all of
+ * them, every key straight to its final position.
+ *
+ * With a pool the nodes at least PARALLEL_HEIGHT_CUTOFF high are cut
+ * off the tree: the walk over them lists, in the requested order, those
+ * nodes alone and the lower subtrees whole. A pass over the list sizes
+ * the subtrees (a count per node, unless Stats keeps subtree sizes), a
+ * prefix sum turns the sizes into offsets and the subtrees are written
+ * side by side from there.
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::export_keys(T *out,
+                                                    TraversalOrder order,
+                                                    ThreadPool *pool) const {
+  if (pool == nullptr || pool->get_concurrency() <= 1 ||
+      height_(root_) < PARALLEL_HEIGHT_CUTOFF) {
+    export_subtree_(root_, order, out);
+    return;
+  }
+  std::vector<ExportItem> items;
+  collect_export_items_(root_, order, items);
+  std::vector<size_t> offsets(items.size() + 1, 0);
+  auto size_item = [&](size_t i) {
+    offsets[i + 1] = items[i].whole ? count_nodes_(items[i].node) : 1;
+  };
+  if constexpr (Stats::enabled) {
+    for (size_t i = 0; i < items.size(); ++i) {
+      size_item(i);
     }
+  } else {
+    for_each_index_(0, items.size(), size_item, pool);
   }
-  return result;
+  for (size_t i = 0; i < items.size(); ++i) {
+    offsets[i + 1] += offsets[i];
+  }
+  auto write_item = [&](size_t i) {
+    if (items[i].whole) {
+      export_subtree_(items[i].node, order, out + offsets[i]);
+    } else {
+      out[offsets[i]] = items[i].node->key_;
+    }
+  };
+  for_each_index_(0, items.size(), write_item, pool);
 }
 
-template <typename T> std::vector<T> AVLTree<T>::in_order() const {
+// the parallel path needs the keys default constructed in place first
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+std::vector<T>
+AVLTree<T, Alloc, Stats, Compare>::export_keys(TraversalOrder order,
+                                               ThreadPool *pool) const {
+  if constexpr (std::is_default_constructible_v<T>) {
+    if (pool != nullptr && pool->get_concurrency() > 1 &&
+        height_(root_) >= PARALLEL_HEIGHT_CUTOFF) {
+      std::vector<T> vec(size_);
+      export_keys(vec.data(), order, pool);
+      return vec;
+    }
+  }
   std::vector<T> vec;
-  in_order_(root_, vec);
+  vec.reserve(size_);
+  walk_(root_, order, [&vec](const Node<T, Stats> *node) {
+    vec.push_back(node->key_);
+    return true;
+  });
   return vec;
 }
 
-template <typename T>
-void AVLTree<T>::in_order_(Node<T> *node, std::vector<T> &vec) const {
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+T *AVLTree<T, Alloc, Stats, Compare>::export_subtree_(
+    const Node<T, Stats> *node, TraversalOrder order, T *out) {
+  walk_(node, order, [&out](const Node<T, Stats> *visited) {
+    *out++ = visited->key_;
+    return true;
+  });
+  return out;
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::collect_export_items_(
+    const Node<T, Stats> *node, TraversalOrder order,
+    std::vector<ExportItem> &items) const {
   if (node == nullptr)
     return;
-  in_order_(node->left_, vec);
-  vec.push_back(node->key_);
-  in_order_(node->right_, vec);
+  if (height_(node) < PARALLEL_HEIGHT_CUTOFF) {
+    items.push_back({node, true});
+    return;
+  }
+  if (order == TraversalOrder::pre_order)
+    items.push_back({node, false});
+  collect_export_items_(node->left_, order, items);
+  if (order == TraversalOrder::in_order)
+    items.push_back({node, false});
+  collect_export_items_(node->right_, order, items);
+  if (order == TraversalOrder::post_order)
+    items.push_back({node, false});
 }
 
-template <typename T> std::vector<T> AVLTree<T>::pre_order() const {
-  std::vector<T> vec;
-  pre_order_(root_, vec);
-  return vec;
+// calls fn on every key of the subtree, in order
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename F>
+void AVLTree<T, Alloc, Stats, Compare>::for_each_key_(
+    const Node<T, Stats> *node, F &fn) {
+  walk_(node, TraversalOrder::in_order, [&fn](const Node<T, Stats> *visited) {
+    fn(static_cast<const T &>(visited->key_));
+    return true;
+  });
 }
 
-template <typename T>
-void AVLTree<T>::pre_order_(Node<T> *node, std::vector<T> &vec) const {
-  if (node == nullptr)
+// calls fn(i) for every i in [begin, end), halving the range per fork
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename F>
+void AVLTree<T, Alloc, Stats, Compare>::for_each_index_(size_t begin,
+                                                        size_t end, F &fn,
+                                                        ThreadPool *pool) {
+  if (end - begin == 1) {
+    fn(begin);
     return;
-  vec.push_back(node->key_);
-  pre_order_(node->left_, vec);
-  pre_order_(node->right_, vec);
+  }
+  size_t mid = begin + (end - begin) / 2;
+  pool->parallel_invoke([&] { for_each_index_(begin, mid, fn, pool); },
+                        [&] { for_each_index_(mid, end, fn, pool); });
 }
 
-template <typename T> std::vector<T> AVLTree<T>::post_order() const {
-  std::vector<T> vec;
-  post_order_(root_, vec);
-  return vec;
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::get_root() const {
+  return root_;
 }
 
-template <typename T>
-void AVLTree<T>::post_order_(Node<T> *node, std::vector<T> &vec) const {
-  if (node == nullptr)
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+const Alloc<Node<T, Stats>> &
+AVLTree<T, Alloc, Stats, Compare>::get_allocator() const {
+  return node_alloc_;
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Compare AVLTree<T, Alloc, Stats, Compare>::key_comp() const {
+  return key_comp_.get();
+}
+
+/* Read-only copy of the keys in one flat array, see frozen_avltree.hpp.
+ * The tree is left as it is; later changes do not show in the copy. The
+ * default layout is the SIMD searched one for arithmetic keys and the
+ * Eytzinger order for all others.
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+FrozenAVLTree<T, Compare>
+AVLTree<T, Alloc, Stats, Compare>::freeze(FrozenLayout layout) const {
+  std::vector<T> keys;
+  keys.reserve(size_);
+  auto push = [&keys](const T &key) { keys.push_back(key); };
+  for_each_key_(root_, push);
+  return FrozenAVLTree<T, Compare>(std::move(keys), layout, key_comp_.get());
+}
+
+/* Writes the keys to an image at path, see snapshot.hpp. Throws
+ * std::system_error when the file cannot be written, leaving an earlier
+ * image at path as it was.
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::save(const std::string &path) const {
+  constexpr bool raw = std::is_trivially_copyable_v<T>;
+  snapshot_detail::Writer writer(path);
+  std::string &buffer = writer.buffer();
+  auto write_key = [&](const T &key) {
+    if constexpr (raw) {
+      buffer.append(reinterpret_cast<const char *>(&key), sizeof(T));
+    } else {
+      SnapshotSerializer<T>::write(key, buffer);
+    }
+    writer.flush_if_full();
+  };
+  for_each_key_(root_, write_key);
+  writer.finish(raw, raw ? sizeof(T) : 0, size_);
+}
+
+/* Replaces the content of the tree with the image at path, in linear
+ * time. The file is mapped, not read: keys of a trivially copyable T go
+ * into the nodes straight from the mapping, with the pool as in
+ * build_from_unsorted, other keys are decoded first. A corrupted image,
+ * one written for another key type, or one whose keys are not strictly
+ * ascending under this Compare, throws std::runtime_error and leaves the
+ * tree as it was.
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::load(const std::string &path,
+                                             ThreadPool *pool) {
+  MappedFile file(path, true, MADV_SEQUENTIAL);
+  SnapshotHeader header = snapshot_detail::check_header<T>(file, true);
+  char *payload = file.data() + sizeof(header);
+  size_t count = header.count;
+  auto less = [this](const T &a, const T &b) { return key_comp_.less(a, b); };
+  if constexpr (std::is_trivially_copyable_v<T>) {
+    T *keys = reinterpret_cast<T *>(payload);
+    snapshot_detail::check_order(keys, keys + count, less);
+    if constexpr (has_block_allocation<Alloc<Node<T, Stats>>>::value) {
+      clear_tree();
+      Node<T, Stats> *block = node_alloc_.allocate_block(count);
+      root_ = build_parallel_(keys, count, block, pool);
+      size_ = count;
+    } else {
+      build_from_sorted(keys, keys + count);
+    }
+  } else {
+    std::vector<T> keys;
+    keys.reserve(count);
+    const char *in = payload;
+    const char *end = payload + header.payload_bytes;
+    for (size_t i = 0; i < count; ++i) {
+      keys.push_back(SnapshotSerializer<T>::read(in, end));
+    }
+    snapshot_detail::check_order(keys.data(), keys.data() + count, less);
+    build_from_sorted(std::make_move_iterator(keys.begin()),
+                      std::make_move_iterator(keys.end()));
+  }
+}
+
+/* Order statistics, available with the OrderStatistics policy only.
+ *
+ * Every one of them is a single descent that sums up the sizes of the
+ * left subtrees it skips.
+ */
+
+// node with the k-th smallest key (counting from 0), nullptr if k >= size
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::select(size_t k) const {
+  static_assert(Stats::enabled, "select needs OrderStatistics");
+  Node<T, Stats> *node = root_;
+  while (node != nullptr) {
+    size_t left_size = (node->left_) ? node->left_->get_subtree_size() : 0;
+    if (k == left_size) {
+      return node;
+    }
+    if (k < left_size) {
+      node = node->left_;
+    } else {
+      k -= left_size + 1;
+      node = node->right_;
+    }
+  }
+  return nullptr;
+}
+
+// number of keys less than key
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename K, typename>
+size_t AVLTree<T, Alloc, Stats, Compare>::rank(const K &key) const {
+  static_assert(Stats::enabled, "rank needs OrderStatistics");
+  size_t result = 0;
+  Node<T, Stats> *node = root_;
+  while (node != nullptr) {
+    if (key_comp_.less(node->key_, key)) {
+      result += 1 + ((node->left_) ? node->left_->get_subtree_size() : 0);
+      node = node->right_;
+    } else {
+      node = node->left_;
+    }
+  }
+  return result;
+}
+
+// number of keys in [lo, hi]
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename K, typename>
+size_t AVLTree<T, Alloc, Stats, Compare>::count_range(const K &lo,
+                                                      const K &hi) const {
+  static_assert(Stats::enabled, "count_range needs OrderStatistics");
+  if (key_comp_.less(hi, lo)) {
+    return 0;
+  }
+  return count_not_greater_(hi) - rank(lo);
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename K>
+size_t
+AVLTree<T, Alloc, Stats, Compare>::count_not_greater_(const K &key) const {
+  size_t result = 0;
+  Node<T, Stats> *node = root_;
+  while (node != nullptr) {
+    if (key_comp_.less(key, node->key_)) {
+      node = node->left_;
+    } else {
+      result += 1 + ((node->left_) ? node->left_->get_subtree_size() : 0);
+      node = node->right_;
+    }
+  }
+  return result;
+}
+
+/* Cuts the tree at key.
+ *
+ * Returns {keys < key, keys >= key}, *this is left empty. The halves
+ * reuse the nodes of this tree, and both keep its node storage alive.
+ *
+ * The cut itself is O(log n), but the halves need their sizes: with
+ * OrderStatistics they are read off the new roots, so the whole split is
+ * O(log n). Without subtree sizes nothing on the search path tells how
+ * many keys hang off it, so the first half is counted, which is linear
+ * in its size; use OrderStatistics where splits must stay logarithmic.
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+std::pair<AVLTree<T, Alloc, Stats, Compare>, AVLTree<T, Alloc, Stats, Compare>>
+AVLTree<T, Alloc, Stats, Compare>::split(const T &key) {
+  AVLTree less(key_comp_.get());
+  AVLTree greater(key_comp_.get());
+  Node<T, Stats> *found = split_(root_, key, less.root_, greater.root_);
+  if (found != nullptr) {
+    greater.root_ = greater.join_(nullptr, found, greater.root_);
+  }
+
+  less.size_ = count_nodes_(less.root_);
+  greater.size_ = size_ - less.size_;
+  less.node_alloc_ = std::move(node_alloc_);
+  greater.node_alloc_.share(less.node_alloc_);
+
+  root_ = nullptr;
+  size_ = 0;
+  return {std::move(less), std::move(greater)};
+}
+
+/* Concatenates two trees around pivot in O(log n).
+ *
+ * Every key of left must be less than pivot and every key of right
+ * greater than pivot. Both trees are left empty.
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+AVLTree<T, Alloc, Stats, Compare> AVLTree<T, Alloc, Stats, Compare>::join(
+    AVLTree &&left, const T &pivot, AVLTree &&right) {
+  AVLTree result(std::move(left));
+  result.node_alloc_.share(right.node_alloc_);
+  Node<T, Stats> *pivot_node = result.create_node_(pivot);
+  result.root_ = result.join_(result.root_, pivot_node, right.root_);
+  result.size_ += right.size_ + 1;
+
+  right.root_ = nullptr;
+  right.size_ = 0;
+  return result;
+}
+
+// same without a pivot, every key of left must be less than those of right
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+AVLTree<T, Alloc, Stats, Compare> AVLTree<T, Alloc, Stats, Compare>::join(
+    AVLTree &&left, AVLTree &&right) {
+  AVLTree result(std::move(left));
+  result.node_alloc_.share(right.node_alloc_);
+  if (result.root_ == nullptr) {
+    result.root_ = right.root_;
+  } else if (right.root_ != nullptr) {
+    Node<T, Stats> *rest = nullptr;
+    Node<T, Stats> *pivot = result.split_last_(result.root_, rest);
+    result.root_ = result.join_(rest, pivot, right.root_);
+  }
+  result.size_ += right.size_;
+
+  right.root_ = nullptr;
+  right.size_ = 0;
+  return result;
+}
+
+// makes node the root of a subtree with given children, both balanced
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::link_(
+    Node<T, Stats> *left, Node<T, Stats> *node, Node<T, Stats> *right) {
+  node->left_ = left;
+  node->right_ = right;
+  node->parent_ = nullptr;
+  if (left != nullptr) {
+    left->parent_ = node;
+  }
+  if (right != nullptr) {
+    right->parent_ = node;
+  }
+  update_node_(node);
+  return node;
+}
+
+/* Joins two subtrees and a detached pivot node into one AVL subtree,
+ * the cost is proportional to the difference of their heights.
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::join_(
+    Node<T, Stats> *left, Node<T, Stats> *pivot, Node<T, Stats> *right) {
+  if (height_(left) > height_(right) + 1) {
+    return join_right_(left, pivot, right);
+  }
+  if (height_(right) > height_(left) + 1) {
+    return join_left_(left, pivot, right);
+  }
+  return link_(left, pivot, right);
+}
+
+/* left is the higher one: walk down its right spine until a subtree
+ * of about the height of right is found and hang pivot there,
+ * rotating on the way back up where the spine got too high
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::join_right_(
+    Node<T, Stats> *left, Node<T, Stats> *pivot, Node<T, Stats> *right) {
+  Node<T, Stats> *outer = left->left_;
+  Node<T, Stats> *inner = left->right_;
+
+  if (height_(inner) <= height_(right) + 1) {
+    Node<T, Stats> *joined = link_(inner, pivot, right);
+    if (height_(joined) <= height_(outer) + 1) {
+      return link_(outer, left, joined);
+    }
+    return RR_rotate(link_(outer, left, LL_rotate(joined)));
+  }
+
+  Node<T, Stats> *joined = join_right_(inner, pivot, right);
+  Node<T, Stats> *node = link_(outer, left, joined);
+  if (height_(joined) <= height_(outer) + 1) {
+    return node;
+  }
+  return RR_rotate(node);
+}
+
+// mirror of join_right_, right is the higher one
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::join_left_(
+    Node<T, Stats> *left, Node<T, Stats> *pivot, Node<T, Stats> *right) {
+  Node<T, Stats> *outer = right->right_;
+  Node<T, Stats> *inner = right->left_;
+
+  if (height_(inner) <= height_(left) + 1) {
+    Node<T, Stats> *joined = link_(left, pivot, inner);
+    if (height_(joined) <= height_(outer) + 1) {
+      return link_(joined, right, outer);
+    }
+    return LL_rotate(link_(RR_rotate(joined), right, outer));
+  }
+
+  Node<T, Stats> *joined = join_left_(left, pivot, inner);
+  Node<T, Stats> *node = link_(joined, right, outer);
+  if (height_(joined) <= height_(outer) + 1) {
+    return node;
+  }
+  return LL_rotate(node);
+}
+
+/* Splits a subtree into keys less than key and keys greater than key.
+ * The node holding key itself, if any, is detached and returned.
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::split_(
+    Node<T, Stats> *node, const T &key, Node<T, Stats> *&less,
+    Node<T, Stats> *&greater) {
+  if (node == nullptr) {
+    less = greater = nullptr;
+    return nullptr;
+  }
+  Node<T, Stats> *left = node->left_;
+  Node<T, Stats> *right = node->right_;
+  if (left != nullptr) {
+    left->parent_ = nullptr;
+  }
+  if (right != nullptr) {
+    right->parent_ = nullptr;
+  }
+
+  int order = key_comp_.compare(key, node->key_);
+  if (order == 0) {
+    less = left;
+    greater = right;
+    isolate_node_(node);
+    node->parent_ = nullptr;
+    return node;
+  }
+
+  Node<T, Stats> *found = nullptr;
+  Node<T, Stats> *middle = nullptr;
+  if (order < 0) {
+    found = split_(left, key, less, middle);
+    greater = join_(middle, node, right);
+  } else {
+    found = split_(right, key, middle, greater);
+    less = join_(left, node, middle);
+  }
+  return found;
+}
+
+// detaches the node with the greatest key, rest gets the remaining tree
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::split_last_(
+    Node<T, Stats> *node, Node<T, Stats> *&rest) {
+  Node<T, Stats> *left = node->left_;
+  Node<T, Stats> *right = node->right_;
+  if (left != nullptr) {
+    left->parent_ = nullptr;
+  }
+  if (right == nullptr) {
+    rest = left;
+    isolate_node_(node);
+    node->parent_ = nullptr;
+    return node;
+  }
+  right->parent_ = nullptr;
+
+  Node<T, Stats> *right_rest = nullptr;
+  Node<T, Stats> *last = split_last_(right, right_rest);
+  rest = join_(left, node, right_rest);
+  return last;
+}
+
+// join without a pivot, every key of left is less than those of right
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::join2_(
+    Node<T, Stats> *left, Node<T, Stats> *right) {
+  if (left == nullptr) {
+    return right;
+  }
+  if (right == nullptr) {
+    return left;
+  }
+  Node<T, Stats> *rest = nullptr;
+  Node<T, Stats> *last = split_last_(left, rest);
+  return join_(rest, last, right);
+}
+
+/* Set operations.
+ *
+ * Each one takes the root of one tree, splits the other tree by its key
+ * and recurses on the two pairs of halves, which share no nodes and can
+ * be processed in parallel. The halves are glued back with join, so the
+ * result is a valid AVL tree at every level of the recursion. Work is
+ * O(m log(n/m + 1)) for trees of sizes m <= n.
+ *
+ * other is left empty. Nodes present in both trees are taken from
+ * *this, the rest are freed once the parallel part is over.
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::union_with(AVLTree &&other,
+                                                   ThreadPool *pool) {
+  DroppedNodes dropped;
+  Node<T, Stats> *root = union_(root_, other.root_, dropped, pool);
+  finish_set_operation_(root, other, dropped);
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::intersect_with(AVLTree &&other,
+                                                       ThreadPool *pool) {
+  DroppedNodes dropped;
+  Node<T, Stats> *root = intersect_(root_, other.root_, dropped, pool);
+  finish_set_operation_(root, other, dropped);
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::difference_with(AVLTree &&other,
+                                                        ThreadPool *pool) {
+  DroppedNodes dropped;
+  Node<T, Stats> *root = difference_(root_, other.root_, dropped, pool);
+  finish_set_operation_(root, other, dropped);
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::union_(Node<T, Stats> *a,
+                                                          Node<T, Stats> *b,
+                                                          DroppedNodes &dropped,
+                                                          ThreadPool *pool) {
+  if (a == nullptr) {
+    return b;
+  }
+  if (b == nullptr) {
+    return a;
+  }
+  Node<T, Stats> *b_less = nullptr;
+  Node<T, Stats> *b_greater = nullptr;
+  Node<T, Stats> *duplicate = split_(b, a->key_, b_less, b_greater);
+  if (duplicate != nullptr) {
+    dropped.push(duplicate);
+  }
+
+  Node<T, Stats> *a_left = nullptr;
+  Node<T, Stats> *a_right = nullptr;
+  detach_children_(a, a_left, a_right);
+
+  Node<T, Stats> *left = nullptr;
+  Node<T, Stats> *right = nullptr;
+  DroppedNodes right_dropped;
+  fork_(pool, a, [&] { left = union_(a_left, b_less, dropped, pool); },
+        [&] { right = union_(a_right, b_greater, right_dropped, pool); });
+  dropped.splice(right_dropped);
+
+  return join_(left, a, right);
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::intersect_(
+    Node<T, Stats> *a, Node<T, Stats> *b, DroppedNodes &dropped,
+    ThreadPool *pool) {
+  if (a == nullptr || b == nullptr) {
+    dropped.push_subtree(a);
+    dropped.push_subtree(b);
+    return nullptr;
+  }
+  Node<T, Stats> *b_less = nullptr;
+  Node<T, Stats> *b_greater = nullptr;
+  Node<T, Stats> *duplicate = split_(b, a->key_, b_less, b_greater);
+
+  Node<T, Stats> *a_left = nullptr;
+  Node<T, Stats> *a_right = nullptr;
+  detach_children_(a, a_left, a_right);
+
+  Node<T, Stats> *left = nullptr;
+  Node<T, Stats> *right = nullptr;
+  DroppedNodes right_dropped;
+  fork_(pool, a, [&] { left = intersect_(a_left, b_less, dropped, pool); },
+        [&] { right = intersect_(a_right, b_greater, right_dropped, pool); });
+  dropped.splice(right_dropped);
+
+  if (duplicate != nullptr) {
+    dropped.push(duplicate);
+    return join_(left, a, right);
+  }
+  dropped.push(a);
+  return join2_(left, right);
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+Node<T, Stats> *AVLTree<T, Alloc, Stats, Compare>::difference_(
+    Node<T, Stats> *a, Node<T, Stats> *b, DroppedNodes &dropped,
+    ThreadPool *pool) {
+  if (a == nullptr || b == nullptr) {
+    dropped.push_subtree(b);
+    return a;
+  }
+  Node<T, Stats> *a_less = nullptr;
+  Node<T, Stats> *a_greater = nullptr;
+  Node<T, Stats> *duplicate = split_(a, b->key_, a_less, a_greater);
+  if (duplicate != nullptr) {
+    dropped.push(duplicate);
+  }
+
+  Node<T, Stats> *b_left = nullptr;
+  Node<T, Stats> *b_right = nullptr;
+  detach_children_(b, b_left, b_right);
+  dropped.push(b);
+
+  Node<T, Stats> *left = nullptr;
+  Node<T, Stats> *right = nullptr;
+  DroppedNodes right_dropped;
+  fork_(pool, b, [&] { left = difference_(a_less, b_left, dropped, pool); },
+        [&] { right = difference_(a_greater, b_right, right_dropped, pool); });
+  dropped.splice(right_dropped);
+
+  return join2_(left, right);
+}
+
+// runs both halves of a set operation, in parallel if node is high enough
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename F, typename G>
+void AVLTree<T, Alloc, Stats, Compare>::fork_(ThreadPool *pool,
+                                              const Node<T, Stats> *node,
+                                              F &&left, G &&right) {
+  if (pool != nullptr && height_(node) >= PARALLEL_HEIGHT_CUTOFF) {
+    pool->parallel_invoke(left, right);
+  } else {
+    left();
+    right();
+  }
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::finish_set_operation_(
+    Node<T, Stats> *root, AVLTree &other, DroppedNodes &dropped) {
+  node_alloc_.share(other.node_alloc_);
+  for (Node<T, Stats> *node = dropped.head; node != nullptr;) {
+    Node<T, Stats> *next = node->left_;
+    destroy_node_(node);
+    node = next;
+  }
+
+  if (root != nullptr) {
+    root->parent_ = nullptr;
+  }
+  root_ = root;
+  size_ = size_ + other.size_ - dropped.count;
+  other.root_ = nullptr;
+  other.size_ = 0;
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void
+AVLTree<T, Alloc, Stats, Compare>::detach_children_(Node<T, Stats> *node,
+                                                    Node<T, Stats> *&left,
+                                                    Node<T, Stats> *&right) {
+  left = node->left_;
+  right = node->right_;
+  if (left != nullptr) {
+    left->parent_ = nullptr;
+  }
+  if (right != nullptr) {
+    right->parent_ = nullptr;
+  }
+  node->left_ = nullptr;
+  node->right_ = nullptr;
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void
+AVLTree<T, Alloc, Stats, Compare>::DroppedNodes::push(Node<T, Stats> *node) {
+  node->left_ = nullptr;
+  node->right_ = nullptr;
+  if (tail == nullptr) {
+    head = node;
+  } else {
+    tail->left_ = node;
+  }
+  tail = node;
+  ++count;
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void AVLTree<T, Alloc, Stats, Compare>::DroppedNodes::push_subtree(
+    Node<T, Stats> *node) {
+  // rotates left children up like destroy_subtree_, push reuses left_
+  while (node != nullptr) {
+    Node<T, Stats> *left = node->left_;
+    if (left != nullptr) {
+      node->left_ = left->right_;
+      left->right_ = node;
+      node = left;
+      continue;
+    }
+    Node<T, Stats> *right = node->right_;
+    push(node);
+    node = right;
+  }
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+void
+AVLTree<T, Alloc, Stats, Compare>::DroppedNodes::splice(DroppedNodes &other) {
+  if (other.head == nullptr) {
     return;
-  post_order_(node->left_, vec);
-  post_order_(node->right_, vec);
-  vec.push_back(node->key_);
+  }
+  if (tail == nullptr) {
+    head = other.head;
+  } else {
+    tail->left_ = other.head;
+  }
+  tail = other.tail;
+  count += other.count;
+  other.head = other.tail = nullptr;
+  other.count = 0;
 }
 
-template <typename T> Node<T> *AVLTree<T>::get_root() const { return root_; }
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+int AVLTree<T, Alloc, Stats, Compare>::height_(const Node<T, Stats> *node) {
+  return (node != nullptr) ? node->get_height() : 0;
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+size_t
+AVLTree<T, Alloc, Stats, Compare>::count_nodes_(const Node<T, Stats> *node) {
+  if (node == nullptr) {
+    return 0;
+  }
+  if constexpr (Stats::enabled) {
+    return node->get_subtree_size();
+  }
+  size_t count = 0;
+  walk_(node, TraversalOrder::pre_order, [&count](const Node<T, Stats> *) {
+    ++count;
+    return true;
+  });
+  return count;
+}
+
+/* Calls visit on every node of the subtree of root in the given order
+ * and stops early, returning false, once visit returns false.
+ *
+ * The walks keep no stack and do not touch the tree: once a subtree is
+ * done they climb parent_ to the first ancestor with work left, which
+ * they tell by the child they come up from. The parent of the current
+ * node is carried along in up rather than read from the node: that node
+ * has usually just missed the cache, its ancestors have not, so the
+ * climb does not wait for the load. On the way down the right child is
+ * prefetched while the left subtree is walked.
+ */
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename F>
+bool AVLTree<T, Alloc, Stats, Compare>::walk_(const Node<T, Stats> *root,
+                                              TraversalOrder order,
+                                              F &&visit) {
+  if (root == nullptr) {
+    return true;
+  }
+  switch (order) {
+  case TraversalOrder::in_order:
+    return walk_in_order_(root, visit);
+  case TraversalOrder::pre_order:
+    return walk_pre_order_(root, visit);
+  case TraversalOrder::post_order:
+    return walk_post_order_(root, visit);
+  }
+  return true;
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename F>
+bool AVLTree<T, Alloc, Stats, Compare>::walk_in_order_(
+    const Node<T, Stats> *root, F &visit) {
+  const Node<T, Stats> *node = root;
+  const Node<T, Stats> *up = root->parent_; // never read at root
+  for (;;) {
+    while (node->left_ != nullptr) {
+      __builtin_prefetch(node->right_);
+      up = node;
+      node = node->left_;
+    }
+    for (;;) {
+      if (!visit(node)) {
+        return false;
+      }
+      if (node->right_ != nullptr) {
+        up = node;
+        node = node->right_;
+        break;
+      }
+      // up past every subtree finished from the right, then to the
+      // parent whose left subtree this was
+      while (node != root && node == up->right_) {
+        node = up;
+        up = node->parent_;
+      }
+      if (node == root) {
+        return true;
+      }
+      node = up;
+      up = node->parent_;
+    }
+  }
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename F>
+bool AVLTree<T, Alloc, Stats, Compare>::walk_pre_order_(
+    const Node<T, Stats> *root, F &visit) {
+  const Node<T, Stats> *node = root;
+  const Node<T, Stats> *up = root->parent_;
+  for (;;) {
+    if (!visit(node)) {
+      return false;
+    }
+    if (node->left_ != nullptr) {
+      __builtin_prefetch(node->right_);
+      up = node;
+      node = node->left_;
+      continue;
+    }
+    if (node->right_ != nullptr) {
+      up = node;
+      node = node->right_;
+      continue;
+    }
+    // up to the nearest ancestor whose right subtree is still to come
+    for (;;) {
+      if (node == root) {
+        return true;
+      }
+      if (node == up->left_ && up->right_ != nullptr) {
+        node = up->right_;
+        break;
+      }
+      node = up;
+      up = node->parent_;
+    }
+  }
+}
+
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+template <typename F>
+bool AVLTree<T, Alloc, Stats, Compare>::walk_post_order_(
+    const Node<T, Stats> *root, F &visit) {
+  const Node<T, Stats> *node = root;
+  const Node<T, Stats> *up = root->parent_;
+  for (;;) {
+    // down to the first node of the subtree in post-order
+    for (;;) {
+      if (node->left_ != nullptr) {
+        __builtin_prefetch(node->right_);
+        up = node;
+        node = node->left_;
+      } else if (node->right_ != nullptr) {
+        up = node;
+        node = node->right_;
+      } else {
+        break;
+      }
+    }
+    for (;;) {
+      if (!visit(node)) {
+        return false;
+      }
+      if (node == root) {
+        return true;
+      }
+      if (node == up->left_ && up->right_ != nullptr) {
+        node = up->right_;
+        break;
+      }
+      node = up;
+      up = node->parent_;
+    }
+  }
+}
@@ -0,0 +1,656 @@
+#pragma once
+
+#include "compare.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+/* Compact AVL tree for large sets of small keys.
+ *
+ * Nodes live in one array owned by the tree and refer to each other by
+ * 32-bit index instead of pointer. The balance factor takes the place of
+ * the stored height and is packed into the top 2 bits of the right link,
+ * so a node is the key plus 8 bytes: 12 bytes for an int key against 32
+ * for Node<int>. ParentLinks adds a 32-bit parent index, 16 bytes in
+ * total, in exchange for iterators; without it every operation walks
+ * down from the root and remembers its path on a small stack.
+ *
+ * Freed slots are chained into a free list and reused by later
+ * insertions, their keys stay constructed until then. Growing the array
+ * may move the keys, so pointers returned by find and friends are valid
+ * until the next insertion only.
+ *
+ * The interface follows AVLTree, minus the operations that hand out
+ * nodes. At most 2^30 - 1 keys fit.
+ */
+
+struct CompactNoParent {};
+
+struct CompactParent {
+  uint32_t parent_;
+};
+
+template <typename T, bool ParentLinks>
+struct CompactNode
+    : std::conditional_t<ParentLinks, CompactParent, CompactNoParent> {
+  T key_;
+  uint32_t left_;
+  uint32_t right_balance_; // balance + 1 in the top 2 bits, right index below
+};
+
+template <typename T, bool ParentLinks = false,
+          typename Compare = std::less<T>>
+class CompactAVLTree {
+  // lookups take any key type with a transparent Compare, see AVLTree
+  template <typename K>
+  using lookup_key_t =
+      std::enable_if_t<std::is_same_v<K, T> || is_transparent<Compare>::value>;
+
+public:
+  class iterator;
+  using value_type = T;
+  using size_type = size_t;
+  using key_compare = Compare;
+  using const_iterator = iterator;
+  using Node = CompactNode<T, ParentLinks>;
+
+  static constexpr uint32_t NIL = (uint32_t(1) << 30) - 1;
+  static constexpr size_t MAX_SIZE = NIL;
+
+  CompactAVLTree();
+  explicit CompactAVLTree(const Compare &comp);
+
+  void reserve(size_t count);
+  void insert(const T &key);
+  void insert(T &&key);
+  const T *find(const T &key) const { return find<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  const T *find(const K &key) const;
+  void delete_key(const T &key);
+  void clear_tree();
+
+  size_t get_height() const;
+  size_t get_size() const;
+  bool is_empty() const;
+  bool is_balanced() const;
+  size_t memory_bytes() const;
+  const T *lowerbound(const T &key) const;
+  const T *upperbound(const T &key) const;
+  std::vector<T> in_order() const;
+  template <typename F>
+  void for_each_in_range(const T &lo, const T &hi, F &&fn) const;
+
+  iterator begin() const;
+  iterator end() const;
+
+private:
+  // the deepest path an AVL tree of MAX_SIZE keys can have is 44 nodes
+  static constexpr int MAX_PATH = 64;
+
+  struct Path {
+    uint32_t nodes[MAX_PATH];
+    bool went_left[MAX_PATH];
+    int length = 0;
+
+    void push(uint32_t node, bool left) {
+      nodes[length] = node;
+      went_left[length] = left;
+      ++length;
+    }
+  };
+
+  template <typename K> void insert_(K &&key);
+  uint32_t create_node_(T &&key);
+  uint32_t rebalance_(uint32_t node, int balance, bool &height_kept);
+  uint32_t rotate_right_(uint32_t node);
+  uint32_t rotate_left_(uint32_t node);
+  void replace_child_(const Path &path, int depth, uint32_t child);
+  int check_(uint32_t node, uint32_t parent, bool &ok) const;
+  uint32_t next_(uint32_t node) const;
+  uint32_t prev_(uint32_t node) const;
+
+  uint32_t left_(uint32_t node) const { return nodes_[node].left_; }
+  uint32_t right_(uint32_t node) const {
+    return nodes_[node].right_balance_ & NIL;
+  }
+  int balance_(uint32_t node) const {
+    return static_cast<int>(nodes_[node].right_balance_ >> 30) - 1;
+  }
+  void set_balance_(uint32_t node, int balance);
+  void set_left_(uint32_t node, uint32_t child);
+  void set_right_(uint32_t node, uint32_t child);
+  void set_parent_(uint32_t node, uint32_t parent);
+
+  std::vector<Node> nodes_;
+  uint32_t root_;
+  uint32_t free_list_; // chained through left_
+  size_t size_;
+  KeyCompare<T, Compare> key_comp_;
+};
+
+/* Bidirectional iterator, available with ParentLinks only.
+ *
+ * Like pointers returned by find it is invalidated by insertions.
+ */
+template <typename T, bool ParentLinks, typename Compare>
+class CompactAVLTree<T, ParentLinks, Compare>::iterator {
+public:
+  using iterator_category = std::bidirectional_iterator_tag;
+  using value_type = T;
+  using difference_type = std::ptrdiff_t;
+  using pointer = const T *;
+  using reference = const T &;
+
+  iterator() : tree_{nullptr}, node_{NIL} {}
+  iterator(const CompactAVLTree *tree, uint32_t node)
+      : tree_{tree}, node_{node} {}
+
+  reference operator*() const { return tree_->nodes_[node_].key_; }
+  pointer operator->() const { return &tree_->nodes_[node_].key_; }
+
+  iterator &operator++() {
+    node_ = tree_->next_(node_);
+    return *this;
+  }
+  iterator operator++(int) {
+    iterator old = *this;
+    ++*this;
+    return old;
+  }
+  iterator &operator--() {
+    node_ = tree_->prev_(node_);
+    return *this;
+  }
+  iterator operator--(int) {
+    iterator old = *this;
+    --*this;
+    return old;
+  }
+
+  bool operator==(const iterator &other) const { return node_ == other.node_; }
+  bool operator!=(const iterator &other) const { return node_ != other.node_; }
+
+private:
+  const CompactAVLTree *tree_;
+  uint32_t node_;
+};
+
+template <typename T, bool ParentLinks, typename Compare>
+CompactAVLTree<T, ParentLinks, Compare>::CompactAVLTree()
+    : root_{NIL}, free_list_{NIL}, size_{0} {}
+
+template <typename T, bool ParentLinks, typename Compare>
+CompactAVLTree<T, ParentLinks, Compare>::CompactAVLTree(const Compare &comp)
+    : root_{NIL}, free_list_{NIL}, size_{0}, key_comp_{comp} {}
+
+template <typename T, bool ParentLinks, typename Compare>
+void CompactAVLTree<T, ParentLinks, Compare>::reserve(size_t count) {
+  nodes_.reserve(count);
+}
+
+template <typename T, bool ParentLinks, typename Compare>
+void CompactAVLTree<T, ParentLinks, Compare>::set_balance_(uint32_t node,
+                                                           int balance) {
+  uint32_t &word = nodes_[node].right_balance_;
+  word = (word & NIL) | (static_cast<uint32_t>(balance + 1) << 30);
+}
+
+template <typename T, bool ParentLinks, typename Compare>
+void CompactAVLTree<T, ParentLinks, Compare>::set_left_(uint32_t node,
+                                                        uint32_t child) {
+  nodes_[node].left_ = child;
+  set_parent_(child, node);
+}
+
+template <typename T, bool ParentLinks, typename Compare>
+void CompactAVLTree<T, ParentLinks, Compare>::set_right_(uint32_t node,
+                                                         uint32_t child) {
+  uint32_t &word = nodes_[node].right_balance_;
+  word = (word & ~NIL) | child;
+  set_parent_(child, node);
+}
+
+template <typename T, bool ParentLinks, typename Compare>
+void CompactAVLTree<T, ParentLinks, Compare>::set_parent_(uint32_t node,
+                                                          uint32_t parent) {
+  if constexpr (ParentLinks) {
+    if (node != NIL) {
+      nodes_[node].parent_ = parent;
+    }
+  }
+}
+
+template <typename T, bool ParentLinks, typename Compare>
+void CompactAVLTree<T, ParentLinks, Compare>::insert(const T &key) {
+  insert_(key);
+}
+
+template <typename T, bool ParentLinks, typename Compare>
+void CompactAVLTree<T, ParentLinks, Compare>::insert(T &&key) {
+  insert_(std::move(key));
+}
+
+/* Going down records the path, going up updates balance factors.
+ *
+ * A node whose balance becomes 0 did not get higher, so the walk stops
+ * there. One that reaches +-2 is rotated, which after an insertion always
+ * restores the old height of the subtree and stops the walk as well.
+ */
+template <typename T, bool ParentLinks, typename Compare>
+template <typename K>
+void CompactAVLTree<T, ParentLinks, Compare>::insert_(K &&key) {
+  Path path;
+  uint32_t walk_node = root_;
+  while (walk_node != NIL) {
+    int order = key_comp_.compare(key, nodes_[walk_node].key_);
+    if (order == 0) {
+      return;
+    }
+    path.push(walk_node, order < 0);
+    walk_node = (order < 0) ? left_(walk_node) : right_(walk_node);
+  }
+  if (size_ == MAX_SIZE) {
+    throw std::length_error("CompactAVLTree is full");
+  }
+
+  uint32_t node = create_node_(T(std::forward<K>(key)));
+  ++size_;
+  replace_child_(path, path.length, node);
+
+  for (int depth = path.length - 1; depth >= 0; --depth) {
+    uint32_t parent = path.nodes[depth];
+    int balance = balance_(parent) + (path.went_left[depth] ? 1 : -1);
+    if (balance == 0) {
+      set_balance_(parent, 0);
+      return;
+    }
+    if (balance == 1 || balance == -1) {
+      set_balance_(parent, balance);
+      continue;
+    }
+    bool height_kept = false;
+    replace_child_(path, depth, rebalance_(parent, balance, height_kept));
+    return;
+  }
+}
+
+template <typename T, bool ParentLinks, typename Compare>
+uint32_t CompactAVLTree<T, ParentLinks, Compare>::create_node_(T &&key) {
+  uint32_t node = free_list_;
+  if (node != NIL) {
+    free_list_ = nodes_[node].left_;
+    nodes_[node].key_ = std::move(key);
+  } else {
+    node = static_cast<uint32_t>(nodes_.size());
+    nodes_.push_back(Node{{}, std::move(key), NIL, NIL});
+  }
+  nodes_[node].left_ = NIL;
+  nodes_[node].right_balance_ = NIL;
+  set_balance_(node, 0);
+  set_parent_(node, NIL);
+  return node;
+}
+
+// makes child the child of path.nodes[depth - 1] the path went through
+template <typename T, bool ParentLinks, typename Compare>
+void CompactAVLTree<T, ParentLinks, Compare>::replace_child_(const Path &path,
+                                                             int depth,
+                                                             uint32_t child) {
+  if (depth == 0) {
+    root_ = child;
+    set_parent_(child, NIL);
+  } else if (path.went_left[depth - 1]) {
+    set_left_(path.nodes[depth - 1], child);
+  } else {
+    set_right_(path.nodes[depth - 1], child);
+  }
+}
+
+/* Rotates node, whose balance would be +-2, and returns the new root of
+ * the subtree with all balance factors set. height_kept tells whether
+ * the subtree is as high as before the rotation, which only happens
+ * after a deletion, when the higher child was perfectly balanced.
+ */
+template <typename T, bool ParentLinks, typename Compare>
+uint32_t
+CompactAVLTree<T, ParentLinks, Compare>::rebalance_(uint32_t node, int balance,
+                                                    bool &height_kept) {
+  height_kept = false;
+  if (balance > 0) {
+    uint32_t child = left_(node);
+    int child_balance = balance_(child);
+    if (child_balance >= 0) {
+      height_kept = (child_balance == 0);
+      set_balance_(node, height_kept ? 1 : 0);
+      set_balance_(child, height_kept ? -1 : 0);
+      return rotate_right_(node);
+    }
+    uint32_t grandchild = right_(child);
+    int grandchild_balance = balance_(grandchild);
+    set_balance_(node, (grandchild_balance == 1) ? -1 : 0);
+    set_balance_(child, (grandchild_balance == -1) ? 1 : 0);
+    set_balance_(grandchild, 0);
+    set_left_(node, rotate_left_(child));
+    return rotate_right_(node);
+  }
+
+  uint32_t child = right_(node);
+  int child_balance = balance_(child);
+  if (child_balance <= 0) {
+    height_kept = (child_balance == 0);
+    set_balance_(node, height_kept ? -1 : 0);
+    set_balance_(child, height_kept ? 1 : 0);
+    return rotate_left_(node);
+  }
+  uint32_t grandchild = left_(child);
+  int grandchild_balance = balance_(grandchild);
+  set_balance_(node, (grandchild_balance == -1) ? 1 : 0);
+  set_balance_(child, (grandchild_balance == 1) ? -1 : 0);
+  set_balance_(grandchild, 0);
+  set_right_(node, rotate_right_(child));
+  return rotate_left_(node);
+}
+
+// left child becomes the root of the subtree, balances are left alone
+template <typename T, bool ParentLinks, typename Compare>
+uint32_t CompactAVLTree<T, ParentLinks, Compare>::rotate_right_(uint32_t node) {
+  uint32_t child = left_(node);
+  set_left_(node, right_(child));
+  set_right_(child, node);
+  return child;
+}
+
+template <typename T, bool ParentLinks, typename Compare>
+uint32_t CompactAVLTree<T, ParentLinks, Compare>::rotate_left_(uint32_t node) {
+  uint32_t child = right_(node);
+  set_right_(node, left_(child));
+  set_left_(child, node);
+  return child;
+}
+
+template <typename T, bool ParentLinks, typename Compare>
+template <typename K, typename>
+const T *CompactAVLTree<T, ParentLinks, Compare>::find(const K &key) const {
+  uint32_t walk_node = root_;
+  while (walk_node != NIL) {
+    int order = key_comp_.compare(key, nodes_[walk_node].key_);
+    if (order == 0) {
+      return &nodes_[walk_node].key_;
+    }
+    walk_node = (order < 0) ? left_(walk_node) : right_(walk_node);
+  }
+  return nullptr;
+}
+
+/* A node with two children first swaps keys with its successor, so the
+ * node actually unlinked has one child at most. Going up, a node whose
+ * balance becomes +-1 kept its height and the walk stops. One that
+ * reaches +-2 is rotated, and the walk goes on unless the rotation kept
+ * the height.
+ */
+template <typename T, bool ParentLinks, typename Compare>
+void CompactAVLTree<T, ParentLinks, Compare>::delete_key(const T &key) {
+  Path path;
+  uint32_t node = root_;
+  while (node != NIL) {
+    int order = key_comp_.compare(key, nodes_[node].key_);
+    if (order == 0) {
+      break;
+    }
+    path.push(node, order < 0);
+    node = (order < 0) ? left_(node) : right_(node);
+  }
+  if (node == NIL) {
+    return;
+  }
+
+  if (left_(node) != NIL && right_(node) != NIL) {
+    path.push(node, false);
+    uint32_t successor = right_(node);
+    while (left_(successor) != NIL) {
+      path.push(successor, true);
+      successor = left_(successor);
+    }
+    std::swap(nodes_[node].key_, nodes_[successor].key_);
+    node = successor;
+  }
+
+  uint32_t child = (left_(node) != NIL) ? left_(node) : right_(node);
+  replace_child_(path, path.length, child);
+  nodes_[node].left_ = free_list_;
+  free_list_ = node;
+  --size_;
+
+  for (int depth = path.length - 1; depth >= 0; --depth) {
+    uint32_t parent = path.nodes[depth];
+    int balance = balance_(parent) + (path.went_left[depth] ? -1 : 1);
+    if (balance == 1 || balance == -1) {
+      set_balance_(parent, balance);
+      return;
+    }
+    if (balance == 0) {
+      set_balance_(parent, 0);
+      continue;
+    }
+    bool height_kept = false;
+    replace_child_(path, depth, rebalance_(parent, balance, height_kept));
+    if (height_kept) {
+      return;
+    }
+  }
+}
+
+template <typename T, bool ParentLinks, typename Compare>
+void CompactAVLTree<T, ParentLinks, Compare>::clear_tree() {
+  nodes_.clear();
+  root_ = NIL;
+  free_list_ = NIL;
+  size_ = 0;
+}
+
+// follows the higher child down, so the walk is as long as the height
+template <typename T, bool ParentLinks, typename Compare>
+size_t CompactAVLTree<T, ParentLinks, Compare>::get_height() const {
+  size_t height = 0;
+  for (uint32_t node = root_; node != NIL; ++height) {
+    node = (balance_(node) < 0) ? right_(node) : left_(node);
+  }
+  return height;
+}
+
+template <typename T, bool ParentLinks, typename Compare>
+size_t CompactAVLTree<T, ParentLinks, Compare>::get_size() const {
+  return size_;
+}
+
+template <typename T, bool ParentLinks, typename Compare>
+bool CompactAVLTree<T, ParentLinks, Compare>::is_empty() const {
+  return size_ == 0;
+}
+
+template <typename T, bool ParentLinks, typename Compare>
+size_t CompactAVLTree<T, ParentLinks, Compare>::memory_bytes() const {
+  return nodes_.capacity() * sizeof(Node);
+}
+
+/* Recomputes every height from scratch and checks it against the stored
+ * balance factors, the AVL property and, if present, the parent links.
+ */
+template <typename T, bool ParentLinks, typename Compare>
+bool CompactAVLTree<T, ParentLinks, Compare>::is_balanced() const {
+  bool ok = true;
+  check_(root_, NIL, ok);
+  return ok;
+}
+
+template <typename T, bool ParentLinks, typename Compare>
+int CompactAVLTree<T, ParentLinks, Compare>::check_(uint32_t node,
+                                                    uint32_t parent,
+                                                    bool &ok) const {
+  if (node == NIL || !ok) {
+    return 0;
+  }
+  if constexpr (ParentLinks) {
+    if (nodes_[node].parent_ != parent) {
+      ok = false;
+    }
+  }
+  int left_height = check_(left_(node), node, ok);
+  int right_height = check_(right_(node), node, ok);
+  if (left_height - right_height != balance_(node)) {
+    ok = false;
+  }
+  return 1 + std::max(left_height, right_height);
+}
+
+// smallest key >= key, as AVLTree::lowerbound
+template <typename T, bool ParentLinks, typename Compare>
+const T *CompactAVLTree<T, ParentLinks, Compare>::lowerbound(
+    const T &key) const {
+  const T *result = nullptr;
+  uint32_t node = root_;
+  while (node != NIL) {
+    if (key_comp_.less(nodes_[node].key_, key)) {
+      node = right_(node);
+    } else {
+      result = &nodes_[node].key_;
+      node = left_(node);
+    }
+  }
+  return result;
+}
+
+// largest key <= key, as AVLTree::upperbound
+template <typename T, bool ParentLinks, typename Compare>
+const T *CompactAVLTree<T, ParentLinks, Compare>::upperbound(
+    const T &key) const {
+  const T *result = nullptr;
+  uint32_t node = root_;
+  while (node != NIL) {
+    if (key_comp_.less(key, nodes_[node].key_)) {
+      node = left_(node);
+    } else {
+      result = &nodes_[node].key_;
+      node = right_(node);
+    }
+  }
+  return result;
+}
+
+template <typename T, bool ParentLinks, typename Compare>
+std::vector<T> CompactAVLTree<T, ParentLinks, Compare>::in_order() const {
+  std::vector<T> vec;
+  vec.reserve(size_);
+  uint32_t stack[MAX_PATH];
+  int top = 0;
+  uint32_t node = root_;
+  while (node != NIL || top > 0) {
+    for (; node != NIL; node = left_(node)) {
+      stack[top++] = node;
+    }
+    node = stack[--top];
+    vec.push_back(nodes_[node].key_);
+    node = right_(node);
+  }
+  return vec;
+}
+
+/* Calls fn(key) for every key in [lo, hi], in ascending order.
+ *
+ * The stack holds the nodes whose left subtree is being visited, seeded
+ * by one descent to lo, so no parent links are needed.
+ */
+template <typename T, bool ParentLinks, typename Compare>
+template <typename F>
+void CompactAVLTree<T, ParentLinks, Compare>::for_each_in_range(const T &lo,
+                                                               const T &hi,
+                                                               F &&fn) const {
+  uint32_t stack[MAX_PATH];
+  int top = 0;
+  uint32_t node = root_;
+  while (node != NIL) {
+    if (key_comp_.less(nodes_[node].key_, lo)) {
+      node = right_(node);
+    } else {
+      stack[top++] = node;
+      node = left_(node);
+    }
+  }
+  while (top > 0) {
+    node = stack[--top];
+    if (key_comp_.less(hi, nodes_[node].key_)) {
+      return;
+    }
+    fn(nodes_[node].key_);
+    for (node = right_(node); node != NIL; node = left_(node)) {
+      stack[top++] = node;
+    }
+  }
+}
+
+template <typename T, bool ParentLinks, typename Compare>
+typename CompactAVLTree<T, ParentLinks, Compare>::iterator
+CompactAVLTree<T, ParentLinks, Compare>::begin() const {
+  static_assert(ParentLinks, "iterators need ParentLinks, "
+                             "use for_each_in_range instead");
+  uint32_t node = root_;
+  while (node != NIL && left_(node) != NIL) {
+    node = left_(node);
+  }
+  return iterator(this, node);
+}
+
+template <typename T, bool ParentLinks, typename Compare>
+typename CompactAVLTree<T, ParentLinks, Compare>::iterator
+CompactAVLTree<T, ParentLinks, Compare>::end() const {
+  static_assert(ParentLinks, "iterators need ParentLinks, "
+                             "use for_each_in_range instead");
+  return iterator(this, NIL);
+}
+
+template <typename T, bool ParentLinks, typename Compare>
+uint32_t CompactAVLTree<T, ParentLinks, Compare>::next_(uint32_t node) const {
+  if (right_(node) != NIL) {
+    node = right_(node);
+    while (left_(node) != NIL) {
+      node = left_(node);
+    }
+    return node;
+  }
+  uint32_t parent = nodes_[node].parent_;
+  while (parent != NIL && node == right_(parent)) {
+    node = parent;
+    parent = nodes_[parent].parent_;
+  }
+  return parent;
+}
+
+// --end() is the largest key
+template <typename T, bool ParentLinks, typename Compare>
+uint32_t CompactAVLTree<T, ParentLinks, Compare>::prev_(uint32_t node) const {
+  if (node == NIL) {
+    node = root_;
+    while (right_(node) != NIL) {
+      node = right_(node);
+    }
+    return node;
+  }
+  if (left_(node) != NIL) {
+    node = left_(node);
+    while (right_(node) != NIL) {
+      node = right_(node);
+    }
+    return node;
+  }
+  uint32_t parent = nodes_[node].parent_;
+  while (parent != NIL && node == left_(parent)) {
+    node = parent;
+    parent = nodes_[parent].parent_;
+  }
+  return parent;
+}
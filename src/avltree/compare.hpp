@@ -0,0 +1,103 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#if defined(__cpp_impl_three_way_comparison) &&                                \
+    defined(__cpp_lib_three_way_comparison)
+#include <compare>
+#define AVLTREE_HAS_SPACESHIP 1
+#endif
+
+/* Key comparison for AVLTree.
+ *
+ * Compare is a strict weak ordering, std::less<T> by default. Descents
+ * that have to tell "equal" from "greater" ask KeyCompare::compare for a
+ * three-way result once per node instead of calling Compare twice. It is
+ * computed with the cheapest of, in this order:
+ *
+ *   - comp.compare(a, b), if Compare has such a member (returns an int
+ *     or an ordering: negative, zero or positive);
+ *   - a.compare(b) for strings and string views under std::less;
+ *   - a <=> b under std::less, when built as C++20;
+ *   - comp(a, b), and comp(b, a) only if the first one was false.
+ *
+ * A transparent Compare (one with an is_transparent member type, such as
+ * std::less<>) can compare keys with any other type it accepts, so
+ * lookups take that type as is instead of building a T from it.
+ */
+
+template <typename Compare, typename A, typename B, typename = void>
+struct has_compare_member : std::false_type {};
+
+template <typename Compare, typename A, typename B>
+struct has_compare_member<
+    Compare, A, B,
+    std::void_t<decltype(std::declval<const Compare &>().compare(
+        std::declval<const A &>(), std::declval<const B &>()))>>
+    : std::true_type {};
+
+template <typename Compare, typename = void>
+struct is_transparent : std::false_type {};
+
+template <typename Compare>
+struct is_transparent<Compare, std::void_t<typename Compare::is_transparent>>
+    : std::true_type {};
+
+// strings and string views, which have a three-way compare member
+template <typename T> struct is_string_like : std::false_type {};
+
+template <typename C, typename Traits, typename A>
+struct is_string_like<std::basic_string<C, Traits, A>> : std::true_type {};
+
+template <typename C, typename Traits>
+struct is_string_like<std::basic_string_view<C, Traits>> : std::true_type {};
+
+template <typename Compare, typename T>
+struct is_default_less
+    : std::bool_constant<std::is_same_v<Compare, std::less<T>> ||
+                         std::is_same_v<Compare, std::less<>>> {};
+
+template <typename T, typename Compare> class KeyCompare {
+public:
+  KeyCompare() = default;
+  explicit KeyCompare(const Compare &comp) : comp_{comp} {}
+
+  template <typename A, typename B> bool less(const A &a, const B &b) const {
+    return comp_(a, b);
+  }
+  template <typename A, typename B> int compare(const A &a, const B &b) const;
+  const Compare &get() const { return comp_; }
+
+private:
+  // maps an int or an ordering to -1, 0 or 1
+  template <typename R> static int sign_(const R &result) {
+    return (result < 0) ? -1 : ((0 < result) ? 1 : 0);
+  }
+
+  Compare comp_;
+};
+
+// negative, zero or positive as a is less than, equal to or greater than b
+template <typename T, typename Compare>
+template <typename A, typename B>
+int KeyCompare<T, Compare>::compare(const A &a, const B &b) const {
+  if constexpr (has_compare_member<Compare, A, B>::value) {
+    return sign_(comp_.compare(a, b));
+  } else if constexpr (is_default_less<Compare, T>::value &&
+                       is_string_like<A>::value && is_string_like<B>::value) {
+    return sign_(a.compare(b));
+#ifdef AVLTREE_HAS_SPACESHIP
+  } else if constexpr (is_default_less<Compare, T>::value &&
+                       std::three_way_comparable_with<A, B>) {
+    return sign_(a <=> b);
+#endif
+  } else {
+    if (comp_(a, b)) {
+      return -1;
+    }
+    return comp_(b, a) ? 1 : 0;
+  }
+}
@@ -0,0 +1,1121 @@
+#pragma once
+
+#include "../utils/epoch.hpp"
+#include "compare.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/* AVL tree for many threads inserting, deleting and looking up at once,
+ * after Bronson, Casper, Chafi and Olukotun, "A Practical Concurrent
+ * Binary Search Tree" (PPoPP 2010).
+ *
+ *   - Optimistic concurrency: every node has a version that a rotation
+ *     marks as "shrinking" while it moves keys out of the subtree, and
+ *     bumps afterwards. Lookups take no locks; they read a child, then
+ *     check that the parent's version did not change (hand-over-hand
+ *     validation), and retry from the last valid node otherwise.
+ *   - Writers lock only the nodes they change, parents before children.
+ *   - Relaxed balance: a writer fixes the heights and rotations its own
+ *     change calls for on the way back up, one node at a time, while
+ *     other threads may already be working below. Once all threads are
+ *     done the tree is an AVL tree again.
+ *   - Deleting a key whose node has two children only marks the node as
+ *     a routing node. Routing nodes are unlinked once they have at most
+ *     one child.
+ *
+ * Unlinked nodes are freed through the epoch domain, see epoch.hpp.
+ * Lookups return copies of the keys.
+ *
+ * lowerbound and upperbound descend the same way and step over routing
+ * nodes. Under concurrent writers they return a key that was in the
+ * tree during the call, and do not skip a key that stayed in the tree
+ * for the whole call.
+ *
+ * in_order, get_height and is_balanced need the tree to be quiescent.
+ */
+
+// per-node test-and-test-and-set lock, held only for a few stores
+class NodeLock {
+public:
+  void lock() {
+    int spins = 0;
+    while (locked_.exchange(true, std::memory_order_acquire)) {
+      while (locked_.load(std::memory_order_relaxed)) {
+        if (++spins > 64) {
+          std::this_thread::yield();
+        }
+      }
+    }
+  }
+  void unlock() { locked_.store(false, std::memory_order_release); }
+
+private:
+  std::atomic<bool> locked_{false};
+};
+
+template <typename T> struct ConcurrentNode;
+
+// everything but the key, which the holder of the root does not have
+template <typename T> struct ConcurrentLinks {
+  // what a lookup reads first, then the small fields packed together
+  std::atomic<uint64_t> version_{0};
+  std::atomic<ConcurrentNode<T> *> left_{nullptr};
+  std::atomic<ConcurrentNode<T> *> right_{nullptr};
+  std::atomic<ConcurrentLinks *> parent_{nullptr};
+  std::atomic<int> height_{0};
+  std::atomic<bool> present_{false}; // false: routing node
+  NodeLock lock_;
+
+  std::atomic<ConcurrentNode<T> *> &child(int dir) {
+    return (dir < 0) ? left_ : right_;
+  }
+};
+
+template <typename T> struct ConcurrentNode : ConcurrentLinks<T> {
+  template <typename Key>
+  ConcurrentNode(Key &&key, ConcurrentLinks<T> *parent)
+      : key_(std::forward<Key>(key)) {
+    this->parent_.store(parent, std::memory_order_relaxed);
+    this->height_.store(1, std::memory_order_relaxed);
+    this->present_.store(true, std::memory_order_relaxed);
+  }
+
+  const T key_;
+};
+
+template <typename T, typename Compare = std::less<T>>
+class ConcurrentAVLTree {
+  // lookups take any key type with a transparent Compare, see AVLTree
+  template <typename K>
+  using lookup_key_t =
+      std::enable_if_t<std::is_same_v<K, T> || is_transparent<Compare>::value>;
+
+public:
+  using value_type = T;
+  using size_type = size_t;
+  using key_compare = Compare;
+
+  ConcurrentAVLTree() = default;
+  explicit ConcurrentAVLTree(const Compare &comp) : key_comp_{comp} {}
+  ConcurrentAVLTree(const ConcurrentAVLTree &) = delete;
+  ConcurrentAVLTree &operator=(const ConcurrentAVLTree &) = delete;
+  ~ConcurrentAVLTree();
+
+  void insert(const T &key) { update_(key, true); }
+  void delete_key(const T &key) { delete_key<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  void delete_key(const K &key) {
+    update_(key, false);
+  }
+
+  bool contains(const T &key) const { return contains<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  bool contains(const K &key) const;
+  std::optional<T> find(const T &key) const { return find<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  std::optional<T> find(const K &key) const;
+  std::optional<T> lowerbound(const T &key) const {
+    return lowerbound<T>(key);
+  }
+  template <typename K, typename = lookup_key_t<K>>
+  std::optional<T> lowerbound(const K &key) const {
+    return bound_(key, true);
+  }
+  std::optional<T> upperbound(const T &key) const {
+    return upperbound<T>(key);
+  }
+  template <typename K, typename = lookup_key_t<K>>
+  std::optional<T> upperbound(const K &key) const {
+    return bound_(key, false);
+  }
+
+  size_t get_size() const { return size_.load(std::memory_order_relaxed); }
+  bool is_empty() const { return get_size() == 0; }
+  std::vector<T> in_order() const;
+  size_t get_height() const;
+  bool is_balanced() const;
+
+private:
+  using NodeT = ConcurrentNode<T>;
+  using LinksT = ConcurrentLinks<T>;
+
+  static constexpr int LEFT = -1;
+  static constexpr int RIGHT = 1;
+
+  // results of the attempt_ functions
+  enum Outcome { RETRY = -1, ABSENT = 0, PRESENT = 1 };
+
+  // node_condition_ results other than a new height
+  static constexpr int UNLINK_REQUIRED = -1;
+  static constexpr int REBALANCE_REQUIRED = -2;
+  static constexpr int NOTHING_REQUIRED = -3;
+
+  // version bits; the rest counts finished changes
+  static constexpr uint64_t SHRINKING = 1;
+  static constexpr uint64_t UNLINKED = 2;
+
+  static bool is_shrinking_or_unlinked_(uint64_t version) {
+    return (version & (SHRINKING | UNLINKED)) != 0;
+  }
+  static bool is_unlinked_(uint64_t version) {
+    return (version & UNLINKED) != 0;
+  }
+  static uint64_t begin_change_(uint64_t version) { return version | SHRINKING; }
+  static uint64_t end_change_(uint64_t version) {
+    return (version | SHRINKING | UNLINKED) + 1;
+  }
+  static int height_(const LinksT *node) {
+    return (node == nullptr) ? 0 : node->height_.load();
+  }
+  static void wait_until_not_changing_(LinksT *node, uint64_t version);
+
+  template <typename K>
+  int attempt_get_(const K &key, NodeT *node, int dir, uint64_t node_version,
+                   NodeT *&found) const;
+  template <typename K>
+  NodeT *bound_node_(const K &key, bool ceiling, bool strict) const;
+  template <typename K>
+  int attempt_bound_(const K &key, bool ceiling, bool strict, NodeT *node,
+                     int dir, uint64_t node_version, NodeT *best,
+                     NodeT *&found) const;
+  template <typename K>
+  std::optional<T> bound_(const K &key, bool ceiling) const;
+
+  template <typename K> void update_(const K &key, bool present);
+  template <typename K> bool insert_into_empty_(const K &key);
+  template <typename K>
+  int attempt_update_(const K &key, bool present, LinksT *parent, NodeT *node,
+                      uint64_t node_version);
+  int attempt_node_update_(bool present, LinksT *parent, NodeT *node);
+  bool attempt_unlink_nl_(LinksT *parent, NodeT *node);
+
+  int node_condition_(LinksT *node) const;
+  LinksT *fix_height_nl_(LinksT *node);
+  void fix_height_and_rebalance_(LinksT *node);
+  LinksT *rebalance_nl_(LinksT *parent, NodeT *node);
+  LinksT *rebalance_to_right_nl_(LinksT *parent, NodeT *node, NodeT *left,
+                                 int right_height);
+  LinksT *rebalance_to_left_nl_(LinksT *parent, NodeT *node, NodeT *right,
+                                int left_height);
+  LinksT *rotate_right_nl_(LinksT *parent, NodeT *node, NodeT *left,
+                           int right_height, int left_left_height,
+                           NodeT *left_right, int left_right_height);
+  LinksT *rotate_left_nl_(LinksT *parent, NodeT *node, NodeT *right,
+                          int left_height, int right_right_height,
+                          NodeT *right_left, int right_left_height);
+  LinksT *rotate_right_over_left_nl_(LinksT *parent, NodeT *node, NodeT *left,
+                                     int right_height, int left_left_height,
+                                     NodeT *left_right,
+                                     int left_right_left_height);
+  LinksT *rotate_left_over_right_nl_(LinksT *parent, NodeT *node,
+                                     NodeT *right, int left_height,
+                                     int right_right_height, NodeT *right_left,
+                                     int right_left_right_height);
+  void replace_child_nl_(LinksT *parent, NodeT *old_child, NodeT *new_child);
+
+  bool check_(const NodeT *node, int &height) const;
+  static void delete_node_(void *node) { delete static_cast<NodeT *>(node); }
+
+  // the root is holder_.right_; holder_ has no parent and no key
+  mutable LinksT holder_;
+  std::atomic<size_t> size_{0};
+  KeyCompare<T, Compare> key_comp_;
+};
+
+// threads must be done with the tree
+template <typename T, typename Compare>
+ConcurrentAVLTree<T, Compare>::~ConcurrentAVLTree() {
+  std::vector<NodeT *> stack;
+  if (NodeT *root = holder_.right_.load()) {
+    stack.push_back(root);
+  }
+  while (!stack.empty()) {
+    NodeT *node = stack.back();
+    stack.pop_back();
+    if (NodeT *left = node->left_.load()) {
+      stack.push_back(left);
+    }
+    if (NodeT *right = node->right_.load()) {
+      stack.push_back(right);
+    }
+    delete node;
+  }
+}
+
+/* A rotation holds the lock of the node it shrinks, so taking that lock
+ * waits for the rotation once spinning took too long.
+ */
+template <typename T, typename Compare>
+void ConcurrentAVLTree<T, Compare>::wait_until_not_changing_(
+    LinksT *node, uint64_t version) {
+  if ((version & SHRINKING) == 0) {
+    return;
+  }
+  for (int spins = 0; spins < 100; ++spins) {
+    if (node->version_.load() != version) {
+      return;
+    }
+  }
+  std::lock_guard<NodeLock> lock(node->lock_);
+}
+
+/* Lookups.
+ *
+ * attempt_ functions continue a descent below node in direction dir,
+ * node_version being the version of node when the descent got there.
+ * They return RETRY when that version changed, which sends the caller
+ * back to its own node; every other answer was valid when the last
+ * version check passed.
+ */
+
+template <typename T, typename Compare>
+template <typename K>
+int ConcurrentAVLTree<T, Compare>::attempt_get_(const K &key, NodeT *node,
+                                                int dir, uint64_t node_version,
+                                                NodeT *&found) const {
+  for (;;) {
+    NodeT *child = node->child(dir).load();
+    if (child == nullptr) {
+      if (node->version_.load() != node_version) {
+        return RETRY;
+      }
+      found = nullptr;
+      return ABSENT;
+    }
+    int order = key_comp_.compare(key, child->key_);
+    if (order == 0) {
+      found = child;
+      return child->present_.load() ? PRESENT : ABSENT;
+    }
+    uint64_t child_version = child->version_.load();
+    if (is_shrinking_or_unlinked_(child_version)) {
+      wait_until_not_changing_(child, child_version);
+      if (node->version_.load() != node_version) {
+        return RETRY;
+      }
+    } else if (child != node->child(dir).load()) {
+      if (node->version_.load() != node_version) {
+        return RETRY;
+      }
+    } else {
+      if (node->version_.load() != node_version) {
+        return RETRY;
+      }
+      int result = attempt_get_(key, child, order, child_version, found);
+      if (result != RETRY) {
+        return result;
+      }
+    }
+  }
+}
+
+template <typename T, typename Compare>
+template <typename K, typename>
+bool ConcurrentAVLTree<T, Compare>::contains(const K &key) const {
+  EpochGuard guard;
+  NodeT *found = nullptr;
+  for (;;) {
+    NodeT *root = holder_.right_.load();
+    if (root == nullptr) {
+      return false;
+    }
+    int order = key_comp_.compare(key, root->key_);
+    if (order == 0) {
+      return root->present_.load();
+    }
+    uint64_t version = root->version_.load();
+    if (is_shrinking_or_unlinked_(version)) {
+      wait_until_not_changing_(root, version);
+    } else if (root == holder_.right_.load()) {
+      int result = attempt_get_(key, root, order, version, found);
+      if (result != RETRY) {
+        return result == PRESENT;
+      }
+    }
+  }
+}
+
+template <typename T, typename Compare>
+template <typename K, typename>
+std::optional<T> ConcurrentAVLTree<T, Compare>::find(const K &key) const {
+  EpochGuard guard;
+  NodeT *found = nullptr;
+  for (;;) {
+    NodeT *root = holder_.right_.load();
+    if (root == nullptr) {
+      return std::nullopt;
+    }
+    int order = key_comp_.compare(key, root->key_);
+    if (order == 0) {
+      return root->present_.load() ? std::optional<T>(root->key_)
+                                   : std::nullopt;
+    }
+    uint64_t version = root->version_.load();
+    if (is_shrinking_or_unlinked_(version)) {
+      wait_until_not_changing_(root, version);
+    } else if (root == holder_.right_.load()) {
+      int result = attempt_get_(key, root, order, version, found);
+      if (result != RETRY) {
+        return (result == PRESENT) ? std::optional<T>(found->key_)
+                                   : std::nullopt;
+      }
+    }
+  }
+}
+
+/* Nearest node to key in the tree, routing nodes included: the smallest
+ * one >= key (ceiling) or the largest one <= key, strict leaves key
+ * itself out. best is the nearest node on the path so far.
+ */
+template <typename T, typename Compare>
+template <typename K>
+int ConcurrentAVLTree<T, Compare>::attempt_bound_(
+    const K &key, bool ceiling, bool strict, NodeT *node, int dir,
+    uint64_t node_version, NodeT *best, NodeT *&found) const {
+  for (;;) {
+    NodeT *child = node->child(dir).load();
+    if (child == nullptr) {
+      if (node->version_.load() != node_version) {
+        return RETRY;
+      }
+      found = best;
+      return PRESENT;
+    }
+    int order = key_comp_.compare(key, child->key_);
+    if (order == 0 && !strict) {
+      found = child;
+      return PRESENT;
+    }
+    bool candidate = ceiling ? (order < 0 || (order == 0 && !strict))
+                             : (order > 0 || (order == 0 && !strict));
+    int child_dir = (candidate == ceiling) ? LEFT : RIGHT;
+    uint64_t child_version = child->version_.load();
+    if (is_shrinking_or_unlinked_(child_version)) {
+      wait_until_not_changing_(child, child_version);
+      if (node->version_.load() != node_version) {
+        return RETRY;
+      }
+    } else if (child != node->child(dir).load()) {
+      if (node->version_.load() != node_version) {
+        return RETRY;
+      }
+    } else {
+      if (node->version_.load() != node_version) {
+        return RETRY;
+      }
+      int result =
+          attempt_bound_(key, ceiling, strict, child, child_dir, child_version,
+                         candidate ? child : best, found);
+      if (result != RETRY) {
+        return result;
+      }
+    }
+  }
+}
+
+template <typename T, typename Compare>
+template <typename K>
+ConcurrentNode<T> *
+ConcurrentAVLTree<T, Compare>::bound_node_(const K &key, bool ceiling,
+                                           bool strict) const {
+  NodeT *found = nullptr;
+  for (;;) {
+    NodeT *root = holder_.right_.load();
+    if (root == nullptr) {
+      return nullptr;
+    }
+    int order = key_comp_.compare(key, root->key_);
+    if (order == 0 && !strict) {
+      return root;
+    }
+    bool candidate = ceiling ? (order < 0) : (order > 0);
+    int dir = (candidate == ceiling) ? LEFT : RIGHT;
+    uint64_t version = root->version_.load();
+    if (is_shrinking_or_unlinked_(version)) {
+      wait_until_not_changing_(root, version);
+    } else if (root == holder_.right_.load()) {
+      if (attempt_bound_(key, ceiling, strict, root, dir, version,
+                         candidate ? root : nullptr, found) != RETRY) {
+        return found;
+      }
+    }
+  }
+}
+
+// smallest key >= key (ceiling) or largest key <= key
+template <typename T, typename Compare>
+template <typename K>
+std::optional<T> ConcurrentAVLTree<T, Compare>::bound_(const K &key,
+                                                       bool ceiling) const {
+  EpochGuard guard;
+  NodeT *node = bound_node_(key, ceiling, false);
+  while (node != nullptr && !node->present_.load()) {
+    node = bound_node_(node->key_, ceiling, true);
+  }
+  return (node != nullptr) ? std::optional<T>(node->key_) : std::nullopt;
+}
+
+/* Updates.
+ *
+ * update_ makes key present or absent. The result of attempt_update_ is
+ * whether the key was present before.
+ */
+
+template <typename T, typename Compare>
+template <typename K>
+void ConcurrentAVLTree<T, Compare>::update_(const K &key, bool present) {
+  EpochGuard guard;
+  int result = RETRY;
+  while (result == RETRY) {
+    NodeT *root = holder_.right_.load();
+    if (root == nullptr) {
+      if (!present) {
+        return;
+      }
+      if (insert_into_empty_(key)) {
+        result = ABSENT;
+      }
+      continue;
+    }
+    uint64_t version = root->version_.load();
+    if (is_shrinking_or_unlinked_(version)) {
+      wait_until_not_changing_(root, version);
+    } else if (root == holder_.right_.load()) {
+      result = attempt_update_(key, present, &holder_, root, version);
+    }
+  }
+  if (present && result == ABSENT) {
+    size_.fetch_add(1, std::memory_order_relaxed);
+  } else if (!present && result == PRESENT) {
+    size_.fetch_sub(1, std::memory_order_relaxed);
+  }
+}
+
+template <typename T, typename Compare>
+template <typename K>
+bool ConcurrentAVLTree<T, Compare>::insert_into_empty_(const K &key) {
+  std::lock_guard<NodeLock> lock(holder_.lock_);
+  if (holder_.right_.load() != nullptr) {
+    return false;
+  }
+  holder_.right_.store(new NodeT(key, &holder_));
+  holder_.height_.store(2);
+  return true;
+}
+
+template <typename T, typename Compare>
+template <typename K>
+int ConcurrentAVLTree<T, Compare>::attempt_update_(const K &key, bool present,
+                                                   LinksT *parent, NodeT *node,
+                                                   uint64_t node_version) {
+  int order = key_comp_.compare(key, node->key_);
+  if (order == 0) {
+    return attempt_node_update_(present, parent, node);
+  }
+  for (;;) {
+    NodeT *child = node->child(order).load();
+    if (node->version_.load() != node_version) {
+      return RETRY;
+    }
+    if (child == nullptr) {
+      if (!present) {
+        return ABSENT;
+      }
+      LinksT *damaged = nullptr;
+      {
+        std::lock_guard<NodeLock> lock(node->lock_);
+        if (node->version_.load() != node_version) {
+          return RETRY;
+        }
+        if (node->child(order).load() == nullptr) {
+          node->child(order).store(new NodeT(key, node));
+          damaged = fix_height_nl_(node);
+          child = node; // inserted
+        }
+      }
+      if (child == node) {
+        fix_height_and_rebalance_(damaged);
+        return ABSENT;
+      }
+      continue; // someone else inserted a child there first
+    }
+    uint64_t child_version = child->version_.load();
+    if (is_shrinking_or_unlinked_(child_version)) {
+      wait_until_not_changing_(child, child_version);
+    } else if (child == node->child(order).load()) {
+      if (node->version_.load() != node_version) {
+        return RETRY;
+      }
+      int result = attempt_update_(key, present, node, child, child_version);
+      if (result != RETRY) {
+        return result;
+      }
+    }
+  }
+}
+
+/* Deleting the key of a node with at most one child unlinks the node,
+ * which needs the parent's lock first. Anything else is a change of the
+ * present flag under the node's own lock.
+ */
+template <typename T, typename Compare>
+int ConcurrentAVLTree<T, Compare>::attempt_node_update_(bool present,
+                                                        LinksT *parent,
+                                                        NodeT *node) {
+  if (!present && !node->present_.load()) {
+    return ABSENT;
+  }
+  if (!present &&
+      (node->left_.load() == nullptr || node->right_.load() == nullptr)) {
+    LinksT *damaged;
+    {
+      std::lock_guard<NodeLock> parent_lock(parent->lock_);
+      if (is_unlinked_(parent->version_.load()) ||
+          node->parent_.load() != parent) {
+        return RETRY;
+      }
+      {
+        std::lock_guard<NodeLock> lock(node->lock_);
+        if (!node->present_.load()) {
+          return ABSENT;
+        }
+        if (!attempt_unlink_nl_(parent, node)) {
+          return RETRY;
+        }
+      }
+      damaged = fix_height_nl_(parent);
+    }
+    fix_height_and_rebalance_(damaged);
+    return PRESENT;
+  }
+  std::lock_guard<NodeLock> lock(node->lock_);
+  if (is_unlinked_(node->version_.load())) {
+    return RETRY;
+  }
+  bool was_present = node->present_.load();
+  if (was_present == present) {
+    return was_present ? PRESENT : ABSENT;
+  }
+  // a child may have gone meanwhile, so unlinking became possible
+  if (!present &&
+      (node->left_.load() == nullptr || node->right_.load() == nullptr)) {
+    return RETRY;
+  }
+  node->present_.store(present);
+  return was_present ? PRESENT : ABSENT;
+}
+
+// parent and node are locked
+template <typename T, typename Compare>
+bool ConcurrentAVLTree<T, Compare>::attempt_unlink_nl_(LinksT *parent,
+                                                       NodeT *node) {
+  NodeT *parent_left = parent->left_.load();
+  if (parent_left != node && parent->right_.load() != node) {
+    return false;
+  }
+  NodeT *left = node->left_.load();
+  NodeT *right = node->right_.load();
+  if (left != nullptr && right != nullptr) {
+    return false;
+  }
+  NodeT *splice = (left != nullptr) ? left : right;
+  if (parent_left == node) {
+    parent->left_.store(splice);
+  } else {
+    parent->right_.store(splice);
+  }
+  if (splice != nullptr) {
+    splice->parent_.store(parent);
+  }
+  node->version_.store(UNLINKED);
+  node->present_.store(false);
+  // threads still on node are pinned, so it outlives them
+  EpochDomain::global().retire(node, &delete_node_);
+  return true;
+}
+
+/* Balance repair.
+ *
+ * The _nl functions expect the locks of the nodes they are given and
+ * return the next node that needs repair, or nullptr.
+ */
+
+// what node needs, read without locks, so only a hint
+template <typename T, typename Compare>
+int ConcurrentAVLTree<T, Compare>::node_condition_(LinksT *node) const {
+  NodeT *left = node->left_.load();
+  NodeT *right = node->right_.load();
+  if ((left == nullptr || right == nullptr) && !node->present_.load()) {
+    return UNLINK_REQUIRED;
+  }
+  int height = node->height_.load();
+  int left_height = height_(left);
+  int right_height = height_(right);
+  int new_height =
+      1 + ((left_height > right_height) ? left_height : right_height);
+  int balance = left_height - right_height;
+  if (balance < -1 || balance > 1) {
+    return REBALANCE_REQUIRED;
+  }
+  return (height != new_height) ? new_height : NOTHING_REQUIRED;
+}
+
+template <typename T, typename Compare>
+ConcurrentLinks<T> *ConcurrentAVLTree<T, Compare>::fix_height_nl_(
+    LinksT *node) {
+  int condition = node_condition_(node);
+  switch (condition) {
+  case REBALANCE_REQUIRED:
+  case UNLINK_REQUIRED:
+    return node;
+  case NOTHING_REQUIRED:
+    return nullptr;
+  default:
+    node->height_.store(condition);
+    return node->parent_.load();
+  }
+}
+
+/* Repairs node and whatever its repair damages in turn. A rotation may
+ * hand back a node below it while the parent of the rotated subtree
+ * still has the old height, and the repairs below need not reach that
+ * far up again, so after rotations the path above is checked once more.
+ */
+template <typename T, typename Compare>
+void ConcurrentAVLTree<T, Compare>::fix_height_and_rebalance_(LinksT *node) {
+  bool rotated = false;
+  for (;;) {
+    LinksT *last = node;
+    while (node != nullptr && node->parent_.load() != nullptr) {
+      int condition = node_condition_(node);
+      if (condition == NOTHING_REQUIRED ||
+          is_unlinked_(node->version_.load())) {
+        break;
+      }
+      last = node;
+      if (condition != UNLINK_REQUIRED && condition != REBALANCE_REQUIRED) {
+        std::lock_guard<NodeLock> lock(node->lock_);
+        node = fix_height_nl_(node);
+      } else {
+        LinksT *parent = node->parent_.load();
+        std::lock_guard<NodeLock> parent_lock(parent->lock_);
+        if (!is_unlinked_(parent->version_.load()) &&
+            node->parent_.load() == parent) {
+          std::lock_guard<NodeLock> lock(node->lock_);
+          node = rebalance_nl_(parent, static_cast<NodeT *>(node));
+          rotated = true;
+        }
+      }
+    }
+    if (!rotated) {
+      return;
+    }
+    rotated = false;
+    node = nullptr;
+    for (LinksT *up = last; up != nullptr && up->parent_.load() != nullptr;
+         up = up->parent_.load()) {
+      if (!is_unlinked_(up->version_.load()) &&
+          node_condition_(up) != NOTHING_REQUIRED) {
+        node = up;
+        break;
+      }
+    }
+    if (node == nullptr) {
+      return;
+    }
+  }
+}
+
+template <typename T, typename Compare>
+ConcurrentLinks<T> *ConcurrentAVLTree<T, Compare>::rebalance_nl_(LinksT *parent,
+                                                                 NodeT *node) {
+  NodeT *left = node->left_.load();
+  NodeT *right = node->right_.load();
+  if ((left == nullptr || right == nullptr) && !node->present_.load()) {
+    if (attempt_unlink_nl_(parent, node)) {
+      return fix_height_nl_(parent);
+    }
+    return node;
+  }
+  int height = node->height_.load();
+  int left_height = height_(left);
+  int right_height = height_(right);
+  int new_height =
+      1 + ((left_height > right_height) ? left_height : right_height);
+  int balance = left_height - right_height;
+  if (balance > 1) {
+    return rebalance_to_right_nl_(parent, node, left, right_height);
+  }
+  if (balance < -1) {
+    return rebalance_to_left_nl_(parent, node, right, left_height);
+  }
+  if (new_height != height) {
+    node->height_.store(new_height);
+    return fix_height_nl_(parent);
+  }
+  return nullptr;
+}
+
+/* node leans left: rotate it right, after rotating its left child left
+ * first if that one leans right. Heights of locked nodes are exact, the
+ * others are snapshots and rechecked once locked.
+ */
+template <typename T, typename Compare>
+ConcurrentLinks<T> *ConcurrentAVLTree<T, Compare>::rebalance_to_right_nl_(
+    LinksT *parent, NodeT *node, NodeT *left, int right_height) {
+  std::lock_guard<NodeLock> left_lock(left->lock_);
+  int left_height = left->height_.load();
+  if (left_height - right_height <= 1) {
+    return node; // changed meanwhile, look again
+  }
+  NodeT *left_right = left->right_.load();
+  int left_left_height = height_(left->left_.load());
+  int left_right_height = height_(left_right);
+  if (left_left_height >= left_right_height) {
+    return rotate_right_nl_(parent, node, left, right_height, left_left_height,
+                            left_right, left_right_height);
+  }
+  {
+    std::lock_guard<NodeLock> left_right_lock(left_right->lock_);
+    left_right_height = left_right->height_.load();
+    if (left_left_height >= left_right_height) {
+      return rotate_right_nl_(parent, node, left, right_height,
+                              left_left_height, left_right, left_right_height);
+    }
+    /* A double rotation leaves left balanced only if left_right's left
+     * subtree fits next to left's left one; otherwise fix left alone
+     * and come back to node later.
+     */
+    int left_right_left_height = height_(left_right->left_.load());
+    int balance = left_left_height - left_right_left_height;
+    if (balance >= -1 && balance <= 1) {
+      return rotate_right_over_left_nl_(parent, node, left, right_height,
+                                        left_left_height, left_right,
+                                        left_right_left_height);
+    }
+  }
+  return rebalance_to_left_nl_(node, left, left_right, left_left_height);
+}
+
+template <typename T, typename Compare>
+ConcurrentLinks<T> *ConcurrentAVLTree<T, Compare>::rebalance_to_left_nl_(
+    LinksT *parent, NodeT *node, NodeT *right, int left_height) {
+  std::lock_guard<NodeLock> right_lock(right->lock_);
+  int right_height = right->height_.load();
+  if (left_height - right_height >= -1) {
+    return node;
+  }
+  NodeT *right_left = right->left_.load();
+  int right_right_height = height_(right->right_.load());
+  int right_left_height = height_(right_left);
+  if (right_right_height >= right_left_height) {
+    return rotate_left_nl_(parent, node, right, left_height,
+                           right_right_height, right_left, right_left_height);
+  }
+  {
+    std::lock_guard<NodeLock> right_left_lock(right_left->lock_);
+    right_left_height = right_left->height_.load();
+    if (right_right_height >= right_left_height) {
+      return rotate_left_nl_(parent, node, right, left_height,
+                             right_right_height, right_left,
+                             right_left_height);
+    }
+    int right_left_right_height = height_(right_left->right_.load());
+    int balance = right_right_height - right_left_right_height;
+    if (balance >= -1 && balance <= 1) {
+      return rotate_left_over_right_nl_(parent, node, right, left_height,
+                                        right_right_height, right_left,
+                                        right_left_right_height);
+    }
+  }
+  return rebalance_to_right_nl_(node, right, right_left, right_right_height);
+}
+
+template <typename T, typename Compare>
+void ConcurrentAVLTree<T, Compare>::replace_child_nl_(LinksT *parent,
+                                                      NodeT *old_child,
+                                                      NodeT *new_child) {
+  if (parent->left_.load() == old_child) {
+    parent->left_.store(new_child);
+  } else {
+    parent->right_.store(new_child);
+  }
+  new_child->parent_.store(parent);
+}
+
+/* node moves down to the right of left. node shrinks, so its version is
+ * marked for the duration. Returns the deepest node the rotation left
+ * damaged, as far as the held locks allow fixing anything.
+ */
+template <typename T, typename Compare>
+ConcurrentLinks<T> *ConcurrentAVLTree<T, Compare>::rotate_right_nl_(
+    LinksT *parent, NodeT *node, NodeT *left, int right_height,
+    int left_left_height, NodeT *left_right, int left_right_height) {
+  uint64_t version = node->version_.load();
+  node->version_.store(begin_change_(version));
+
+  node->left_.store(left_right);
+  if (left_right != nullptr) {
+    left_right->parent_.store(node);
+  }
+  left->right_.store(node);
+  node->parent_.store(left);
+  replace_child_nl_(parent, node, left);
+
+  int node_height = 1 + ((left_right_height > right_height) ? left_right_height
+                                                            : right_height);
+  node->height_.store(node_height);
+  left->height_.store(
+      1 + ((left_left_height > node_height) ? left_left_height : node_height));
+
+  node->version_.store(end_change_(version));
+
+  int node_balance = left_right_height - right_height;
+  if (node_balance < -1 || node_balance > 1) {
+    return node;
+  }
+  if ((left_right == nullptr || right_height == 0) &&
+      !node->present_.load()) {
+    return node;
+  }
+  int left_balance = left_left_height - node_height;
+  if (left_balance < -1 || left_balance > 1) {
+    return left;
+  }
+  if (left_left_height == 0 && !left->present_.load()) {
+    return left;
+  }
+  return fix_height_nl_(parent);
+}
+
+template <typename T, typename Compare>
+ConcurrentLinks<T> *ConcurrentAVLTree<T, Compare>::rotate_left_nl_(
+    LinksT *parent, NodeT *node, NodeT *right, int left_height,
+    int right_right_height, NodeT *right_left, int right_left_height) {
+  uint64_t version = node->version_.load();
+  node->version_.store(begin_change_(version));
+
+  node->right_.store(right_left);
+  if (right_left != nullptr) {
+    right_left->parent_.store(node);
+  }
+  right->left_.store(node);
+  node->parent_.store(right);
+  replace_child_nl_(parent, node, right);
+
+  int node_height = 1 + ((left_height > right_left_height) ? left_height
+                                                           : right_left_height);
+  node->height_.store(node_height);
+  right->height_.store(1 + ((right_right_height > node_height)
+                                ? right_right_height
+                                : node_height));
+
+  node->version_.store(end_change_(version));
+
+  int node_balance = right_left_height - left_height;
+  if (node_balance < -1 || node_balance > 1) {
+    return node;
+  }
+  if ((right_left == nullptr || left_height == 0) && !node->present_.load()) {
+    return node;
+  }
+  int right_balance = right_right_height - node_height;
+  if (right_balance < -1 || right_balance > 1) {
+    return right;
+  }
+  if (right_right_height == 0 && !right->present_.load()) {
+    return right;
+  }
+  return fix_height_nl_(parent);
+}
+
+// left_right becomes the root of the three, node and left both shrink
+template <typename T, typename Compare>
+ConcurrentLinks<T> *ConcurrentAVLTree<T, Compare>::rotate_right_over_left_nl_(
+    LinksT *parent, NodeT *node, NodeT *left, int right_height,
+    int left_left_height, NodeT *left_right, int left_right_left_height) {
+  uint64_t node_version = node->version_.load();
+  uint64_t left_version = left->version_.load();
+  NodeT *left_right_left = left_right->left_.load();
+  NodeT *left_right_right = left_right->right_.load();
+  int left_right_right_height = height_(left_right_right);
+
+  node->version_.store(begin_change_(node_version));
+  left->version_.store(begin_change_(left_version));
+
+  node->left_.store(left_right_right);
+  if (left_right_right != nullptr) {
+    left_right_right->parent_.store(node);
+  }
+  left->right_.store(left_right_left);
+  if (left_right_left != nullptr) {
+    left_right_left->parent_.store(left);
+  }
+  left_right->left_.store(left);
+  left->parent_.store(left_right);
+  left_right->right_.store(node);
+  node->parent_.store(left_right);
+  replace_child_nl_(parent, node, left_right);
+
+  int node_height =
+      1 + ((left_right_right_height > right_height) ? left_right_right_height
+                                                    : right_height);
+  node->height_.store(node_height);
+  int left_new_height =
+      1 + ((left_left_height > left_right_left_height) ? left_left_height
+                                                       : left_right_left_height);
+  left->height_.store(left_new_height);
+  left_right->height_.store(1 + ((left_new_height > node_height)
+                                     ? left_new_height
+                                     : node_height));
+
+  node->version_.store(end_change_(node_version));
+  left->version_.store(end_change_(left_version));
+
+  int node_balance = left_right_right_height - right_height;
+  if (node_balance < -1 || node_balance > 1) {
+    return node;
+  }
+  if ((left_right_right == nullptr || right_height == 0) &&
+      !node->present_.load()) {
+    return node;
+  }
+  // a routing left may be down to one child and wait for unlinking
+  if ((left_right_left == nullptr || left_left_height == 0) &&
+      !left->present_.load()) {
+    return left;
+  }
+  int balance = left_new_height - node_height;
+  if (balance < -1 || balance > 1) {
+    return left_right;
+  }
+  return fix_height_nl_(parent);
+}
+
+template <typename T, typename Compare>
+ConcurrentLinks<T> *ConcurrentAVLTree<T, Compare>::rotate_left_over_right_nl_(
+    LinksT *parent, NodeT *node, NodeT *right, int left_height,
+    int right_right_height, NodeT *right_left, int right_left_right_height) {
+  uint64_t node_version = node->version_.load();
+  uint64_t right_version = right->version_.load();
+  NodeT *right_left_left = right_left->left_.load();
+  NodeT *right_left_right = right_left->right_.load();
+  int right_left_left_height = height_(right_left_left);
+
+  node->version_.store(begin_change_(node_version));
+  right->version_.store(begin_change_(right_version));
+
+  node->right_.store(right_left_left);
+  if (right_left_left != nullptr) {
+    right_left_left->parent_.store(node);
+  }
+  right->left_.store(right_left_right);
+  if (right_left_right != nullptr) {
+    right_left_right->parent_.store(right);
+  }
+  right_left->right_.store(right);
+  right->parent_.store(right_left);
+  right_left->left_.store(node);
+  node->parent_.store(right_left);
+  replace_child_nl_(parent, node, right_left);
+
+  int node_height =
+      1 + ((left_height > right_left_left_height) ? left_height
+                                                  : right_left_left_height);
+  node->height_.store(node_height);
+  int right_new_height =
+      1 + ((right_left_right_height > right_right_height)
+               ? right_left_right_height
+               : right_right_height);
+  right->height_.store(right_new_height);
+  right_left->height_.store(1 + ((node_height > right_new_height)
+                                     ? node_height
+                                     : right_new_height));
+
+  node->version_.store(end_change_(node_version));
+  right->version_.store(end_change_(right_version));
+
+  int node_balance = right_left_left_height - left_height;
+  if (node_balance < -1 || node_balance > 1) {
+    return node;
+  }
+  if ((right_left_left == nullptr || left_height == 0) &&
+      !node->present_.load()) {
+    return node;
+  }
+  if ((right_left_right == nullptr || right_right_height == 0) &&
+      !right->present_.load()) {
+    return right;
+  }
+  int balance = right_new_height - node_height;
+  if (balance < -1 || balance > 1) {
+    return right_left;
+  }
+  return fix_height_nl_(parent);
+}
+
+/* Whole-tree queries, for a quiescent tree only. */
+
+template <typename T, typename Compare>
+std::vector<T> ConcurrentAVLTree<T, Compare>::in_order() const {
+  std::vector<T> keys;
+  std::vector<const NodeT *> stack;
+  const NodeT *node = holder_.right_.load();
+  while (node != nullptr || !stack.empty()) {
+    while (node != nullptr) {
+      stack.push_back(node);
+      node = node->left_.load();
+    }
+    node = stack.back();
+    stack.pop_back();
+    if (node->present_.load()) {
+      keys.push_back(node->key_);
+    }
+    node = node->right_.load();
+  }
+  return keys;
+}
+
+template <typename T, typename Compare>
+size_t ConcurrentAVLTree<T, Compare>::get_height() const {
+  return height_(holder_.right_.load());
+}
+
+template <typename T, typename Compare>
+bool ConcurrentAVLTree<T, Compare>::is_balanced() const {
+  int height = 0;
+  return check_(holder_.right_.load(), height);
+}
+
+// heights, balance, order and parent links of the subtree of node
+template <typename T, typename Compare>
+bool ConcurrentAVLTree<T, Compare>::check_(const NodeT *node,
+                                           int &height) const {
+  if (node == nullptr) {
+    height = 0;
+    return true;
+  }
+  const NodeT *left = node->left_.load();
+  const NodeT *right = node->right_.load();
+  int left_height = 0;
+  int right_height = 0;
+  if (!check_(left, left_height) || !check_(right, right_height)) {
+    return false;
+  }
+  if ((left != nullptr && (!key_comp_.less(left->key_, node->key_) ||
+                           left->parent_.load() != node)) ||
+      (right != nullptr && (!key_comp_.less(node->key_, right->key_) ||
+                            right->parent_.load() != node))) {
+    return false;
+  }
+  height = 1 + ((left_height > right_height) ? left_height : right_height);
+  return height == node->height_.load() && left_height - right_height <= 1 &&
+         right_height - left_height <= 1;
+}
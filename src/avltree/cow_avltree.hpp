@@ -0,0 +1,494 @@
+#pragma once
+
+#include "../utils/epoch.hpp"
+#include "compare.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/* AVL tree with lock-free readers, for one writer at a time next to any
+ * number of reading threads.
+ *
+ * Published nodes are never changed. A writer copies the nodes on the
+ * path it modifies (path copying), links the copies into a new version
+ * of the tree and publishes it with one atomic store of the root.
+ * Readers load the root and walk whatever version they got without
+ * taking any lock; they only pin the reclamation epoch while doing so,
+ * see epoch.hpp. The nodes a write replaced are retired and freed once
+ * no reader can still be walking an older version.
+ *
+ * Writers are serialized with a mutex. Nodes carry no parent pointers,
+ * as any node can be shared by several versions.
+ *
+ * Lookups return copies of the keys, since a node may be freed as soon
+ * as the lookup is done.
+ */
+template <typename T> struct CowNode {
+  T key_;
+  CowNode *left_;
+  CowNode *right_;
+  int height_;
+  uint64_t version_; // write that created the node
+};
+
+template <typename T, typename Compare = std::less<T>> class CowAVLTree {
+  // lookups take any key type with a transparent Compare, see AVLTree
+  template <typename K>
+  using lookup_key_t =
+      std::enable_if_t<std::is_same_v<K, T> || is_transparent<Compare>::value>;
+
+public:
+  using value_type = T;
+  using size_type = size_t;
+  using key_compare = Compare;
+
+  CowAVLTree();
+  explicit CowAVLTree(const Compare &comp);
+  CowAVLTree(const CowAVLTree &) = delete;
+  CowAVLTree &operator=(const CowAVLTree &) = delete;
+  ~CowAVLTree();
+
+  // writers, serialized among themselves
+  void insert(const T &key) { insert_key_(key); }
+  void insert(T &&key) { insert_key_(std::move(key)); }
+  void delete_key(const T &key) { delete_key<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  void delete_key(const K &key);
+  void clear_tree();
+
+  // readers, lock-free; each call sees a single version of the tree
+  bool contains(const T &key) const { return contains<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  bool contains(const K &key) const;
+  std::optional<T> find(const T &key) const { return find<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  std::optional<T> find(const K &key) const;
+  std::optional<T> lowerbound(const T &key) const {
+    return lowerbound<T>(key);
+  }
+  template <typename K, typename = lookup_key_t<K>>
+  std::optional<T> lowerbound(const K &key) const;
+  std::optional<T> upperbound(const T &key) const {
+    return upperbound<T>(key);
+  }
+  template <typename K, typename = lookup_key_t<K>>
+  std::optional<T> upperbound(const K &key) const;
+  template <typename F>
+  void for_each_in_range(const T &lo, const T &hi, F &&fn) const {
+    for_each_in_range<T, F>(lo, hi, std::forward<F>(fn));
+  }
+  template <typename K, typename F, typename = lookup_key_t<K>>
+  void for_each_in_range(const K &lo, const K &hi, F &&fn) const;
+  std::vector<T> in_order() const;
+
+  size_t get_size() const { return size_.load(std::memory_order_relaxed); }
+  bool is_empty() const { return get_size() == 0; }
+  size_t get_height() const;
+  bool is_balanced() const;
+
+private:
+  using NodeT = CowNode<T>;
+
+  // nodes one write replaced or threw away, see publish_
+  struct Write {
+    uint64_t version;
+    std::vector<NodeT *> replaced;  // published, retired after the write
+    std::vector<NodeT *> discarded; // never published, freed right away
+  };
+
+  template <typename Key> void insert_key_(Key &&key);
+  template <typename K>
+  const NodeT *find_node_(const NodeT *root, const K &key) const;
+  template <typename Key> NodeT *insert_(NodeT *node, Key &&key, Write &write);
+  template <typename K>
+  NodeT *remove_(NodeT *node, const K &key, Write &write);
+  NodeT *remove_min_(NodeT *node, const T *&min, Write &write);
+  NodeT *own_(NodeT *node, Write &write);
+  void drop_(NodeT *node, Write &write);
+  NodeT *balance_(NodeT *node, Write &write);
+  NodeT *rotate_left_(NodeT *node, Write &write);
+  NodeT *rotate_right_(NodeT *node, Write &write);
+  void publish_(NodeT *root, Write &write);
+  template <typename K, typename F>
+  void visit_range_(const NodeT *node, const K &lo, const K &hi, F &fn) const;
+  bool check_(const NodeT *node, int &height) const;
+  static int height_(const NodeT *node) {
+    return (node == nullptr) ? 0 : node->height_;
+  }
+  static void update_height_(NodeT *node);
+  static void delete_node_(void *node) { delete static_cast<NodeT *>(node); }
+  static void free_tree_(NodeT *node);
+
+  std::atomic<NodeT *> root_;
+  std::atomic<size_t> size_;
+  std::mutex write_mutex_;
+  uint64_t version_; // of the last write, under write_mutex_
+  KeyCompare<T, Compare> key_comp_;
+};
+
+template <typename T, typename Compare>
+CowAVLTree<T, Compare>::CowAVLTree() : root_{nullptr}, size_{0}, version_{0} {}
+
+template <typename T, typename Compare>
+CowAVLTree<T, Compare>::CowAVLTree(const Compare &comp)
+    : root_{nullptr}, size_{0}, version_{0}, key_comp_{comp} {}
+
+// readers must be gone by now, so the current version is freed directly
+template <typename T, typename Compare> CowAVLTree<T, Compare>::~CowAVLTree() {
+  free_tree_(root_.load(std::memory_order_relaxed));
+}
+
+template <typename T, typename Compare>
+void CowAVLTree<T, Compare>::free_tree_(NodeT *node) {
+  while (node != nullptr) {
+    free_tree_(node->right_);
+    NodeT *left = node->left_;
+    delete node;
+    node = left;
+  }
+}
+
+template <typename T, typename Compare>
+void CowAVLTree<T, Compare>::update_height_(NodeT *node) {
+  int left = height_(node->left_);
+  int right = height_(node->right_);
+  node->height_ = 1 + ((left > right) ? left : right);
+}
+
+template <typename T, typename Compare>
+template <typename K>
+const CowNode<T> *CowAVLTree<T, Compare>::find_node_(const NodeT *node,
+                                                     const K &key) const {
+  while (node != nullptr) {
+    int order = key_comp_.compare(key, node->key_);
+    if (order == 0) {
+      break;
+    }
+    node = (order < 0) ? node->left_ : node->right_;
+  }
+  return node;
+}
+
+/* A node the current write may change: the node itself if the write
+ * created it, a fresh copy otherwise.
+ */
+template <typename T, typename Compare>
+CowNode<T> *CowAVLTree<T, Compare>::own_(NodeT *node, Write &write) {
+  if (node->version_ == write.version) {
+    return node;
+  }
+  write.replaced.push_back(node);
+  return new NodeT{node->key_, node->left_, node->right_, node->height_,
+                   write.version};
+}
+
+// takes node out of the new version
+template <typename T, typename Compare>
+void CowAVLTree<T, Compare>::drop_(NodeT *node, Write &write) {
+  if (node->version_ == write.version) {
+    write.discarded.push_back(node);
+  } else {
+    write.replaced.push_back(node);
+  }
+}
+
+// both take a node owned by the write and own the child they lift
+template <typename T, typename Compare>
+CowNode<T> *CowAVLTree<T, Compare>::rotate_left_(NodeT *node, Write &write) {
+  NodeT *right = own_(node->right_, write);
+  node->right_ = right->left_;
+  right->left_ = node;
+  update_height_(node);
+  update_height_(right);
+  return right;
+}
+
+template <typename T, typename Compare>
+CowNode<T> *CowAVLTree<T, Compare>::rotate_right_(NodeT *node, Write &write) {
+  NodeT *left = own_(node->left_, write);
+  node->left_ = left->right_;
+  left->right_ = node;
+  update_height_(node);
+  update_height_(left);
+  return left;
+}
+
+// node is owned by the write, its children are balanced
+template <typename T, typename Compare>
+CowNode<T> *CowAVLTree<T, Compare>::balance_(NodeT *node, Write &write) {
+  update_height_(node);
+  int balance = height_(node->left_) - height_(node->right_);
+  if (balance > 1) {
+    if (height_(node->left_->left_) < height_(node->left_->right_)) {
+      node->left_ = rotate_left_(own_(node->left_, write), write);
+    }
+    return rotate_right_(node, write);
+  }
+  if (balance < -1) {
+    if (height_(node->right_->right_) < height_(node->right_->left_)) {
+      node->right_ = rotate_right_(own_(node->right_, write), write);
+    }
+    return rotate_left_(node, write);
+  }
+  return node;
+}
+
+template <typename T, typename Compare>
+template <typename Key>
+CowNode<T> *CowAVLTree<T, Compare>::insert_(NodeT *node, Key &&key,
+                                            Write &write) {
+  if (node == nullptr) {
+    return new NodeT{T(std::forward<Key>(key)), nullptr, nullptr, 1,
+                     write.version};
+  }
+  node = own_(node, write);
+  if (key_comp_.less(key, node->key_)) {
+    node->left_ = insert_(node->left_, std::forward<Key>(key), write);
+  } else {
+    node->right_ = insert_(node->right_, std::forward<Key>(key), write);
+  }
+  return balance_(node, write);
+}
+
+template <typename T, typename Compare>
+template <typename K>
+CowNode<T> *CowAVLTree<T, Compare>::remove_(NodeT *node, const K &key,
+                                            Write &write) {
+  int order = key_comp_.compare(key, node->key_);
+  if (order == 0 && (node->left_ == nullptr || node->right_ == nullptr)) {
+    drop_(node, write);
+    return (node->left_ != nullptr) ? node->left_ : node->right_;
+  }
+  node = own_(node, write);
+  if (order < 0) {
+    node->left_ = remove_(node->left_, key, write);
+  } else if (order > 0) {
+    node->right_ = remove_(node->right_, key, write);
+  } else {
+    // the successor takes the place of the key
+    const T *min = nullptr;
+    node->right_ = remove_min_(node->right_, min, write);
+    node->key_ = *min;
+  }
+  return balance_(node, write);
+}
+
+// min points into the removed node, which lives until the write ends
+template <typename T, typename Compare>
+CowNode<T> *CowAVLTree<T, Compare>::remove_min_(NodeT *node, const T *&min,
+                                                Write &write) {
+  if (node->left_ == nullptr) {
+    min = &node->key_;
+    drop_(node, write);
+    return node->right_;
+  }
+  node = own_(node, write);
+  node->left_ = remove_min_(node->left_, min, write);
+  return balance_(node, write);
+}
+
+/* Makes root the current version. Readers that loaded the old root may
+ * still be walking the replaced nodes, so those go to the epoch domain;
+ * nodes the write created and dropped again were never visible.
+ */
+template <typename T, typename Compare>
+void CowAVLTree<T, Compare>::publish_(NodeT *root, Write &write) {
+  root_.store(root);
+  for (NodeT *node : write.discarded) {
+    delete node;
+  }
+  EpochDomain &domain = EpochDomain::global();
+  for (NodeT *node : write.replaced) {
+    domain.retire(node, &delete_node_);
+  }
+}
+
+template <typename T, typename Compare>
+template <typename Key>
+void CowAVLTree<T, Compare>::insert_key_(Key &&key) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  NodeT *root = root_.load(std::memory_order_relaxed);
+  if (find_node_(root, key) != nullptr) {
+    return;
+  }
+  Write write{++version_, {}, {}};
+  publish_(insert_(root, std::forward<Key>(key), write), write);
+  size_.fetch_add(1, std::memory_order_relaxed);
+}
+
+template <typename T, typename Compare>
+template <typename K, typename>
+void CowAVLTree<T, Compare>::delete_key(const K &key) {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  NodeT *root = root_.load(std::memory_order_relaxed);
+  if (find_node_(root, key) == nullptr) {
+    return;
+  }
+  Write write{++version_, {}, {}};
+  publish_(remove_(root, key, write), write);
+  size_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+template <typename T, typename Compare>
+void CowAVLTree<T, Compare>::clear_tree() {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  NodeT *root = root_.load(std::memory_order_relaxed);
+  root_.store(nullptr);
+  size_.store(0, std::memory_order_relaxed);
+  std::vector<NodeT *> stack;
+  if (root != nullptr) {
+    stack.push_back(root);
+  }
+  EpochDomain &domain = EpochDomain::global();
+  while (!stack.empty()) {
+    NodeT *node = stack.back();
+    stack.pop_back();
+    if (node->left_ != nullptr) {
+      stack.push_back(node->left_);
+    }
+    if (node->right_ != nullptr) {
+      stack.push_back(node->right_);
+    }
+    domain.retire(node, &delete_node_);
+  }
+}
+
+template <typename T, typename Compare>
+template <typename K, typename>
+bool CowAVLTree<T, Compare>::contains(const K &key) const {
+  EpochGuard guard;
+  return find_node_(root_.load(), key) != nullptr;
+}
+
+template <typename T, typename Compare>
+template <typename K, typename>
+std::optional<T> CowAVLTree<T, Compare>::find(const K &key) const {
+  EpochGuard guard;
+  const NodeT *node = find_node_(root_.load(), key);
+  return (node != nullptr) ? std::optional<T>(node->key_) : std::nullopt;
+}
+
+// smallest key >= key
+template <typename T, typename Compare>
+template <typename K, typename>
+std::optional<T> CowAVLTree<T, Compare>::lowerbound(const K &key) const {
+  EpochGuard guard;
+  const NodeT *node = root_.load();
+  const NodeT *result = nullptr;
+  while (node != nullptr) {
+    if (!key_comp_.less(node->key_, key)) {
+      result = node;
+      node = node->left_;
+    } else {
+      node = node->right_;
+    }
+  }
+  return (result != nullptr) ? std::optional<T>(result->key_) : std::nullopt;
+}
+
+// largest key <= key
+template <typename T, typename Compare>
+template <typename K, typename>
+std::optional<T> CowAVLTree<T, Compare>::upperbound(const K &key) const {
+  EpochGuard guard;
+  const NodeT *node = root_.load();
+  const NodeT *result = nullptr;
+  while (node != nullptr) {
+    if (!key_comp_.less(key, node->key_)) {
+      result = node;
+      node = node->right_;
+    } else {
+      node = node->left_;
+    }
+  }
+  return (result != nullptr) ? std::optional<T>(result->key_) : std::nullopt;
+}
+
+/* Calls fn(key) for every key in [lo, hi] of one version, in ascending
+ * order. Writers are not held up, but the version stays allocated until
+ * the walk is over, so fn should not take long.
+ */
+template <typename T, typename Compare>
+template <typename K, typename F, typename>
+void CowAVLTree<T, Compare>::for_each_in_range(const K &lo, const K &hi,
+                                               F &&fn) const {
+  EpochGuard guard;
+  visit_range_(root_.load(), lo, hi, fn);
+}
+
+template <typename T, typename Compare>
+template <typename K, typename F>
+void CowAVLTree<T, Compare>::visit_range_(const NodeT *node, const K &lo,
+                                          const K &hi, F &fn) const {
+  while (node != nullptr) {
+    if (key_comp_.less(node->key_, lo)) {
+      node = node->right_;
+    } else if (key_comp_.less(hi, node->key_)) {
+      node = node->left_;
+    } else {
+      visit_range_(node->left_, lo, hi, fn);
+      fn(static_cast<const T &>(node->key_));
+      node = node->right_;
+    }
+  }
+}
+
+template <typename T, typename Compare>
+std::vector<T> CowAVLTree<T, Compare>::in_order() const {
+  std::vector<T> keys;
+  EpochGuard guard;
+  const NodeT *node = root_.load();
+  std::vector<const NodeT *> stack;
+  while (node != nullptr || !stack.empty()) {
+    while (node != nullptr) {
+      stack.push_back(node);
+      node = node->left_;
+    }
+    node = stack.back();
+    stack.pop_back();
+    keys.push_back(node->key_);
+    node = node->right_;
+  }
+  return keys;
+}
+
+template <typename T, typename Compare>
+size_t CowAVLTree<T, Compare>::get_height() const {
+  EpochGuard guard;
+  return height_(root_.load());
+}
+
+template <typename T, typename Compare>
+bool CowAVLTree<T, Compare>::is_balanced() const {
+  EpochGuard guard;
+  int height = 0;
+  return check_(root_.load(), height);
+}
+
+// stored heights, balance and order of the subtree of node
+template <typename T, typename Compare>
+bool CowAVLTree<T, Compare>::check_(const NodeT *node, int &height) const {
+  if (node == nullptr) {
+    height = 0;
+    return true;
+  }
+  int left = 0;
+  int right = 0;
+  if (!check_(node->left_, left) || !check_(node->right_, right)) {
+    return false;
+  }
+  if ((node->left_ != nullptr &&
+       !key_comp_.less(node->left_->key_, node->key_)) ||
+      (node->right_ != nullptr &&
+       !key_comp_.less(node->key_, node->right_->key_))) {
+    return false;
+  }
+  height = 1 + ((left > right) ? left : right);
+  return height == node->height_ && left - right <= 1 && right - left <= 1;
+}
@@ -0,0 +1,570 @@
+#pragma once
+
+#include "compare.hpp"
+#include "simd_search.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/* Read-only snapshot of a tree's keys, see AVLTree::freeze().
+ *
+ * The keys sit in a single array in the order of an implicit binary
+ * search tree, so there are no pointers at all and the children of a
+ * node are found by arithmetic on its index. Three orders are offered:
+ *
+ *   - eytzinger: breadth-first, node i has children 2i and 2i + 1. The
+ *     top levels share a few cache lines and the search prefetches the
+ *     line four levels down, which hides most of the memory latency;
+ *   - van_emde_boas: the tree is cut at half its height, the top half is
+ *     laid out first, then every bottom subtree, each recursively. Any
+ *     root-to-leaf walk touches O(log_B n) blocks for every block size B
+ *     at once, which pays off when the array outgrows the caches and the
+ *     TLB;
+ *   - blocked: a static B-tree with one cache line per node, searched
+ *     with SSE or AVX2 where available, see simd_search.hpp. It takes
+ *     arithmetic keys under the default ordering only, other trees asked
+ *     for it get the eytzinger order instead.
+ *
+ * The van Emde Boas order needs a perfect tree, so it is padded with
+ * copies of the largest key, up to twice the keys in the worst case.
+ * The blocked order pads its last node with the largest value of T.
+ * Lookups never return a padding slot.
+ *
+ * find, lowerbound and upperbound return a pointer to the key or
+ * nullptr and mean the same as in AVLTree.
+ */
+enum class FrozenLayout { eytzinger, van_emde_boas, blocked };
+
+template <typename T, typename Compare = std::less<T>> class FrozenAVLTree {
+  // lookups take any key type with a transparent Compare, see AVLTree
+  template <typename K>
+  using lookup_key_t =
+      std::enable_if_t<std::is_same_v<K, T> || is_transparent<Compare>::value>;
+
+public:
+  using value_type = T;
+  using size_type = size_t;
+  using key_compare = Compare;
+
+  FrozenAVLTree();
+  // sorted_keys must be sorted by comp and free of duplicates
+  FrozenAVLTree(std::vector<T> sorted_keys, FrozenLayout layout,
+                const Compare &comp = Compare());
+
+  const T *find(const T &key) const { return find<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  const T *find(const K &key) const;
+  const T *lowerbound(const T &key) const { return lowerbound<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  const T *lowerbound(const K &key) const;
+  const T *upperbound(const T &key) const { return upperbound<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  const T *upperbound(const K &key) const;
+  template <typename F>
+  void for_each_in_range(const T &lo, const T &hi, F &&fn) const {
+    for_each_in_range<T, F>(lo, hi, std::forward<F>(fn));
+  }
+  template <typename K, typename F, typename = lookup_key_t<K>>
+  void for_each_in_range(const K &lo, const K &hi, F &&fn) const;
+
+  size_t get_size() const { return size_; }
+  bool is_empty() const { return size_ == 0; }
+  FrozenLayout get_layout() const { return layout_; }
+  size_t memory_bytes() const { return keys_.capacity() * sizeof(T); }
+  SimdLevel get_simd_level() const { return simd_level_; }
+  // at most level, for testing and benchmarks; the CPU may offer less
+  void set_simd_level(SimdLevel level) {
+    simd_level_ = std::min(level, detect_simd_level());
+  }
+
+private:
+  static constexpr int MAX_DEPTH = 64;
+  // keys per cache line, the Eytzinger search prefetches that far ahead
+  static constexpr size_t LINE_KEYS = std::max<size_t>(1, 64 / sizeof(T));
+  static constexpr bool BLOCKABLE = is_blockable<T, Compare>::value;
+
+  /* A node of the implicit tree: its breadth-first index (the root is 1,
+   * 0 means none), its depth and the array slots of the whole path from
+   * the root down to it, which the van Emde Boas order needs to find the
+   * slots of the children.
+   */
+  struct Cursor {
+    size_t index;
+    int depth;
+    size_t slots[MAX_DEPTH];
+  };
+
+  // van Emde Boas bookkeeping for the nodes at one depth, see build_veb_
+  struct VebLevel {
+    size_t top_size;    // nodes in the top tree above, also a bit mask
+    size_t bottom_size; // nodes in each bottom tree
+    int top_depth;      // depth of the root of the top tree
+  };
+
+  template <bool Veb, typename K> const T *lower_(const K &key) const;
+  template <bool Veb, typename K> const T *upper_(const K &key) const;
+  template <bool Veb, bool Strict, typename K>
+  void search_(const K &key, Cursor &cursor) const;
+  template <bool Veb> void next_(Cursor &cursor) const;
+  template <bool Veb> void prev_(Cursor &cursor) const;
+  template <bool Veb> void descend_(Cursor &cursor, bool right) const;
+  template <bool Veb> bool is_key_(const Cursor &cursor) const;
+  template <bool Veb, typename K, typename F>
+  void scan_(const K &lo, const K &hi, F &fn) const;
+  template <bool Inclusive, typename K>
+  const T *find_block_(const K &key) const;
+  template <bool Inclusive, typename K>
+  size_t rank_block_(const T *block, const K &key) const;
+  template <typename K, typename F>
+  void scan_blocks_(const K &lo, const K &hi, F &fn) const;
+  size_t rank_(size_t index, int depth) const;
+  void build_eytzinger_(const std::vector<T> &sorted, size_t index,
+                        size_t &next);
+  void build_veb_(const std::vector<T> &sorted);
+  void build_blocked_(const std::vector<T> &sorted);
+  void place_blocked_(const std::vector<T> &sorted, size_t block,
+                      size_t &next);
+  void plan_veb_(int depth, int height);
+  void place_veb_(const std::vector<T> &sorted, size_t index, int depth,
+                  int height);
+
+  std::vector<T> keys_;
+  std::vector<VebLevel> levels_;
+  size_t size_;
+  size_t node_count_; // size of the implicit tree, padding included
+  size_t max_slot_;   // slot of the largest key
+  size_t block_count_;
+  size_t block_offset_; // first slot of the blocked order, on a 64B line
+  int height_;
+  FrozenLayout layout_;
+  SimdLevel simd_level_;
+  KeyCompare<T, Compare> key_comp_;
+};
+
+template <typename T, typename Compare>
+FrozenAVLTree<T, Compare>::FrozenAVLTree()
+    : size_{0}, node_count_{0}, max_slot_{0}, block_count_{0},
+      block_offset_{0}, height_{0}, layout_{FrozenLayout::eytzinger},
+      simd_level_{detect_simd_level()} {}
+
+template <typename T, typename Compare>
+FrozenAVLTree<T, Compare>::FrozenAVLTree(std::vector<T> sorted_keys,
+                                         FrozenLayout layout,
+                                         const Compare &comp)
+    : size_{sorted_keys.size()}, node_count_{0}, max_slot_{0},
+      block_count_{0}, block_offset_{0}, height_{0}, layout_{layout},
+      simd_level_{detect_simd_level()}, key_comp_{comp} {
+  if (layout_ == FrozenLayout::blocked && !BLOCKABLE) {
+    layout_ = FrozenLayout::eytzinger;
+  }
+  while (node_count_ < size_) {
+    node_count_ = 2 * node_count_ + 1;
+    ++height_;
+  }
+  if (size_ == 0) {
+    return;
+  }
+  if (layout_ == FrozenLayout::blocked) {
+    build_blocked_(sorted_keys);
+    return;
+  }
+  if (layout_ == FrozenLayout::eytzinger) {
+    node_count_ = size_;
+    // slots are filled out of order, start from copies of any key
+    keys_.assign(size_, sorted_keys.front());
+    size_t next = 0;
+    build_eytzinger_(sorted_keys, 1, next);
+  } else {
+    build_veb_(sorted_keys);
+  }
+  // the first copy of the largest key is the real one, not padding
+  max_slot_ = lowerbound(sorted_keys.back()) - keys_.data();
+}
+
+// in-order walk of the implicit tree hands out the keys in sorted order
+template <typename T, typename Compare>
+void FrozenAVLTree<T, Compare>::build_eytzinger_(const std::vector<T> &sorted,
+                                                 size_t index, size_t &next) {
+  if (index > size_) {
+    return;
+  }
+  build_eytzinger_(sorted, 2 * index, next);
+  keys_[index - 1] = sorted[next++];
+  build_eytzinger_(sorted, 2 * index + 1, next);
+}
+
+/* Blocks are filled by an in-order walk of the B-tree, so padding can
+ * only end up after the last key. The array has room for one extra
+ * block to start the blocks on a cache line.
+ */
+template <typename T, typename Compare>
+void FrozenAVLTree<T, Compare>::build_blocked_(const std::vector<T> &sorted) {
+  if constexpr (BLOCKABLE) {
+    constexpr size_t B = BLOCK_KEYS<T>;
+    T padding = std::numeric_limits<T>::has_infinity
+                    ? std::numeric_limits<T>::infinity()
+                    : std::numeric_limits<T>::max();
+    block_count_ = (size_ + B - 1) / B;
+    keys_.assign((block_count_ + 1) * B, padding);
+    size_t misalign = reinterpret_cast<uintptr_t>(keys_.data()) % 64;
+    block_offset_ = (misalign == 0) ? 0 : (64 - misalign) / sizeof(T);
+    size_t next = 0;
+    place_blocked_(sorted, 0, next);
+  }
+}
+
+template <typename T, typename Compare>
+void FrozenAVLTree<T, Compare>::place_blocked_(const std::vector<T> &sorted,
+                                               size_t block, size_t &next) {
+  constexpr size_t B = BLOCK_KEYS<T>;
+  if (block >= block_count_) {
+    return;
+  }
+  for (size_t i = 0; i < B; ++i) {
+    place_blocked_(sorted, block * (B + 1) + i + 1, next);
+    if (next < size_) {
+      size_t slot = block_offset_ + block * B + i;
+      keys_[slot] = sorted[next];
+      max_slot_ = slot;
+      ++next;
+    }
+  }
+  place_blocked_(sorted, block * (B + 1) + B + 1, next);
+}
+
+template <typename T, typename Compare>
+void FrozenAVLTree<T, Compare>::build_veb_(const std::vector<T> &sorted) {
+  levels_.assign(height_, VebLevel{0, 0, 0});
+  plan_veb_(0, height_);
+  keys_.reserve(node_count_);
+  place_veb_(sorted, 1, 0, height_);
+}
+
+/* A subtree of the given height rooted at depth is cut below its top
+ * height / 2 levels. The nodes right below the cut are roots of bottom
+ * trees, and the slot of such a node follows from the slot of the top
+ * tree's root:
+ *
+ *   slot = root slot + top_size + (index & top_size) * bottom_size
+ *
+ * as the top tree comes first and the bottom trees follow in order.
+ * Every depth is right below exactly one cut.
+ */
+template <typename T, typename Compare>
+void FrozenAVLTree<T, Compare>::plan_veb_(int depth, int height) {
+  if (height <= 1) {
+    return;
+  }
+  int top_height = height / 2;
+  int bottom_height = height - top_height;
+  levels_[depth + top_height] = VebLevel{(size_t(1) << top_height) - 1,
+                                         (size_t(1) << bottom_height) - 1,
+                                         depth};
+  plan_veb_(depth, top_height);
+  plan_veb_(depth + top_height, bottom_height);
+}
+
+// appends the subtree of index in van Emde Boas order
+template <typename T, typename Compare>
+void FrozenAVLTree<T, Compare>::place_veb_(const std::vector<T> &sorted,
+                                           size_t index, int depth,
+                                           int height) {
+  if (height == 1) {
+    size_t rank = rank_(index, depth);
+    keys_.push_back(sorted[std::min(rank, size_ - 1)]);
+    return;
+  }
+  int top_height = height / 2;
+  int bottom_height = height - top_height;
+  place_veb_(sorted, index, depth, top_height);
+  size_t first = index << top_height;
+  for (size_t bottom = 0; bottom < (size_t(1) << top_height); ++bottom) {
+    place_veb_(sorted, first + bottom, depth + top_height, bottom_height);
+  }
+}
+
+// position in sorted order of a node of the perfect tree
+template <typename T, typename Compare>
+size_t FrozenAVLTree<T, Compare>::rank_(size_t index, int depth) const {
+  size_t offset = index - (size_t(1) << depth);
+  return ((2 * offset + 1) << (height_ - 1 - depth)) - 1;
+}
+
+template <typename T, typename Compare>
+template <bool Veb>
+void FrozenAVLTree<T, Compare>::descend_(Cursor &cursor, bool right) const {
+  cursor.index = 2 * cursor.index + (right ? 1 : 0);
+  ++cursor.depth;
+  if constexpr (Veb) {
+    const VebLevel &level = levels_[cursor.depth];
+    cursor.slots[cursor.depth] =
+        cursor.slots[level.top_depth] + level.top_size +
+        (cursor.index & level.top_size) * level.bottom_size;
+  } else {
+    cursor.slots[cursor.depth] = cursor.index - 1;
+  }
+}
+
+/* Walks from the root to a leaf, going right past every key less than
+ * key (Strict: not greater than key). The answer is the last node where
+ * the walk went left; its index is what remains after dropping the
+ * trailing right turns and one left turn from the index of the leaf.
+ * The cursor is left on that node, 0 if there is none.
+ */
+template <typename T, typename Compare>
+template <bool Veb, bool Strict, typename K>
+void FrozenAVLTree<T, Compare>::search_(const K &key, Cursor &cursor) const {
+  cursor.index = 1;
+  cursor.depth = 0;
+  cursor.slots[0] = 0;
+  const T *keys = keys_.data();
+  for (;;) {
+    const T &node_key = keys[cursor.slots[cursor.depth]];
+    bool right = Strict ? !key_comp_.less(key, node_key)
+                        : key_comp_.less(node_key, key);
+    size_t child = 2 * cursor.index + (right ? 1 : 0);
+    if (Veb ? cursor.depth + 1 == height_ : child > node_count_) {
+      cursor.index = child;
+      break;
+    }
+    if (!Veb && LINE_KEYS * child < node_count_) {
+      __builtin_prefetch(keys + LINE_KEYS * child);
+    }
+    descend_<Veb>(cursor, right);
+  }
+  int turns = __builtin_ctzll(~static_cast<unsigned long long>(cursor.index));
+  cursor.index >>= turns + 1;
+  cursor.depth -= turns;
+}
+
+template <typename T, typename Compare>
+template <bool Veb>
+bool FrozenAVLTree<T, Compare>::is_key_(const Cursor &cursor) const {
+  if (cursor.index == 0) {
+    return false;
+  }
+  return !Veb || rank_(cursor.index, cursor.depth) < size_;
+}
+
+// in-order successor, leaves the cursor at 0 after the last key
+template <typename T, typename Compare>
+template <bool Veb>
+void FrozenAVLTree<T, Compare>::next_(Cursor &cursor) const {
+  if (2 * cursor.index + 1 <= node_count_) {
+    descend_<Veb>(cursor, true);
+    while (2 * cursor.index <= node_count_) {
+      descend_<Veb>(cursor, false);
+    }
+    return;
+  }
+  while (cursor.index & 1) {
+    cursor.index >>= 1;
+    --cursor.depth;
+  }
+  cursor.index >>= 1;
+  --cursor.depth;
+}
+
+// in-order predecessor, leaves the cursor at 0 before the first key
+template <typename T, typename Compare>
+template <bool Veb>
+void FrozenAVLTree<T, Compare>::prev_(Cursor &cursor) const {
+  if (2 * cursor.index <= node_count_) {
+    descend_<Veb>(cursor, false);
+    while (2 * cursor.index + 1 <= node_count_) {
+      descend_<Veb>(cursor, true);
+    }
+    return;
+  }
+  while (cursor.index != 0 && !(cursor.index & 1)) {
+    cursor.index >>= 1;
+    --cursor.depth;
+  }
+  cursor.index >>= 1;
+  --cursor.depth;
+}
+
+template <typename T, typename Compare>
+template <typename K, typename>
+const T *FrozenAVLTree<T, Compare>::find(const K &key) const {
+  const T *found = lowerbound(key);
+  if (found != nullptr && !key_comp_.less(key, *found)) {
+    return found;
+  }
+  return nullptr;
+}
+
+// smallest key >= key
+template <typename T, typename Compare>
+template <typename K, typename>
+const T *FrozenAVLTree<T, Compare>::lowerbound(const K &key) const {
+  if (size_ == 0) {
+    return nullptr;
+  }
+  if constexpr (BLOCKABLE) {
+    if (layout_ == FrozenLayout::blocked) {
+      return find_block_<false>(key);
+    }
+  }
+  return layout_ == FrozenLayout::eytzinger ? lower_<false>(key)
+                                            : lower_<true>(key);
+}
+
+/* Largest key <= key: the predecessor of the first key > key, or the
+ * largest key of all when there is no key > key.
+ */
+template <typename T, typename Compare>
+template <typename K, typename>
+const T *FrozenAVLTree<T, Compare>::upperbound(const K &key) const {
+  if (size_ == 0) {
+    return nullptr;
+  }
+  if constexpr (BLOCKABLE) {
+    if (layout_ == FrozenLayout::blocked) {
+      return find_block_<true>(key);
+    }
+  }
+  return layout_ == FrozenLayout::eytzinger ? upper_<false>(key)
+                                            : upper_<true>(key);
+}
+
+template <typename T, typename Compare>
+template <bool Veb, typename K>
+const T *FrozenAVLTree<T, Compare>::lower_(const K &key) const {
+  Cursor cursor;
+  search_<Veb, false>(key, cursor);
+  return is_key_<Veb>(cursor) ? &keys_[cursor.slots[cursor.depth]] : nullptr;
+}
+
+template <typename T, typename Compare>
+template <bool Veb, typename K>
+const T *FrozenAVLTree<T, Compare>::upper_(const K &key) const {
+  Cursor cursor;
+  search_<Veb, true>(key, cursor);
+  if (cursor.index == 0) {
+    return &keys_[max_slot_];
+  }
+  prev_<Veb>(cursor);
+  return is_key_<Veb>(cursor) ? &keys_[cursor.slots[cursor.depth]] : nullptr;
+}
+
+/* Calls fn(key) for every key in [lo, hi], in ascending order: one
+ * search for lo, then successor steps that mostly stay within a few
+ * cache lines.
+ */
+template <typename T, typename Compare>
+template <typename K, typename F, typename>
+void FrozenAVLTree<T, Compare>::for_each_in_range(const K &lo, const K &hi,
+                                                  F &&fn) const {
+  if (size_ == 0) {
+    return;
+  }
+  if (layout_ == FrozenLayout::blocked) {
+    scan_blocks_(lo, hi, fn);
+  } else if (layout_ == FrozenLayout::eytzinger) {
+    scan_<false>(lo, hi, fn);
+  } else {
+    scan_<true>(lo, hi, fn);
+  }
+}
+
+template <typename T, typename Compare>
+template <bool Veb, typename K, typename F>
+void FrozenAVLTree<T, Compare>::scan_(const K &lo, const K &hi, F &fn) const {
+  Cursor cursor;
+  search_<Veb, false>(lo, cursor);
+  while (is_key_<Veb>(cursor)) {
+    const T &key = keys_[cursor.slots[cursor.depth]];
+    if (key_comp_.less(hi, key)) {
+      return;
+    }
+    fn(key);
+    next_<Veb>(cursor);
+  }
+}
+
+/* Smallest key >= key, with Inclusive largest key <= key. Keys past the
+ * largest one are answered up front, after that no search can end on
+ * padding. Other key types than T go through the comparator.
+ */
+template <typename T, typename Compare>
+template <bool Inclusive, typename K>
+const T *FrozenAVLTree<T, Compare>::find_block_(const K &key) const {
+  const T &largest = keys_[max_slot_];
+  if (Inclusive ? !key_comp_.less(key, largest)
+                : key_comp_.less(largest, key)) {
+    return Inclusive ? &largest : nullptr;
+  }
+  const T *blocks = keys_.data() + block_offset_;
+  size_t slot;
+  if constexpr (std::is_same_v<K, T>) {
+    slot = stree_find<Inclusive>(blocks, block_count_, key, simd_level_);
+  } else {
+    slot = stree_descend<Inclusive>(
+        blocks, block_count_, key, [this](const T *block, const K &k) {
+          return rank_block_<Inclusive>(block, k);
+        });
+  }
+  return (slot == NO_SLOT) ? nullptr : blocks + slot;
+}
+
+// keys of the block below key (Inclusive: not above key)
+template <typename T, typename Compare>
+template <bool Inclusive, typename K>
+size_t FrozenAVLTree<T, Compare>::rank_block_(const T *block,
+                                              const K &key) const {
+  size_t below = 0;
+  for (size_t i = 0; i < BLOCK_KEYS<T>; ++i) {
+    below += Inclusive ? !key_comp_.less(key, block[i])
+                       : key_comp_.less(block[i], key);
+  }
+  return below;
+}
+
+/* In-order walk of the B-tree from lo on. The stack holds a block and
+ * the next key to visit in it for every level; the path of the search
+ * for lo is exactly the stack to start from.
+ */
+template <typename T, typename Compare>
+template <typename K, typename F>
+void FrozenAVLTree<T, Compare>::scan_blocks_(const K &lo, const K &hi,
+                                             F &fn) const {
+  constexpr size_t B = BLOCK_KEYS<T>;
+  struct Frame {
+    size_t block;
+    size_t next;
+  };
+  Frame stack[MAX_DEPTH];
+  int depth = 0;
+  const T *blocks = keys_.data() + block_offset_;
+  for (size_t block = 0; block < block_count_;) {
+    size_t below = rank_block_<false>(blocks + block * B, lo);
+    stack[depth++] = Frame{block, below};
+    block = block * (B + 1) + below + 1;
+  }
+  while (depth > 0) {
+    Frame &top = stack[depth - 1];
+    if (top.next == B) {
+      --depth;
+      continue;
+    }
+    size_t slot = top.block * B + top.next;
+    if (key_comp_.less(hi, blocks[slot])) {
+      return;
+    }
+    fn(blocks[slot]);
+    if (block_offset_ + slot == max_slot_) {
+      return;
+    }
+    ++top.next;
+    size_t child = top.block * (B + 1) + top.next + 1;
+    for (; child < block_count_; child = child * (B + 1) + 1) {
+      stack[depth++] = Frame{child, 0};
+    }
+  }
+}
@@ -0,0 +1,416 @@
+#pragma once
+
+#include "avltree.hpp"
+#include "snapshot.hpp"
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// bumped whenever the record format below changes
+#define WAL_VERSION 1
+
+/* AVLTree whose changes survive a crash, kept in a write-ahead log.
+ *
+ * insert and delete_key apply the change to the tree, append a record
+ * of it to the log and return once the record is on disk. The callers
+ * share their syncs (group commit): the first one that needs a sync
+ * becomes the leader, waits commit_window for others to add their
+ * records, writes all of them with one write and one fdatasync and
+ * wakes up every caller it covered. Records that come in while the
+ * leader syncs make up the next group. A longer window means fewer and
+ * fuller syncs, at the price of that much more latency per change.
+ *
+ * The tree and the log share one mutex, so the log holds the changes in
+ * the order they were applied; reads take it as well. A change is seen
+ * by readers as soon as it is applied, before it is durable. A change
+ * that changes nothing (inserting a present key, deleting a missing one)
+ * is not logged; it only waits for the changes before it to be on disk,
+ * and when they are it costs no write and no sync.
+ *
+ * checkpoint() saves the tree to snapshot_path, see AVLTree::save, and
+ * empties the log. Opening loads the snapshot, when there is one, and
+ * replays the log over it. A crash between the save and the truncation
+ * leaves every change up to the snapshot in the log: replaying all of
+ * them in order leaves every key as its last change did, which is where
+ * the snapshot already is.
+ *
+ * The log starts with a 16 byte header. A record is the operation (one
+ * byte), the length of the key and a checksum of the record (four bytes
+ * each), then the key as in a snapshot: its bytes for a trivially
+ * copyable T, SnapshotSerializer<T> for others. Replay stops at the
+ * first torn or corrupted record, the end of a write that a crash cut
+ * short and that no caller was told was done, and cuts the log there.
+ *
+ * If a write or a sync fails, the log can no longer be trusted: the
+ * callers waiting for it and every later change throw
+ * std::system_error.
+ */
+template <typename T, typename Compare = std::less<T>> class LoggedAVLTree {
+public:
+  using value_type = T;
+  using size_type = size_t;
+  using key_compare = Compare;
+  using tree_type = AVLTree<T, NodePool, NoOrderStatistics, Compare>;
+
+  LoggedAVLTree(std::string snapshot_path, std::string log_path,
+                std::chrono::microseconds commit_window =
+                    std::chrono::microseconds{0},
+                const Compare &comp = Compare());
+  ~LoggedAVLTree();
+  LoggedAVLTree(const LoggedAVLTree &) = delete;
+  LoggedAVLTree &operator=(const LoggedAVLTree &) = delete;
+
+  void insert(const T &key);
+  void delete_key(const T &key);
+  void checkpoint();
+
+  bool contains(const T &key) const;
+  std::vector<T> in_order() const;
+  size_t get_size() const;
+  bool is_empty() const { return get_size() == 0; }
+  // syncs made so far, changes per sync is the size of the groups
+  uint64_t get_sync_count() const;
+  size_t get_log_bytes() const;
+
+private:
+  enum Op : uint8_t { INSERT_OP = 1, DELETE_OP = 2 };
+  static constexpr size_t RECORD_HEADER = 9;
+  static constexpr bool RAW = std::is_trivially_copyable_v<T>;
+
+  struct LogHeader {
+    char magic[8];     // "AVLWAL" and two zeros
+    uint32_t version;  // WAL_VERSION
+    uint32_t key_size; // sizeof(T) for raw keys, 0 otherwise
+  };
+  static_assert(sizeof(LogHeader) == 16, "records follow at byte 16");
+
+  void open_log_();
+  size_t replay_(const std::string &log);
+  uint64_t append_record_(Op op, const T &key);
+  void wait_durable_(uint64_t lsn, std::unique_lock<std::mutex> &lock);
+  void check_error_() const;
+  static uint32_t record_sum_(const char *record, uint32_t length);
+
+  tree_type tree_;
+  std::string snapshot_path_;
+  std::string log_path_;
+  std::chrono::microseconds commit_window_;
+  int fd_;
+  std::string pending_;  // records not handed to a leader yet
+  std::string writing_;  // the group the leader writes
+  uint64_t next_lsn_;    // number of the next record, from 1
+  uint64_t durable_lsn_; // records up to this one are on disk
+  uint64_t sync_count_;
+  size_t log_bytes_;
+  bool flushing_; // a leader is writing a group
+  int error_;     // errno of a failed write or sync, 0 if none
+  mutable std::mutex mutex_;
+  std::condition_variable synced_;
+};
+
+template <typename T, typename Compare>
+LoggedAVLTree<T, Compare>::LoggedAVLTree(
+    std::string snapshot_path, std::string log_path,
+    std::chrono::microseconds commit_window, const Compare &comp)
+    : tree_{comp}, snapshot_path_{std::move(snapshot_path)},
+      log_path_{std::move(log_path)}, commit_window_{commit_window}, fd_{-1},
+      next_lsn_{1}, durable_lsn_{0}, sync_count_{0}, log_bytes_{0},
+      flushing_{false}, error_{0} {
+  struct stat info;
+  if (stat(snapshot_path_.c_str(), &info) == 0) {
+    tree_.load(snapshot_path_);
+  }
+  try {
+    open_log_();
+  } catch (...) {
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+    throw;
+  }
+}
+
+template <typename T, typename Compare>
+LoggedAVLTree<T, Compare>::~LoggedAVLTree() {
+  close(fd_);
+}
+
+// opens or creates the log, replays it and cuts off a torn tail
+template <typename T, typename Compare>
+void LoggedAVLTree<T, Compare>::open_log_() {
+  fd_ = open(log_path_.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+             0644);
+  if (fd_ < 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "wal: cannot open " + log_path_);
+  }
+  std::string log;
+  char chunk[1 << 16];
+  for (;;) {
+    ssize_t got = read(fd_, chunk, sizeof(chunk));
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "wal: cannot read " + log_path_);
+    }
+    if (got == 0) {
+      break;
+    }
+    log.append(chunk, static_cast<size_t>(got));
+  }
+
+  LogHeader header{};
+  std::memcpy(header.magic, "AVLWAL", 6);
+  header.version = WAL_VERSION;
+  header.key_size = RAW ? sizeof(T) : 0;
+  if (log.empty()) {
+    snapshot_detail::write_all(fd_, reinterpret_cast<const char *>(&header),
+                               sizeof(header), "wal");
+    if (fdatasync(fd_) != 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "wal: fdatasync failed");
+    }
+    snapshot_detail::sync_directory(log_path_);
+    log_bytes_ = sizeof(header);
+    return;
+  }
+  if (log.size() < sizeof(header) ||
+      std::memcmp(log.data(), &header, sizeof(header)) != 0) {
+    throw std::runtime_error("wal: " + log_path_ +
+                             " is not a log of this version and key type");
+  }
+  size_t valid = replay_(log);
+  if (valid < log.size()) {
+    if (ftruncate(fd_, static_cast<off_t>(valid)) != 0 ||
+        fdatasync(fd_) != 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "wal: cannot truncate " + log_path_);
+    }
+  }
+  log_bytes_ = valid;
+}
+
+// applies the records of log to the tree, returns where the good ones end
+template <typename T, typename Compare>
+size_t LoggedAVLTree<T, Compare>::replay_(const std::string &log) {
+  size_t at = sizeof(LogHeader);
+  while (log.size() - at >= RECORD_HEADER) {
+    const char *record = log.data() + at;
+    uint32_t length;
+    uint32_t sum;
+    std::memcpy(&length, record + 1, sizeof(length));
+    std::memcpy(&sum, record + 5, sizeof(sum));
+    if (length > log.size() - at - RECORD_HEADER ||
+        record_sum_(record, length) != sum) {
+      break;
+    }
+    const char *key_bytes = record + RECORD_HEADER;
+    auto apply = [&](const T &key) {
+      if (record[0] == INSERT_OP) {
+        tree_.insert(key);
+      } else if (record[0] == DELETE_OP) {
+        tree_.delete_key(key);
+      } else {
+        throw std::runtime_error("wal: unknown record");
+      }
+    };
+    if constexpr (RAW) {
+      if (length != sizeof(T)) {
+        throw std::runtime_error("wal: record of another key type");
+      }
+      alignas(T) char storage[sizeof(T)];
+      std::memcpy(storage, key_bytes, sizeof(T));
+      apply(*std::launder(reinterpret_cast<const T *>(storage)));
+    } else {
+      const char *in = key_bytes;
+      T key = SnapshotSerializer<T>::read(in, key_bytes + length);
+      apply(key);
+    }
+    at += RECORD_HEADER + length;
+  }
+  return at;
+}
+
+// checksum of the operation, the length and the key of a record
+template <typename T, typename Compare>
+uint32_t LoggedAVLTree<T, Compare>::record_sum_(const char *record,
+                                                uint32_t length) {
+  SnapshotChecksum sum;
+  sum.update(record, 5);
+  sum.update(record + RECORD_HEADER, length);
+  return static_cast<uint32_t>(sum.value());
+}
+
+// appends the record to pending_ and returns its number, under mutex_
+template <typename T, typename Compare>
+uint64_t LoggedAVLTree<T, Compare>::append_record_(Op op, const T &key) {
+  size_t start = pending_.size();
+  pending_.append(RECORD_HEADER, '\0');
+  if constexpr (RAW) {
+    pending_.append(reinterpret_cast<const char *>(&key), sizeof(T));
+  } else {
+    SnapshotSerializer<T>::write(key, pending_);
+  }
+  uint32_t length = static_cast<uint32_t>(pending_.size() - start -
+                                          RECORD_HEADER);
+  char *record = &pending_[start];
+  record[0] = static_cast<char>(op);
+  std::memcpy(record + 1, &length, sizeof(length));
+  uint32_t sum = record_sum_(record, length);
+  std::memcpy(record + 5, &sum, sizeof(sum));
+  return next_lsn_++;
+}
+
+/* Returns once record lsn is on disk, leading the sync of a group if no
+ * other caller is. The leader drops the lock while it waits for the
+ * window to fill and while it writes, so that others can go on adding
+ * records.
+ */
+template <typename T, typename Compare>
+void LoggedAVLTree<T, Compare>::wait_durable_(
+    uint64_t lsn, std::unique_lock<std::mutex> &lock) {
+  while (durable_lsn_ < lsn) {
+    check_error_();
+    if (flushing_) {
+      synced_.wait(lock);
+      continue;
+    }
+    flushing_ = true;
+    if (commit_window_.count() > 0) {
+      lock.unlock();
+      std::this_thread::sleep_for(commit_window_);
+      lock.lock();
+    }
+    writing_.clear();
+    writing_.swap(pending_);
+    uint64_t group_lsn = next_lsn_ - 1;
+    lock.unlock();
+
+    int error = 0;
+    try {
+      snapshot_detail::write_all(fd_, writing_.data(), writing_.size(),
+                                 "wal");
+    } catch (const std::system_error &e) {
+      error = e.code().value();
+    }
+    if (error == 0 && fdatasync(fd_) != 0) {
+      error = errno;
+    }
+
+    lock.lock();
+    flushing_ = false;
+    if (error != 0) {
+      error_ = error;
+    } else {
+      durable_lsn_ = group_lsn;
+      log_bytes_ += writing_.size();
+      ++sync_count_;
+    }
+    synced_.notify_all();
+  }
+}
+
+template <typename T, typename Compare>
+void LoggedAVLTree<T, Compare>::check_error_() const {
+  if (error_ != 0) {
+    throw std::system_error(error_, std::generic_category(),
+                            "wal: an earlier write or sync failed");
+  }
+}
+
+template <typename T, typename Compare>
+void LoggedAVLTree<T, Compare>::insert(const T &key) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  check_error_();
+  size_t old_size = tree_.get_size();
+  tree_.insert(key);
+  uint64_t lsn = (tree_.get_size() != old_size)
+                     ? append_record_(INSERT_OP, key)
+                     : next_lsn_ - 1; // nothing changed, nothing to log
+  wait_durable_(lsn, lock);
+}
+
+template <typename T, typename Compare>
+void LoggedAVLTree<T, Compare>::delete_key(const T &key) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  check_error_();
+  size_t old_size = tree_.get_size();
+  tree_.delete_key(key);
+  uint64_t lsn = (tree_.get_size() != old_size)
+                     ? append_record_(DELETE_OP, key)
+                     : next_lsn_ - 1; // nothing changed, nothing to log
+  wait_durable_(lsn, lock);
+}
+
+/* Saves the tree and empties the log. Every record is synced first and
+ * changes wait until the checkpoint is over, so the log ends exactly
+ * where the snapshot does, see the class comment.
+ */
+template <typename T, typename Compare>
+void LoggedAVLTree<T, Compare>::checkpoint() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (flushing_ || durable_lsn_ + 1 < next_lsn_) {
+    check_error_();
+    if (flushing_) {
+      synced_.wait(lock);
+    } else {
+      wait_durable_(next_lsn_ - 1, lock);
+    }
+  }
+  check_error_();
+  tree_.save(snapshot_path_);
+  if (ftruncate(fd_, sizeof(LogHeader)) != 0 || fdatasync(fd_) != 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "wal: cannot truncate " + log_path_);
+  }
+  log_bytes_ = sizeof(LogHeader);
+}
+
+template <typename T, typename Compare>
+bool LoggedAVLTree<T, Compare>::contains(const T &key) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto found = tree_.lower_bound(key);
+  return found != tree_.end() && !tree_.key_comp()(key, *found);
+}
+
+template <typename T, typename Compare>
+std::vector<T> LoggedAVLTree<T, Compare>::in_order() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return tree_.in_order();
+}
+
+template <typename T, typename Compare>
+size_t LoggedAVLTree<T, Compare>::get_size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return tree_.get_size();
+}
+
+template <typename T, typename Compare>
+uint64_t LoggedAVLTree<T, Compare>::get_sync_count() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return sync_count_;
+}
+
+template <typename T, typename Compare>
+size_t LoggedAVLTree<T, Compare>::get_log_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return log_bytes_;
+}
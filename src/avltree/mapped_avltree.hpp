@@ -0,0 +1,135 @@
+#pragma once
+
+#include "compare.hpp"
+#include "snapshot.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+/* Read-only tree served straight from an image written by
+ * AVLTree::save, see snapshot.hpp.
+ *
+ * Opening maps the file and checks its header; the keys are not copied
+ * and no node is built, so startup costs the same for any size of
+ * image. The pages are read by the lookups that touch them. With verify
+ * the keys are checksummed and checked to be strictly ascending under
+ * Compare first, which reads the whole file once; without it the image
+ * is trusted to have been saved from a tree with the same Compare.
+ *
+ * The keys are searched in place by bisection, the implicit balanced
+ * tree the image records. Only trivially copyable keys are stored as
+ * their bytes, so only those can be mapped; load other images into an
+ * AVLTree.
+ *
+ * find, lowerbound and upperbound return a pointer into the mapping or
+ * nullptr and mean the same as in AVLTree.
+ */
+template <typename T, typename Compare = std::less<T>> class MappedAVLTree {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "only trivially copyable keys can be used in place");
+
+  // lookups take any key type with a transparent Compare, see AVLTree
+  template <typename K>
+  using lookup_key_t =
+      std::enable_if_t<std::is_same_v<K, T> || is_transparent<Compare>::value>;
+
+public:
+  using value_type = T;
+  using size_type = size_t;
+  using key_compare = Compare;
+
+  explicit MappedAVLTree(const std::string &path, bool verify = true,
+                         const Compare &comp = Compare());
+
+  const T *find(const T &key) const { return find<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  const T *find(const K &key) const;
+  const T *lowerbound(const T &key) const { return lowerbound<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  const T *lowerbound(const K &key) const;
+  const T *upperbound(const T &key) const { return upperbound<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  const T *upperbound(const K &key) const;
+  template <typename F>
+  void for_each_in_range(const T &lo, const T &hi, F &&fn) const {
+    for_each_in_range<T, F>(lo, hi, std::forward<F>(fn));
+  }
+  template <typename K, typename F, typename = lookup_key_t<K>>
+  void for_each_in_range(const K &lo, const K &hi, F &&fn) const;
+
+  // the keys in ascending order
+  const T *begin() const { return keys_; }
+  const T *end() const { return keys_ + size_; }
+  size_t get_size() const { return size_; }
+  bool is_empty() const { return size_ == 0; }
+
+private:
+  MappedFile file_;
+  const T *keys_;
+  size_t size_;
+  KeyCompare<T, Compare> key_comp_;
+};
+
+template <typename T, typename Compare>
+MappedAVLTree<T, Compare>::MappedAVLTree(const std::string &path,
+                                         bool verify, const Compare &comp)
+    : file_{path, false, MADV_RANDOM}, keys_{nullptr}, size_{0},
+      key_comp_{comp} {
+  SnapshotHeader header = snapshot_detail::check_header<T>(file_, verify);
+  keys_ = reinterpret_cast<const T *>(file_.data() + sizeof(header));
+  size_ = header.count;
+  if (verify) {
+    snapshot_detail::check_order(
+        keys_, keys_ + size_,
+        [this](const T &a, const T &b) { return key_comp_.less(a, b); });
+  }
+}
+
+template <typename T, typename Compare>
+template <typename K, typename>
+const T *MappedAVLTree<T, Compare>::find(const K &key) const {
+  const T *found = lowerbound(key);
+  if (found != nullptr && !key_comp_.less(key, *found)) {
+    return found;
+  }
+  return nullptr;
+}
+
+// smallest key >= key
+template <typename T, typename Compare>
+template <typename K, typename>
+const T *MappedAVLTree<T, Compare>::lowerbound(const K &key) const {
+  const T *found =
+      std::lower_bound(begin(), end(), key, [this](const T &a, const K &b) {
+        return key_comp_.less(a, b);
+      });
+  return (found != end()) ? found : nullptr;
+}
+
+// largest key <= key
+template <typename T, typename Compare>
+template <typename K, typename>
+const T *MappedAVLTree<T, Compare>::upperbound(const K &key) const {
+  const T *after =
+      std::upper_bound(begin(), end(), key, [this](const K &a, const T &b) {
+        return key_comp_.less(a, b);
+      });
+  return (after != begin()) ? after - 1 : nullptr;
+}
+
+// calls fn on every key in [lo, hi], in ascending order
+template <typename T, typename Compare>
+template <typename K, typename F, typename>
+void MappedAVLTree<T, Compare>::for_each_in_range(const K &lo, const K &hi,
+                                                  F &&fn) const {
+  const T *key = lowerbound(lo);
+  if (key == nullptr) {
+    return;
+  }
+  for (; key != end() && !key_comp_.less(hi, *key); ++key) {
+    fn(*key);
+  }
+}
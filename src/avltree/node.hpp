@@ -1,19 +1,54 @@
 #pragma once
 
 #include <algorithm>
+#include <cstddef>
 #include <cstdlib>
 #include <iostream>
+#include <utility>
 
-template <typename T> class AVLTree;
+template <typename T, template <typename> class Alloc, typename Stats,
+          typename Compare>
+class AVLTree;
 template <typename T> class PstreeDisplay;
 
-template <typename T> class Node {
-  friend class AVLTree<T>;
+/* Stats policies: what a node knows about its subtree besides height.
+ *
+ * The policy is a base class of Node, NoOrderStatistics is empty and
+ * costs no memory. OrderStatistics stores the number of nodes in the
+ * subtree, which AVLTree needs for select, rank and count_range.
+ */
+struct NoOrderStatistics {
+  static constexpr bool enabled = false;
+
+  size_t get_subtree_size() const { return 0; }
+
+protected:
+  void set_subtree_size(size_t) {}
+};
+
+struct OrderStatistics {
+  static constexpr bool enabled = true;
+
+  size_t get_subtree_size() const { return subtree_size_; }
+
+protected:
+  void set_subtree_size(size_t size) { subtree_size_ = size; }
+
+private:
+  size_t subtree_size_ = 1;
+};
+
+template <typename T, typename Stats = NoOrderStatistics>
+class Node : public Stats {
+  template <typename, template <typename> class, typename, typename>
+  friend class AVLTree;
   friend class PstreeDisplay<T>;
 
 public:
   Node(const T &key = T{}, int height = 1);
-  ~Node();
+  // builds the key in place from args
+  template <typename... Args>
+  explicit Node(std::in_place_t, Args &&...args);
 
   Node(const Node &) = delete;
   Node &operator=(const Node &) = delete;
@@ -22,58 +57,68 @@ public:
   int get_height() const;
   int get_balance() const;
   void recalc_height();
-  Node<T> *get_min();
-  Node<T> *get_max();
-  Node<T> *get_next() const;
-  Node<T> *lowerbound();
-  Node<T> *upperbound();
+  void recalc_size();
+  Node<T, Stats> *get_min();
+  Node<T, Stats> *get_max();
+  Node<T, Stats> *get_next() const;
+  Node<T, Stats> *get_prev() const;
+  Node<T, Stats> *lowerbound();
+  Node<T, Stats> *upperbound();
   void display() const;
   T &get_key();
+  const T &get_key() const;
 
 private:
-  Node<T> *left_;
-  Node<T> *right_;
-  Node<T> *parent_;
+  Node<T, Stats> *left_;
+  Node<T, Stats> *right_;
+  Node<T, Stats> *parent_;
   T key_;
   int height_;
 };
 
-template <typename T>
-Node<T>::Node(const T &key, int height)
+template <typename T, typename Stats>
+Node<T, Stats>::Node(const T &key, int height)
     : left_{nullptr}, right_{nullptr}, parent_{nullptr}, key_{key},
       height_{height} {}
 
-template <typename T> Node<T>::~Node() {
-  delete left_;
-  delete right_;
-}
+template <typename T, typename Stats>
+template <typename... Args>
+Node<T, Stats>::Node(std::in_place_t, Args &&...args)
+    : left_{nullptr}, right_{nullptr}, parent_{nullptr},
+      key_(std::forward<Args>(args)...), height_{1} {}
 
-template <typename T> void Node<T>::set_height(int height) { height_ = height; }
+template <typename T, typename Stats>
+void Node<T, Stats>::set_height(int height) { height_ = height; }
 
-template <typename T> int Node<T>::get_height() const { return height_; }
+template <typename T, typename Stats>
+int Node<T, Stats>::get_height() const { return height_; }
 
-template <typename T> Node<T> *Node<T>::get_min() {
-  Node<T> *current = this;
+template <typename T, typename Stats>
+Node<T, Stats> *Node<T, Stats>::get_min() {
+  Node<T, Stats> *current = this;
   while (current->left_) {
     current = current->left_;
   }
   return current;
 }
 
-template <typename T> Node<T> *Node<T>::get_max() {
-  Node<T> *current = this;
+template <typename T, typename Stats>
+Node<T, Stats> *Node<T, Stats>::get_max() {
+  Node<T, Stats> *current = this;
   while (current->right_) {
     current = current->right_;
   }
   return current;
 }
 
-template <typename T> Node<T> *Node<T>::get_next() const {
+// in-order successor, nullptr for the largest key
+template <typename T, typename Stats>
+Node<T, Stats> *Node<T, Stats>::get_next() const {
   if (right_) {
-    return get_min(right_);
+    return right_->get_min();
   }
-  Node<T> *current = this;
-  Node<T> *parent = parent_;
+  const Node<T, Stats> *current = this;
+  Node<T, Stats> *parent = parent_;
   while (parent && current != parent->left_) {
     current = parent;
     parent = parent->parent_;
@@ -81,35 +126,60 @@ template <typename T> Node<T> *Node<T>::get_next() const {
   return parent;
 }
 
-template <typename T> void Node<T>::recalc_height() {
+// in-order predecessor, nullptr for the smallest key
+template <typename T, typename Stats>
+Node<T, Stats> *Node<T, Stats>::get_prev() const {
+  if (left_) {
+    return left_->get_max();
+  }
+  const Node<T, Stats> *current = this;
+  Node<T, Stats> *parent = parent_;
+  while (parent && current != parent->right_) {
+    current = parent;
+    parent = parent->parent_;
+  }
+  return parent;
+}
+
+template <typename T, typename Stats> void Node<T, Stats>::recalc_height() {
   int left_height = (left_) ? left_->get_height() : 0;
   int right_height = (right_) ? right_->get_height() : 0;
   height_ = 1 + std::max(left_height, right_height);
 }
 
-template <typename T> int Node<T>::get_balance() const {
+template <typename T, typename Stats> void Node<T, Stats>::recalc_size() {
+  if constexpr (Stats::enabled) {
+    size_t left_size = (left_) ? left_->get_subtree_size() : 0;
+    size_t right_size = (right_) ? right_->get_subtree_size() : 0;
+    this->set_subtree_size(1 + left_size + right_size);
+  }
+}
+
+template <typename T, typename Stats> int Node<T, Stats>::get_balance() const {
   int left_height = (left_) ? left_->get_height() : 0;
   int right_height = (right_) ? right_->get_height() : 0;
   return left_height - right_height;
 }
 
-template <typename T> void Node<T>::display() const {
+template <typename T, typename Stats> void Node<T, Stats>::display() const {
   std::cout << key_ << " ";
 }
 
-template <typename T> void display_node(const Node<T> *node) {
+template <typename T, typename Stats>
+void display_node(const Node<T, Stats> *node) {
   node->display();
 }
 
-template <typename T> Node<T> *Node<T>::lowerbound() {
-  Node<T> *node = this;
+template <typename T, typename Stats>
+Node<T, Stats> *Node<T, Stats>::lowerbound() {
+  Node<T, Stats> *node = this;
   if (node == nullptr) {
     return nullptr;
   }
   if (node->right_ != nullptr) {
     return node->right_->get_min();
   }
-  Node<T> *prev_node = node->parent_;
+  Node<T, Stats> *prev_node = node->parent_;
   while (prev_node && node != prev_node->left_) {
     node = prev_node;
     prev_node = prev_node->parent_;
@@ -117,15 +187,16 @@ template <typename T> Node<T> *Node<T>::lowerbound() {
   return prev_node;
 }
 
-template <typename T> Node<T> *Node<T>::upperbound() {
-  Node<T> *node = this;
+template <typename T, typename Stats>
+Node<T, Stats> *Node<T, Stats>::upperbound() {
+  Node<T, Stats> *node = this;
   if (node == nullptr) {
     return nullptr;
   }
   if (node->left_ != nullptr) {
     return node->left_->get_max();
   }
-  Node<T> *prev_node = node->parent_;
+  Node<T, Stats> *prev_node = node->parent_;
   while (prev_node && node != prev_node->right_) {
     node = prev_node;
     prev_node = prev_node->parent_;
@@ -133,4 +204,8 @@ template <typename T> Node<T> *Node<T>::upperbound() {
   return prev_node;
 }
 
-template <typename T> T &Node<T>::get_key() { return key_; }
+template <typename T, typename Stats>
+T &Node<T, Stats>::get_key() { return key_; }
+
+template <typename T, typename Stats>
+const T &Node<T, Stats>::get_key() const { return key_; }
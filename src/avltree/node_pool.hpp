@@ -0,0 +1,206 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/* Allocator policies for tree nodes.
+ *
+ * AVLTree takes the policy as a template template parameter and
+ * instantiates it with its node type. A policy hands out raw storage for
+ * one node at a time; constructing and destroying the node itself is the
+ * tree's job.
+ *
+ *   NodeT *allocate();
+ *   void deallocate(NodeT *node);
+ *   void share(const Policy &other); // other's nodes may now be freed here
+ *   void release();                  // forget every node at once
+ *   static constexpr bool releases_in_bulk;
+ *
+ * When releases_in_bulk is false, release() does not free anything and the
+ * tree has to deallocate its nodes one by one.
+ *
+ * Optionally a policy can hand out contiguous storage for many nodes,
+ * each of which may later be deallocated on its own:
+ *
+ *   NodeT *allocate_block(size_t count);
+ */
+
+/* Default policy: a slab / free-list pool owned by the tree.
+ *
+ * Nodes are carved out of contiguous slabs whose size grows geometrically,
+ * freed nodes are pushed onto an intrusive free list and recycled by the
+ * next allocation, and release() drops whole slabs at once.
+ *
+ * Slabs are reference counted, so after split/join a node may live in a
+ * slab that was allocated by another tree: share() makes this pool keep
+ * the other pool's slabs alive. Bump allocation only ever happens in a
+ * slab created by this pool, so two trees sharing slabs can still be used
+ * from different threads.
+ */
+template <typename NodeT> class NodePool {
+public:
+  static constexpr bool releases_in_bulk = true;
+
+  NodePool();
+  NodePool(NodePool &&other) noexcept;
+  NodePool &operator=(NodePool &&other) noexcept;
+  ~NodePool() = default;
+
+  NodePool(const NodePool &) = delete;
+  NodePool &operator=(const NodePool &) = delete;
+
+  NodeT *allocate();
+  NodeT *allocate_block(size_t count);
+  void deallocate(NodeT *node);
+  void share(const NodePool &other);
+  void release();
+  size_t reserved_bytes() const;
+
+private:
+  union Slot {
+    Slot *next;
+    alignas(NodeT) unsigned char storage[sizeof(NodeT)];
+  };
+
+  static constexpr size_t MIN_SLAB_NODES = 64;
+  static constexpr size_t MAX_SLAB_NODES = 1 << 16;
+
+  Slot *new_slab_(size_t count);
+
+  std::vector<std::shared_ptr<Slot[]>> slabs_;
+  Slot *free_list_;
+  Slot *cursor_; // bump pointer inside the newest slab
+  Slot *end_;
+  size_t next_slab_nodes_;
+  size_t reserved_nodes_;
+};
+
+template <typename NodeT>
+NodePool<NodeT>::NodePool()
+    : free_list_{nullptr}, cursor_{nullptr}, end_{nullptr},
+      next_slab_nodes_{MIN_SLAB_NODES}, reserved_nodes_{0} {}
+
+template <typename NodeT>
+NodePool<NodeT>::NodePool(NodePool &&other) noexcept
+    : slabs_{std::move(other.slabs_)}, free_list_{other.free_list_},
+      cursor_{other.cursor_}, end_{other.end_},
+      next_slab_nodes_{other.next_slab_nodes_},
+      reserved_nodes_{other.reserved_nodes_} {
+  other.slabs_.clear();
+  other.free_list_ = other.cursor_ = other.end_ = nullptr;
+  other.next_slab_nodes_ = MIN_SLAB_NODES;
+  other.reserved_nodes_ = 0;
+}
+
+template <typename NodeT>
+NodePool<NodeT> &NodePool<NodeT>::operator=(NodePool &&other) noexcept {
+  if (this != &other) {
+    slabs_ = std::move(other.slabs_);
+    free_list_ = other.free_list_;
+    cursor_ = other.cursor_;
+    end_ = other.end_;
+    next_slab_nodes_ = other.next_slab_nodes_;
+    reserved_nodes_ = other.reserved_nodes_;
+    other.slabs_.clear();
+    other.free_list_ = other.cursor_ = other.end_ = nullptr;
+    other.next_slab_nodes_ = MIN_SLAB_NODES;
+    other.reserved_nodes_ = 0;
+  }
+  return *this;
+}
+
+template <typename NodeT>
+typename NodePool<NodeT>::Slot *NodePool<NodeT>::new_slab_(size_t count) {
+  slabs_.emplace_back(new Slot[count]);
+  reserved_nodes_ += count;
+  return slabs_.back().get();
+}
+
+template <typename NodeT> NodeT *NodePool<NodeT>::allocate() {
+  Slot *slot = free_list_;
+  if (slot != nullptr) {
+    free_list_ = slot->next;
+    return reinterpret_cast<NodeT *>(slot->storage);
+  }
+  if (cursor_ == end_) {
+    cursor_ = new_slab_(next_slab_nodes_);
+    end_ = cursor_ + next_slab_nodes_;
+    next_slab_nodes_ = std::min(next_slab_nodes_ * 2, MAX_SLAB_NODES);
+  }
+  return reinterpret_cast<NodeT *>((cursor_++)->storage);
+}
+
+// contiguous storage for count nodes, every one of them may be freed alone
+template <typename NodeT> NodeT *NodePool<NodeT>::allocate_block(size_t count) {
+  if (count == 0) {
+    return nullptr;
+  }
+  if (static_cast<size_t>(end_ - cursor_) >= count) {
+    Slot *block = cursor_;
+    cursor_ += count;
+    return reinterpret_cast<NodeT *>(block->storage);
+  }
+  // dedicated slab, the current bump slab stays usable
+  return reinterpret_cast<NodeT *>(new_slab_(count)->storage);
+}
+
+template <typename NodeT> void NodePool<NodeT>::deallocate(NodeT *node) {
+  Slot *slot = reinterpret_cast<Slot *>(node);
+  slot->next = free_list_;
+  free_list_ = slot;
+}
+
+template <typename NodeT> void NodePool<NodeT>::share(const NodePool &other) {
+  if (this == &other || other.slabs_.empty()) {
+    return;
+  }
+  slabs_.insert(slabs_.end(), other.slabs_.begin(), other.slabs_.end());
+
+  // repeated split/join would otherwise pile up references to the same slab
+  std::sort(slabs_.begin(), slabs_.end(),
+            [](const std::shared_ptr<Slot[]> &a,
+               const std::shared_ptr<Slot[]> &b) { return a.get() < b.get(); });
+  slabs_.erase(std::unique(slabs_.begin(), slabs_.end()), slabs_.end());
+}
+
+template <typename NodeT> void NodePool<NodeT>::release() {
+  slabs_.clear();
+  free_list_ = cursor_ = end_ = nullptr;
+  next_slab_nodes_ = MIN_SLAB_NODES;
+  reserved_nodes_ = 0;
+}
+
+template <typename NodeT> size_t NodePool<NodeT>::reserved_bytes() const {
+  return reserved_nodes_ * sizeof(Slot);
+}
+
+/* Plain new/delete per node, the behaviour before NodePool existed.
+ * Kept for comparison and for callers that need every node to be an
+ * independent heap allocation.
+ */
+template <typename NodeT> class NewDeleteAllocator {
+public:
+  static constexpr bool releases_in_bulk = false;
+
+  NodeT *allocate() {
+    return static_cast<NodeT *>(::operator new(sizeof(NodeT)));
+  }
+  void deallocate(NodeT *node) { ::operator delete(node); }
+  void share(const NewDeleteAllocator &) {}
+  void release() {}
+  size_t reserved_bytes() const { return 0; }
+};
+
+// true if Policy provides allocate_block(count)
+template <typename Policy, typename = void>
+struct has_block_allocation : std::false_type {};
+
+template <typename Policy>
+struct has_block_allocation<
+    Policy, std::void_t<decltype(std::declval<Policy &>().allocate_block(
+                size_t{}))>> : std::true_type {};
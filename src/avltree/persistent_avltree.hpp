@@ -0,0 +1,463 @@
+#pragma once
+
+#include "compare.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/* Persistent AVL tree: every version stays valid for as long as someone
+ * holds it.
+ *
+ * Copying a tree is O(1) and gives a snapshot: both copies share all
+ * nodes, and each insert or delete_key then copies only the nodes on
+ * its path (path copying) and leaves the other version as it was. This
+ * needs nodes without parent pointers, as one node may sit in many
+ * versions under different parents.
+ *
+ * Nodes are reference counted and freed when the last version using
+ * them is gone. A node referenced once can only be reached through the
+ * tree being changed, so it is updated in place instead of copied; a
+ * tree without snapshots hardly copies anything.
+ *
+ * Different trees sharing nodes may be used from different threads, the
+ * counts are atomic. A single tree is not thread safe.
+ */
+template <typename T> struct PersistentNode {
+  T key_;
+  PersistentNode *left_;
+  PersistentNode *right_;
+  int height_;
+  std::atomic<uint32_t> refs_;
+};
+
+template <typename T, typename Compare = std::less<T>>
+class PersistentAVLTree {
+  // lookups take any key type with a transparent Compare, see AVLTree
+  template <typename K>
+  using lookup_key_t =
+      std::enable_if_t<std::is_same_v<K, T> || is_transparent<Compare>::value>;
+
+public:
+  using value_type = T;
+  using size_type = size_t;
+  using key_compare = Compare;
+
+  PersistentAVLTree();
+  explicit PersistentAVLTree(const Compare &comp);
+  PersistentAVLTree(const PersistentAVLTree &other);
+  PersistentAVLTree &operator=(const PersistentAVLTree &other);
+  PersistentAVLTree(PersistentAVLTree &&other) noexcept;
+  PersistentAVLTree &operator=(PersistentAVLTree &&other) noexcept;
+  ~PersistentAVLTree();
+
+  // same as a copy, for readability at call sites
+  PersistentAVLTree snapshot() const { return *this; }
+
+  void insert(const T &key) { insert_key_(key); }
+  void insert(T &&key) { insert_key_(std::move(key)); }
+  void delete_key(const T &key) { delete_key<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  void delete_key(const K &key);
+  void clear_tree();
+
+  // pointers stay valid until this tree is changed or destroyed
+  const T *find(const T &key) const { return find<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  const T *find(const K &key) const;
+  const T *lowerbound(const T &key) const { return lowerbound<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  const T *lowerbound(const K &key) const;
+  const T *upperbound(const T &key) const { return upperbound<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  const T *upperbound(const K &key) const;
+  template <typename F>
+  void for_each_in_range(const T &lo, const T &hi, F &&fn) const {
+    for_each_in_range<T, F>(lo, hi, std::forward<F>(fn));
+  }
+  template <typename K, typename F, typename = lookup_key_t<K>>
+  void for_each_in_range(const K &lo, const K &hi, F &&fn) const;
+  std::vector<T> in_order() const;
+
+  size_t get_size() const { return size_; }
+  bool is_empty() const { return size_ == 0; }
+  size_t get_height() const { return height_(root_); }
+  bool is_balanced() const;
+
+private:
+  using NodeT = PersistentNode<T>;
+
+  /* The recursive helpers take over the caller's reference to node and
+   * hand back a reference to the new subtree.
+   */
+  template <typename Key> void insert_key_(Key &&key);
+  template <typename K> const NodeT *find_node_(const K &key) const;
+  template <typename Key> NodeT *insert_(NodeT *node, Key &&key);
+  template <typename K> NodeT *remove_(NodeT *node, const K &key);
+  NodeT *remove_min_(NodeT *node, T &min);
+  NodeT *own_(NodeT *node);
+  NodeT *balance_(NodeT *node);
+  NodeT *rotate_left_(NodeT *node);
+  NodeT *rotate_right_(NodeT *node);
+  template <typename K, typename F>
+  void visit_range_(const NodeT *node, const K &lo, const K &hi, F &fn) const;
+  bool check_(const NodeT *node, int &height) const;
+  static int height_(const NodeT *node) {
+    return (node == nullptr) ? 0 : node->height_;
+  }
+  static void update_height_(NodeT *node);
+  static NodeT *retain_(NodeT *node);
+  static void release_(NodeT *node);
+
+  NodeT *root_;
+  size_t size_;
+  KeyCompare<T, Compare> key_comp_;
+};
+
+template <typename T, typename Compare>
+PersistentAVLTree<T, Compare>::PersistentAVLTree()
+    : root_{nullptr}, size_{0} {}
+
+template <typename T, typename Compare>
+PersistentAVLTree<T, Compare>::PersistentAVLTree(const Compare &comp)
+    : root_{nullptr}, size_{0}, key_comp_{comp} {}
+
+template <typename T, typename Compare>
+PersistentAVLTree<T, Compare>::PersistentAVLTree(
+    const PersistentAVLTree &other)
+    : root_{retain_(other.root_)}, size_{other.size_},
+      key_comp_{other.key_comp_} {}
+
+template <typename T, typename Compare>
+PersistentAVLTree<T, Compare> &
+PersistentAVLTree<T, Compare>::operator=(const PersistentAVLTree &other) {
+  NodeT *old_root = root_;
+  root_ = retain_(other.root_);
+  size_ = other.size_;
+  key_comp_ = other.key_comp_;
+  release_(old_root);
+  return *this;
+}
+
+template <typename T, typename Compare>
+PersistentAVLTree<T, Compare>::PersistentAVLTree(
+    PersistentAVLTree &&other) noexcept
+    : root_{other.root_}, size_{other.size_}, key_comp_{other.key_comp_} {
+  other.root_ = nullptr;
+  other.size_ = 0;
+}
+
+template <typename T, typename Compare>
+PersistentAVLTree<T, Compare> &
+PersistentAVLTree<T, Compare>::operator=(PersistentAVLTree &&other) noexcept {
+  if (this != &other) {
+    release_(root_);
+    root_ = other.root_;
+    size_ = other.size_;
+    key_comp_ = other.key_comp_;
+    other.root_ = nullptr;
+    other.size_ = 0;
+  }
+  return *this;
+}
+
+template <typename T, typename Compare>
+PersistentAVLTree<T, Compare>::~PersistentAVLTree() {
+  release_(root_);
+}
+
+template <typename T, typename Compare>
+PersistentNode<T> *PersistentAVLTree<T, Compare>::retain_(NodeT *node) {
+  if (node != nullptr) {
+    node->refs_.fetch_add(1, std::memory_order_relaxed);
+  }
+  return node;
+}
+
+// frees node once nothing refers to it, and then its children in turn
+template <typename T, typename Compare>
+void PersistentAVLTree<T, Compare>::release_(NodeT *node) {
+  while (node != nullptr &&
+         node->refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+    release_(node->left_);
+    NodeT *right = node->right_;
+    delete node;
+    node = right;
+  }
+}
+
+/* A node this tree may change. Only the caller's reference leads to a
+ * node counted once, so it is changed in place; a shared node is copied
+ * and the copy takes over the caller's reference.
+ */
+template <typename T, typename Compare>
+PersistentNode<T> *PersistentAVLTree<T, Compare>::own_(NodeT *node) {
+  if (node->refs_.load(std::memory_order_acquire) == 1) {
+    return node;
+  }
+  NodeT *copy = new NodeT{node->key_, retain_(node->left_),
+                          retain_(node->right_), node->height_, {1}};
+  release_(node);
+  return copy;
+}
+
+template <typename T, typename Compare>
+void PersistentAVLTree<T, Compare>::update_height_(NodeT *node) {
+  int left = height_(node->left_);
+  int right = height_(node->right_);
+  node->height_ = 1 + ((left > right) ? left : right);
+}
+
+// both take an owned node and own the child they lift
+template <typename T, typename Compare>
+PersistentNode<T> *PersistentAVLTree<T, Compare>::rotate_left_(NodeT *node) {
+  NodeT *right = own_(node->right_);
+  node->right_ = right->left_;
+  right->left_ = node;
+  update_height_(node);
+  update_height_(right);
+  return right;
+}
+
+template <typename T, typename Compare>
+PersistentNode<T> *PersistentAVLTree<T, Compare>::rotate_right_(NodeT *node) {
+  NodeT *left = own_(node->left_);
+  node->left_ = left->right_;
+  left->right_ = node;
+  update_height_(node);
+  update_height_(left);
+  return left;
+}
+
+template <typename T, typename Compare>
+PersistentNode<T> *PersistentAVLTree<T, Compare>::balance_(NodeT *node) {
+  update_height_(node);
+  int balance = height_(node->left_) - height_(node->right_);
+  if (balance > 1) {
+    if (height_(node->left_->left_) < height_(node->left_->right_)) {
+      node->left_ = rotate_left_(own_(node->left_));
+    }
+    return rotate_right_(node);
+  }
+  if (balance < -1) {
+    if (height_(node->right_->right_) < height_(node->right_->left_)) {
+      node->right_ = rotate_right_(own_(node->right_));
+    }
+    return rotate_left_(node);
+  }
+  return node;
+}
+
+template <typename T, typename Compare>
+template <typename Key>
+PersistentNode<T> *PersistentAVLTree<T, Compare>::insert_(NodeT *node,
+                                                          Key &&key) {
+  if (node == nullptr) {
+    return new NodeT{T(std::forward<Key>(key)), nullptr, nullptr, 1, {1}};
+  }
+  node = own_(node);
+  if (key_comp_.less(key, node->key_)) {
+    node->left_ = insert_(node->left_, std::forward<Key>(key));
+  } else {
+    node->right_ = insert_(node->right_, std::forward<Key>(key));
+  }
+  return balance_(node);
+}
+
+template <typename T, typename Compare>
+template <typename K>
+PersistentNode<T> *PersistentAVLTree<T, Compare>::remove_(NodeT *node,
+                                                          const K &key) {
+  int order = key_comp_.compare(key, node->key_);
+  if (order == 0 && (node->left_ == nullptr || node->right_ == nullptr)) {
+    NodeT *child = retain_((node->left_ != nullptr) ? node->left_
+                                                    : node->right_);
+    release_(node);
+    return child;
+  }
+  node = own_(node);
+  if (order < 0) {
+    node->left_ = remove_(node->left_, key);
+  } else if (order > 0) {
+    node->right_ = remove_(node->right_, key);
+  } else {
+    // the successor takes the place of the key
+    node->right_ = remove_min_(node->right_, node->key_);
+  }
+  return balance_(node);
+}
+
+template <typename T, typename Compare>
+PersistentNode<T> *PersistentAVLTree<T, Compare>::remove_min_(NodeT *node,
+                                                              T &min) {
+  if (node->left_ == nullptr) {
+    min = node->key_;
+    NodeT *right = retain_(node->right_);
+    release_(node);
+    return right;
+  }
+  node = own_(node);
+  node->left_ = remove_min_(node->left_, min);
+  return balance_(node);
+}
+
+// a key that is already there leaves the tree and its sharing alone
+template <typename T, typename Compare>
+template <typename Key>
+void PersistentAVLTree<T, Compare>::insert_key_(Key &&key) {
+  if (find_node_(key) != nullptr) {
+    return;
+  }
+  root_ = insert_(root_, std::forward<Key>(key));
+  ++size_;
+}
+
+template <typename T, typename Compare>
+template <typename K, typename>
+void PersistentAVLTree<T, Compare>::delete_key(const K &key) {
+  if (find_node_(key) == nullptr) {
+    return;
+  }
+  root_ = remove_(root_, key);
+  --size_;
+}
+
+template <typename T, typename Compare>
+void PersistentAVLTree<T, Compare>::clear_tree() {
+  release_(root_);
+  root_ = nullptr;
+  size_ = 0;
+}
+
+template <typename T, typename Compare>
+template <typename K>
+const PersistentNode<T> *
+PersistentAVLTree<T, Compare>::find_node_(const K &key) const {
+  const NodeT *node = root_;
+  while (node != nullptr) {
+    int order = key_comp_.compare(key, node->key_);
+    if (order == 0) {
+      break;
+    }
+    node = (order < 0) ? node->left_ : node->right_;
+  }
+  return node;
+}
+
+template <typename T, typename Compare>
+template <typename K, typename>
+const T *PersistentAVLTree<T, Compare>::find(const K &key) const {
+  const NodeT *node = find_node_(key);
+  return (node != nullptr) ? &node->key_ : nullptr;
+}
+
+// smallest key >= key
+template <typename T, typename Compare>
+template <typename K, typename>
+const T *PersistentAVLTree<T, Compare>::lowerbound(const K &key) const {
+  const NodeT *node = root_;
+  const T *result = nullptr;
+  while (node != nullptr) {
+    if (!key_comp_.less(node->key_, key)) {
+      result = &node->key_;
+      node = node->left_;
+    } else {
+      node = node->right_;
+    }
+  }
+  return result;
+}
+
+// largest key <= key
+template <typename T, typename Compare>
+template <typename K, typename>
+const T *PersistentAVLTree<T, Compare>::upperbound(const K &key) const {
+  const NodeT *node = root_;
+  const T *result = nullptr;
+  while (node != nullptr) {
+    if (!key_comp_.less(key, node->key_)) {
+      result = &node->key_;
+      node = node->right_;
+    } else {
+      node = node->left_;
+    }
+  }
+  return result;
+}
+
+template <typename T, typename Compare>
+template <typename K, typename F, typename>
+void PersistentAVLTree<T, Compare>::for_each_in_range(const K &lo,
+                                                      const K &hi,
+                                                      F &&fn) const {
+  visit_range_(root_, lo, hi, fn);
+}
+
+template <typename T, typename Compare>
+template <typename K, typename F>
+void PersistentAVLTree<T, Compare>::visit_range_(const NodeT *node,
+                                                 const K &lo, const K &hi,
+                                                 F &fn) const {
+  while (node != nullptr) {
+    if (key_comp_.less(node->key_, lo)) {
+      node = node->right_;
+    } else if (key_comp_.less(hi, node->key_)) {
+      node = node->left_;
+    } else {
+      visit_range_(node->left_, lo, hi, fn);
+      fn(static_cast<const T &>(node->key_));
+      node = node->right_;
+    }
+  }
+}
+
+template <typename T, typename Compare>
+std::vector<T> PersistentAVLTree<T, Compare>::in_order() const {
+  std::vector<T> keys;
+  keys.reserve(size_);
+  std::vector<const NodeT *> stack;
+  const NodeT *node = root_;
+  while (node != nullptr || !stack.empty()) {
+    while (node != nullptr) {
+      stack.push_back(node);
+      node = node->left_;
+    }
+    node = stack.back();
+    stack.pop_back();
+    keys.push_back(node->key_);
+    node = node->right_;
+  }
+  return keys;
+}
+
+template <typename T, typename Compare>
+bool PersistentAVLTree<T, Compare>::is_balanced() const {
+  int height = 0;
+  return check_(root_, height);
+}
+
+// stored heights, balance and order of the subtree of node
+template <typename T, typename Compare>
+bool PersistentAVLTree<T, Compare>::check_(const NodeT *node,
+                                           int &height) const {
+  if (node == nullptr) {
+    height = 0;
+    return true;
+  }
+  int left = 0;
+  int right = 0;
+  if (!check_(node->left_, left) || !check_(node->right_, right)) {
+    return false;
+  }
+  if ((node->left_ != nullptr &&
+       !key_comp_.less(node->left_->key_, node->key_)) ||
+      (node->right_ != nullptr &&
+       !key_comp_.less(node->key_, node->right_->key_))) {
+    return false;
+  }
+  height = 1 + ((left > right) ? left : right);
+  return height == node->height_ && left - right <= 1 && right - left <= 1;
+}
@@ -0,0 +1,482 @@
+#pragma once
+
+#include "avltree.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/* a shard is split once it holds SHARD_SPLIT_RATIO times the keys of
+ * an average shard, and not before it has SHARD_MIN_SPLIT_SIZE keys
+ */
+#define SHARD_SPLIT_RATIO 2
+#define SHARD_MIN_SPLIT_SIZE 1024
+/* operations announce themselves on one of SHARD_READER_SLOTS counters,
+ * each on its own cache line, picked per thread
+ */
+#define SHARD_READER_SLOTS 16
+
+/* Set of keys split into key ranges (shards), each an AVLTree behind
+ * its own lock, so that threads working on different ranges do not
+ * wait for each other.
+ *
+ * Point operations lock the one shard that owns the key. Range queries
+ * and iteration walk the shards in key order, locking one shard at a
+ * time: each shard is seen at one moment, the whole set is not.
+ *
+ * The ranges follow the keys. The tree starts with one shard and splits
+ * shards at their median as keys come in. Once it has as many shards as
+ * asked for, a shard is split when it grows to SHARD_SPLIT_RATIO times
+ * the average, and the two neighbours with the fewest keys are joined.
+ * The shards keep order statistics, so finding the median, splitting
+ * and joining are all O(log n) in the size of the shard.
+ *
+ * Nothing is shared by all operations but reads. Each shard counts its
+ * own keys and get_size() adds them up. The boundaries carry a layout
+ * version which is odd while a rebalance changes them. An operation
+ * adds itself to the counter of its reader slot and goes on if the
+ * version is even; a rebalance makes the version odd, waits for all
+ * counters to drop to zero and makes it even again when done. So an
+ * operation only writes a counter that the threads sharing its slot
+ * write, and waits only while a rebalance is running.
+ *
+ * Lookups return copies of the keys, since the shard is unlocked when
+ * they return.
+ */
+template <typename T, typename Compare = std::less<T>> class ShardedAVLTree {
+  // lookups take any key type with a transparent Compare, see AVLTree
+  template <typename K>
+  using lookup_key_t =
+      std::enable_if_t<std::is_same_v<K, T> || is_transparent<Compare>::value>;
+
+public:
+  using value_type = T;
+  using size_type = size_t;
+  using key_compare = Compare;
+  using tree_type = AVLTree<T, NodePool, OrderStatistics, Compare>;
+
+  explicit ShardedAVLTree(size_t shards = default_shards(),
+                          const Compare &comp = Compare());
+  // starts with bounds.size() + 1 shards, split at the sorted bounds
+  explicit ShardedAVLTree(std::vector<T> bounds,
+                          const Compare &comp = Compare());
+  ShardedAVLTree(const ShardedAVLTree &) = delete;
+  ShardedAVLTree &operator=(const ShardedAVLTree &) = delete;
+
+  void insert(const T &key);
+  void delete_key(const T &key) { delete_key<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  void delete_key(const K &key);
+
+  bool contains(const T &key) const { return contains<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  bool contains(const K &key) const;
+  std::optional<T> find(const T &key) const { return find<T>(key); }
+  template <typename K, typename = lookup_key_t<K>>
+  std::optional<T> find(const K &key) const;
+  std::optional<T> lowerbound(const T &key) const {
+    return lowerbound<T>(key);
+  }
+  template <typename K, typename = lookup_key_t<K>>
+  std::optional<T> lowerbound(const K &key) const;
+  std::optional<T> upperbound(const T &key) const {
+    return upperbound<T>(key);
+  }
+  template <typename K, typename = lookup_key_t<K>>
+  std::optional<T> upperbound(const K &key) const;
+  template <typename F>
+  void for_each_in_range(const T &lo, const T &hi, F &&fn) const {
+    for_each_in_range<T, F>(lo, hi, std::forward<F>(fn));
+  }
+  template <typename K, typename F, typename = lookup_key_t<K>>
+  void for_each_in_range(const K &lo, const K &hi, F &&fn) const;
+  template <typename F> void for_each(F &&fn) const;
+  std::vector<T> in_order() const;
+  void clear_tree();
+
+  size_t get_size() const;
+  bool is_empty() const { return get_size() == 0; }
+  size_t get_shard_count() const;
+  std::vector<size_t> get_shard_sizes() const;
+  bool is_balanced() const;
+
+  static size_t default_shards() {
+    unsigned cores = std::thread::hardware_concurrency();
+    return 4 * ((cores > 0) ? cores : 1);
+  }
+
+private:
+  // on its own cache lines, so that locking one does not slow the next
+  struct alignas(64) Shard {
+    explicit Shard(const Compare &comp)
+        : tree(comp), size{0}, split_at{SHARD_MIN_SPLIT_SIZE} {}
+    tree_type tree;
+    mutable std::shared_mutex mutex;
+    // tree.get_size(), readable without the lock
+    std::atomic<size_t> size;
+    // under the lock: the size at which to check whether to split
+    size_t split_at;
+  };
+
+  struct alignas(64) ReaderSlot {
+    std::atomic<size_t> count{0};
+  };
+
+  // held by every operation, makes it wait for a rebalance first
+  class LayoutLock {
+  public:
+    explicit LayoutLock(const ShardedAVLTree &tree);
+    ~LayoutLock() { slot_.fetch_sub(1, std::memory_order_release); }
+
+  private:
+    std::atomic<size_t> &slot_;
+  };
+
+  static size_t reader_slot_();
+
+  template <typename K> size_t route_(const K &key) const;
+  size_t split_threshold_() const;
+  void rebalance_();
+
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::vector<T> bounds_; // bounds_[i] is the least key of shard i + 1
+  size_t max_shards_;
+  std::atomic<size_t> layout_version_; // odd while rebalancing
+  mutable ReaderSlot readers_[SHARD_READER_SLOTS];
+  KeyCompare<T, Compare> key_comp_;
+};
+
+template <typename T, typename Compare>
+ShardedAVLTree<T, Compare>::ShardedAVLTree(size_t shards,
+                                           const Compare &comp)
+    : max_shards_{(shards > 0) ? shards : 1}, layout_version_{0},
+      key_comp_{comp} {
+  // more shards come with the keys
+  shards_.push_back(std::make_unique<Shard>(comp));
+}
+
+template <typename T, typename Compare>
+ShardedAVLTree<T, Compare>::ShardedAVLTree(std::vector<T> bounds,
+                                           const Compare &comp)
+    : bounds_(std::move(bounds)), max_shards_{bounds_.size() + 1},
+      layout_version_{0}, key_comp_{comp} {
+  auto less = [this](const T &a, const T &b) { return key_comp_.less(a, b); };
+  std::sort(bounds_.begin(), bounds_.end(), less);
+  bounds_.erase(std::unique(bounds_.begin(), bounds_.end(),
+                            [&less](const T &a, const T &b) {
+                              return !less(a, b) && !less(b, a);
+                            }),
+                bounds_.end());
+  max_shards_ = bounds_.size() + 1;
+  for (size_t i = 0; i < max_shards_; ++i) {
+    shards_.push_back(std::make_unique<Shard>(comp));
+  }
+}
+
+template <typename T, typename Compare>
+ShardedAVLTree<T, Compare>::LayoutLock::LayoutLock(const ShardedAVLTree &tree)
+    : slot_{tree.readers_[reader_slot_()].count} {
+  // seq_cst on both sides: either the rebalance sees the count or this
+  // sees the odd version
+  slot_.fetch_add(1);
+  while (tree.layout_version_.load() % 2 == 1) {
+    slot_.fetch_sub(1, std::memory_order_release);
+    while (tree.layout_version_.load(std::memory_order_acquire) % 2 == 1) {
+      std::this_thread::yield();
+    }
+    slot_.fetch_add(1);
+  }
+}
+
+// threads take the slots in turn, so the first ones never share
+template <typename T, typename Compare>
+size_t ShardedAVLTree<T, Compare>::reader_slot_() {
+  static std::atomic<size_t> next_slot{0};
+  thread_local size_t slot =
+      next_slot.fetch_add(1, std::memory_order_relaxed) % SHARD_READER_SLOTS;
+  return slot;
+}
+
+template <typename T, typename Compare>
+size_t ShardedAVLTree<T, Compare>::get_size() const {
+  LayoutLock layout(*this);
+  size_t size = 0;
+  for (const std::unique_ptr<Shard> &shard : shards_) {
+    size += shard->size.load(std::memory_order_relaxed);
+  }
+  return size;
+}
+
+// index of the shard that owns key, under the layout lock
+template <typename T, typename Compare>
+template <typename K>
+size_t ShardedAVLTree<T, Compare>::route_(const K &key) const {
+  auto it = std::upper_bound(
+      bounds_.begin(), bounds_.end(), key,
+      [this](const K &k, const T &bound) { return key_comp_.less(k, bound); });
+  return static_cast<size_t>(it - bounds_.begin());
+}
+
+/* Smallest size of a shard that is to be split, under the layout lock.
+ * While shards are missing, any shard above the average is split.
+ *
+ * It adds up the sizes of all shards, whose cache lines the inserts into
+ * them keep writing, so an insert only calls it when its shard reaches
+ * the split_at kept with the shard. If the total grew meanwhile, the
+ * shard just gets a new split_at; if it shrank, the split waits for the
+ * next rebalance, which sets split_at anew for every shard.
+ */
+template <typename T, typename Compare>
+size_t ShardedAVLTree<T, Compare>::split_threshold_() const {
+  size_t ratio = (shards_.size() < max_shards_) ? 1 : SHARD_SPLIT_RATIO;
+  size_t size = 0;
+  for (const std::unique_ptr<Shard> &shard : shards_) {
+    size += shard->size.load(std::memory_order_relaxed);
+  }
+  return std::max<size_t>(SHARD_MIN_SPLIT_SIZE,
+                          ratio * size / max_shards_ + 1);
+}
+
+template <typename T, typename Compare>
+void ShardedAVLTree<T, Compare>::insert(const T &key) {
+  bool oversized;
+  {
+    LayoutLock layout(*this);
+    Shard &shard = *shards_[route_(key)];
+    std::unique_lock<std::shared_mutex> lock(shard.mutex);
+    size_t old_size = shard.tree.get_size();
+    shard.tree.insert(key);
+    if (shard.tree.get_size() == old_size) {
+      return;
+    }
+    shard.size.store(old_size + 1, std::memory_order_relaxed);
+    if (old_size + 1 < shard.split_at) {
+      return;
+    }
+    shard.split_at = split_threshold_();
+    oversized = old_size + 1 >= shard.split_at;
+  }
+  if (oversized) {
+    rebalance_();
+  }
+}
+
+template <typename T, typename Compare>
+template <typename K, typename>
+void ShardedAVLTree<T, Compare>::delete_key(const K &key) {
+  LayoutLock layout(*this);
+  Shard &shard = *shards_[route_(key)];
+  std::unique_lock<std::shared_mutex> lock(shard.mutex);
+  size_t old_size = shard.tree.get_size();
+  shard.tree.delete_key(key);
+  if (shard.tree.get_size() != old_size) {
+    shard.size.store(old_size - 1, std::memory_order_relaxed);
+  }
+}
+
+/* Splits the largest shard if it is still oversized, then joins the
+ * smallest neighbours if that made one shard too many. Operations that
+ * raced for the same rebalance find nothing left to do.
+ */
+template <typename T, typename Compare>
+void ShardedAVLTree<T, Compare>::rebalance_() {
+  size_t version = layout_version_.load(std::memory_order_relaxed);
+  if (version % 2 == 1 ||
+      !layout_version_.compare_exchange_strong(version, version + 1)) {
+    return; // another thread is on it
+  }
+  for (ReaderSlot &slot : readers_) {
+    while (slot.count.load() != 0) {
+      std::this_thread::yield();
+    }
+  }
+  {
+    size_t largest = 0;
+    for (size_t i = 1; i < shards_.size(); ++i) {
+      if (shards_[i]->tree.get_size() > shards_[largest]->tree.get_size()) {
+        largest = i;
+      }
+    }
+    tree_type &tree = shards_[largest]->tree;
+    if (tree.get_size() >= split_threshold_()) {
+      T bound = tree.select(tree.get_size() / 2)->get_key();
+      auto [less, greater] = tree.split(bound);
+      tree = std::move(less);
+      shards_[largest]->size.store(tree.get_size(), std::memory_order_relaxed);
+      auto shard = std::make_unique<Shard>(key_comp_.get());
+      shard->tree = std::move(greater);
+      shard->size.store(shard->tree.get_size(), std::memory_order_relaxed);
+      shards_.insert(shards_.begin() + largest + 1, std::move(shard));
+      bounds_.insert(bounds_.begin() + largest, std::move(bound));
+    }
+    if (shards_.size() > max_shards_) {
+      size_t smallest = 0;
+      size_t smallest_size = SIZE_MAX;
+      for (size_t i = 0; i + 1 < shards_.size(); ++i) {
+        size_t pair_size =
+            shards_[i]->tree.get_size() + shards_[i + 1]->tree.get_size();
+        if (pair_size < smallest_size) {
+          smallest = i;
+          smallest_size = pair_size;
+        }
+      }
+      shards_[smallest]->tree =
+          tree_type::join(std::move(shards_[smallest]->tree),
+                          std::move(shards_[smallest + 1]->tree));
+      shards_[smallest]->size.store(smallest_size, std::memory_order_relaxed);
+      shards_.erase(shards_.begin() + smallest + 1);
+      bounds_.erase(bounds_.begin() + smallest);
+    }
+    size_t split_at = split_threshold_();
+    for (const std::unique_ptr<Shard> &shard : shards_) {
+      shard->split_at = split_at;
+    }
+  }
+  layout_version_.store(version + 2, std::memory_order_release);
+}
+
+template <typename T, typename Compare>
+template <typename K, typename>
+bool ShardedAVLTree<T, Compare>::contains(const K &key) const {
+  LayoutLock layout(*this);
+  Shard &shard = *shards_[route_(key)];
+  std::shared_lock<std::shared_mutex> lock(shard.mutex);
+  return shard.tree.find(key) != nullptr;
+}
+
+template <typename T, typename Compare>
+template <typename K, typename>
+std::optional<T> ShardedAVLTree<T, Compare>::find(const K &key) const {
+  LayoutLock layout(*this);
+  Shard &shard = *shards_[route_(key)];
+  std::shared_lock<std::shared_mutex> lock(shard.mutex);
+  auto *node = shard.tree.find(key);
+  return (node != nullptr) ? std::optional<T>(node->get_key()) : std::nullopt;
+}
+
+// smallest key >= key, looking on in the next shards if need be
+template <typename T, typename Compare>
+template <typename K, typename>
+std::optional<T> ShardedAVLTree<T, Compare>::lowerbound(const K &key) const {
+  LayoutLock layout(*this);
+  for (size_t i = route_(key); i < shards_.size(); ++i) {
+    Shard &shard = *shards_[i];
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    if (auto *node = shard.tree.lowerbound(key)) {
+      return node->get_key();
+    }
+  }
+  return std::nullopt;
+}
+
+// largest key <= key, looking on in the previous shards if need be
+template <typename T, typename Compare>
+template <typename K, typename>
+std::optional<T> ShardedAVLTree<T, Compare>::upperbound(const K &key) const {
+  LayoutLock layout(*this);
+  for (size_t i = route_(key) + 1; i-- > 0;) {
+    Shard &shard = *shards_[i];
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    if (auto *node = shard.tree.upperbound(key)) {
+      return node->get_key();
+    }
+  }
+  return std::nullopt;
+}
+
+template <typename T, typename Compare>
+template <typename K, typename F, typename>
+void ShardedAVLTree<T, Compare>::for_each_in_range(const K &lo, const K &hi,
+                                                   F &&fn) const {
+  if (key_comp_.less(hi, lo)) {
+    return;
+  }
+  LayoutLock layout(*this);
+  size_t last = route_(hi);
+  for (size_t i = route_(lo); i <= last; ++i) {
+    Shard &shard = *shards_[i];
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    shard.tree.for_each_in_range(lo, hi, fn);
+  }
+}
+
+// fn must not call back into the tree
+template <typename T, typename Compare>
+template <typename F>
+void ShardedAVLTree<T, Compare>::for_each(F &&fn) const {
+  LayoutLock layout(*this);
+  for (const std::unique_ptr<Shard> &shard : shards_) {
+    std::shared_lock<std::shared_mutex> lock(shard->mutex);
+    for (const T &key : shard->tree) {
+      fn(key);
+    }
+  }
+}
+
+template <typename T, typename Compare>
+std::vector<T> ShardedAVLTree<T, Compare>::in_order() const {
+  std::vector<T> keys;
+  keys.reserve(get_size());
+  for_each([&keys](const T &key) { keys.push_back(key); });
+  return keys;
+}
+
+// keeps the boundaries
+template <typename T, typename Compare>
+void ShardedAVLTree<T, Compare>::clear_tree() {
+  LayoutLock layout(*this);
+  for (const std::unique_ptr<Shard> &shard : shards_) {
+    std::unique_lock<std::shared_mutex> lock(shard->mutex);
+    shard->tree.clear_tree();
+    shard->size.store(0, std::memory_order_relaxed);
+    shard->split_at = SHARD_MIN_SPLIT_SIZE;
+  }
+}
+
+template <typename T, typename Compare>
+size_t ShardedAVLTree<T, Compare>::get_shard_count() const {
+  LayoutLock layout(*this);
+  return shards_.size();
+}
+
+template <typename T, typename Compare>
+std::vector<size_t> ShardedAVLTree<T, Compare>::get_shard_sizes() const {
+  LayoutLock layout(*this);
+  std::vector<size_t> sizes;
+  for (const std::unique_ptr<Shard> &shard : shards_) {
+    std::shared_lock<std::shared_mutex> lock(shard->mutex);
+    sizes.push_back(shard->tree.get_size());
+  }
+  return sizes;
+}
+
+// every shard is balanced and holds only keys of its own range
+template <typename T, typename Compare>
+bool ShardedAVLTree<T, Compare>::is_balanced() const {
+  LayoutLock layout(*this);
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    Shard &shard = *shards_[i];
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    if (!shard.tree.is_balanced()) {
+      return false;
+    }
+    if (shard.tree.is_empty()) {
+      continue;
+    }
+    if ((i > 0 &&
+         key_comp_.less(shard.tree.get_min()->get_key(), bounds_[i - 1])) ||
+        (i < bounds_.size() &&
+         !key_comp_.less(shard.tree.get_max()->get_key(), bounds_[i]))) {
+      return false;
+    }
+  }
+  return true;
+}
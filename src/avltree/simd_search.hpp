@@ -0,0 +1,241 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AVLTREE_HAS_X86_SIMD 1
+#define AVLTREE_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+/* Searches over blocked arrays of arithmetic keys, for the blocked
+ * layout of FrozenAVLTree.
+ *
+ * Keys are grouped into blocks of one cache line, BLOCK_KEYS keys each,
+ * which form a static B-tree (an "S-tree"): block k has the BLOCK_KEYS
+ * + 1 children k * (BLOCK_KEYS + 1) + 1 + i. A search compares the key
+ * with a whole block at once, counts the keys below it and takes that
+ * child, so it reads one cache line per level of a tree about four
+ * times shallower than a binary one.
+ *
+ * The counting uses AVX2 or SSE4.2 when the CPU has them, picked at run
+ * time, and plain code otherwise. Keys of 32 and 64 bits and floating
+ * point keys have vector versions; narrower integers use plain code,
+ * which compilers vectorize on their own.
+ */
+enum class SimdLevel { scalar, sse42, avx2 };
+
+// best instruction set of this CPU, checked once
+inline SimdLevel detect_simd_level() {
+#ifdef AVLTREE_HAS_X86_SIMD
+  static const SimdLevel level = __builtin_cpu_supports("avx2")
+                                     ? SimdLevel::avx2
+                                 : __builtin_cpu_supports("sse4.2")
+                                     ? SimdLevel::sse42
+                                     : SimdLevel::scalar;
+  return level;
+#else
+  return SimdLevel::scalar;
+#endif
+}
+
+// arithmetic keys can be blocked, under the default ordering only
+template <typename T, typename Compare>
+struct is_blockable
+    : std::bool_constant<std::is_arithmetic_v<T> &&
+                         !std::is_same_v<T, bool> &&
+                         (std::is_same_v<Compare, std::less<T>> ||
+                          std::is_same_v<Compare, std::less<>>)> {};
+
+// keys with a vector version of the block search
+template <typename T>
+struct has_simd_rank
+    : std::bool_constant<std::is_same_v<T, float> ||
+                         std::is_same_v<T, double> ||
+                         (std::is_integral_v<T> &&
+                          (sizeof(T) == 4 || sizeof(T) == 8))> {};
+
+template <typename T>
+inline constexpr size_t BLOCK_KEYS = (sizeof(T) < 64) ? 64 / sizeof(T) : 1;
+
+inline constexpr size_t NO_SLOT = SIZE_MAX;
+
+/* Descends the S-tree to the smallest key >= key, or with Inclusive to
+ * the largest key <= key. rank(block, key) counts the keys of the block
+ * below key (Inclusive: not above key). Returns the slot of the key
+ * found or NO_SLOT.
+ */
+template <bool Inclusive, typename T, typename K, typename Rank>
+inline size_t stree_descend(const T *keys, size_t block_count, const K &key,
+                            const Rank &rank) {
+  constexpr size_t B = BLOCK_KEYS<T>;
+  size_t found = NO_SLOT;
+  size_t block = 0;
+  while (block < block_count) {
+    size_t below = rank(keys + block * B, key);
+    if (Inclusive ? below > 0 : below < B) {
+      found = block * B + below - (Inclusive ? 1 : 0);
+    }
+    block = block * (B + 1) + below + 1;
+  }
+  return found;
+}
+
+template <bool Inclusive> struct ScalarRank {
+  template <typename T> size_t operator()(const T *block, T key) const {
+    size_t below = 0;
+    for (size_t i = 0; i < BLOCK_KEYS<T>; ++i) {
+      below += Inclusive ? !(key < block[i]) : (block[i] < key);
+    }
+    return below;
+  }
+};
+
+#ifdef AVLTREE_HAS_X86_SIMD
+
+/* Vector versions. Integers are compared with cmpgt, which only exists
+ * for signed lanes, so unsigned keys get their top bit flipped first.
+ * Each comparison leaves a bit per key in a mask and the answer is the
+ * number of bits set.
+ */
+template <bool Inclusive> struct Sse42Rank {
+  template <typename T>
+  AVLTREE_TARGET("sse4.2,popcnt")
+  size_t operator()(const T *block, T key) const {
+    constexpr size_t B = BLOCK_KEYS<T>;
+    unsigned mask = 0;
+    if constexpr (std::is_same_v<T, float>) {
+      __m128 k = _mm_set1_ps(key);
+      for (size_t i = 0; i < B; i += 4) {
+        __m128 v = _mm_loadu_ps(block + i);
+        __m128 c = Inclusive ? _mm_cmple_ps(v, k) : _mm_cmplt_ps(v, k);
+        mask |= unsigned(_mm_movemask_ps(c)) << i;
+      }
+      return __builtin_popcount(mask);
+    } else if constexpr (std::is_same_v<T, double>) {
+      __m128d k = _mm_set1_pd(key);
+      for (size_t i = 0; i < B; i += 2) {
+        __m128d v = _mm_loadu_pd(block + i);
+        __m128d c = Inclusive ? _mm_cmple_pd(v, k) : _mm_cmplt_pd(v, k);
+        mask |= unsigned(_mm_movemask_pd(c)) << i;
+      }
+      return __builtin_popcount(mask);
+    } else {
+      constexpr bool wide = sizeof(T) == 8;
+      __m128i flip = _mm_setzero_si128();
+      if constexpr (std::is_unsigned_v<T>) {
+        flip = wide ? _mm_set1_epi64x(INT64_MIN) : _mm_set1_epi32(INT32_MIN);
+      }
+      __m128i k = wide ? _mm_set1_epi64x(int64_t(key))
+                       : _mm_set1_epi32(int32_t(key));
+      k = _mm_xor_si128(k, flip);
+      for (size_t i = 0; i < B; i += 16 / sizeof(T)) {
+        __m128i v =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(block + i));
+        v = _mm_xor_si128(v, flip);
+        // Inclusive counts the keys that are not above key
+        __m128i above =
+            wide ? (Inclusive ? _mm_cmpgt_epi64(v, k) : _mm_cmpgt_epi64(k, v))
+                 : (Inclusive ? _mm_cmpgt_epi32(v, k) : _mm_cmpgt_epi32(k, v));
+        unsigned bits = wide ? _mm_movemask_pd(_mm_castsi128_pd(above))
+                             : _mm_movemask_ps(_mm_castsi128_ps(above));
+        mask |= bits << i;
+      }
+      size_t count = __builtin_popcount(mask);
+      return Inclusive ? B - count : count;
+    }
+  }
+};
+
+template <bool Inclusive> struct Avx2Rank {
+  template <typename T>
+  AVLTREE_TARGET("avx2,popcnt")
+  size_t operator()(const T *block, T key) const {
+    constexpr size_t B = BLOCK_KEYS<T>;
+    unsigned mask = 0;
+    if constexpr (std::is_same_v<T, float>) {
+      __m256 k = _mm256_set1_ps(key);
+      for (size_t i = 0; i < B; i += 8) {
+        __m256 v = _mm256_loadu_ps(block + i);
+        __m256 c = _mm256_cmp_ps(v, k, Inclusive ? _CMP_LE_OQ : _CMP_LT_OQ);
+        mask |= unsigned(_mm256_movemask_ps(c)) << i;
+      }
+      return __builtin_popcount(mask);
+    } else if constexpr (std::is_same_v<T, double>) {
+      __m256d k = _mm256_set1_pd(key);
+      for (size_t i = 0; i < B; i += 4) {
+        __m256d v = _mm256_loadu_pd(block + i);
+        __m256d c = _mm256_cmp_pd(v, k, Inclusive ? _CMP_LE_OQ : _CMP_LT_OQ);
+        mask |= unsigned(_mm256_movemask_pd(c)) << i;
+      }
+      return __builtin_popcount(mask);
+    } else {
+      constexpr bool wide = sizeof(T) == 8;
+      __m256i flip = _mm256_setzero_si256();
+      if constexpr (std::is_unsigned_v<T>) {
+        flip = wide ? _mm256_set1_epi64x(INT64_MIN)
+                    : _mm256_set1_epi32(INT32_MIN);
+      }
+      __m256i k = wide ? _mm256_set1_epi64x(int64_t(key))
+                       : _mm256_set1_epi32(int32_t(key));
+      k = _mm256_xor_si256(k, flip);
+      for (size_t i = 0; i < B; i += 32 / sizeof(T)) {
+        __m256i v =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(block + i));
+        v = _mm256_xor_si256(v, flip);
+        __m256i above = wide ? (Inclusive ? _mm256_cmpgt_epi64(v, k)
+                                          : _mm256_cmpgt_epi64(k, v))
+                             : (Inclusive ? _mm256_cmpgt_epi32(v, k)
+                                          : _mm256_cmpgt_epi32(k, v));
+        unsigned bits = wide ? _mm256_movemask_pd(_mm256_castsi256_pd(above))
+                             : _mm256_movemask_ps(_mm256_castsi256_ps(above));
+        mask |= bits << i;
+      }
+      size_t count = __builtin_popcount(mask);
+      return Inclusive ? B - count : count;
+    }
+  }
+};
+
+/* The whole descent is compiled once per instruction set, with the
+ * block search inlined into it (flatten), so the only run-time dispatch
+ * is one switch per lookup.
+ */
+template <bool Inclusive, typename T>
+AVLTREE_TARGET("sse4.2,popcnt")
+__attribute__((flatten)) size_t
+stree_find_sse42(const T *keys, size_t block_count, T key) {
+  return stree_descend<Inclusive>(keys, block_count, key,
+                                  Sse42Rank<Inclusive>());
+}
+
+template <bool Inclusive, typename T>
+AVLTREE_TARGET("avx2,popcnt")
+__attribute__((flatten)) size_t
+stree_find_avx2(const T *keys, size_t block_count, T key) {
+  return stree_descend<Inclusive>(keys, block_count, key,
+                                  Avx2Rank<Inclusive>());
+}
+
+#endif
+
+template <bool Inclusive, typename T>
+size_t stree_find(const T *keys, size_t block_count, T key,
+                  SimdLevel level) {
+  (void)level;
+#ifdef AVLTREE_HAS_X86_SIMD
+  if constexpr (has_simd_rank<T>::value) {
+    switch (level) {
+    case SimdLevel::avx2:
+      return stree_find_avx2<Inclusive>(keys, block_count, key);
+    case SimdLevel::sse42:
+      return stree_find_sse42<Inclusive>(keys, block_count, key);
+    case SimdLevel::scalar:
+      break;
+    }
+  }
+#endif
+  return stree_descend<Inclusive>(keys, block_count, key,
+                                  ScalarRank<Inclusive>());
+}
@@ -0,0 +1,417 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <type_traits>
+#include <unistd.h>
+#include <utility>
+
+// bumped whenever the layout below changes; older images are refused
+#define SNAPSHOT_VERSION 1
+
+// bytes collected before each write of AVLTree::save
+#define SNAPSHOT_WRITE_CHUNK (1 << 20)
+
+/* Binary image of a tree, see AVLTree::save and AVLTree::load.
+ *
+ *   SnapshotHeader   64 bytes
+ *   keys             count keys in ascending order
+ *
+ * The keys are the in-order of the tree. Its shape is not stored: the
+ * only structure recorded is SnapshotShape::balanced, the perfectly
+ * balanced tree over the keys (the left subtree of a range holds its
+ * first half). load builds exactly that tree in linear time and a binary
+ * search of the array, as MappedAVLTree does, walks the same tree
+ * without any node.
+ *
+ * Keys of a trivially copyable T are their bytes in host order, so the
+ * array can be used in place from a mapping of the file. Others are
+ * written by SnapshotSerializer<T>, and read back one by one on load.
+ *
+ * Both the header and the keys are checksummed. The image is written to
+ * path + ".tmp", flushed to disk and renamed over path, so a crash
+ * during save leaves the previous image whole.
+ */
+enum class SnapshotShape : uint32_t { balanced = 0 };
+
+struct SnapshotHeader {
+  char magic[8];           // "AVLSNAP" with its terminating zero
+  uint32_t version;        // SNAPSHOT_VERSION
+  uint32_t byte_order;     // 0x01020304 as written by the host
+  uint32_t shape;          // a SnapshotShape
+  uint32_t raw_keys;       // 1 when the keys are their bytes
+  uint64_t key_size;       // sizeof(T) for raw keys, 0 otherwise
+  uint64_t count;          // number of keys
+  uint64_t payload_bytes;  // bytes after the header
+  uint64_t payload_sum;    // SnapshotChecksum of those bytes
+  uint64_t header_sum;     // of the header with this field zeroed
+};
+static_assert(sizeof(SnapshotHeader) == 64, "the keys start on a 64B line");
+
+/* How a key that is not trivially copyable goes to and comes from an
+ * image: write appends its bytes to out, read decodes a key starting at
+ * in, moves in past it and throws std::runtime_error if the key would
+ * end after end. Strings are provided, other key types specialize it.
+ */
+template <typename T, typename = void> struct SnapshotSerializer;
+
+// the length as 8 bytes, then the characters
+template <typename C, typename Traits, typename A>
+struct SnapshotSerializer<std::basic_string<C, Traits, A>> {
+  using string_type = std::basic_string<C, Traits, A>;
+
+  static void write(const string_type &key, std::string &out) {
+    uint64_t length = key.size();
+    out.append(reinterpret_cast<const char *>(&length), sizeof(length));
+    out.append(reinterpret_cast<const char *>(key.data()),
+               key.size() * sizeof(C));
+  }
+
+  static string_type read(const char *&in, const char *end) {
+    uint64_t length;
+    if (static_cast<size_t>(end - in) < sizeof(length)) {
+      throw std::runtime_error("snapshot: truncated key");
+    }
+    std::memcpy(&length, in, sizeof(length));
+    in += sizeof(length);
+    if (length > static_cast<size_t>(end - in) / sizeof(C)) {
+      throw std::runtime_error("snapshot: truncated key");
+    }
+    string_type key(length, C{});
+    std::memcpy(key.data(), in, length * sizeof(C));
+    in += length * sizeof(C);
+    return key;
+  }
+};
+
+/* 64-bit checksum of a byte stream, fed in pieces of any size.
+ *
+ * Four independent lanes each take every fourth 8-byte word with a
+ * multiply and a rotation, so the checksum keeps up with memory
+ * bandwidth; the lanes, the tail and the length are folded together at
+ * the end. It catches torn and corrupted files, it is not meant to
+ * resist tampering.
+ */
+class SnapshotChecksum {
+public:
+  void update(const void *data, size_t bytes);
+  uint64_t value() const;
+
+private:
+  static constexpr uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+  static constexpr uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+  static constexpr size_t STRIPE = 32;
+
+  static uint64_t rotl_(uint64_t x, int bits) {
+    return (x << bits) | (x >> (64 - bits));
+  }
+  static uint64_t mix_(uint64_t lane, uint64_t word) {
+    return rotl_(lane + word * PRIME2, 31) * PRIME1;
+  }
+  void stripe_(const unsigned char *data);
+
+  uint64_t lanes_[4] = {PRIME1 + PRIME2, PRIME2, 0, 0 - PRIME1};
+  unsigned char pending_[STRIPE];
+  size_t pending_bytes_ = 0;
+  uint64_t total_bytes_ = 0;
+};
+
+inline void SnapshotChecksum::stripe_(const unsigned char *data) {
+  for (int lane = 0; lane < 4; ++lane) {
+    uint64_t word;
+    std::memcpy(&word, data + 8 * lane, sizeof(word));
+    lanes_[lane] = mix_(lanes_[lane], word);
+  }
+}
+
+inline void SnapshotChecksum::update(const void *data, size_t bytes) {
+  const unsigned char *in = static_cast<const unsigned char *>(data);
+  total_bytes_ += bytes;
+  if (pending_bytes_ != 0) {
+    size_t take = std::min(bytes, STRIPE - pending_bytes_);
+    std::memcpy(pending_ + pending_bytes_, in, take);
+    pending_bytes_ += take;
+    in += take;
+    bytes -= take;
+    if (pending_bytes_ < STRIPE) {
+      return;
+    }
+    stripe_(pending_);
+    pending_bytes_ = 0;
+  }
+  for (; bytes >= STRIPE; in += STRIPE, bytes -= STRIPE) {
+    stripe_(in);
+  }
+  std::memcpy(pending_, in, bytes);
+  pending_bytes_ = bytes;
+}
+
+inline uint64_t SnapshotChecksum::value() const {
+  uint64_t hash = rotl_(lanes_[0], 1) + rotl_(lanes_[1], 7) +
+                  rotl_(lanes_[2], 12) + rotl_(lanes_[3], 18);
+  unsigned char tail[STRIPE] = {};
+  std::memcpy(tail, pending_, pending_bytes_);
+  for (size_t i = 0; i < STRIPE; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, tail + i, sizeof(word));
+    hash = mix_(hash, word);
+  }
+  hash ^= total_bytes_;
+  hash ^= hash >> 33;
+  hash *= PRIME2;
+  hash ^= hash >> 29;
+  hash *= PRIME1;
+  return hash ^ (hash >> 32);
+}
+
+// read-only (or private copy-on-write) mapping of a whole file
+class MappedFile {
+public:
+  MappedFile(const std::string &path, bool writable, int advice);
+  MappedFile(MappedFile &&other) noexcept
+      : data_{std::exchange(other.data_, nullptr)},
+        size_{std::exchange(other.size_, 0)} {}
+  MappedFile &operator=(MappedFile &&other) noexcept {
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    return *this;
+  }
+  ~MappedFile() {
+    if (data_ != nullptr) {
+      munmap(data_, size_);
+    }
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  char *data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  char *data_;
+  size_t size_;
+};
+
+/* advice is passed to madvise, MADV_SEQUENTIAL for a single pass over
+ * the file and MADV_RANDOM or MADV_NORMAL for lookups. Changes to a
+ * writable mapping stay in this process.
+ */
+inline MappedFile::MappedFile(const std::string &path, bool writable,
+                              int advice)
+    : data_{nullptr}, size_{0} {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::system_error(errno, std::generic_category(),
+                            "snapshot: cannot open " + path);
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0) {
+    int error = errno;
+    close(fd);
+    throw std::system_error(error, std::generic_category(),
+                            "snapshot: cannot stat " + path);
+  }
+  size_ = static_cast<size_t>(info.st_size);
+  if (size_ < sizeof(SnapshotHeader)) {
+    close(fd);
+    throw std::runtime_error("snapshot: " + path + " is too short");
+  }
+  int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+  void *address = mmap(nullptr, size_, protection, MAP_PRIVATE, fd, 0);
+  int error = errno;
+  close(fd); // the mapping keeps the file
+  if (address == MAP_FAILED) {
+    throw std::system_error(error, std::generic_category(),
+                            "snapshot: cannot map " + path);
+  }
+  data_ = static_cast<char *>(address);
+  madvise(data_, size_, advice);
+}
+
+namespace snapshot_detail {
+
+inline uint64_t header_sum(SnapshotHeader header) {
+  header.header_sum = 0;
+  SnapshotChecksum sum;
+  sum.update(&header, sizeof(header));
+  return sum.value();
+}
+
+/* Checks the header of file against a tree of T and returns it; with
+ * verify the keys are checksummed as well, which reads the whole file.
+ */
+template <typename T>
+SnapshotHeader check_header(const MappedFile &file, bool verify) {
+  constexpr bool raw = std::is_trivially_copyable_v<T>;
+  SnapshotHeader header;
+  std::memcpy(&header, file.data(), sizeof(header));
+  if (std::memcmp(header.magic, "AVLSNAP", 8) != 0) {
+    throw std::runtime_error("snapshot: not a tree image");
+  }
+  if (header.header_sum != header_sum(header)) {
+    throw std::runtime_error("snapshot: corrupted header");
+  }
+  if (header.version != SNAPSHOT_VERSION ||
+      header.byte_order != 0x01020304 ||
+      header.shape != static_cast<uint32_t>(SnapshotShape::balanced)) {
+    throw std::runtime_error("snapshot: unsupported version or platform");
+  }
+  if (header.raw_keys != raw || header.key_size != (raw ? sizeof(T) : 0)) {
+    throw std::runtime_error("snapshot: written for another key type");
+  }
+  if (header.payload_bytes != file.size() - sizeof(header) ||
+      (raw && header.payload_bytes != header.count * sizeof(T))) {
+    throw std::runtime_error("snapshot: truncated image");
+  }
+  if (verify) {
+    SnapshotChecksum sum;
+    sum.update(file.data() + sizeof(header), header.payload_bytes);
+    if (sum.value() != header.payload_sum) {
+      throw std::runtime_error("snapshot: corrupted keys");
+    }
+  }
+  return header;
+}
+
+/* Throws unless the keys in [first, last) are strictly ascending under
+ * less: an image written under another Compare, or with duplicates
+ * under this one, would build a tree that cannot be searched.
+ */
+template <typename T, typename Less>
+void check_order(const T *first, const T *last, Less less) {
+  auto out_of_order = [&less](const T &a, const T &b) { return !less(a, b); };
+  if (std::adjacent_find(first, last, out_of_order) != last) {
+    throw std::runtime_error("snapshot: keys out of order for this Compare");
+  }
+}
+
+// what names the file in the error thrown if a write fails
+inline void write_all(int fd, const char *data, size_t bytes,
+                      const char *what = "snapshot") {
+  while (bytes != 0) {
+    ssize_t written = write(fd, data, bytes);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error(errno, std::generic_category(),
+                              std::string(what) + ": write failed");
+    }
+    data += written;
+    bytes -= static_cast<size_t>(written);
+  }
+}
+
+// makes a file created or renamed at path survive a crash
+inline void sync_directory(const std::string &path) {
+  size_t slash = path.find_last_of('/');
+  std::string dir = (slash == std::string::npos) ? "."
+                    : (slash == 0)               ? "/"
+                                                 : path.substr(0, slash);
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+/* Streams an image to path + ".tmp"; finish() completes the header,
+ * syncs the file and renames it over path. Destroyed unfinished, the
+ * writer removes the temporary file.
+ */
+class Writer {
+public:
+  explicit Writer(const std::string &path)
+      : path_{path}, tmp_path_{path + ".tmp"} {
+    fd_ = open(tmp_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+               0644);
+    if (fd_ < 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "snapshot: cannot create " + tmp_path_);
+    }
+    buffer_.reserve(SNAPSHOT_WRITE_CHUNK + 64);
+    buffer_.resize(sizeof(SnapshotHeader)); // filled in by finish()
+  }
+  ~Writer() {
+    if (fd_ >= 0) {
+      close(fd_);
+      unlink(tmp_path_.c_str());
+    }
+  }
+
+  Writer(const Writer &) = delete;
+  Writer &operator=(const Writer &) = delete;
+
+  // bytes of the keys go here, then call flush_if_full()
+  std::string &buffer() { return buffer_; }
+
+  void flush_if_full() {
+    if (buffer_.size() >= SNAPSHOT_WRITE_CHUNK) {
+      flush_();
+    }
+  }
+
+  void finish(bool raw, uint64_t key_size, uint64_t count) {
+    flush_();
+    SnapshotHeader header{};
+    std::memcpy(header.magic, "AVLSNAP", 8);
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = 0x01020304;
+    header.shape = static_cast<uint32_t>(SnapshotShape::balanced);
+    header.raw_keys = raw;
+    header.key_size = key_size;
+    header.count = count;
+    header.payload_bytes = payload_bytes_;
+    header.payload_sum = sum_.value();
+    header.header_sum = header_sum(header);
+    if (pwrite(fd_, &header, sizeof(header), 0) !=
+        static_cast<ssize_t>(sizeof(header))) {
+      throw std::system_error(errno, std::generic_category(),
+                              "snapshot: write failed");
+    }
+    if (fsync(fd_) != 0) {
+      throw std::system_error(errno, std::generic_category(),
+                              "snapshot: fsync failed");
+    }
+    close(fd_);
+    fd_ = -1;
+    if (rename(tmp_path_.c_str(), path_.c_str()) != 0) {
+      int error = errno;
+      unlink(tmp_path_.c_str());
+      throw std::system_error(error, std::generic_category(),
+                              "snapshot: cannot replace " + path_);
+    }
+    sync_directory(path_);
+  }
+
+private:
+  void flush_() {
+    // the first chunk starts with the header, which is not checksummed
+    size_t skip = header_written_ ? 0 : sizeof(SnapshotHeader);
+    sum_.update(buffer_.data() + skip, buffer_.size() - skip);
+    payload_bytes_ += buffer_.size() - skip;
+    write_all(fd_, buffer_.data(), buffer_.size());
+    header_written_ = true;
+    buffer_.clear();
+  }
+
+  std::string path_;
+  std::string tmp_path_;
+  std::string buffer_;
+  SnapshotChecksum sum_;
+  uint64_t payload_bytes_ = 0;
+  bool header_written_ = false;
+  int fd_;
+};
+
+} // namespace snapshot_detail
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "node.hpp"
+#include <cstddef>
+#include <iterator>
+
+/* Bidirectional iterator over the keys of an AVLTree, in ascending order.
+ *
+ * Stepping follows parent_ links, so the iterator is two pointers wide
+ * and never allocates. Keys are read-only: changing one in place would
+ * break the ordering.
+ *
+ * end() holds no node. To step back from it the iterator keeps a pointer
+ * to the tree's root pointer rather than the root itself, which stays
+ * valid while the tree rebalances. Insertions keep iterators to other
+ * nodes valid, deleting a key invalidates only iterators to that key.
+ */
+template <typename T, typename Stats = NoOrderStatistics> class TreeIterator {
+public:
+  using iterator_category = std::bidirectional_iterator_tag;
+  using value_type = T;
+  using difference_type = std::ptrdiff_t;
+  using pointer = const T *;
+  using reference = const T &;
+
+  TreeIterator() : node_{nullptr}, root_{nullptr} {}
+  TreeIterator(Node<T, Stats> *node, Node<T, Stats> *const *root)
+      : node_{node}, root_{root} {}
+
+  reference operator*() const { return node_->get_key(); }
+  pointer operator->() const { return &node_->get_key(); }
+
+  TreeIterator &operator++();
+  TreeIterator operator++(int);
+  TreeIterator &operator--();
+  TreeIterator operator--(int);
+
+  bool operator==(const TreeIterator &other) const {
+    return node_ == other.node_;
+  }
+  bool operator!=(const TreeIterator &other) const {
+    return node_ != other.node_;
+  }
+
+  // node the iterator points to, nullptr for end()
+  Node<T, Stats> *get_node() const { return node_; }
+
+private:
+  Node<T, Stats> *node_;
+  Node<T, Stats> *const *root_;
+};
+
+template <typename T, typename Stats>
+TreeIterator<T, Stats> &TreeIterator<T, Stats>::operator++() {
+  node_ = node_->get_next();
+  return *this;
+}
+
+template <typename T, typename Stats>
+TreeIterator<T, Stats> TreeIterator<T, Stats>::operator++(int) {
+  TreeIterator old = *this;
+  ++*this;
+  return old;
+}
+
+template <typename T, typename Stats>
+TreeIterator<T, Stats> &TreeIterator<T, Stats>::operator--() {
+  // --end() is the largest key
+  node_ = (node_) ? node_->get_prev() : (*root_)->get_max();
+  return *this;
+}
+
+template <typename T, typename Stats>
+TreeIterator<T, Stats> TreeIterator<T, Stats>::operator--(int) {
+  TreeIterator old = *this;
+  --*this;
+  return old;
+}
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+/* Epoch-based memory reclamation for structures read without locks.
+ *
+ * Readers pin the current epoch while they hold pointers into the shared
+ * structure (EpochGuard). A writer that unlinks an object hands it to
+ * retire() instead of deleting it; the object is tagged with the epoch
+ * of that moment and freed only once every pinned reader has a later
+ * epoch, i.e. started after the object was unreachable.
+ *
+ * Pinning is one store to a record of the calling thread, each on its
+ * own cache line, so readers do not write to anything shared. Records
+ * are reused by later threads once their thread exits.
+ *
+ * There is one domain per process, EpochDomain::global().
+ */
+class EpochDomain final {
+public:
+  static EpochDomain &global() {
+    static EpochDomain domain;
+    return domain;
+  }
+
+  EpochDomain(const EpochDomain &) = delete;
+  EpochDomain &operator=(const EpochDomain &) = delete;
+  ~EpochDomain();
+
+  // pins the calling thread; calls nest
+  void enter();
+  void exit();
+  // deleter(ptr) runs once no reader can still see ptr
+  void retire(void *ptr, void (*deleter)(void *));
+  // advances the epoch and frees what has become safe to free
+  void collect();
+  // retired objects not freed yet
+  size_t pending() const;
+
+private:
+  static constexpr uint64_t IDLE = UINT64_MAX;
+  // retire() collects every time this many more objects are pending
+  static constexpr size_t COLLECT_EVERY = 256;
+
+  struct alignas(64) Record {
+    std::atomic<uint64_t> epoch{IDLE};
+    std::atomic<bool> in_use{true};
+    int depth = 0; // nesting of enter(), owner thread only
+    Record *next = nullptr;
+  };
+
+  struct Retired {
+    void *ptr;
+    void (*deleter)(void *);
+    uint64_t epoch;
+  };
+
+  // gives the record of a thread back when the thread exits
+  struct RecordHandle {
+    Record *record = nullptr;
+    ~RecordHandle() {
+      if (record != nullptr) {
+        record->epoch.store(IDLE, std::memory_order_release);
+        record->in_use.store(false, std::memory_order_release);
+      }
+    }
+  };
+
+  EpochDomain() = default;
+  Record *record_();
+  uint64_t oldest_pinned_() const;
+
+  std::atomic<uint64_t> epoch_{0};
+  std::atomic<Record *> records_{nullptr}; // only ever grows
+  mutable std::mutex retired_mutex_;
+  std::vector<Retired> retired_;
+  size_t collect_at_ = COLLECT_EVERY;
+};
+
+// pins the calling thread for its lifetime
+class EpochGuard final {
+public:
+  EpochGuard() { EpochDomain::global().enter(); }
+  ~EpochGuard() { EpochDomain::global().exit(); }
+
+  EpochGuard(const EpochGuard &) = delete;
+  EpochGuard &operator=(const EpochGuard &) = delete;
+};
+
+inline EpochDomain::~EpochDomain() {
+  for (Retired &retired : retired_) {
+    retired.deleter(retired.ptr);
+  }
+  Record *record = records_.load();
+  while (record != nullptr) {
+    Record *next = record->next;
+    delete record;
+    record = next;
+  }
+}
+
+inline EpochDomain::Record *EpochDomain::record_() {
+  thread_local RecordHandle handle;
+  if (handle.record != nullptr) {
+    return handle.record;
+  }
+  for (Record *record = records_.load(); record != nullptr;
+       record = record->next) {
+    bool in_use = false;
+    if (!record->in_use.load(std::memory_order_relaxed) &&
+        record->in_use.compare_exchange_strong(in_use, true)) {
+      record->depth = 0;
+      handle.record = record;
+      return record;
+    }
+  }
+  Record *record = new Record;
+  record->next = records_.load();
+  while (!records_.compare_exchange_weak(record->next, record)) {
+  }
+  handle.record = record;
+  return record;
+}
+
+/* The store and the loads that follow it are sequentially consistent:
+ * either a concurrent collect() sees this thread pinned, or this thread
+ * sees everything unlinked before that collect().
+ */
+inline void EpochDomain::enter() {
+  Record *record = record_();
+  if (record->depth++ == 0) {
+    record->epoch.store(epoch_.load());
+  }
+}
+
+inline void EpochDomain::exit() {
+  Record *record = record_();
+  if (--record->depth == 0) {
+    record->epoch.store(IDLE, std::memory_order_release);
+  }
+}
+
+inline void EpochDomain::retire(void *ptr, void (*deleter)(void *)) {
+  bool full;
+  {
+    std::lock_guard<std::mutex> lock(retired_mutex_);
+    retired_.push_back(Retired{ptr, deleter, epoch_.load()});
+    full = retired_.size() >= collect_at_;
+  }
+  if (full) {
+    collect();
+  }
+}
+
+inline uint64_t EpochDomain::oldest_pinned_() const {
+  uint64_t oldest = IDLE;
+  for (Record *record = records_.load(); record != nullptr;
+       record = record->next) {
+    uint64_t epoch = record->epoch.load();
+    oldest = (epoch < oldest) ? epoch : oldest;
+  }
+  return oldest;
+}
+
+inline void EpochDomain::collect() {
+  epoch_.fetch_add(1);
+  uint64_t oldest = oldest_pinned_();
+  std::vector<Retired> ready;
+  {
+    std::lock_guard<std::mutex> lock(retired_mutex_);
+    size_t kept = 0;
+    for (Retired &retired : retired_) {
+      if (retired.epoch < oldest) {
+        ready.push_back(retired);
+      } else {
+        retired_[kept++] = retired;
+      }
+    }
+    retired_.resize(kept);
+    // a reader stuck in one epoch must not make every retire collect
+    collect_at_ = kept + COLLECT_EVERY;
+  }
+  for (Retired &retired : ready) {
+    retired.deleter(retired.ptr);
+  }
+}
+
+inline size_t EpochDomain::pending() const {
+  std::lock_guard<std::mutex> lock(retired_mutex_);
+  return retired_.size();
+}
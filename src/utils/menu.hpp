@@ -4,6 +4,7 @@
 #include <iostream>
 #include <limits>
 #include <sstream>
+#include <vector>
 
 void display_menu();
 
@@ -54,12 +55,13 @@ template <typename T> bool handle_operation(AVLTree<T> &tree) {
     std::getline(std::cin, line);
     std::istringstream iss(line);
     T num;
-    size_t count = 0;
+    std::vector<T> values;
 
     while (iss >> num) {
-      tree.insert(num);
-      count++;
+      values.push_back(num);
     }
+    size_t count = values.size();
+    tree.insert_batch(values.begin(), values.end());
     if (iss.fail() && !iss.eof()) {
       std::string bad_input;
       iss.clear();
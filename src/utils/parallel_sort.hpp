@@ -0,0 +1,175 @@
+#pragma once
+
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/* ranges shorter than this are sorted, merged or scanned on one thread,
+ * longer ones are cut in two halves for the pool
+ */
+#define PARALLEL_SORT_CUTOFF (1 << 16)
+
+/* Merge sort on a ThreadPool.
+ *
+ * Both halves are sorted in parallel, then merged in parallel as well:
+ * the merge cuts the longer input at its middle, finds the matching cut
+ * of the other one by binary search and merges the two pairs of pieces
+ * side by side. The keys move between the vector and a buffer of the
+ * same size, so the sort needs n more keys of memory.
+ *
+ * Without a pool or with a pool of one thread, or for keys that cannot
+ * be default constructed into the buffer, this is std::sort.
+ */
+template <typename T, typename Less>
+void parallel_sort(std::vector<T> &keys, Less less, ThreadPool *pool);
+
+// drops all but the first of every run of equal keys of a sorted vector
+template <typename T, typename Less>
+void parallel_unique(std::vector<T> &keys, Less less, ThreadPool *pool);
+
+namespace parallel_sort_detail {
+
+template <typename F, typename G>
+void fork(ThreadPool *pool, size_t count, F &&left, G &&right) {
+  if (pool != nullptr && count > PARALLEL_SORT_CUTOFF) {
+    pool->parallel_invoke(left, right);
+  } else {
+    left();
+    right();
+  }
+}
+
+// merges [a, a_end) and [b, b_end) into out, moving the keys
+template <typename T, typename Less>
+void merge(T *a, T *a_end, T *b, T *b_end, T *out, Less &less,
+           ThreadPool *pool) {
+  size_t count = (a_end - a) + (b_end - b);
+  if (pool == nullptr || count <= PARALLEL_SORT_CUTOFF) {
+    std::merge(std::make_move_iterator(a), std::make_move_iterator(a_end),
+               std::make_move_iterator(b), std::make_move_iterator(b_end),
+               out, less);
+    return;
+  }
+  if (a_end - a < b_end - b) {
+    std::swap(a, b);
+    std::swap(a_end, b_end);
+  }
+  T *a_mid = a + (a_end - a) / 2;
+  T *b_mid = std::lower_bound(b, b_end, *a_mid, less);
+  T *out_mid = out + (a_mid - a) + (b_mid - b);
+  fork(
+      pool, count, [&] { merge(a, a_mid, b, b_mid, out, less, pool); },
+      [&] { merge(a_mid, a_end, b_mid, b_end, out_mid, less, pool); });
+}
+
+/* Sorts the count keys at keys, leaving them there (in_keys) or in
+ * buffer; the other array is scratch space.
+ */
+template <typename T, typename Less>
+void sort(T *keys, T *buffer, size_t count, bool in_keys, Less &less,
+          ThreadPool *pool) {
+  if (count <= PARALLEL_SORT_CUTOFF) {
+    std::sort(keys, keys + count, less);
+    if (!in_keys) {
+      std::move(keys, keys + count, buffer);
+    }
+    return;
+  }
+  size_t half = count / 2;
+  fork(
+      pool, count,
+      [&] { sort(keys, buffer, half, !in_keys, less, pool); },
+      [&] {
+        sort(keys + half, buffer + half, count - half, !in_keys, less, pool);
+      });
+  // the halves are in the other array now
+  T *from = in_keys ? buffer : keys;
+  T *to = in_keys ? keys : buffer;
+  merge(from, from + half, from + half, from + count, to, less, pool);
+}
+
+// calls fn(begin, end) on consecutive chunks covering [0, count)
+template <typename F>
+void for_chunks(size_t begin, size_t end, size_t chunk, F &fn,
+                ThreadPool *pool) {
+  if (end - begin <= chunk) {
+    fn(begin, end);
+    return;
+  }
+  size_t mid = begin + (end - begin) / 2 / chunk * chunk;
+  if (mid == begin) {
+    mid += chunk;
+  }
+  fork(
+      pool, end - begin, [&] { for_chunks(begin, mid, chunk, fn, pool); },
+      [&] { for_chunks(mid, end, chunk, fn, pool); });
+}
+
+} // namespace parallel_sort_detail
+
+template <typename T, typename Less>
+void parallel_sort(std::vector<T> &keys, Less less, ThreadPool *pool) {
+  if constexpr (std::is_default_constructible_v<T>) {
+    if (pool != nullptr && pool->get_concurrency() > 1 &&
+        keys.size() > PARALLEL_SORT_CUTOFF) {
+      std::vector<T> buffer(keys.size());
+      parallel_sort_detail::sort(keys.data(), buffer.data(), keys.size(), true,
+                                 less, pool);
+      return;
+    }
+  }
+  std::sort(keys.begin(), keys.end(), less);
+}
+
+/* Each chunk first counts the keys it keeps, a prefix sum over the
+ * counts gives every chunk its place in the result, then the chunks
+ * copy their keys there side by side.
+ */
+template <typename T, typename Less>
+void parallel_unique(std::vector<T> &keys, Less less, ThreadPool *pool) {
+  auto is_new = [&keys, &less](size_t i) {
+    return i == 0 || less(keys[i - 1], keys[i]);
+  };
+  if constexpr (std::is_default_constructible_v<T>) {
+    if (pool != nullptr && pool->get_concurrency() > 1 &&
+        keys.size() > PARALLEL_SORT_CUTOFF) {
+      size_t count = keys.size();
+      size_t chunk = PARALLEL_SORT_CUTOFF;
+      size_t chunks = (count + chunk - 1) / chunk;
+      std::vector<size_t> offsets(chunks + 1, 0);
+      auto count_kept = [&](size_t begin, size_t end) {
+        size_t kept = 0;
+        for (size_t i = begin; i < end; ++i) {
+          kept += is_new(i);
+        }
+        offsets[begin / chunk + 1] = kept;
+      };
+      parallel_sort_detail::for_chunks(0, count, chunk, count_kept, pool);
+      for (size_t c = 0; c < chunks; ++c) {
+        offsets[c + 1] += offsets[c];
+      }
+      // copies: a moved-from key would break is_new for the next chunk
+      std::vector<T> result(offsets[chunks]);
+      auto copy_kept = [&](size_t begin, size_t end) {
+        T *out = result.data() + offsets[begin / chunk];
+        for (size_t i = begin; i < end; ++i) {
+          if (is_new(i)) {
+            *out++ = keys[i];
+          }
+        }
+      };
+      parallel_sort_detail::for_chunks(0, count, chunk, copy_kept, pool);
+      keys = std::move(result);
+      return;
+    }
+  }
+  keys.erase(std::unique(keys.begin(), keys.end(),
+                         [&less](const T &a, const T &b) {
+                           return !less(a, b) && !less(b, a);
+                         }),
+             keys.end());
+}
@@ -6,7 +6,7 @@
 #include <unistd.h>
 #include <vector>
 
-#include "../avltree/node.hpp"
+#include "../avltree/avltree.hpp"
 
 template <typename T> class PstreeDisplay final {
 public:
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Minimal fork-join thread pool.
+ *
+ * The calling thread always takes part in the work: parallel_invoke runs
+ * one function itself and queues the other one. While waiting for the
+ * queued half it keeps executing queued tasks, so nested parallel_invoke
+ * calls from inside tasks cannot deadlock the pool.
+ *
+ * ThreadPool(0) has no workers and runs everything on the caller.
+ */
+class ThreadPool final {
+public:
+  explicit ThreadPool(size_t workers = default_workers());
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // number of threads doing the work, caller included
+  size_t get_concurrency() const { return workers_.size() + 1; }
+
+  template <typename F, typename G> void parallel_invoke(F &&left, G &&right);
+
+  static size_t default_workers() {
+    unsigned cores = std::thread::hardware_concurrency();
+    return (cores > 1) ? cores - 1 : 0;
+  }
+
+private:
+  bool run_pending_task_();
+  void worker_loop_();
+
+  std::vector<std::thread> workers_;
+  std::deque<std::function<void()>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable has_tasks_;
+  bool stopping_;
+};
+
+inline ThreadPool::ThreadPool(size_t workers) : stopping_{false} {
+  for (size_t i = 0; i < workers; ++i) {
+    workers_.emplace_back([this] { worker_loop_(); });
+  }
+}
+
+inline ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  has_tasks_.notify_all();
+  for (std::thread &worker : workers_) {
+    worker.join();
+  }
+}
+
+template <typename F, typename G>
+void ThreadPool::parallel_invoke(F &&left, G &&right) {
+  if (workers_.empty()) {
+    left();
+    right();
+    return;
+  }
+
+  std::atomic<bool> done{false};
+  std::exception_ptr error;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    tasks_.emplace_back([&] {
+      try {
+        right();
+      } catch (...) {
+        error = std::current_exception();
+      }
+      done.store(true, std::memory_order_release);
+    });
+  }
+  has_tasks_.notify_one();
+
+  // right may still be queued if left throws, so wait in any case
+  std::exception_ptr left_error;
+  try {
+    left();
+  } catch (...) {
+    left_error = std::current_exception();
+  }
+  while (!done.load(std::memory_order_acquire)) {
+    if (!run_pending_task_()) {
+      std::this_thread::yield();
+    }
+  }
+
+  if (left_error) {
+    std::rethrow_exception(left_error);
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+inline bool ThreadPool::run_pending_task_() {
+  std::function<void()> task;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (tasks_.empty()) {
+      return false;
+    }
+    // newest first: it is the smallest piece and the hottest in cache
+    task = std::move(tasks_.back());
+    tasks_.pop_back();
+  }
+  task();
+  return true;
+}
+
+inline void ThreadPool::worker_loop_() {
+  for (;;) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      has_tasks_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+      if (stopping_ && tasks_.empty()) {
+        return;
+      }
+      // workers steal the oldest, i.e. the biggest, pieces of work
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
@@ -1,9 +1,25 @@
 #include "../src/avltree/avltree.hpp"
+#include "../src/avltree/compact_avltree.hpp"
+#include "../src/avltree/concurrent_avltree.hpp"
+#include "../src/avltree/mapped_avltree.hpp"
+#include "../src/avltree/cow_avltree.hpp"
+#include "../src/avltree/logged_avltree.hpp"
+#include "../src/avltree/persistent_avltree.hpp"
+#include "../src/avltree/sharded_avltree.hpp"
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <fstream>
+#include <functional>
 #include <gtest/gtest.h>
+#include <limits>
+#include <list>
 #include <memory>
 #include <random>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 class AVLTreeTest : public ::testing::Test {
@@ -301,6 +317,1772 @@ TEST_F(AVLTreeTest, LargeNumbers) {
   EXPECT_EQ(tree->get_max()->get_key(), max_value);
 }
 
+// Test random inserts and deletes against std::set
+TEST_F(AVLTreeTest, RandomInsertDeleteMatchesSet) {
+  std::mt19937 gen(7);
+  std::uniform_int_distribution<> dis(0, 500);
+  std::set<int> reference;
+
+  for (int i = 0; i < 20000; ++i) {
+    int val = dis(gen);
+    if (gen() % 3 == 0) {
+      tree->delete_key(val);
+      reference.erase(val);
+    } else {
+      tree->insert(val);
+      reference.insert(val);
+    }
+    ASSERT_TRUE(tree->is_balanced());
+  }
+  EXPECT_EQ(tree->get_size(), reference.size());
+  EXPECT_EQ(tree->in_order(),
+            std::vector<int>(reference.begin(), reference.end()));
+}
+
+// Test bulk load from sorted input
+TEST_F(AVLTreeTest, BuildFromSorted) {
+  std::vector<int> values;
+  for (int i = 1; i <= 1000; ++i) {
+    values.push_back(i);
+  }
+  tree->build_from_sorted(values.begin(), values.end());
+
+  EXPECT_EQ(tree->get_size(), values.size());
+  EXPECT_TRUE(tree->is_balanced());
+  EXPECT_EQ(tree->get_height(), 10);
+  EXPECT_EQ(tree->in_order(), values);
+
+  // the tree stays usable for ordinary updates
+  tree->insert(0);
+  tree->delete_key(500);
+  EXPECT_TRUE(tree->is_balanced());
+  EXPECT_EQ(tree->get_size(), values.size());
+  EXPECT_EQ(tree->get_min()->get_key(), 0);
+}
+
+// Test bulk load drops duplicates and replaces old content
+TEST_F(AVLTreeTest, BuildFromSortedDuplicates) {
+  tree->insert(42);
+  std::list<int> values = {1, 1, 2, 3, 3, 3, 5, 8, 8};
+  tree->build_from_sorted(values.begin(), values.end());
+
+  EXPECT_EQ(tree->get_size(), 5);
+  EXPECT_TRUE(tree->is_balanced());
+  EXPECT_EQ(tree->in_order(), (std::vector<int>{1, 2, 3, 5, 8}));
+  EXPECT_EQ(tree->find(42), nullptr);
+
+  tree->build_from_sorted(values.end(), values.end());
+  EXPECT_TRUE(tree->is_empty());
+}
+
+// Test sorted range constructor
+TEST(AVLTreeBulkTest, SortedRangeConstructor) {
+  std::vector<std::string> values = {"a", "b", "c", "d", "e", "f", "g"};
+  AVLTree<std::string> tree(sorted_range, values.begin(), values.end());
+  EXPECT_EQ(tree.get_size(), 7);
+  EXPECT_EQ(tree.get_height(), 3);
+  EXPECT_EQ(tree.get_root()->get_key(), "d");
+  EXPECT_TRUE(tree.is_balanced());
+
+  std::vector<int> numbers = {1, 2, 2, 3};
+  AVLTree<int, NewDeleteAllocator> plain(sorted_range, numbers.begin(),
+                                         numbers.end());
+  EXPECT_EQ(plain.in_order(), (std::vector<int>{1, 2, 3}));
+  EXPECT_TRUE(plain.is_balanced());
+}
+
+// Test batch insert of small and big unsorted batches
+TEST_F(AVLTreeTest, InsertBatch) {
+  std::mt19937 gen(11);
+  std::uniform_int_distribution<> dis(0, 100000);
+  std::set<int> reference;
+
+  // first batch into an empty tree, then one small and one big batch
+  for (size_t batch_size : {5000, 100, 20000}) {
+    std::vector<int> batch(batch_size);
+    for (int &val : batch) {
+      val = dis(gen);
+    }
+    batch.push_back(batch.front()); // duplicate inside the batch
+    tree->insert_batch(batch.begin(), batch.end());
+    reference.insert(batch.begin(), batch.end());
+
+    ASSERT_TRUE(tree->is_balanced());
+    EXPECT_EQ(tree->get_size(), reference.size());
+  }
+  EXPECT_EQ(tree->in_order(),
+            std::vector<int>(reference.begin(), reference.end()));
+
+  std::vector<int> empty;
+  tree->insert_batch(empty.begin(), empty.end());
+  EXPECT_EQ(tree->get_size(), reference.size());
+}
+
+// Test split at present, missing and extreme keys
+TEST(AVLTreeJoinSplitTest, Split) {
+  for (int key : {-5, 0, 1, 250, 333, 499, 500, 1000}) {
+    AVLTree<int> tree;
+    for (int i = 0; i < 500; i += 2) {
+      tree.insert(i);
+    }
+    auto [less, greater] = tree.split(key);
+    EXPECT_TRUE(tree.is_empty());
+    EXPECT_TRUE(less.is_balanced());
+    EXPECT_TRUE(greater.is_balanced());
+    EXPECT_EQ(less.get_size() + greater.get_size(), 250);
+
+    std::vector<int> less_keys = less.in_order();
+    std::vector<int> greater_keys = greater.in_order();
+    EXPECT_EQ(less_keys.size(), less.get_size());
+    EXPECT_EQ(greater_keys.size(), greater.get_size());
+    EXPECT_TRUE(less_keys.empty() || less_keys.back() < key);
+    EXPECT_TRUE(greater_keys.empty() || greater_keys.front() >= key);
+
+    // halves are independent trees now
+    less.insert(key - 1000);
+    greater.delete_key(key);
+    EXPECT_TRUE(less.is_balanced());
+    EXPECT_TRUE(greater.is_balanced());
+  }
+}
+
+// Test join of trees with very different heights
+TEST(AVLTreeJoinSplitTest, Join) {
+  for (int left_count : {0, 1, 7, 100, 3000}) {
+    for (int right_count : {0, 1, 50, 2000}) {
+      AVLTree<int> left;
+      AVLTree<int> right;
+      for (int i = 0; i < left_count; ++i) {
+        left.insert(i);
+      }
+      for (int i = 0; i < right_count; ++i) {
+        right.insert(10000 + i);
+      }
+
+      AVLTree<int> joined =
+          AVLTree<int>::join(std::move(left), 5000, std::move(right));
+      EXPECT_TRUE(left.is_empty());
+      EXPECT_TRUE(right.is_empty());
+      ASSERT_TRUE(joined.is_balanced());
+      EXPECT_EQ(joined.get_size(), left_count + right_count + 1);
+      EXPECT_EQ(joined.in_order().size(), joined.get_size());
+      EXPECT_NE(joined.find(5000), nullptr);
+
+      AVLTree<int> low;
+      AVLTree<int> high;
+      std::tie(low, high) = joined.split(5000);
+      AVLTree<int> rejoined = AVLTree<int>::join(std::move(low),
+                                                 std::move(high));
+      ASSERT_TRUE(rejoined.is_balanced());
+      EXPECT_EQ(rejoined.get_size(), left_count + right_count + 1);
+    }
+  }
+}
+
+// Test range extraction with two splits and a join
+TEST(AVLTreeJoinSplitTest, ExtractRange) {
+  AVLTree<int> tree;
+  for (int i = 0; i < 1000; ++i) {
+    tree.insert(i);
+  }
+  auto [head, rest] = tree.split(100);
+  auto [range, tail] = rest.split(200);
+  AVLTree<int> remaining = AVLTree<int>::join(std::move(head), std::move(tail));
+
+  EXPECT_EQ(range.get_size(), 100);
+  EXPECT_EQ(range.get_min()->get_key(), 100);
+  EXPECT_EQ(range.get_max()->get_key(), 199);
+  EXPECT_EQ(remaining.get_size(), 900);
+  EXPECT_EQ(remaining.find(150), nullptr);
+  EXPECT_TRUE(remaining.is_balanced());
+
+  // nodes of the extracted range outlive the tree they came from
+  remaining.clear_tree();
+  range.insert(1000);
+  EXPECT_EQ(range.in_order().front(), 100);
+}
+
+// Test that split halves keep exact sizes through later changes
+TEST(AVLTreeJoinSplitTest, SizeAfterSplit) {
+  AVLTree<int> tree;
+  for (int i = 0; i < 1000; ++i) {
+    tree.insert(i);
+  }
+  auto [less, greater] = tree.split(300);
+  EXPECT_FALSE(less.is_empty());
+  EXPECT_TRUE(less.emplace(-1).second);
+  EXPECT_FALSE(less.emplace(5).second);
+  less.delete_key(0);
+  less.delete_key(1);
+  greater.insert(2000);
+  AVLTree<int> joined = AVLTree<int>::join(std::move(greater), AVLTree<int>());
+  EXPECT_EQ(less.get_size(), 299);
+  EXPECT_EQ(joined.get_size(), 701);
+  less.insert(-2);
+  EXPECT_EQ(less.get_size(), 300);
+
+  AVLTree<int, NodePool, OrderStatistics> counted;
+  for (int i = 0; i < 1000; ++i) {
+    counted.insert(i);
+  }
+  auto [head, tail] = counted.split(300);
+  EXPECT_EQ(head.get_size(), 300);
+  EXPECT_EQ(tail.get_size(), 700);
+}
+
+// Test union, intersection and difference against std::set_* algorithms
+TEST(AVLTreeSetOperationsTest, MatchStdAlgorithms) {
+  ThreadPool pool(3);
+  std::mt19937 gen(5);
+  for (int sizes : {0, 1, 10, 1000, 20000}) {
+    std::uniform_int_distribution<> dis(0, 2 * sizes + 10);
+    std::set<int> a_keys;
+    std::set<int> b_keys;
+    for (int i = 0; i < sizes; ++i) {
+      a_keys.insert(dis(gen));
+      b_keys.insert(dis(gen) / 2);
+    }
+    std::vector<int> expected_union;
+    std::vector<int> expected_intersection;
+    std::vector<int> expected_difference;
+    std::set_union(a_keys.begin(), a_keys.end(), b_keys.begin(), b_keys.end(),
+                   std::back_inserter(expected_union));
+    std::set_intersection(a_keys.begin(), a_keys.end(), b_keys.begin(),
+                          b_keys.end(),
+                          std::back_inserter(expected_intersection));
+    std::set_difference(a_keys.begin(), a_keys.end(), b_keys.begin(),
+                        b_keys.end(), std::back_inserter(expected_difference));
+
+    for (ThreadPool *used_pool : {static_cast<ThreadPool *>(nullptr), &pool}) {
+      AVLTree<int> a(sorted_range, a_keys.begin(), a_keys.end());
+      AVLTree<int> b(sorted_range, b_keys.begin(), b_keys.end());
+      a.union_with(std::move(b), used_pool);
+      EXPECT_TRUE(b.is_empty());
+      ASSERT_TRUE(a.is_balanced());
+      EXPECT_EQ(a.get_size(), expected_union.size());
+      EXPECT_EQ(a.in_order(), expected_union);
+
+      AVLTree<int> c(sorted_range, a_keys.begin(), a_keys.end());
+      AVLTree<int> d(sorted_range, b_keys.begin(), b_keys.end());
+      c.intersect_with(std::move(d), used_pool);
+      ASSERT_TRUE(c.is_balanced());
+      EXPECT_EQ(c.get_size(), expected_intersection.size());
+      EXPECT_EQ(c.in_order(), expected_intersection);
+
+      AVLTree<int> e(sorted_range, a_keys.begin(), a_keys.end());
+      AVLTree<int> f(sorted_range, b_keys.begin(), b_keys.end());
+      e.difference_with(std::move(f), used_pool);
+      ASSERT_TRUE(e.is_balanced());
+      EXPECT_EQ(e.get_size(), expected_difference.size());
+      EXPECT_EQ(e.in_order(), expected_difference);
+    }
+  }
+}
+
+// Test select, rank and count_range against std::set
+TEST(AVLTreeOrderStatisticsTest, MatchesSet) {
+  using StatsTree = AVLTree<int, NodePool, OrderStatistics>;
+  static_assert(sizeof(Node<int>) < sizeof(Node<int, OrderStatistics>),
+                "the default node must not pay for subtree sizes");
+
+  StatsTree tree;
+  std::set<int> expected;
+  std::mt19937 gen(11);
+  std::uniform_int_distribution<> dis(0, 3000);
+  for (int i = 0; i < 20000; ++i) {
+    int key = dis(gen);
+    if (i % 3 == 0) {
+      tree.delete_key(key);
+      expected.erase(key);
+    } else {
+      tree.insert(key);
+      expected.insert(key);
+    }
+  }
+  ASSERT_TRUE(tree.is_balanced());
+  ASSERT_EQ(tree.get_size(), expected.size());
+
+  size_t k = 0;
+  for (int key : expected) {
+    ASSERT_NE(tree.select(k), nullptr);
+    EXPECT_EQ(tree.select(k)->get_key(), key);
+    EXPECT_EQ(tree.rank(key), k);
+    ++k;
+  }
+  EXPECT_EQ(tree.select(expected.size()), nullptr);
+  EXPECT_EQ(tree.rank(-1), 0u);
+  EXPECT_EQ(tree.rank(5000), expected.size());
+
+  for (int i = 0; i < 200; ++i) {
+    int lo = dis(gen);
+    int hi = dis(gen);
+    size_t count = 0;
+    if (lo <= hi) {
+      count = std::distance(expected.lower_bound(lo), expected.upper_bound(hi));
+    }
+    EXPECT_EQ(tree.count_range(lo, hi), count);
+  }
+}
+
+// Test that sizes survive bulk loads, split, join and set operations
+TEST(AVLTreeOrderStatisticsTest, BulkOperationsKeepSizes) {
+  using StatsTree = AVLTree<int, NodePool, OrderStatistics>;
+  std::vector<int> keys;
+  for (int i = 0; i < 5000; ++i) {
+    keys.push_back(i * 2);
+  }
+  StatsTree tree(sorted_range, keys.begin(), keys.end());
+  ASSERT_TRUE(tree.is_balanced());
+  EXPECT_EQ(tree.select(100)->get_key(), 200);
+
+  std::vector<int> batch;
+  for (int i = 0; i < 300; ++i) {
+    batch.push_back(i * 6 + 1); // odd keys only
+  }
+  tree.insert_batch(batch.begin(), batch.end());
+  ASSERT_TRUE(tree.is_balanced());
+
+  auto halves = tree.split(4000);
+  ASSERT_TRUE(halves.first.is_balanced());
+  ASSERT_TRUE(halves.second.is_balanced());
+  EXPECT_EQ(halves.first.get_size(), halves.first.in_order().size());
+  EXPECT_EQ(halves.first.count_range(0, 3999), halves.first.get_size());
+  EXPECT_EQ(halves.second.rank(4000), 0u);
+
+  StatsTree joined = StatsTree::join(std::move(halves.first),
+                                     std::move(halves.second));
+  ASSERT_TRUE(joined.is_balanced());
+  EXPECT_EQ(joined.rank(4000), joined.count_range(0, 3999));
+
+  ThreadPool pool(3);
+  StatsTree other(sorted_range, batch.begin(), batch.end());
+  joined.difference_with(std::move(other), &pool);
+  ASSERT_TRUE(joined.is_balanced());
+  EXPECT_EQ(joined.get_size(), 5000u);
+  EXPECT_EQ(joined.select(100)->get_key(), 200);
+}
+
+// Test iterators and lower_bound/upper_bound against std::set
+TEST(AVLTreeIteratorTest, MatchesSet) {
+  AVLTree<int> tree;
+  EXPECT_TRUE(tree.begin() == tree.end());
+  EXPECT_TRUE(tree.rbegin() == tree.rend());
+
+  std::set<int> expected;
+  std::mt19937 gen(3);
+  std::uniform_int_distribution<> dis(-500, 500);
+  for (int i = 0; i < 2000; ++i) {
+    int key = dis(gen);
+    tree.insert(key);
+    expected.insert(key);
+  }
+
+  std::vector<int> forward;
+  for (int key : tree) {
+    forward.push_back(key);
+  }
+  EXPECT_EQ(forward, std::vector<int>(expected.begin(), expected.end()));
+  EXPECT_TRUE(std::equal(tree.rbegin(), tree.rend(), expected.rbegin(),
+                         expected.rend()));
+  EXPECT_EQ(static_cast<size_t>(std::distance(tree.begin(), tree.end())),
+            tree.get_size());
+  EXPECT_EQ(*std::prev(tree.end()), *expected.rbegin());
+
+  for (int key = -510; key <= 510; ++key) {
+    auto lower = tree.lower_bound(key);
+    auto upper = tree.upper_bound(key);
+    auto expected_lower = expected.lower_bound(key);
+    auto expected_upper = expected.upper_bound(key);
+    if (expected_lower == expected.end()) {
+      EXPECT_TRUE(lower == tree.end());
+    } else {
+      ASSERT_TRUE(lower != tree.end());
+      EXPECT_EQ(*lower, *expected_lower);
+    }
+    if (expected_upper == expected.end()) {
+      EXPECT_TRUE(upper == tree.end());
+    } else {
+      ASSERT_TRUE(upper != tree.end());
+      EXPECT_EQ(*upper, *expected_upper);
+    }
+  }
+
+  // iterators to surviving keys stay valid while the tree rebalances
+  tree.insert(0);
+  auto it = tree.lower_bound(0);
+  int key = *it;
+  for (int i = 1; i < 400; i += 2) {
+    tree.delete_key(i);
+    tree.delete_key(-i);
+  }
+  EXPECT_EQ(*it, key);
+  EXPECT_EQ(*std::next(it), *tree.upper_bound(key));
+}
+
+// Test the range visitors against std::set
+TEST(AVLTreeIteratorTest, ForEachInRange) {
+  AVLTree<int> tree;
+  std::set<int> expected;
+  std::mt19937 gen(8);
+  std::uniform_int_distribution<> dis(0, 1000);
+  for (int i = 0; i < 600; ++i) {
+    int key = dis(gen);
+    tree.insert(key);
+    expected.insert(key);
+  }
+
+  for (int i = 0; i < 300; ++i) {
+    int lo = dis(gen) - 10;
+    int hi = lo + dis(gen) % 200 - 20;
+    std::vector<int> ascending;
+    std::vector<int> descending;
+    tree.for_each_in_range(lo, hi, [&](int key) { ascending.push_back(key); });
+    tree.for_each_in_range_desc(lo, hi,
+                                [&](int key) { descending.push_back(key); });
+
+    std::vector<int> wanted;
+    if (lo <= hi) {
+      wanted.assign(expected.lower_bound(lo), expected.upper_bound(hi));
+    }
+    EXPECT_EQ(ascending, wanted);
+    std::reverse(wanted.begin(), wanted.end());
+    EXPECT_EQ(descending, wanted);
+  }
+}
+
+// Key type that can only be moved, ordered by value
+struct MoveOnlyKey {
+  explicit MoveOnlyKey(int value) : value{std::make_unique<int>(value)} {}
+  MoveOnlyKey(MoveOnlyKey &&) = default;
+  MoveOnlyKey &operator=(MoveOnlyKey &&) = default;
+
+  bool operator==(const MoveOnlyKey &other) const {
+    return *value == *other.value;
+  }
+  bool operator<(const MoveOnlyKey &other) const {
+    return *value < *other.value;
+  }
+
+  std::unique_ptr<int> value;
+};
+
+// Test insert(T&&) and emplace with move-only and string keys
+TEST(AVLTreeEmplaceTest, MoveOnlyKeys) {
+  AVLTree<MoveOnlyKey, NewDeleteAllocator> tree;
+  for (int i = 0; i < 100; ++i) {
+    tree.insert(MoveOnlyKey(i * 3 % 100));
+  }
+  auto inserted = tree.emplace(100);
+  EXPECT_TRUE(inserted.second);
+  EXPECT_EQ(*inserted.first->value, 100);
+  auto duplicate = tree.emplace(42);
+  EXPECT_FALSE(duplicate.second);
+  EXPECT_EQ(*duplicate.first->value, 42);
+
+  EXPECT_EQ(tree.get_size(), 101u);
+  EXPECT_TRUE(tree.is_balanced());
+  int expected = 0;
+  for (const MoveOnlyKey &key : tree) {
+    EXPECT_EQ(*key.value, expected++);
+  }
+}
+
+TEST(AVLTreeEmplaceTest, StringKeys) {
+  AVLTree<std::string> tree;
+  std::string key(40, 'k');
+  tree.insert(std::move(key));
+  EXPECT_NE(tree.find(std::string(40, 'k')), nullptr);
+
+  // a duplicate passed as T is looked up first and left untouched
+  std::string same(40, 'k');
+  auto result = tree.emplace(std::move(same));
+  EXPECT_FALSE(result.second);
+  EXPECT_EQ(same, std::string(40, 'k'));
+
+  result = tree.emplace(3, 'a');
+  EXPECT_TRUE(result.second);
+  EXPECT_EQ(*result.first, "aaa");
+  EXPECT_FALSE(tree.emplace(3, 'a').second);
+  EXPECT_EQ(tree.get_size(), 2u);
+  EXPECT_FALSE(std::is_copy_constructible<AVLTree<std::string>>::value);
+}
+
+// Comparator with a three-way member that counts its calls
+struct CountingCompare {
+  size_t *calls;
+
+  bool operator()(int a, int b) const {
+    ++*calls;
+    return a < b;
+  }
+  int compare(int a, int b) const {
+    ++*calls;
+    return (a < b) ? -1 : (b < a);
+  }
+};
+
+// Test that a custom ordering is used by every operation
+TEST(AVLTreeCompareTest, DescendingOrder) {
+  using DescTree = AVLTree<int, NodePool, NoOrderStatistics, std::greater<int>>;
+  DescTree tree;
+  for (int i = 0; i < 100; ++i) {
+    tree.insert(i);
+  }
+  std::vector<int> batch = {150, 120, 101, 5, 150};
+  tree.insert_batch(batch.begin(), batch.end());
+  ASSERT_TRUE(tree.is_balanced());
+  EXPECT_EQ(tree.get_size(), 103u);
+  EXPECT_EQ(*tree.begin(), 150);
+  EXPECT_TRUE(std::is_sorted(tree.begin(), tree.end(), std::greater<int>()));
+
+  EXPECT_EQ(*tree.lower_bound(110), 101);
+  EXPECT_EQ(*tree.upper_bound(50), 49);
+  EXPECT_EQ(tree.lowerbound(110)->get_key(), 101);
+  EXPECT_NE(tree.find(120), nullptr);
+  EXPECT_EQ(tree.find(110), nullptr);
+
+  std::vector<int> visited;
+  tree.for_each_in_range(60, 50, [&](int key) { visited.push_back(key); });
+  EXPECT_EQ(visited.size(), 11u);
+  EXPECT_EQ(visited.front(), 60);
+
+  auto halves = tree.split(50);
+  EXPECT_EQ(halves.first.get_size(), 52u); // 150..51
+  EXPECT_EQ(*halves.second.begin(), 50);
+}
+
+// Test that a three-way comparator is called once per visited node
+TEST(AVLTreeCompareTest, OneComparisonPerLevel) {
+  size_t calls = 0;
+  AVLTree<int, NodePool, NoOrderStatistics, CountingCompare> tree(
+      CountingCompare{&calls});
+  for (int i = 0; i < 4096; ++i) {
+    tree.insert((i * 7919) % 4096);
+  }
+  ASSERT_TRUE(tree.is_balanced());
+
+  for (int i = 0; i < 4096; i += 17) {
+    calls = 0;
+    tree.find(i);
+    EXPECT_LE(calls, tree.get_height());
+  }
+}
+
+// Key that counts how many times it was constructed from an int
+struct TrackedKey {
+  static inline size_t constructed = 0;
+
+  TrackedKey(int value) : value{value} { ++constructed; }
+
+  int value;
+};
+
+// Transparent ordering of TrackedKey and plain ints
+struct TrackedLess {
+  using is_transparent = void;
+
+  bool operator()(const TrackedKey &a, const TrackedKey &b) const {
+    return a.value < b.value;
+  }
+  bool operator()(const TrackedKey &a, int b) const { return a.value < b; }
+  bool operator()(int a, const TrackedKey &b) const { return a < b.value; }
+};
+
+// Test lookups with a type other than the key and no conversions
+TEST(AVLTreeCompareTest, TransparentLookup) {
+  AVLTree<std::string, NodePool, OrderStatistics, std::less<>> tree;
+  for (const char *word : {"apple", "banana", "cherry", "date", "fig"}) {
+    tree.insert(word);
+  }
+  std::string buffer = "xxcherryxx";
+  std::string_view slice(buffer.data() + 2, 6);
+  ASSERT_NE(tree.find(slice), nullptr);
+  EXPECT_EQ(tree.find(slice)->get_key(), "cherry");
+  EXPECT_EQ(tree.find(std::string_view("grape")), nullptr);
+  EXPECT_EQ(*tree.lower_bound(std::string_view("c")), "cherry");
+  EXPECT_EQ(*tree.upper_bound(std::string_view("date")), "fig");
+  EXPECT_EQ(tree.lowerbound(std::string_view("d"))->get_key(), "date");
+  EXPECT_EQ(tree.upperbound(std::string_view("d"))->get_key(), "cherry");
+  EXPECT_EQ(tree.rank(std::string_view("c")), 2u);
+  EXPECT_EQ(tree.count_range(std::string_view("b"), std::string_view("e")),
+            3u);
+
+  std::vector<std::string> visited;
+  tree.for_each_in_range(std::string_view("b"), std::string_view("d"),
+                         [&](const std::string &key) {
+                           visited.push_back(key);
+                         });
+  EXPECT_EQ(visited, (std::vector<std::string>{"banana", "cherry"}));
+
+  tree.delete_key(slice);
+  EXPECT_EQ(tree.get_size(), 4u);
+  EXPECT_TRUE(tree.is_balanced());
+
+  // without a transparent ordering arguments are still converted to T
+  AVLTree<std::string> plain;
+  plain.insert("apple");
+  EXPECT_NE(plain.find("apple"), nullptr);
+  plain.delete_key("apple");
+  EXPECT_TRUE(plain.is_empty());
+}
+
+TEST(AVLTreeCompareTest, TransparentLookupConstructsNoKeys) {
+  AVLTree<TrackedKey, NodePool, NoOrderStatistics, TrackedLess> tree;
+  for (int i = 0; i < 100; ++i) {
+    tree.insert(TrackedKey(i * 2));
+  }
+  TrackedKey::constructed = 0;
+  for (int i = 0; i < 200; ++i) {
+    EXPECT_EQ(tree.find(i) != nullptr, i % 2 == 0);
+    tree.lower_bound(i);
+    tree.for_each_in_range(i, i + 4, [](const TrackedKey &) {});
+  }
+  tree.delete_key(10);
+  EXPECT_EQ(TrackedKey::constructed, 0u);
+  EXPECT_EQ(tree.get_size(), 99u);
+}
+
+// Test the compact tree against std::set, with and without parent links
+template <typename Tree> void check_compact_tree(Tree &tree) {
+  std::set<int> expected;
+  std::mt19937 gen(21);
+  std::uniform_int_distribution<> dis(0, 5000);
+  for (int i = 0; i < 40000; ++i) {
+    int key = dis(gen);
+    if (i % 3 == 2) {
+      tree.delete_key(key);
+      expected.erase(key);
+    } else {
+      tree.insert(key);
+      expected.insert(key);
+    }
+    if (i % 4000 == 0) {
+      ASSERT_TRUE(tree.is_balanced());
+    }
+  }
+  ASSERT_TRUE(tree.is_balanced());
+  ASSERT_EQ(tree.get_size(), expected.size());
+  EXPECT_EQ(tree.in_order(),
+            std::vector<int>(expected.begin(), expected.end()));
+
+  for (int key = -1; key <= 5001; ++key) {
+    EXPECT_EQ(tree.find(key) != nullptr, expected.count(key) == 1);
+    auto lower = expected.lower_bound(key);
+    const int *found = tree.lowerbound(key);
+    EXPECT_EQ(found == nullptr, lower == expected.end());
+    if (found != nullptr && lower != expected.end()) {
+      EXPECT_EQ(*found, *lower);
+    }
+  }
+
+  std::vector<int> visited;
+  tree.for_each_in_range(1000, 1100, [&](int key) { visited.push_back(key); });
+  EXPECT_EQ(visited, std::vector<int>(expected.lower_bound(1000),
+                                      expected.upper_bound(1100)));
+
+  // an AVL tree is between log2(n + 1) and about 1.44 log2(n) high
+  size_t height = 0;
+  for (size_t n = expected.size(); n > 0; n /= 2) {
+    ++height;
+  }
+  EXPECT_GE(tree.get_height(), height);
+  EXPECT_LE(tree.get_height(), height * 3 / 2 + 1);
+
+  for (int key : std::vector<int>(expected.begin(), expected.end())) {
+    tree.delete_key(key);
+  }
+  EXPECT_TRUE(tree.is_empty());
+  EXPECT_TRUE(tree.is_balanced());
+}
+
+TEST(CompactAVLTreeTest, MatchesSet) {
+  static_assert(sizeof(CompactNode<int, false>) == 12, "");
+  static_assert(sizeof(CompactNode<int, true>) == 16, "");
+  CompactAVLTree<int> tree;
+  check_compact_tree(tree);
+}
+
+TEST(CompactAVLTreeTest, ParentLinksAndIterators) {
+  CompactAVLTree<int, true> tree;
+  check_compact_tree(tree);
+
+  for (int i = 100; i > 0; --i) {
+    tree.insert(i * 2);
+  }
+  std::vector<int> forward(tree.begin(), tree.end());
+  ASSERT_EQ(forward.size(), 100u);
+  EXPECT_TRUE(std::is_sorted(forward.begin(), forward.end()));
+  EXPECT_EQ(*std::prev(tree.end()), 200);
+  EXPECT_EQ(std::distance(tree.begin(), tree.end()), 100);
+}
+
+TEST(CompactAVLTreeTest, StringKeysReuseSlots) {
+  CompactAVLTree<std::string, false, std::less<>> tree;
+  for (int i = 0; i < 1000; ++i) {
+    tree.insert(std::to_string(i));
+  }
+  size_t bytes = tree.memory_bytes();
+  for (int round = 0; round < 5; ++round) {
+    for (int i = 0; i < 1000; i += 2) {
+      tree.delete_key(std::to_string(i));
+    }
+    for (int i = 0; i < 1000; i += 2) {
+      tree.insert(std::to_string(i));
+    }
+  }
+  EXPECT_EQ(tree.memory_bytes(), bytes);
+  EXPECT_EQ(tree.get_size(), 1000u);
+  EXPECT_TRUE(tree.is_balanced());
+  EXPECT_NE(tree.find(std::string_view("512")), nullptr);
+}
+
+// Test that batched lookups give the same nodes as one by one lookups
+TEST(AVLTreeBatchLookupTest, MatchesSingleLookups) {
+  AVLTree<int> tree;
+  std::mt19937 gen(31);
+  std::uniform_int_distribution<> dis(0, 10000);
+  std::vector<int> keys(3000);
+  for (int &key : keys) {
+    key = dis(gen);
+    tree.insert(key);
+  }
+  for (size_t count : {0, 1, 15, 16, 17, 1000}) {
+    std::vector<int> probes(count);
+    for (int &probe : probes) {
+      probe = dis(gen) - 5;
+    }
+    std::vector<Node<int> *> found;
+    tree.find_batch(probes.begin(), probes.end(), std::back_inserter(found));
+    ASSERT_EQ(found.size(), count);
+    std::vector<Node<int> *> lower(count);
+    tree.lowerbound_batch(probes.begin(), probes.end(), lower.begin());
+    for (size_t i = 0; i < count; ++i) {
+      EXPECT_EQ(found[i], tree.find(probes[i]));
+      EXPECT_EQ(lower[i], tree.lowerbound(probes[i]));
+    }
+  }
+
+  AVLTree<int> empty;
+  std::vector<Node<int> *> found(3, reinterpret_cast<Node<int> *>(1));
+  empty.find_batch(keys.begin(), keys.begin() + 3, found.begin());
+  EXPECT_EQ(found, std::vector<Node<int> *>(3, nullptr));
+}
+
+TEST(AVLTreeBatchLookupTest, TransparentKeys) {
+  AVLTree<std::string, NodePool, NoOrderStatistics, std::less<>> tree;
+  for (int i = 0; i < 100; ++i) {
+    tree.insert(std::to_string(i));
+  }
+  std::vector<std::string_view> probes{"7", "70", "700", "x"};
+  std::vector<Node<std::string> *> found;
+  tree.find_batch(probes.begin(), probes.end(), std::back_inserter(found));
+  ASSERT_EQ(found.size(), 4u);
+  EXPECT_EQ(found[0]->get_key(), "7");
+  EXPECT_EQ(found[1]->get_key(), "70");
+  EXPECT_EQ(found[2], nullptr);
+  EXPECT_EQ(found[3], nullptr);
+}
+
+// Test frozen snapshots in both layouts against std::set
+void check_frozen_tree(FrozenLayout layout) {
+  // sizes around powers of two, where the padding changes most
+  for (int count : {0, 1, 2, 3, 7, 8, 9, 100, 255, 256, 1000, 4097}) {
+    AVLTree<int> tree;
+    std::set<int> expected;
+    for (int i = 0; i < count; ++i) {
+      tree.insert(3 * i);
+      expected.insert(3 * i);
+    }
+    FrozenAVLTree<int> frozen = tree.freeze(layout);
+    ASSERT_EQ(frozen.get_size(), expected.size());
+    ASSERT_EQ(frozen.get_layout(), layout);
+
+    for (int key = -2; key <= 3 * count + 2; ++key) {
+      EXPECT_EQ(frozen.find(key) != nullptr, expected.count(key) == 1);
+      auto lower = expected.lower_bound(key);
+      const int *found = frozen.lowerbound(key);
+      ASSERT_EQ(found == nullptr, lower == expected.end()) << key;
+      if (found != nullptr) {
+        EXPECT_EQ(*found, *lower);
+      }
+      auto upper = expected.upper_bound(key);
+      found = frozen.upperbound(key);
+      ASSERT_EQ(found == nullptr, upper == expected.begin()) << key;
+      if (found != nullptr) {
+        EXPECT_EQ(*found, *std::prev(upper));
+      }
+    }
+
+    for (int lo = -5; lo <= 3 * count; lo += std::max(1, count / 2)) {
+      std::vector<int> visited;
+      frozen.for_each_in_range(lo, lo + 40,
+                               [&](int key) { visited.push_back(key); });
+      EXPECT_EQ(visited, std::vector<int>(expected.lower_bound(lo),
+                                          expected.upper_bound(lo + 40)));
+    }
+    std::vector<int> all;
+    frozen.for_each_in_range(-1, 3 * count,
+                             [&](int key) { all.push_back(key); });
+    EXPECT_EQ(all, tree.in_order());
+  }
+}
+
+TEST(FrozenAVLTreeTest, EytzingerMatchesSet) {
+  check_frozen_tree(FrozenLayout::eytzinger);
+}
+
+TEST(FrozenAVLTreeTest, VanEmdeBoasMatchesSet) {
+  check_frozen_tree(FrozenLayout::van_emde_boas);
+}
+
+TEST(FrozenAVLTreeTest, TransparentStringKeys) {
+  AVLTree<std::string, NodePool, NoOrderStatistics, std::less<>> tree;
+  for (int i = 0; i < 500; ++i) {
+    tree.insert(std::to_string(i));
+  }
+  for (FrozenLayout layout :
+       {FrozenLayout::eytzinger, FrozenLayout::van_emde_boas}) {
+    auto frozen = tree.freeze(layout);
+    tree.insert("zzz"); // the snapshot does not change
+    EXPECT_NE(frozen.find(std::string_view("250")), nullptr);
+    EXPECT_EQ(frozen.find(std::string_view("zzz")), nullptr);
+    EXPECT_EQ(*frozen.lowerbound(std::string_view("98a")), "99");
+    EXPECT_EQ(*frozen.upperbound(std::string_view("98a")), "98");
+    tree.delete_key("zzz");
+  }
+}
+
+// Test the blocked layout with every instruction set against std::set
+template <typename T> void check_blocked_tree(const std::vector<T> &values) {
+  std::set<T> expected(values.begin(), values.end());
+  AVLTree<T> tree;
+  for (T value : values) {
+    tree.insert(value);
+  }
+  // probes between and next to every key, and past both ends
+  T lowest = std::numeric_limits<T>::lowest();
+  T highest = std::numeric_limits<T>::max();
+  std::vector<T> probes = tree.in_order();
+  for (T value : tree.in_order()) {
+    if (value != lowest) {
+      probes.push_back(value - 1);
+    }
+    if (value != highest) {
+      probes.push_back(value + 1);
+    }
+  }
+  probes.push_back(lowest);
+  probes.push_back(highest);
+
+  for (SimdLevel level :
+       {SimdLevel::scalar, SimdLevel::sse42, SimdLevel::avx2}) {
+    FrozenAVLTree<T> frozen = tree.freeze();
+    ASSERT_EQ(frozen.get_layout(), FrozenLayout::blocked);
+    frozen.set_simd_level(level);
+    EXPECT_LE(frozen.get_simd_level(), level);
+    for (T key : probes) {
+      EXPECT_EQ(frozen.find(key) != nullptr, expected.count(key) == 1);
+      auto lower = expected.lower_bound(key);
+      const T *found = frozen.lowerbound(key);
+      ASSERT_EQ(found == nullptr, lower == expected.end());
+      if (found != nullptr) {
+        EXPECT_EQ(*found, *lower);
+      }
+      auto upper = expected.upper_bound(key);
+      found = frozen.upperbound(key);
+      ASSERT_EQ(found == nullptr, upper == expected.begin());
+      if (found != nullptr) {
+        EXPECT_EQ(*found, *std::prev(upper));
+      }
+    }
+    std::vector<T> visited;
+    frozen.for_each_in_range(lowest, highest,
+                             [&](T key) { visited.push_back(key); });
+    EXPECT_EQ(visited, tree.in_order());
+    for (size_t i = 0; i < probes.size(); i += probes.size() / 40 + 1) {
+      T lo = std::min(probes[i], probes[probes.size() - 1 - i]);
+      T hi = std::max(probes[i], probes[probes.size() - 1 - i]);
+      visited.clear();
+      frozen.for_each_in_range(lo, hi, [&](T key) { visited.push_back(key); });
+      EXPECT_EQ(visited, std::vector<T>(expected.lower_bound(lo),
+                                        expected.upper_bound(hi)));
+    }
+  }
+}
+
+template <typename T> std::vector<T> blocked_test_values(size_t count) {
+  std::mt19937_64 gen(count);
+  std::vector<T> values;
+  for (size_t i = 0; i < count; ++i) {
+    values.push_back(static_cast<T>(gen() % 100000) - static_cast<T>(40000));
+  }
+  return values;
+}
+
+TEST(FrozenAVLTreeTest, BlockedMatchesSet) {
+  for (size_t count : {1, 5, 16, 17, 300, 5000}) {
+    check_blocked_tree(blocked_test_values<int>(count));
+    check_blocked_tree(blocked_test_values<unsigned>(count));
+    check_blocked_tree(blocked_test_values<long>(count));
+    check_blocked_tree(blocked_test_values<unsigned long>(count));
+    check_blocked_tree(blocked_test_values<short>(count));
+    check_blocked_tree(blocked_test_values<float>(count));
+    check_blocked_tree(blocked_test_values<double>(count));
+  }
+}
+
+TEST(FrozenAVLTreeTest, BlockedExtremeKeys) {
+  int lowest = std::numeric_limits<int>::min();
+  int highest = std::numeric_limits<int>::max();
+  check_blocked_tree(std::vector<int>{lowest, -1, 0, 1, highest});
+  check_blocked_tree(std::vector<unsigned>{0, 1, 0x80000000u, 0xffffffffu});
+  double inf = std::numeric_limits<double>::infinity();
+  AVLTree<double> tree;
+  for (double value : {-inf, -1.5, 0.0, 2.25, inf}) {
+    tree.insert(value);
+  }
+  FrozenAVLTree<double> frozen = tree.freeze();
+  EXPECT_EQ(*frozen.lowerbound(3.0), inf);
+  EXPECT_EQ(*frozen.upperbound(inf), inf);
+  EXPECT_EQ(*frozen.upperbound(-2.0), -inf);
+  EXPECT_EQ(*frozen.lowerbound(-inf), -inf);
+}
+
+TEST(FrozenAVLTreeTest, BlockedFallsBackForOtherKeys) {
+  AVLTree<std::string> strings;
+  strings.insert("a");
+  EXPECT_EQ(strings.freeze().get_layout(), FrozenLayout::eytzinger);
+  AVLTree<int, NodePool, NoOrderStatistics, std::greater<int>> descending;
+  descending.insert(1);
+  descending.insert(2);
+  auto frozen = descending.freeze();
+  EXPECT_EQ(frozen.get_layout(), FrozenLayout::eytzinger);
+  EXPECT_EQ(*frozen.lowerbound(3), 2);
+}
+
+/* Test a tree that returns keys by value (CowAVLTree, ConcurrentAVLTree,
+ * ShardedAVLTree) against std::set: count random changes of keys in
+ * [0, max_key], one in delete_every a delete, then every lookup around
+ * those keys. expected is left holding the keys, for the checks of the
+ * tree itself.
+ */
+template <typename Tree>
+void check_matches_set(Tree &tree, std::set<int> &expected, unsigned seed,
+                       int max_key, int count, int delete_every) {
+  std::mt19937 gen(seed);
+  std::uniform_int_distribution<> dis(0, max_key);
+  for (int i = 0; i < count; ++i) {
+    int key = dis(gen);
+    if (i % delete_every == delete_every - 1) {
+      tree.delete_key(key);
+      expected.erase(key);
+    } else {
+      tree.insert(key);
+      expected.insert(key);
+    }
+  }
+  ASSERT_TRUE(tree.is_balanced());
+  ASSERT_EQ(tree.get_size(), expected.size());
+  EXPECT_EQ(tree.in_order(),
+            std::vector<int>(expected.begin(), expected.end()));
+  // every key of small ranges, a sample of large ones
+  int step = 1 + max_key / 16384;
+  for (int key = -1; key <= max_key + 1; key += step) {
+    EXPECT_EQ(tree.contains(key), expected.count(key) == 1);
+    EXPECT_EQ(tree.find(key), expected.count(key) == 1
+                                  ? std::optional<int>(key)
+                                  : std::nullopt);
+    auto lower = expected.lower_bound(key);
+    EXPECT_EQ(tree.lowerbound(key), (lower == expected.end())
+                                        ? std::nullopt
+                                        : std::optional<int>(*lower));
+    auto upper = expected.upper_bound(key);
+    EXPECT_EQ(tree.upperbound(key), (upper == expected.begin())
+                                        ? std::nullopt
+                                        : std::optional<int>(*--upper));
+  }
+}
+
+// Test the copy-on-write tree against std::set from a single thread
+TEST(CowAVLTreeTest, MatchesSet) {
+  CowAVLTree<int> tree;
+  std::set<int> expected;
+  check_matches_set(tree, expected, 17, 3000, 20000, 3);
+  std::vector<int> visited;
+  tree.for_each_in_range(100, 200, [&](int key) { visited.push_back(key); });
+  EXPECT_EQ(visited, std::vector<int>(expected.lower_bound(100),
+                                      expected.upper_bound(200)));
+  tree.clear_tree();
+  EXPECT_TRUE(tree.is_empty());
+  EXPECT_FALSE(tree.contains(*expected.begin()));
+}
+
+// Test that readers always see a whole version while a writer runs
+TEST(CowAVLTreeTest, ReadersDuringWrites) {
+  CowAVLTree<int> tree;
+  // multiples of 4 stay in the tree, the writer churns the rest
+  for (int key = 0; key < 4000; key += 4) {
+    tree.insert(key);
+  }
+  std::atomic<bool> done{false};
+  std::atomic<int> failures{0};
+  std::vector<std::thread> readers;
+  for (int r = 0; r < 3; ++r) {
+    readers.emplace_back([&, r] {
+      std::mt19937 gen(r);
+      do {
+        int key = 4 * static_cast<int>(gen() % 1000);
+        if (!tree.contains(key) || tree.lowerbound(key) != key) {
+          ++failures;
+        }
+        std::vector<int> keys = tree.in_order();
+        if (!std::is_sorted(keys.begin(), keys.end()) || keys.size() < 1000) {
+          ++failures;
+        }
+      } while (!done);
+    });
+  }
+  std::mt19937 gen(99);
+  for (int i = 0; i < 20000; ++i) {
+    int key = 4 * static_cast<int>(gen() % 1000) + 1 + i % 3;
+    if (i % 2 == 0) {
+      tree.insert(key);
+    } else {
+      tree.delete_key(key);
+    }
+  }
+  done = true;
+  for (std::thread &reader : readers) {
+    reader.join();
+  }
+  EXPECT_EQ(failures, 0);
+  EXPECT_TRUE(tree.is_balanced());
+}
+
+// Test that replaced nodes are kept while a reader is pinned
+TEST(CowAVLTreeTest, ReclaimsAfterReaders) {
+  EpochDomain &domain = EpochDomain::global();
+  CowAVLTree<std::string> tree;
+  for (int i = 0; i < 100; ++i) {
+    tree.insert(std::to_string(i));
+  }
+  domain.collect();
+  EXPECT_EQ(domain.pending(), 0u);
+  {
+    EpochGuard guard;
+    tree.delete_key("50");
+    domain.collect();
+    EXPECT_GT(domain.pending(), 0u);
+  }
+  domain.collect();
+  EXPECT_EQ(domain.pending(), 0u);
+  EXPECT_FALSE(tree.contains("50"));
+  EXPECT_EQ(tree.get_size(), 99u);
+}
+
+// Test that every snapshot keeps the keys it had when it was taken
+TEST(PersistentAVLTreeTest, SnapshotsKeepTheirVersion) {
+  PersistentAVLTree<int> tree;
+  std::set<int> expected;
+  std::vector<std::pair<PersistentAVLTree<int>, std::set<int>>> versions;
+  std::mt19937 gen(23);
+  std::uniform_int_distribution<> dis(0, 2000);
+  for (int i = 0; i < 20000; ++i) {
+    int key = dis(gen);
+    if (i % 3 == 2) {
+      tree.delete_key(key);
+      expected.erase(key);
+    } else {
+      tree.insert(key);
+      expected.insert(key);
+    }
+    if (i % 1000 == 0) {
+      versions.emplace_back(tree.snapshot(), expected);
+    }
+  }
+  versions.emplace_back(tree, expected);
+  for (auto &[version, keys] : versions) {
+    ASSERT_TRUE(version.is_balanced());
+    ASSERT_EQ(version.get_size(), keys.size());
+    EXPECT_EQ(version.in_order(), std::vector<int>(keys.begin(), keys.end()));
+  }
+
+  const auto &[last, keys] = versions.back();
+  for (int key = -1; key <= 2001; ++key) {
+    EXPECT_EQ(last.find(key) != nullptr, keys.count(key) == 1);
+    auto lower = keys.lower_bound(key);
+    const int *found = last.lowerbound(key);
+    EXPECT_EQ(found == nullptr, lower == keys.end());
+    if (found != nullptr && lower != keys.end()) {
+      EXPECT_EQ(*found, *lower);
+    }
+    auto upper = keys.upper_bound(key);
+    found = last.upperbound(key);
+    EXPECT_EQ(found == nullptr, upper == keys.begin());
+    if (found != nullptr && upper != keys.begin()) {
+      EXPECT_EQ(*found, *std::prev(upper));
+    }
+  }
+  std::vector<int> visited;
+  last.for_each_in_range(500, 600, [&](int key) { visited.push_back(key); });
+  EXPECT_EQ(visited, std::vector<int>(keys.lower_bound(500),
+                                      keys.upper_bound(600)));
+}
+
+// key that counts its live instances, to see nodes being freed
+struct CountedKey {
+  static inline int live = 0;
+  int value;
+  CountedKey(int v) : value{v} { ++live; }
+  CountedKey(const CountedKey &other) : value{other.value} { ++live; }
+  CountedKey &operator=(const CountedKey &) = default;
+  ~CountedKey() { --live; }
+  bool operator<(const CountedKey &other) const { return value < other.value; }
+};
+
+// Test that nodes are shared by versions and freed with the last one
+TEST(PersistentAVLTreeTest, SharesAndFreesNodes) {
+  {
+    PersistentAVLTree<CountedKey> tree;
+    for (int i = 0; i < 1000; ++i) {
+      tree.insert(CountedKey(i));
+    }
+    EXPECT_EQ(CountedKey::live, 1000);
+    PersistentAVLTree<CountedKey> snapshot = tree.snapshot();
+    EXPECT_EQ(CountedKey::live, 1000);
+    // a change copies one path only, about log2(n) nodes
+    tree.delete_key(CountedKey(500));
+    EXPECT_LE(CountedKey::live, 1000 + 2 * 11);
+    snapshot.clear_tree();
+    EXPECT_EQ(CountedKey::live, 999);
+    for (int i = 0; i < 1000; i += 2) {
+      tree.delete_key(CountedKey(i));
+    }
+    EXPECT_EQ(CountedKey::live, 500);
+    EXPECT_TRUE(tree.is_balanced());
+  }
+  EXPECT_EQ(CountedKey::live, 0);
+}
+
+// Test that a snapshot can be read by another thread during changes
+TEST(PersistentAVLTreeTest, SnapshotReadByOtherThread) {
+  PersistentAVLTree<int> tree;
+  for (int i = 0; i < 2000; ++i) {
+    tree.insert(i);
+  }
+  PersistentAVLTree<int> snapshot = tree.snapshot();
+  std::thread reader([&snapshot] {
+    for (int round = 0; round < 20; ++round) {
+      std::vector<int> keys = snapshot.in_order();
+      ASSERT_EQ(keys.size(), 2000u);
+      ASSERT_TRUE(std::is_sorted(keys.begin(), keys.end()));
+    }
+  });
+  for (int i = 0; i < 2000; i += 2) {
+    tree.delete_key(i);
+    tree.insert(i + 5000);
+  }
+  reader.join();
+  EXPECT_EQ(snapshot.get_size(), 2000u);
+  EXPECT_EQ(tree.find(0), nullptr);
+  EXPECT_NE(snapshot.find(0), nullptr);
+}
+
+// Test the concurrent tree against std::set from a single thread
+TEST(ConcurrentAVLTreeTest, MatchesSet) {
+  ConcurrentAVLTree<int> tree;
+  std::set<int> expected;
+  check_matches_set(tree, expected, 29, 3000, 20000, 3);
+}
+
+// Test that routing nodes are skipped by lookups and bounds
+TEST(ConcurrentAVLTreeTest, RoutingNodes) {
+  ConcurrentAVLTree<std::string, std::less<>> tree;
+  for (const char *key : {"d", "b", "f", "a", "c", "e", "g"}) {
+    tree.insert(key);
+  }
+  // "b", "d" and "f" have two children, so they stay as routing nodes
+  tree.delete_key(std::string_view("b"));
+  tree.delete_key(std::string_view("d"));
+  tree.delete_key(std::string_view("f"));
+  EXPECT_EQ(tree.get_size(), 4u);
+  EXPECT_FALSE(tree.contains(std::string_view("d")));
+  EXPECT_EQ(tree.lowerbound(std::string_view("cc")), "e");
+  EXPECT_EQ(tree.upperbound(std::string_view("f")), "e");
+  EXPECT_EQ(tree.upperbound(std::string_view("b")), "a");
+  EXPECT_EQ(tree.in_order(), (std::vector<std::string>{"a", "c", "e", "g"}));
+  // the keys come back in place
+  tree.insert("d");
+  EXPECT_EQ(tree.find(std::string_view("d")), "d");
+  tree.delete_key(std::string_view("a"));
+  tree.delete_key(std::string_view("c"));
+  EXPECT_EQ(tree.in_order(), (std::vector<std::string>{"d", "e", "g"}));
+  EXPECT_TRUE(tree.is_balanced());
+}
+
+// Test concurrent writers on overlapping keys next to readers
+TEST(ConcurrentAVLTreeTest, ConcurrentWriters) {
+  ConcurrentAVLTree<int> tree;
+  // multiples of 4 stay in the tree, the writers churn the rest
+  for (int key = 0; key < 4000; key += 4) {
+    tree.insert(key);
+  }
+  std::atomic<bool> done{false};
+  std::atomic<int> failures{0};
+  std::vector<std::thread> readers;
+  for (int r = 0; r < 2; ++r) {
+    readers.emplace_back([&, r] {
+      std::mt19937 gen(r);
+      do {
+        int key = 4 * static_cast<int>(gen() % 1000);
+        // bounds may find churned keys, but never one past a stable key
+        std::optional<int> lower = tree.lowerbound(key - 3);
+        std::optional<int> upper = tree.upperbound(key + 3);
+        if (!tree.contains(key) || tree.find(key) != key ||
+            tree.lowerbound(key) != key || !lower || *lower > key ||
+            !upper || *upper < key) {
+          ++failures;
+        }
+      } while (!done);
+    });
+  }
+  // writer w owns the keys 4k + 1 + w and leaves the odd k in the tree
+  std::vector<std::thread> writers;
+  for (int w = 0; w < 3; ++w) {
+    writers.emplace_back([&tree, w] {
+      std::mt19937 gen(100 + w);
+      for (int i = 0; i < 20000; ++i) {
+        int key = 4 * static_cast<int>(gen() % 1000) + 1 + w;
+        tree.insert(key);
+        if ((key / 4) % 2 == 0) {
+          tree.delete_key(key);
+        }
+      }
+    });
+  }
+  for (std::thread &writer : writers) {
+    writer.join();
+  }
+  done = true;
+  for (std::thread &reader : readers) {
+    reader.join();
+  }
+  EXPECT_EQ(failures, 0);
+  ASSERT_TRUE(tree.is_balanced());
+  std::vector<int> keys = tree.in_order();
+  EXPECT_EQ(keys.size(), tree.get_size());
+  EXPECT_TRUE(std::is_sorted(keys.begin(), keys.end()));
+  for (int key : keys) {
+    EXPECT_TRUE(key % 4 == 0 || (key / 4) % 2 == 1);
+  }
+  EXPECT_GE(keys.size(), 1000u);
+}
+
+// Test the sharded tree against std::set while shards split and join
+TEST(ShardedAVLTreeTest, MatchesSet) {
+  ShardedAVLTree<int> tree(8);
+  std::set<int> expected;
+  check_matches_set(tree, expected, 31, 100000, 60000, 4);
+  EXPECT_EQ(tree.get_shard_count(), 8u);
+  for (size_t size : tree.get_shard_sizes()) {
+    EXPECT_LE(size, SHARD_SPLIT_RATIO * expected.size() / 8);
+  }
+  std::vector<int> visited;
+  tree.for_each_in_range(20000, 70000,
+                         [&](int key) { visited.push_back(key); });
+  EXPECT_EQ(visited, std::vector<int>(expected.lower_bound(20000),
+                                      expected.upper_bound(70000)));
+  tree.clear_tree();
+  EXPECT_TRUE(tree.is_empty());
+  EXPECT_EQ(tree.lowerbound(0), std::nullopt);
+}
+
+// Test fixed boundaries and lookups across empty shards
+TEST(ShardedAVLTreeTest, GivenBounds) {
+  ShardedAVLTree<std::string, std::less<>> tree(
+      std::vector<std::string>{"m", "f", "t", "m"});
+  EXPECT_EQ(tree.get_shard_count(), 4u);
+  for (const char *key : {"a", "b", "z"}) {
+    tree.insert(key);
+  }
+  EXPECT_EQ(tree.get_shard_sizes(), (std::vector<size_t>{2, 0, 0, 1}));
+  EXPECT_EQ(tree.lowerbound(std::string_view("c")), "z");
+  EXPECT_EQ(tree.upperbound(std::string_view("y")), "b");
+  EXPECT_EQ(tree.find(std::string_view("z")), "z");
+  tree.delete_key(std::string_view("a"));
+  EXPECT_EQ(tree.in_order(), (std::vector<std::string>{"b", "z"}));
+  EXPECT_TRUE(tree.is_balanced());
+}
+
+// Test writers on all shards at once, next to range readers
+TEST(ShardedAVLTreeTest, ConcurrentWriters) {
+  ShardedAVLTree<int> tree(4);
+  std::atomic<bool> done{false};
+  std::atomic<int> failures{0};
+  std::thread reader([&] {
+    do {
+      std::vector<int> keys;
+      tree.for_each_in_range(0, 1 << 30,
+                             [&](int key) { keys.push_back(key); });
+      if (!std::is_sorted(keys.begin(), keys.end())) {
+        ++failures;
+      }
+    } while (!done);
+  });
+  std::vector<std::thread> writers;
+  for (int w = 0; w < 4; ++w) {
+    writers.emplace_back([&tree, w] {
+      std::mt19937 gen(200 + w);
+      for (int i = 0; i < 10000; ++i) {
+        int key = 4 * static_cast<int>(gen() % 20000) + w;
+        tree.insert(key);
+        if (i % 3 == 0) {
+          tree.delete_key(key);
+        }
+      }
+    });
+  }
+  for (std::thread &writer : writers) {
+    writer.join();
+  }
+  done = true;
+  reader.join();
+  EXPECT_EQ(failures, 0);
+  ASSERT_TRUE(tree.is_balanced());
+  std::vector<int> keys = tree.in_order();
+  EXPECT_EQ(keys.size(), tree.get_size());
+  EXPECT_TRUE(std::adjacent_find(keys.begin(), keys.end()) == keys.end());
+  EXPECT_GT(tree.get_shard_count(), 1u);
+}
+
+// Test building from unsorted keys with and without a pool
+TEST(AVLTreeBulkTest, BuildFromUnsorted) {
+  ThreadPool pool(3);
+  std::mt19937 gen(37);
+  for (int count : {0, 1, 1000, 300000}) {
+    std::uniform_int_distribution<> dis(0, count);
+    std::vector<int> keys(count);
+    for (int &key : keys) {
+      key = dis(gen); // about a third are duplicates
+    }
+    std::set<int> expected(keys.begin(), keys.end());
+    for (ThreadPool *used_pool : {static_cast<ThreadPool *>(nullptr), &pool}) {
+      AVLTree<int, NodePool, OrderStatistics> tree;
+      tree.insert(-5); // replaced by the build
+      tree.build_from_unsorted(keys, used_pool);
+      ASSERT_TRUE(tree.is_balanced());
+      ASSERT_EQ(tree.get_size(), expected.size());
+      EXPECT_EQ(tree.in_order(),
+                std::vector<int>(expected.begin(), expected.end()));
+      if (!expected.empty()) {
+        EXPECT_EQ(tree.select(expected.size() / 2)->get_key(),
+                  *std::next(expected.begin(), expected.size() / 2));
+        // parent links hold: the iterator climbs them
+        EXPECT_EQ(*std::prev(tree.end()), *expected.rbegin());
+      }
+    }
+  }
+
+  std::vector<std::string> words;
+  for (int i = 0; i < 100000; ++i) {
+    words.push_back(std::to_string(i % 70000));
+  }
+  std::set<std::string> expected(words.begin(), words.end());
+  AVLTree<std::string, NewDeleteAllocator> tree;
+  tree.build_from_unsorted(std::move(words), &pool);
+  ASSERT_TRUE(tree.is_balanced());
+  EXPECT_EQ(tree.in_order(),
+            std::vector<std::string>(expected.begin(), expected.end()));
+}
+
+TEST(AVLTreeBulkTest, ExportKeys) {
+  ThreadPool pool(3);
+  std::mt19937 gen(41);
+  std::uniform_int_distribution<> dis(0, 1 << 20);
+  AVLTree<int> plain;
+  AVLTree<int, NodePool, OrderStatistics> sized;
+  for (int i = 0; i < 200000; ++i) {
+    int key = dis(gen);
+    plain.insert(key);
+    sized.insert(key);
+  }
+  ASSERT_GE(plain.get_height(), PARALLEL_HEIGHT_CUTOFF + 2);
+  std::vector<int> in = plain.in_order();
+  std::vector<int> pre = plain.pre_order();
+  std::vector<int> post = plain.post_order();
+  ASSERT_EQ(in.size(), plain.get_size());
+  ASSERT_TRUE(std::is_sorted(in.begin(), in.end()));
+
+  EXPECT_EQ(plain.export_keys(TraversalOrder::in_order, &pool), in);
+  EXPECT_EQ(plain.export_keys(TraversalOrder::pre_order, &pool), pre);
+  EXPECT_EQ(plain.export_keys(TraversalOrder::post_order, &pool), post);
+  EXPECT_EQ(sized.export_keys(TraversalOrder::in_order, &pool), in);
+  EXPECT_EQ(sized.export_keys(TraversalOrder::pre_order, &pool), pre);
+  EXPECT_EQ(sized.export_keys(TraversalOrder::post_order, &pool), post);
+
+  // a caller buffer: nothing is written past the keys
+  std::vector<int> buffer(in.size() + 1, -1);
+  plain.export_keys(buffer.data(), TraversalOrder::post_order, &pool);
+  EXPECT_TRUE(std::equal(post.begin(), post.end(), buffer.begin()));
+  EXPECT_EQ(buffer.back(), -1);
+
+  AVLTree<int> empty;
+  EXPECT_TRUE(empty.export_keys(TraversalOrder::pre_order, &pool).empty());
+}
+
+// Test the stackless walks and teardown on a tree of many levels
+TEST(AVLTreeTraversalTest, StacklessWalks) {
+  AVLTree<int> small;
+  for (int key : {10, 5, 15, 3, 7, 12, 17}) {
+    small.insert(key);
+  }
+  EXPECT_EQ(small.pre_order(), (std::vector<int>{10, 5, 3, 7, 15, 12, 17}));
+  EXPECT_EQ(small.post_order(), (std::vector<int>{3, 7, 5, 12, 17, 15, 10}));
+  small.delete_key(3);
+  small.delete_key(12);
+  EXPECT_EQ(small.in_order(), (std::vector<int>{5, 7, 10, 15, 17}));
+  EXPECT_EQ(small.pre_order(), (std::vector<int>{10, 5, 7, 15, 17}));
+  EXPECT_EQ(small.post_order(), (std::vector<int>{7, 5, 17, 15, 10}));
+  EXPECT_TRUE(AVLTree<int>().post_order().empty());
+
+  std::mt19937 gen(43);
+  std::uniform_int_distribution<> dis(0, 1 << 18);
+  AVLTree<int> tree;
+  std::set<int> expected;
+  for (int i = 0; i < 100000; ++i) {
+    int key = dis(gen);
+    if (i % 3 == 2) {
+      tree.delete_key(key);
+      expected.erase(key);
+    } else {
+      tree.insert(key);
+      expected.insert(key);
+    }
+  }
+  ASSERT_TRUE(tree.is_balanced());
+  std::vector<int> in = tree.in_order();
+  EXPECT_EQ(in, std::vector<int>(expected.begin(), expected.end()));
+
+  // a pre-order of a search tree: every key goes right of all smaller
+  // keys still open on the stack, post-order is the same mirrored
+  auto is_pre_order = [](const std::vector<int> &keys, bool mirrored) {
+    std::vector<int> open;
+    long lower = std::numeric_limits<long>::min();
+    for (size_t i = 0; i < keys.size(); ++i) {
+      int key = mirrored ? -keys[keys.size() - 1 - i] : keys[i];
+      if (key < lower) {
+        return false;
+      }
+      while (!open.empty() && open.back() < key) {
+        lower = open.back();
+        open.pop_back();
+      }
+      open.push_back(key);
+    }
+    return true;
+  };
+  std::vector<int> pre = tree.pre_order();
+  std::vector<int> post = tree.post_order();
+  EXPECT_EQ(pre.front(), tree.get_root()->get_key());
+  EXPECT_EQ(post.back(), tree.get_root()->get_key());
+  EXPECT_TRUE(is_pre_order(pre, false));
+  EXPECT_TRUE(is_pre_order(post, true));
+  std::sort(pre.begin(), pre.end());
+  std::sort(post.begin(), post.end());
+  EXPECT_EQ(pre, in);
+  EXPECT_EQ(post, in);
+
+  // keys with destructors, freed one by one and through the pool
+  AVLTree<std::string, NewDeleteAllocator> words;
+  AVLTree<std::string> pooled_words;
+  for (int key : in) {
+    words.insert(std::to_string(key));
+    pooled_words.insert(std::to_string(key));
+  }
+  words.clear_tree();
+  EXPECT_TRUE(words.is_empty());
+  words.insert("again");
+  EXPECT_EQ(words.in_order(), std::vector<std::string>{"again"});
+}
+
+// Test saving a tree and loading or mapping the image
+TEST(AVLTreeSnapshotTest, SaveLoadAndMap) {
+  std::string path = testing::TempDir() + "avltree_snapshot_test.bin";
+  ThreadPool pool(3);
+  std::mt19937 gen(47);
+  std::uniform_int_distribution<> dis(-(1 << 20), 1 << 20);
+  AVLTree<int> tree;
+  for (int i = 0; i < 200000; ++i) {
+    tree.insert(dis(gen));
+  }
+  std::vector<int> keys = tree.in_order();
+  tree.save(path);
+
+  for (ThreadPool *used_pool : {static_cast<ThreadPool *>(nullptr), &pool}) {
+    AVLTree<int, NodePool, OrderStatistics> loaded;
+    loaded.insert(7); // replaced by the load
+    loaded.load(path, used_pool);
+    ASSERT_TRUE(loaded.is_balanced());
+    EXPECT_EQ(loaded.get_size(), keys.size());
+    EXPECT_EQ(loaded.in_order(), keys);
+  }
+  AVLTree<int, NewDeleteAllocator> unpooled;
+  unpooled.load(path);
+  EXPECT_EQ(unpooled.in_order(), keys);
+
+  MappedAVLTree<int> mapped(path);
+  ASSERT_EQ(mapped.get_size(), keys.size());
+  EXPECT_TRUE(std::equal(mapped.begin(), mapped.end(), keys.begin()));
+  for (int i = 0; i < 1000; ++i) {
+    int key = dis(gen);
+    Node<int> *lower = tree.lowerbound(key);
+    Node<int> *upper = tree.upperbound(key);
+    const int *mapped_lower = mapped.lowerbound(key);
+    const int *mapped_upper = mapped.upperbound(key);
+    ASSERT_EQ(lower == nullptr, mapped_lower == nullptr);
+    ASSERT_EQ(upper == nullptr, mapped_upper == nullptr);
+    if (lower != nullptr) {
+      EXPECT_EQ(*mapped_lower, lower->get_key());
+    }
+    if (upper != nullptr) {
+      EXPECT_EQ(*mapped_upper, upper->get_key());
+    }
+    EXPECT_EQ(mapped.find(key) != nullptr, tree.find(key) != nullptr);
+  }
+  std::vector<int> range;
+  std::vector<int> mapped_range;
+  tree.for_each_in_range(-1000, 1000, [&](int key) { range.push_back(key); });
+  mapped.for_each_in_range(-1000, 1000,
+                           [&](int key) { mapped_range.push_back(key); });
+  EXPECT_FALSE(range.empty());
+  EXPECT_EQ(mapped_range, range);
+
+  // keys of another type or a flipped byte are refused
+  AVLTree<long> other;
+  EXPECT_THROW(other.load(path), std::runtime_error);
+  {
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekp(1000);
+    file.put('x');
+  }
+  EXPECT_THROW(tree.load(path), std::runtime_error);
+  EXPECT_EQ(tree.in_order(), keys);
+  EXPECT_THROW(MappedAVLTree<int>{path}, std::runtime_error);
+  EXPECT_NO_THROW(MappedAVLTree<int>(path, false));
+  EXPECT_THROW(tree.load(path + ".missing"), std::system_error);
+
+  // keys written through the serializer
+  AVLTree<std::string> words;
+  for (int i = 0; i < 5000; ++i) {
+    words.insert(std::string(i % 40, 'a') + std::to_string(i));
+  }
+  words.save(path);
+  AVLTree<std::string, NewDeleteAllocator> loaded_words;
+  loaded_words.load(path);
+  EXPECT_EQ(loaded_words.in_order(), words.in_order());
+
+  // images saved under another Compare are refused unless trusted
+  AVLTree<int, NodePool, NoOrderStatistics, std::greater<int>> descending;
+  for (int i = 0; i < 1000; ++i) {
+    descending.insert(i);
+  }
+  descending.save(path);
+  EXPECT_THROW(tree.load(path), std::runtime_error);
+  EXPECT_EQ(tree.in_order(), keys);
+  EXPECT_THROW(MappedAVLTree<int>{path}, std::runtime_error);
+  EXPECT_NO_THROW(MappedAVLTree<int>(path, false));
+  EXPECT_NO_THROW((MappedAVLTree<int, std::greater<int>>(path)));
+  AVLTree<int, NodePool, NoOrderStatistics, std::greater<int>> reloaded;
+  reloaded.load(path);
+  EXPECT_EQ(reloaded.in_order(), descending.in_order());
+  AVLTree<std::string, NodePool, NoOrderStatistics, std::greater<>>
+      descending_words;
+  descending_words.insert("a");
+  descending_words.insert("b");
+  descending_words.save(path);
+  EXPECT_THROW(words.load(path), std::runtime_error);
+  EXPECT_EQ(words.get_size(), 5000u);
+
+  AVLTree<int> empty;
+  empty.save(path);
+  tree.load(path);
+  EXPECT_TRUE(tree.is_empty());
+  EXPECT_TRUE(MappedAVLTree<int>(path).is_empty());
+  std::remove(path.c_str());
+}
+
+// Test that logged changes survive reopening, checkpoints and torn writes
+TEST(LoggedAVLTreeTest, ReplayAndCheckpoint) {
+  std::string snapshot = testing::TempDir() + "logged_test.snapshot";
+  std::string log = testing::TempDir() + "logged_test.wal";
+  std::remove(snapshot.c_str());
+  std::remove(log.c_str());
+  auto copy_file = [](const std::string &from, const std::string &to) {
+    std::ifstream in(from, std::ios::binary);
+    std::ofstream out(to, std::ios::binary | std::ios::trunc);
+    out << in.rdbuf();
+  };
+  auto as_vector = [](const std::set<int> &keys) {
+    return std::vector<int>(keys.begin(), keys.end());
+  };
+
+  std::set<int> expected;
+  std::set<int> at_checkpoint;
+  {
+    LoggedAVLTree<int> tree(snapshot, log);
+    for (int i = 0; i < 300; ++i) {
+      tree.insert(i * 7 % 101);
+      expected.insert(i * 7 % 101);
+      if (i % 4 == 3) {
+        tree.delete_key(i % 50);
+        expected.erase(i % 50);
+      }
+    }
+  }
+  {
+    LoggedAVLTree<int> tree(snapshot, log);
+    EXPECT_EQ(tree.in_order(), as_vector(expected));
+    EXPECT_TRUE(tree.contains(*expected.begin()));
+    EXPECT_FALSE(tree.contains(-1));
+
+    // a crash between the save and the truncation keeps the whole log
+    copy_file(log, log + ".old");
+    at_checkpoint = expected;
+    tree.checkpoint();
+    EXPECT_EQ(tree.get_log_bytes(), 16u);
+    tree.insert(1000);
+    tree.delete_key(*expected.begin());
+    expected.insert(1000);
+    expected.erase(expected.begin());
+  }
+  {
+    LoggedAVLTree<int> tree(snapshot, log);
+    EXPECT_EQ(tree.in_order(), as_vector(expected));
+  }
+  copy_file(log + ".old", log);
+  {
+    LoggedAVLTree<int> tree(snapshot, log);
+    EXPECT_EQ(tree.in_order(), as_vector(at_checkpoint));
+  }
+
+  // a torn record at the end is cut off, the ones before it stay
+  std::remove(snapshot.c_str());
+  std::remove(log.c_str());
+  {
+    LoggedAVLTree<int> tree(snapshot, log);
+    tree.insert(1);
+    tree.insert(2);
+  }
+  {
+    std::ofstream out(log, std::ios::binary | std::ios::app);
+    out.write("\x01\x04\x00\x00", 4);
+  }
+  {
+    LoggedAVLTree<int> tree(snapshot, log);
+    EXPECT_EQ(tree.in_order(), (std::vector<int>{1, 2}));
+    tree.insert(3);
+  }
+  {
+    LoggedAVLTree<int> tree(snapshot, log);
+    EXPECT_EQ(tree.in_order(), (std::vector<int>{1, 2, 3}));
+
+    // changes that change nothing are neither logged nor synced
+    size_t log_bytes = tree.get_log_bytes();
+    uint64_t syncs = tree.get_sync_count();
+    tree.insert(2);
+    tree.delete_key(4);
+    EXPECT_EQ(tree.get_log_bytes(), log_bytes);
+    EXPECT_EQ(tree.get_sync_count(), syncs);
+  }
+  EXPECT_THROW((LoggedAVLTree<long>(snapshot, log)), std::runtime_error);
+
+  // string keys, from several threads sharing their syncs
+  std::string word_log = log + ".words";
+  std::remove(word_log.c_str());
+  std::set<std::string> words;
+  {
+    LoggedAVLTree<std::string> tree(snapshot + ".words", word_log,
+                                    std::chrono::microseconds(200));
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+      threads.emplace_back([&tree, t] {
+        for (int i = 0; i < 200; ++i) {
+          tree.insert("word" + std::to_string(t * 1000 + i));
+        }
+      });
+    }
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+    EXPECT_EQ(tree.get_size(), 800u);
+    EXPECT_LE(tree.get_sync_count(), 800u);
+    std::vector<std::string> keys = tree.in_order();
+    words.insert(keys.begin(), keys.end());
+  }
+  {
+    LoggedAVLTree<std::string> tree(snapshot + ".words", word_log);
+    EXPECT_EQ(tree.in_order(),
+              std::vector<std::string>(words.begin(), words.end()));
+  }
+  for (const std::string &path :
+       {snapshot, log, log + ".old", word_log, snapshot + ".words"}) {
+    std::remove(path.c_str());
+  }
+}
+
+// Test that the node pool recycles freed nodes
+TEST_F(AVLTreeTest, PoolReusesFreedNodes) {
+  for (int i = 0; i < 1000; ++i) {
+    tree->insert(i);
+  }
+  size_t reserved = tree->get_allocator().reserved_bytes();
+  EXPECT_GE(reserved, 1000 * sizeof(Node<int>));
+
+  for (int round = 0; round < 10; ++round) {
+    for (int i = 0; i < 1000; i += 2) {
+      tree->delete_key(i);
+    }
+    for (int i = 0; i < 1000; i += 2) {
+      tree->insert(i);
+    }
+  }
+  EXPECT_EQ(tree->get_size(), 1000);
+  EXPECT_TRUE(tree->is_balanced());
+  EXPECT_EQ(tree->get_allocator().reserved_bytes(), reserved);
+
+  tree->clear_tree();
+  EXPECT_EQ(tree->get_allocator().reserved_bytes(), 0);
+}
+
+// Test the plain new/delete allocator policy
+TEST(AVLTreeAllocatorTest, NewDeleteAllocator) {
+  AVLTree<int, NewDeleteAllocator> tree;
+  for (int i = 1; i <= 100; ++i) {
+    tree.insert(i);
+  }
+  for (int i = 1; i <= 100; i += 3) {
+    tree.delete_key(i);
+  }
+  EXPECT_EQ(tree.get_size(), 66);
+  EXPECT_TRUE(tree.is_balanced());
+  EXPECT_EQ(tree.get_min()->get_key(), 2);
+}
+
+// Test that pooled nodes with non-trivial keys are destroyed properly
+TEST(AVLTreeAllocatorTest, PooledStringKeys) {
+  AVLTree<std::string> tree;
+  for (int i = 0; i < 200; ++i) {
+    tree.insert(std::string(40, 'a') + std::to_string(i));
+  }
+  for (int i = 0; i < 200; i += 2) {
+    tree.delete_key(std::string(40, 'a') + std::to_string(i));
+  }
+  EXPECT_EQ(tree.get_size(), 100);
+  EXPECT_TRUE(tree.is_balanced());
+  tree.clear_tree();
+  EXPECT_TRUE(tree.is_empty());
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();